@@ -11,6 +11,7 @@
 #include <string.h>
 
 #include "clist.h"
+#include "heap.h"
 
 #define DEBUG
 
@@ -24,7 +25,7 @@
  */
 static struct _cl_node *_CL_new_node(CListElementType element, struct _cl_node *next)
 {
-  struct _cl_node *new = (struct _cl_node *)malloc(sizeof(struct _cl_node));
+  struct _cl_node *new = (struct _cl_node *)HP_malloc(HP_CLIST, sizeof(struct _cl_node));
   assert(new);
 
   new->element = element;
@@ -36,11 +37,12 @@ static struct _cl_node *_CL_new_node(CListElementType element, struct _cl_node *
 // Documented in .h file
 CList CL_new()
 {
-  CList list = (CList)malloc(sizeof(struct _clist));
+  CList list = (CList)HP_malloc(HP_CLIST, sizeof(struct _clist));
   if (list == NULL)
     return NULL;
 
   list->head = NULL;
+  list->tail = NULL;
   list->length = 0;
 
   return list;
@@ -61,14 +63,14 @@ void CL_free(CList list)
     struct _cl_node *next_node = this_node->next;
 
     // deallocate the current node
-    free(this_node);
+    HP_free(HP_CLIST, this_node);
 
     // move on to the next node
     this_node = next_node;
   }
 
   // deallocate the list structure itself
-  free(list);
+  HP_free(HP_CLIST, list);
 }
 
 // Documented in .h file
@@ -80,11 +82,15 @@ int CL_length(CList list)
   // traverse the list, counting the number of nodes
 #ifdef DEBUG
   int len = 0;
+  struct _cl_node *last = NULL;
   
   for (struct _cl_node *node = list->head; node != NULL; node = node->next)
+  {
+    last = node;
     len++;
+  }
 
-  assert(len == list->length);
+  assert(len == list->length && last == list->tail);
 #endif // DEBUG
 
   return list->length;
@@ -97,6 +103,8 @@ void CL_push(CList list, CListElementType element)
     return;
 
   list->head = _CL_new_node(element, list->head);
+  if (list->tail == NULL)
+    list->tail = list->head;
   list->length++;
 }
 
@@ -115,7 +123,9 @@ CListElementType CL_pop(CList list)
 
   // unlink previous head node, then free it
   list->head = popped_node->next;
-  free(popped_node);
+  if (list->head == NULL)
+    list->tail = NULL;
+  HP_free(HP_CLIST, popped_node);
 
   list->length--;
 
@@ -132,20 +142,14 @@ void CL_append(CList list, CListElementType element)
   // new node to append - its next pointer should be NULL
   struct _cl_node *new_node = _CL_new_node(element, NULL);
 
-  // when appending to an empty list, the new node becomes the head
+  // when appending to an empty list, the new node becomes the head;
+  // otherwise it goes after the tail
   if (list->head == NULL)
     list->head = new_node;
-
   else
-  {
-    // otherwise, traverse the list until we find the last node
-    struct _cl_node *this_node = list->head;
-    while (this_node->next != NULL)
-      this_node = this_node->next;
+    list->tail->next = new_node;
 
-    // then append the new node to the end of the list
-    this_node->next = new_node;
-  }
+  list->tail = new_node;
 
   // increment the length of the list
   list->length++;
@@ -165,6 +169,10 @@ CListElementType CL_nth(CList list, int pos)
   if (pos < 0)
     pos = list->length + pos;
 
+  // the last node is at hand
+  if (pos == list->length - 1)
+    return list->tail->element;
+
   // traverse the list until we find the node at position pos
   struct _cl_node *this_node = list->head;
   while (pos > 0 && this_node != NULL)
@@ -217,6 +225,8 @@ bool CL_insert(CList list, CListElementType element, int pos)
 
   // Otherwise, this_node points to the this_node at position pos-1
   this_node->next = _CL_new_node(element, this_node->next);
+  if (this_node == list->tail)
+    list->tail = this_node->next;
 
   // Increment the length of the list
   list->length++;
@@ -263,6 +273,8 @@ CListElementType CL_remove(CList list, int pos)
   {
     // remove the node at position pos-1 - point current node to the node after the one we are removing
     this_node->next = rm_node->next;
+    if (rm_node == list->tail)
+      list->tail = this_node;
 
     // Save the element to return
     CListElementType rm_element = rm_node->element;
@@ -271,7 +283,7 @@ CListElementType CL_remove(CList list, int pos)
     list->length--;
 
     // deallocate the node we are removing
-    free(rm_node);
+    HP_free(HP_CLIST, rm_node);
 
     return rm_element;
   }
@@ -301,24 +313,23 @@ void CL_join(CList list1, CList list2)
   if (list1->head == NULL)
   {
     list1->head = list2->head;
+    list1->tail = list2->tail;
     list1->length = list2->length;
     list2->head = NULL;
+    list2->tail = NULL;
     list2->length = 0;
   }
 
-  // otherwise, traverse list1 until we find the last node
-  else
+  // otherwise, point the last node of list1 at the head of list2
+  else if (list2->head != NULL)
   {
-    struct _cl_node *this_node = list1->head;
-    while (this_node->next != NULL)
-      this_node = this_node->next;
-
-    // pointing the last node at the head of list2
-    this_node->next = list2->head;
+    list1->tail->next = list2->head;
+    list1->tail = list2->tail;
     list1->length = list1->length + list2->length;
 
     // empty list2
     list2->head = NULL;
+    list2->tail = NULL;
     list2->length = 0;
   }
 }
@@ -346,7 +357,8 @@ void CL_reverse(CList list)
       this_node = next_node;
     }
 
-    // update head of list to point to the last node
+    // update head of list to point to the last node, and the tail to the first
+    list->tail = list->head;
     list->head = prev_node;
   }
 }
@@ -24,6 +24,7 @@ struct _cl_node
 struct _clist
 {
     struct _cl_node *head;
+    struct _cl_node *tail; // the last node, so that appending is O(1)
     int length;
 };
 
@@ -0,0 +1,411 @@
+/*
+ * codegen.c
+ *
+ * Translation of ExprTrees into C source
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#include "codegen.h"
+#include "expr_tree_priv.h"
+
+// prefix of every name the generator makes up itself
+#define CG_RESERVED_PREFIX "ew_"
+
+static const char *c_keywords[] = {
+    "auto", "break", "case", "char", "const", "continue", "default", "do",
+    "double", "else", "enum", "extern", "float", "for", "goto", "if",
+    "inline", "int", "long", "register", "restrict", "return", "short",
+    "signed", "sizeof", "static", "struct", "switch", "typedef", "union",
+    "unsigned", "void", "volatile", "while", "_Bool", "_Complex", "_Imaginary",
+    // GNU C, and C23
+    "asm", "typeof", "typeof_unqual", "bool", "true", "false", "nullptr",
+    "constexpr", "static_assert", "thread_local", "alignas", "alignof",
+    // used by the generated code
+    "pow", "sqrt", "exp", "log", "sin", "cos", "fabs", "size_t", "HUGE_VAL", "NAN"};
+
+// the macros and types of <stddef.h> and <math.h>, which the generated
+// code includes, and the macros GCC predefines in its GNU modes; no
+// name can be one of these
+static const char *header_macros[] = {
+    "ptrdiff_t", "wchar_t", "max_align_t", "float_t", "double_t",
+    "NULL", "offsetof", "INFINITY", "HUGE_VALF", "HUGE_VALL", "MATH_ERRNO",
+    "MATH_ERREXCEPT", "math_errhandling", "FP_INFINITE", "FP_NAN", "FP_NORMAL",
+    "FP_SUBNORMAL", "FP_ZERO", "FP_ILOGB0", "FP_ILOGBNAN", "FP_FAST_FMA",
+    "FP_FAST_FMAF", "FP_FAST_FMAL", "fpclassify", "isfinite", "isinf", "isnan",
+    "isnormal", "signbit", "isgreater", "isgreaterequal", "isless",
+    "islessequal", "islessgreater", "isunordered", "M_E", "M_LOG2E",
+    "M_LOG10E", "M_LN2", "M_LN10", "M_PI", "M_PI_2", "M_PI_4", "M_1_PI",
+    "M_2_PI", "M_2_SQRTPI", "M_SQRT2", "M_SQRT1_2", "linux", "unix", "i386"};
+
+// the functions <math.h> declares, GNU extensions included, and their
+// complex counterparts, which GCC knows as built-ins; each also comes
+// with the suffixes of math_suffixes. A function, though not a
+// parameter, that has one of these names clashes with the declaration.
+static const char *math_functions[] = {
+    "acos", "acosh", "asin", "asinh", "atan", "atan2", "atanh", "cbrt", "ceil",
+    "copysign", "cos", "cosh", "drem", "erf", "erfc", "exp", "exp2", "exp10",
+    "expm1", "fabs", "fdim", "finite", "floor", "fma", "fmax", "fmin", "fmod",
+    "frexp", "gamma", "hypot", "ilogb", "j0", "j1", "jn", "ldexp", "lgamma",
+    "llrint", "llround", "log", "log10", "log1p", "log2", "logb", "lrint",
+    "lround", "modf", "nan", "nearbyint", "nextafter", "nexttoward", "pow",
+    "pow10", "remainder", "remquo", "rint", "round", "roundeven", "scalb",
+    "scalbln", "scalbn", "signgam", "significand", "sin", "sincos", "sinh",
+    "sqrt", "tan", "tanh", "tgamma", "trunc", "y0", "y1", "yn", "nextup",
+    "nextdown", "canonicalize", "fmaxmag", "fminmag", "totalorder",
+    "totalordermag", "getpayload", "setpayload", "setpayloadsig", "llogb",
+    "fromfp", "ufromfp", "fromfpx", "ufromfpx", "issignaling", "iscanonical",
+    "iszero", "issubnormal", "isinf", "isnan", "signbit", "fmaximum", "fminimum", "fmaximum_num",
+    "fminimum_num", "fmaximum_mag", "fminimum_mag", "fmaximum_mag_num",
+    "fminimum_mag_num", "exp2m1", "exp10m1", "log2p1", "log10p1", "logp1",
+    "compound", "pown", "powr", "rootn", "rsqrt", "sinpi", "cospi", "tanpi",
+    "acospi", "asinpi", "atanpi", "atan2pi", "fadd", "fsub", "fmul", "fdiv",
+    "ffma", "fsqrt", "dadd", "dsub", "dmul", "ddiv", "dfma", "dsqrt",
+    "cabs", "cacos", "cacosh", "carg", "casin", "casinh", "catan", "catanh",
+    "ccos", "ccosh", "cexp", "cimag", "clog", "clog10", "conj", "cpow",
+    "cproj", "creal", "csin", "csinh", "csqrt", "ctan", "ctanh"};
+
+static const char *math_suffixes[] = {"f", "l", "f32", "f64", "f128", "f32x", "f64x", "_r", "f_r", "l_r"};
+
+// other library functions GCC knows as built-ins, whose prototypes it
+// insists on
+static const char *builtin_functions[] = {
+    "abort", "abs", "labs", "llabs", "imaxabs", "exit", "_Exit", "_exit",
+    "malloc", "calloc", "realloc", "free", "aligned_alloc", "alloca",
+    "posix_memalign", "memcpy", "memmove", "memset", "memcmp", "memchr",
+    "mempcpy", "bzero", "bcmp", "bcopy", "strlen", "strnlen", "strcpy",
+    "strncpy", "strcat", "strncat", "strcmp", "strncmp", "strchr", "strrchr",
+    "strstr", "strspn", "strcspn", "strpbrk", "strdup", "strndup", "stpcpy",
+    "stpncpy", "index", "rindex", "strcasecmp", "strncasecmp", "ffs", "ffsl",
+    "ffsll", "printf", "fprintf", "sprintf", "snprintf", "vprintf",
+    "vfprintf", "vsprintf", "vsnprintf", "scanf", "fscanf", "sscanf",
+    "vscanf", "vfscanf", "vsscanf", "puts", "fputs", "putchar", "fputc",
+    "putc", "printf_unlocked", "fprintf_unlocked", "putc_unlocked",
+    "putchar_unlocked", "fputc_unlocked", "fputs_unlocked", "fwrite",
+    "fwrite_unlocked", "isalnum", "isalpha", "isascii", "isblank", "iscntrl",
+    "isdigit", "isgraph", "islower", "isprint", "ispunct", "isspace",
+    "isupper", "isxdigit", "tolower", "toupper", "toascii", "iswalnum",
+    "iswalpha", "iswblank", "iswcntrl", "iswdigit", "iswgraph", "iswlower",
+    "iswprint", "iswpunct", "iswspace", "iswupper", "iswxdigit", "towlower",
+    "towupper", "strftime", "strfmon", "fork", "execl", "execle", "execlp",
+    "execv", "execve", "execvp", "gettext", "dgettext", "dcgettext", "main"};
+
+// suffix of the batch variant of every generated function
+#define CG_BATCH_SUFFIX "_batch"
+
+/*
+ * Returns true if name is one of the n names of list
+ */
+static bool in_list(const char *name, const char **list, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    if (strcmp(name, list[i]) == 0)
+      return true;
+
+  return false;
+}
+
+#define IN_LIST(name, list) in_list(name, list, sizeof(list) / sizeof(list[0]))
+
+/*
+ * Returns true if name is one of math_functions, with or without one
+ * of math_suffixes
+ */
+static bool is_math_function(const char *name)
+{
+  char base[64];
+  size_t len = strlen(name);
+
+  if (IN_LIST(name, math_functions))
+    return true;
+
+  for (size_t i = 0; i < sizeof(math_suffixes) / sizeof(math_suffixes[0]); i++)
+  {
+    size_t slen = strlen(math_suffixes[i]);
+
+    if (len > slen && len - slen < sizeof(base) && strcmp(name + len - slen, math_suffixes[i]) == 0)
+    {
+      memcpy(base, name, len - slen);
+      base[len - slen] = '\0';
+      if (IN_LIST(base, math_functions))
+        return true;
+    }
+  }
+
+  return false;
+}
+
+// Documented in .h file
+bool CG_valid_name(const char *name)
+{
+  if (!isalpha(name[0]) && name[0] != '_')
+    return false;
+
+  for (int i = 1; name[i] != '\0'; i++)
+    if (!isalnum(name[i]) && name[i] != '_')
+      return false;
+
+  // reserved to the implementation everywhere
+  if (name[0] == '_' && (name[1] == '_' || isupper(name[1])))
+    return false;
+
+  if (IN_LIST(name, c_keywords) || IN_LIST(name, header_macros))
+    return false;
+
+  return strncmp(name, CG_RESERVED_PREFIX, strlen(CG_RESERVED_PREFIX)) != 0;
+}
+
+// Documented in .h file
+bool CG_valid_function_name(const char *name)
+{
+  size_t len = strlen(name);
+  size_t slen = strlen(CG_BATCH_SUFFIX);
+
+  if (!CG_valid_name(name) || is_math_function(name) || IN_LIST(name, builtin_functions))
+    return false;
+
+  // NAME_batch is taken by the batch variant of NAME
+  return len < slen || strcmp(name + len - slen, CG_BATCH_SUFFIX) != 0;
+}
+
+/*
+ * Write a constant as a C double literal that reads back exactly
+ */
+static void emit_constant(FILE *out, double value)
+{
+  char buf[32];
+
+  if (isnan(value))
+    snprintf(buf, sizeof(buf), "NAN");
+  else if (isinf(value))
+    snprintf(buf, sizeof(buf), "HUGE_VAL");
+  else
+  {
+    snprintf(buf, sizeof(buf), "%.17g", fabs(value));
+
+    // without a '.' or an exponent, C would read an integer
+    if (strpbrk(buf, ".e") == NULL)
+      strcat(buf, ".0");
+  }
+
+  // parenthesized, so that a negative value never follows another '-'
+  if (signbit(value) && !isnan(value))
+    fprintf(out, "(-%s)", buf);
+  else
+    fputs(buf, out);
+}
+
+/*
+ * The C operator for a binary arithmetic or comparison node type
+ */
+static const char *op_str(ExprNodeType type)
+{
+  switch (type)
+  {
+  case OP_ADD:
+    return "+";
+  case OP_SUB:
+    return "-";
+  case OP_MUL:
+    return "*";
+  case OP_DIV:
+    return "/";
+  case OP_LT:
+    return "<";
+  case OP_LE:
+    return "<=";
+  case OP_GT:
+    return ">";
+  case OP_GE:
+    return ">=";
+  case OP_EQ:
+    return "==";
+  case OP_NE:
+    return "!=";
+  default:
+    assert(0);
+  }
+  return "?";
+}
+
+/*
+ * Write an operand: a leaf directly, an interior node by its temporary
+ */
+static void emit_operand(FILE *out, ExprTree tree, int temp)
+{
+  if (tree->type == VALUE)
+    emit_constant(out, tree->n.value);
+  else if (tree->type == VARIABLE)
+    fputs(tree->n.var->name, out);
+  else
+    fprintf(out, CG_RESERVED_PREFIX "t%d", temp);
+}
+
+static int emit_statements(FILE *out, ExprTree tree, int *next);
+
+/*
+ * Write the statements for a range of the operands of a chain, one
+ * per binary node that combines them in the order of ET_split, so that
+ * the generated code rounds as the evaluators do
+ *
+ * Returns: The number of the temporary holding the combined range, or
+ *   -1 if the range is a single leaf
+ */
+static int emit_range(FILE *out, ExprTree tree, int first, int count, int *next)
+{
+  if (count == 1)
+    return emit_statements(out, tree->n.list.ops[first], next);
+
+  int half = ET_split(count);
+  ExprTree left = (half == 1) ? tree->n.list.ops[first] : tree;
+  ExprTree right = (count - half == 1) ? tree->n.list.ops[first + half] : tree;
+  int ltemp = emit_range(out, tree, first, half, next);
+  int rtemp = emit_range(out, tree, first + half, count - half, next);
+  int temp = (*next)++;
+
+  // a range of more than one operand is never a leaf, so is written by its temporary
+  fprintf(out, "  const double " CG_RESERVED_PREFIX "t%d = ", temp);
+  emit_operand(out, left, ltemp);
+  fprintf(out, " %s ", op_str(ET_chain_op(tree->type)));
+  emit_operand(out, right, rtemp);
+  fputs(";\n", out);
+  return temp;
+}
+
+/*
+ * Write one statement per interior node of tree, children first.
+ * Both branches of a conditional are computed, and the result is
+ * selected afterwards: straight-line code that the batch loops can
+ * vectorize with a masked select.
+ *
+ * Parameters:
+ *   out      Where to write the code
+ *   tree     The tree
+ *   next     Number of the next free temporary; advanced past those used
+ *
+ * Returns: The number of the temporary holding the value of tree, or
+ *   -1 if tree is a leaf
+ */
+static int emit_statements(FILE *out, ExprTree tree, int *next)
+{
+  if (ET_is_leaf(tree))
+    return -1;
+
+  if (ET_is_chain(tree))
+    return emit_range(out, tree, 0, tree->n.list.count, next);
+
+  ExprTree left = tree->n.child[LEFT];
+  ExprTree right = tree->n.child[RIGHT];
+  int ltemp = emit_statements(out, left, next);
+  int rtemp = (ET_arity(tree->type) == 1) ? -1 : emit_statements(out, right, next);
+  int ctemp = (tree->type == OP_COND) ? emit_statements(out, tree->n.child[COND_FALSE], next) : -1;
+  int temp = (*next)++;
+
+  fprintf(out, "  const double " CG_RESERVED_PREFIX "t%d = ", temp);
+
+  switch (tree->type)
+  {
+  case UNARY_NEGATE:
+    fputs("-", out);
+    emit_operand(out, left, ltemp);
+    break;
+  case OP_COND:
+    emit_operand(out, left, ltemp);
+    fputs(" != 0 ? ", out);
+    emit_operand(out, right, rtemp);
+    fputs(" : ", out);
+    emit_operand(out, tree->n.child[COND_FALSE], ctemp);
+    break;
+  case OP_LT:
+  case OP_LE:
+  case OP_GT:
+  case OP_GE:
+  case OP_EQ:
+  case OP_NE:
+    fputs("(double)(", out);
+    emit_operand(out, left, ltemp);
+    fprintf(out, " %s ", op_str(tree->type));
+    emit_operand(out, right, rtemp);
+    fputs(")", out);
+    break;
+  case OP_MIN:
+  case OP_MAX:
+    // spelled out, rather than fmin and fmax, to treat NaN as min and max do
+    emit_operand(out, left, ltemp);
+    fputs(tree->type == OP_MIN ? " < " : " > ", out);
+    emit_operand(out, right, rtemp);
+    fputs(" ? ", out);
+    emit_operand(out, left, ltemp);
+    fputs(" : ", out);
+    emit_operand(out, right, rtemp);
+    break;
+  case OP_SQRT:
+  case OP_EXP:
+  case OP_LOG:
+  case OP_SIN:
+  case OP_COS:
+  case OP_ABS:
+    fprintf(out, "%s(", tree->type == OP_ABS ? "fabs" : FN_for_op(tree->type)->name);
+    emit_operand(out, left, ltemp);
+    fputs(")", out);
+    break;
+  case OP_POWER:
+    fputs("pow(", out);
+    emit_operand(out, left, ltemp);
+    fputs(", ", out);
+    emit_operand(out, right, rtemp);
+    fputs(")", out);
+    break;
+  default:
+    emit_operand(out, left, ltemp);
+    fprintf(out, " %s ", op_str(tree->type));
+    emit_operand(out, right, rtemp);
+    break;
+  }
+
+  fputs(";\n", out);
+  return temp;
+}
+
+// Documented in .h file
+void CG_emit_inline(FILE *out, const char *name, ExprTree tree, VarTable vars)
+{
+  int next = 0;
+
+  fprintf(out, "static inline double %s(", name);
+  for (int i = 0; i < VT_count(vars); i++)
+    fprintf(out, "%sdouble %s", i > 0 ? ", " : "", VT_nth(vars, i)->name);
+  fprintf(out, "%s)\n{\n", VT_count(vars) == 0 ? "void" : "");
+
+  int temp = emit_statements(out, tree, &next);
+
+  fputs("  return ", out);
+  emit_operand(out, tree, temp);
+  fputs(";\n}\n", out);
+}
+
+// Documented in .h file
+void CG_emit_batch(FILE *out, const char *name, VarTable vars, bool definition)
+{
+  fprintf(out, "void %s" CG_BATCH_SUFFIX "(double *restrict " CG_RESERVED_PREFIX "out, ", name);
+  for (int i = 0; i < VT_count(vars); i++)
+    fprintf(out, "const double *restrict %s, ", VT_nth(vars, i)->name);
+  fputs("size_t " CG_RESERVED_PREFIX "n)", out);
+
+  if (!definition)
+  {
+    fputs(";\n", out);
+    return;
+  }
+
+  fputs("\n{\n  for (size_t " CG_RESERVED_PREFIX "i = 0; " CG_RESERVED_PREFIX "i < " CG_RESERVED_PREFIX "n; " CG_RESERVED_PREFIX "i++)\n", out);
+  fprintf(out, "    " CG_RESERVED_PREFIX "out[" CG_RESERVED_PREFIX "i] = %s(", name);
+  for (int i = 0; i < VT_count(vars); i++)
+    fprintf(out, "%s%s[" CG_RESERVED_PREFIX "i]", i > 0 ? ", " : "", VT_nth(vars, i)->name);
+  fputs(");\n}\n", out);
+}
@@ -0,0 +1,92 @@
+/*
+ * codegen.h
+ *
+ * Translation of ExprTrees into C source, for formulas that are fixed
+ * when a program is built. Each expression becomes a straight-line
+ * static inline function of its variables, which the C compiler can
+ * inline, constant-fold and vectorize, plus a batch function that
+ * applies it to whole arrays.
+ *
+ * The generated code performs the same operations in the same order
+ * as ET_evaluate, except that both branches of a conditional are
+ * computed and one is then selected, which keeps the code branch-free.
+ * Compile it with -ffp-contract=off for bit-identical results;
+ * otherwise the compiler may fuse a multiply and an add.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#ifndef _CODEGEN_H_
+#define _CODEGEN_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "expr_tree.h"
+#include "vars.h"
+
+/*
+ * Check that name can be used for a generated function or one of its
+ * parameters: it must be a C identifier, not a C keyword, not a macro
+ * of the headers the generated code includes, not reserved to the
+ * implementation, and not start with the prefix reserved for the
+ * generator's own names
+ *
+ * Parameters:
+ *   name     The name, \0-terminated
+ *
+ * Returns: true if the name can be used, false otherwise
+ */
+bool CG_valid_name(const char *name);
+
+/*
+ * Check that name can be used for a generated function: it must be a
+ * valid name (see CG_valid_name), and not clash with what the headers
+ * the generated code includes declare, with a library function GCC
+ * knows as a built-in, with main, or with the batch variant of another
+ * function, so it must not end in "_batch"
+ *
+ * Parameters:
+ *   name     The name, \0-terminated
+ *
+ * Returns: true if the name can be used, false otherwise
+ */
+bool CG_valid_function_name(const char *name);
+
+/*
+ * Write the definition of
+ *
+ *   static inline double name(double v0, double v1, ...)
+ *
+ * which computes tree. The parameters are the variables of vars, in
+ * index order, under their own names.
+ *
+ * Parameters:
+ *   out      Where to write the code
+ *   name     The function name; see CG_valid_function_name
+ *   tree     The expression
+ *   vars     The variables tree refers to
+ *
+ * Returns: None
+ */
+void CG_emit_inline(FILE *out, const char *name, ExprTree tree, VarTable vars);
+
+/*
+ * Write the batch form of the function written by CG_emit_inline:
+ *
+ *   void name_batch(double *restrict ew_out, const double *restrict v0,
+ *                   const double *restrict v1, ..., size_t ew_n)
+ *
+ * which sets ew_out[i] = name(v0[i], v1[i], ...) for 0 <= i < ew_n.
+ *
+ * Parameters:
+ *   out         Where to write the code
+ *   name        The name of the inline function
+ *   vars        The variables of the function
+ *   definition  true to write the definition, false for just the prototype
+ *
+ * Returns: None
+ */
+void CG_emit_batch(FILE *out, const char *name, VarTable vars, bool definition);
+
+#endif /* _CODEGEN_H_ */
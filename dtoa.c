@@ -0,0 +1,500 @@
+/*
+ * dtoa.c
+ *
+ * Shortest round-trip conversion of doubles to decimal, with Florian
+ * Loitsch's Grisu3 algorithm ("Printing floating-point numbers quickly
+ * and accurately with integers", PLDI 2010).
+ *
+ * The double v is taken with its neighbours' midpoints m- and m+:
+ * every number strictly between those reads back as v. All three are
+ * scaled by a cached power of ten c, chosen so that the scaled upper
+ * bound has its binary point in a convenient place, and digits of it
+ * are then produced with 64-bit integer arithmetic until the digits
+ * generated so far lie within the scaled interval. The last digit is
+ * then nudged towards the scaled v. The multiplications by c are not
+ * exact, so the interval is widened by one unit on each side, and the
+ * result is kept only if it is the same for every value within that
+ * unit: then it is certainly the shortest, and the closest of the
+ * shortest. In the rare cases where it is not (1e23 is one), the
+ * digits are found exactly, if slowly, with snprintf and strtod.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "dtoa.h"
+
+#define SIGNIFICAND_BITS 52
+#define HIDDEN_BIT (1ULL << SIGNIFICAND_BITS)
+#define EXPONENT_BIAS (0x3FF + SIGNIFICAND_BITS)
+
+// plain notation is used for decimal exponents from PLAIN_MIN_EXP to
+// PLAIN_MAX_EXP, the same range as "%.17g"
+#define PLAIN_MIN_EXP -4
+#define PLAIN_MAX_EXP 16
+
+// a number f * 2^e, with a 64-bit f ("do it yourself floating point")
+typedef struct
+{
+  uint64_t f;
+  int e;
+} DiyFp;
+
+// 10^k for k = -348, -340, ..., 340, normalized and rounded
+static const DiyFp cached_powers[] = {
+    {0xfa8fd5a0081c0288ULL, -1220}, // 1e-348
+    {0xbaaee17fa23ebf76ULL, -1193}, // 1e-340
+    {0x8b16fb203055ac76ULL, -1166}, // 1e-332
+    {0xcf42894a5dce35eaULL, -1140}, // 1e-324
+    {0x9a6bb0aa55653b2dULL, -1113}, // 1e-316
+    {0xe61acf033d1a45dfULL, -1087}, // 1e-308
+    {0xab70fe17c79ac6caULL, -1060}, // 1e-300
+    {0xff77b1fcbebcdc4fULL, -1034}, // 1e-292
+    {0xbe5691ef416bd60cULL, -1007}, // 1e-284
+    {0x8dd01fad907ffc3cULL, -980}, // 1e-276
+    {0xd3515c2831559a83ULL, -954}, // 1e-268
+    {0x9d71ac8fada6c9b5ULL, -927}, // 1e-260
+    {0xea9c227723ee8bcbULL, -901}, // 1e-252
+    {0xaecc49914078536dULL, -874}, // 1e-244
+    {0x823c12795db6ce57ULL, -847}, // 1e-236
+    {0xc21094364dfb5637ULL, -821}, // 1e-228
+    {0x9096ea6f3848984fULL, -794}, // 1e-220
+    {0xd77485cb25823ac7ULL, -768}, // 1e-212
+    {0xa086cfcd97bf97f4ULL, -741}, // 1e-204
+    {0xef340a98172aace5ULL, -715}, // 1e-196
+    {0xb23867fb2a35b28eULL, -688}, // 1e-188
+    {0x84c8d4dfd2c63f3bULL, -661}, // 1e-180
+    {0xc5dd44271ad3cdbaULL, -635}, // 1e-172
+    {0x936b9fcebb25c996ULL, -608}, // 1e-164
+    {0xdbac6c247d62a584ULL, -582}, // 1e-156
+    {0xa3ab66580d5fdaf6ULL, -555}, // 1e-148
+    {0xf3e2f893dec3f126ULL, -529}, // 1e-140
+    {0xb5b5ada8aaff80b8ULL, -502}, // 1e-132
+    {0x87625f056c7c4a8bULL, -475}, // 1e-124
+    {0xc9bcff6034c13053ULL, -449}, // 1e-116
+    {0x964e858c91ba2655ULL, -422}, // 1e-108
+    {0xdff9772470297ebdULL, -396}, // 1e-100
+    {0xa6dfbd9fb8e5b88fULL, -369}, // 1e-92
+    {0xf8a95fcf88747d94ULL, -343}, // 1e-84
+    {0xb94470938fa89bcfULL, -316}, // 1e-76
+    {0x8a08f0f8bf0f156bULL, -289}, // 1e-68
+    {0xcdb02555653131b6ULL, -263}, // 1e-60
+    {0x993fe2c6d07b7facULL, -236}, // 1e-52
+    {0xe45c10c42a2b3b06ULL, -210}, // 1e-44
+    {0xaa242499697392d3ULL, -183}, // 1e-36
+    {0xfd87b5f28300ca0eULL, -157}, // 1e-28
+    {0xbce5086492111aebULL, -130}, // 1e-20
+    {0x8cbccc096f5088ccULL, -103}, // 1e-12
+    {0xd1b71758e219652cULL, -77}, // 1e-4
+    {0x9c40000000000000ULL, -50}, // 1e4
+    {0xe8d4a51000000000ULL, -24}, // 1e12
+    {0xad78ebc5ac620000ULL, 3}, // 1e20
+    {0x813f3978f8940984ULL, 30}, // 1e28
+    {0xc097ce7bc90715b3ULL, 56}, // 1e36
+    {0x8f7e32ce7bea5c70ULL, 83}, // 1e44
+    {0xd5d238a4abe98068ULL, 109}, // 1e52
+    {0x9f4f2726179a2245ULL, 136}, // 1e60
+    {0xed63a231d4c4fb27ULL, 162}, // 1e68
+    {0xb0de65388cc8ada8ULL, 189}, // 1e76
+    {0x83c7088e1aab65dbULL, 216}, // 1e84
+    {0xc45d1df942711d9aULL, 242}, // 1e92
+    {0x924d692ca61be758ULL, 269}, // 1e100
+    {0xda01ee641a708deaULL, 295}, // 1e108
+    {0xa26da3999aef774aULL, 322}, // 1e116
+    {0xf209787bb47d6b85ULL, 348}, // 1e124
+    {0xb454e4a179dd1877ULL, 375}, // 1e132
+    {0x865b86925b9bc5c2ULL, 402}, // 1e140
+    {0xc83553c5c8965d3dULL, 428}, // 1e148
+    {0x952ab45cfa97a0b3ULL, 455}, // 1e156
+    {0xde469fbd99a05fe3ULL, 481}, // 1e164
+    {0xa59bc234db398c25ULL, 508}, // 1e172
+    {0xf6c69a72a3989f5cULL, 534}, // 1e180
+    {0xb7dcbf5354e9beceULL, 561}, // 1e188
+    {0x88fcf317f22241e2ULL, 588}, // 1e196
+    {0xcc20ce9bd35c78a5ULL, 614}, // 1e204
+    {0x98165af37b2153dfULL, 641}, // 1e212
+    {0xe2a0b5dc971f303aULL, 667}, // 1e220
+    {0xa8d9d1535ce3b396ULL, 694}, // 1e228
+    {0xfb9b7cd9a4a7443cULL, 720}, // 1e236
+    {0xbb764c4ca7a44410ULL, 747}, // 1e244
+    {0x8bab8eefb6409c1aULL, 774}, // 1e252
+    {0xd01fef10a657842cULL, 800}, // 1e260
+    {0x9b10a4e5e9913129ULL, 827}, // 1e268
+    {0xe7109bfba19c0c9dULL, 853}, // 1e276
+    {0xac2820d9623bf429ULL, 880}, // 1e284
+    {0x80444b5e7aa7cf85ULL, 907}, // 1e292
+    {0xbf21e44003acdd2dULL, 933}, // 1e300
+    {0x8e679c2f5e44ff8fULL, 960}, // 1e308
+    {0xd433179d9c8cb841ULL, 986}, // 1e316
+    {0x9e19db92b4e31ba9ULL, 1013}, // 1e324
+    {0xeb96bf6ebadf77d9ULL, 1039}, // 1e332
+    {0xaf87023b9bf0ee6bULL, 1066}, // 1e340
+};
+
+#define CACHED_POWER_MIN_EXP10 -348
+#define CACHED_POWER_STEP 8
+
+static const uint64_t pow10_u64[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+    100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL,
+    10000000000000ULL, 100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL};
+
+/*
+ * Returns x * y, rounded to 64 bits
+ */
+static DiyFp multiply(DiyFp x, DiyFp y)
+{
+  unsigned __int128 p = (unsigned __int128)x.f * y.f;
+  uint64_t h = (uint64_t)(p >> 64);
+
+  if ((uint64_t)p & (1ULL << 63))
+    h++;
+
+  return (DiyFp){h, x.e + y.e + 64};
+}
+
+/*
+ * Returns x shifted left until its top bit is set
+ */
+static DiyFp normalize(DiyFp x)
+{
+  int shift = __builtin_clzll(x.f);
+
+  return (DiyFp){x.f << shift, x.e - shift};
+}
+
+/*
+ * Returns the cached power of ten c = 10^-k that brings a number with
+ * binary exponent e into range, and sets *k
+ */
+static DiyFp cached_power(int e, int *k)
+{
+  // the smallest k such that 10^-k * 2^(e + 64) >= 2^-60 or so: the
+  // scaled number then has 1 to 4 bits before the binary point
+  double dk = (-61 - e) * 0.30102999566398114 + 347;
+  int ik = (int)dk;
+
+  if (dk - ik > 0.0)
+    ik++;
+
+  int index = (ik >> 3) + 1;
+
+  *k = -(CACHED_POWER_MIN_EXP10 + index * CACHED_POWER_STEP);
+  return cached_powers[index];
+}
+
+/*
+ * Move the last digit of buf towards the scaled value, as long as it
+ * stays inside the interval and gets closer, and check that the
+ * result is certainly the closest: the scaled value is only known to
+ * within unit, so the walk must end the same way for wp_w - unit and
+ * wp_w + unit, and the digits must be certainly inside the interval
+ *
+ * Parameters:
+ *   buf        The digits
+ *   len        Number of digits
+ *   delta      Width of the scaled interval, widened by unit on each
+ *              side
+ *   rest       Distance from the digits to the upper bound
+ *   ten_kappa  Weight of the last digit
+ *   wp_w       Distance from the scaled value to the upper bound
+ *   unit       The uncertainty of all of these
+ *
+ * Returns: Whether the digits are certainly the closest shortest ones
+ */
+static bool round_weed(char *buf, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w,
+                       uint64_t unit)
+{
+  const uint64_t small = wp_w - unit;
+  const uint64_t big = wp_w + unit;
+
+  while (rest < small && delta - rest >= ten_kappa &&
+         (rest + ten_kappa < small || small - rest >= rest + ten_kappa - small))
+  {
+    buf[len - 1]--;
+    rest += ten_kappa;
+  }
+
+  // one more step would still be taken for the largest value
+  if (rest < big && delta - rest >= ten_kappa &&
+      (rest + ten_kappa < big || big - rest > rest + ten_kappa - big))
+    return false;
+
+  return 2 * unit <= rest && rest <= delta - 4 * unit;
+}
+
+/*
+ * Generate the digits of the scaled upper bound wp until they are
+ * within delta of it
+ *
+ * Parameters:
+ *   w        The scaled value
+ *   wp       The scaled upper bound, widened by one unit
+ *   delta    Width of the scaled interval, widened by one unit on
+ *            each side
+ *   buf      Return space for the digits
+ *   len      Return space for their number
+ *   k        The decimal exponent of the scaling; updated so that the
+ *            value is digits * 10^k
+ *
+ * Returns: Whether the digits are certainly the closest shortest ones
+ */
+static bool generate_digits(DiyFp w, DiyFp wp, uint64_t delta, char *buf, int *len, int *k)
+{
+  const DiyFp one = {1ULL << -wp.e, wp.e};
+  const uint64_t wp_w = wp.f - w.f;
+  uint32_t p1 = (uint32_t)(wp.f >> -one.e); // the integer part
+  uint64_t p2 = wp.f & (one.f - 1);          // the fraction
+  uint64_t unit = 1;
+  int kappa = 1;
+
+  while (kappa < 10 && p1 >= pow10_u64[kappa])
+    kappa++;
+
+  *len = 0;
+
+  while (kappa > 0)
+  {
+    uint32_t d = p1 / pow10_u64[kappa - 1];
+
+    p1 %= pow10_u64[kappa - 1];
+    if (d != 0 || *len != 0)
+      buf[(*len)++] = '0' + d;
+    kappa--;
+
+    uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+
+    if (rest < delta)
+    {
+      *k += kappa;
+      return round_weed(buf, *len, delta, rest, pow10_u64[kappa] << -one.e, wp_w, unit);
+    }
+  }
+
+  for (;;)
+  {
+    p2 *= 10;
+    delta *= 10;
+    unit *= 10;
+
+    char d = (char)(p2 >> -one.e);
+
+    if (d != 0 || *len != 0)
+      buf[(*len)++] = '0' + d;
+    p2 &= one.f - 1;
+    kappa--;
+
+    if (p2 < delta)
+    {
+      *k += kappa;
+      return round_weed(buf, *len, delta, p2, one.f, wp_w * unit, unit);
+    }
+  }
+}
+
+/*
+ * The shortest digits of a finite, positive value, when they can be
+ * found quickly
+ *
+ * Parameters:
+ *   value    The value
+ *   buf      Return space for the digits (at most 17)
+ *   len      Return space for their number
+ *   k        Return space for the decimal exponent: the value is
+ *            digits * 10^k
+ *
+ * Returns: Whether it could decide; if not, the outputs are garbage
+ */
+static bool grisu3(double value, char *buf, int *len, int *k)
+{
+  uint64_t bits;
+
+  memcpy(&bits, &value, sizeof(bits));
+
+  int biased_e = (int)(bits >> SIGNIFICAND_BITS);
+  uint64_t significand = bits & (HIDDEN_BIT - 1);
+  DiyFp v = (biased_e != 0) ? (DiyFp){significand + HIDDEN_BIT, biased_e - EXPONENT_BIAS}
+                            : (DiyFp){significand, 1 - EXPONENT_BIAS};
+
+  // the boundaries: halfway to the neighbours, which are closer below
+  // at a power of two
+  DiyFp plus = normalize((DiyFp){(v.f << 1) + 1, v.e - 1});
+  DiyFp minus = (v.f == HIDDEN_BIT) ? (DiyFp){(v.f << 2) - 1, v.e - 2} : (DiyFp){(v.f << 1) - 1, v.e - 1};
+
+  minus.f <<= minus.e - plus.e;
+  minus.e = plus.e;
+
+  DiyFp c = cached_power(plus.e, k);
+  DiyFp w = multiply(normalize(v), c);
+  DiyFp wp = multiply(plus, c);
+  DiyFp wm = multiply(minus, c);
+
+  // widened by the error of the multiplications, which round_weed
+  // then accounts for
+  wm.f--;
+  wp.f++;
+
+  return generate_digits(w, wp, wp.f - wm.f, buf, len, k);
+}
+
+/*
+ * The shortest digits of a finite, positive value, the slow way: for
+ * each length in turn, the closest decimal of that length, correctly
+ * rounded by snprintf, is checked with strtod. Below a power of two
+ * the interval that reads back is narrower than above it, so when the
+ * closest falls short below, the next one up is tried too.
+ *
+ * Parameters:
+ *   value    The value
+ *   buf      Return space for the digits (at most 17)
+ *   len      Return space for their number
+ *   k        Return space for the decimal exponent: the value is
+ *            digits * 10^k
+ */
+static void shortest_exact(double value, char *buf, int *len, int *k)
+{
+  char s[DT_BUFFER_SIZE];
+
+  for (*len = 1; *len < 17; (*len)++)
+  {
+    // d.ddde+XX
+    snprintf(s, sizeof(s), "%.*e", *len - 1, value);
+    buf[0] = s[0];
+    memcpy(buf + 1, s + 2, *len - 1);
+    *k = atoi(s + ((*len > 1) ? *len + 2 : 2)) - (*len - 1);
+
+    double back = strtod(s, NULL);
+
+    if (back == value)
+      return;
+    if (back > value)
+      continue;
+
+    int i = *len - 1;
+
+    while (i >= 0 && buf[i] == '9')
+      buf[i--] = '0';
+    if (i >= 0)
+      buf[i]++;
+    else
+    {
+      buf[0] = '1';
+      (*k)++;
+    }
+
+    snprintf(s, sizeof(s), "%.*se%d", *len, buf, *k);
+    if (strtod(s, NULL) == value)
+      return;
+  }
+
+  // 17 digits always read back
+  snprintf(s, sizeof(s), "%.16e", value);
+  buf[0] = s[0];
+  memcpy(buf + 1, s + 2, 16);
+  *k = atoi(s + 19) - 16;
+}
+
+/*
+ * Write digits * 10^k in "%.17g" layout
+ *
+ * Returns: The length written
+ */
+static int layout(const char *digits, int len, int k, char *buf)
+{
+  int exp10 = len + k - 1; // the exponent of the first digit
+  char *p = buf;
+
+  if (exp10 >= PLAIN_MIN_EXP && exp10 <= PLAIN_MAX_EXP)
+  {
+    if (exp10 < 0)
+    {
+      // 0.000ddd
+      *p++ = '0';
+      *p++ = '.';
+      for (int i = -1; i > exp10; i--)
+        *p++ = '0';
+      memcpy(p, digits, len);
+      p += len;
+    }
+    else if (k >= 0)
+    {
+      // ddd000
+      memcpy(p, digits, len);
+      p += len;
+      for (int i = 0; i < k; i++)
+        *p++ = '0';
+    }
+    else
+    {
+      // dd.ddd
+      memcpy(p, digits, exp10 + 1);
+      p += exp10 + 1;
+      *p++ = '.';
+      memcpy(p, digits + exp10 + 1, len - exp10 - 1);
+      p += len - exp10 - 1;
+    }
+  }
+  else
+  {
+    // d.ddde+XX
+    *p++ = digits[0];
+    if (len > 1)
+    {
+      *p++ = '.';
+      memcpy(p, digits + 1, len - 1);
+      p += len - 1;
+    }
+    int e = abs(exp10);
+
+    *p++ = 'e';
+    *p++ = (exp10 < 0) ? '-' : '+';
+    if (e >= 100)
+      *p++ = '0' + e / 100;
+    *p++ = '0' + e / 10 % 10;
+    *p++ = '0' + e % 10;
+  }
+
+  *p = '\0';
+  return p - buf;
+}
+
+// Documented in .h file
+int DT_format(double value, int precision, char *buf)
+{
+  if (precision != DT_SHORTEST || !isfinite(value))
+    return snprintf(buf, DT_BUFFER_SIZE, "%.*g", (precision != DT_SHORTEST) ? precision : 6, value);
+
+  char digits[20];
+  int len, k;
+  char *p = buf;
+
+  if (signbit(value))
+  {
+    *p++ = '-';
+    value = -value;
+  }
+
+  if (value == 0)
+  {
+    strcpy(p, "0");
+    return p + 1 - buf;
+  }
+
+  if (!grisu3(value, digits, &len, &k))
+    shortest_exact(value, digits, &len, &k);
+
+  // the digits may end in zeros
+  while (len > 1 && digits[len - 1] == '0')
+  {
+    len--;
+    k++;
+  }
+
+  return p - buf + layout(digits, len, k, p);
+}
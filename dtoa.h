@@ -0,0 +1,40 @@
+/*
+ * dtoa.h
+ *
+ * Conversion of doubles to decimal strings, for printing results and
+ * the constants of expressions.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#ifndef _DTOA_H_
+#define _DTOA_H_
+
+// Enough room for any string DT_format writes, '\0' included
+#define DT_BUFFER_SIZE 32
+
+// The precision that asks DT_format for the shortest round-trip form
+#define DT_SHORTEST 0
+
+/*
+ * Convert a double to a string. With precision DT_SHORTEST, the
+ * result always reads back as exactly the same double with strtod, so
+ * no precision is lost, and it is the shortest string that does, and
+ * of those the closest to the double. It is laid out like printf's
+ * "%.17g": plain notation when the decimal exponent is from -4 to 16,
+ * otherwise "d.ddde+XX"; no trailing zeros. Otherwise the result is that of "%.*g" with the
+ * given precision.
+ *
+ * Either way, infinities are "inf" and "-inf", NaNs are "nan" or
+ * "-nan", and negative zero is "-0", as with printf.
+ *
+ * Parameters:
+ *   value      The double
+ *   precision  DT_SHORTEST, or a number of significant digits, 1 to 17
+ *   buf        Return space for the string; must hold DT_BUFFER_SIZE
+ *
+ * Returns: The length of the string
+ */
+int DT_format(double value, int precision, char *buf);
+
+#endif /* _DTOA_H_ */
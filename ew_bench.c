@@ -0,0 +1,833 @@
+/*
+ * ew_bench.c
+ *
+ * Microbenchmarks of the expression pipeline. For each shape of
+ * expression and each size, from 10 tokens up by factors of ten, it
+ * generates a random expression from a fixed seed and times the
+ * phases separately: TOK_tokenize_input, Parse, ET_evaluate,
+ * ET_tree2string and ET_free. Small expressions are processed many
+ * copies at a time, so that every timed interval is long enough to
+ * measure; each measurement is repeated, and the mean, standard
+ * deviation and minimum of the time per token are reported, with the
+ * throughput, as JSON on stdout.
+ *
+ * Next to the times, each phase reports the hardware counters of the
+ * benchmark thread per token, from perf_event_open: cycles,
+ * instructions (and so instructions per cycle), branch misses, L1 data
+ * cache, last level cache and data TLB read misses, counted in user
+ * space only. The counters are opened one by one, so that the kernel
+ * can time-share them if the PMU has too few, and scaled by the time
+ * each was running. A counter that cannot be opened (no PMU in a VM,
+ * or perf_event_paranoid too high) is listed with the reason at the
+ * top, and reported as null; the times are unaffected.
+ *
+ * The shapes are:
+ *   flat_sum       1 + 7 + 3 + ...: one long left-leaning chain
+ *   deep_nesting   (((1 + 2) * 3) - 4): parentheses nested to the top
+ *   power_chain    1.01 ^ 1.002 ^ ...: right-associative, as deep as long
+ *   balanced       ((1 + 2) * (3 / 4)): a balanced binary tree
+ *   literal_heavy  long constants with exponents, so tokens are wide
+ *
+ * A case whose predicted time (from the growth of the same shape so
+ * far) exceeds the time budget is not run, but listed as skipped with
+ * the prediction. Everything runs on a thread with a large stack,
+ * since parsing and evaluation recurse as deep as the tree is.
+ * ET_tree2string also keeps two buffers of the output's size on the
+ * stack at each level, so for deep trees it needs far more stack than
+ * that; where it would not fit, the phase is skipped and says so.
+ *
+ * After the cases, a "precision" section times FP_evaluate_batch over
+ * the same rows in float, double and long double, for a fixed set of
+ * scoring expressions compiled into one program, and reports the time
+ * per row of each with its speedup over double.
+ *
+ * Last, a "fastmath" section times each kernel of fastmath.h in its
+ * scalar and its block form against the libm function it approximates,
+ * over the same random arguments, and reports the time per call of
+ * each with the speedup of the two forms over libm.
+ *
+ * Usage: ew_bench [-s SEED] [-r REPETITIONS] [-m MAX_TOKENS] [-t BUDGET_SECONDS]
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "clist.h"
+#include "tokenize.h"
+#include "parse.h"
+#include "expr_tree.h"
+#include "expr_fused.h"
+#include "fastmath.h"
+#include "vars.h"
+
+#define MIN_TOKENS_PER_SAMPLE 200000 // small cases are timed this many tokens at a time
+#define BENCH_STACK_SIZE ((size_t)2 << 30)
+#define NPHASES 5
+#define PRECISION_ROWS (1 << 18) // rows of each batch in the precision section
+#define FASTMATH_ARGS 4096       // arguments of each call of a block kernel
+#define FASTMATH_PASSES 64       // passes over them in each timed interval
+
+static const char *const phase_names[NPHASES] = {"tokenize", "parse", "evaluate", "tree2string", "free"};
+
+#define CACHE_EVENT(cache, op, result)                                                 \
+  (PERF_COUNT_HW_CACHE_##cache | (PERF_COUNT_HW_CACHE_OP_##op << 8) |                  \
+   (PERF_COUNT_HW_CACHE_RESULT_##result << 16))
+
+#define NCOUNTERS 6
+#define CYCLES 0       // the index of the cycles counter in counters
+#define INSTRUCTIONS 1 // and of the instructions
+
+// The hardware counters read around each phase
+static const struct
+{
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+} counters[NCOUNTERS] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"l1d_misses", PERF_TYPE_HW_CACHE, CACHE_EVENT(L1D, READ, MISS)},
+    {"llc_misses", PERF_TYPE_HW_CACHE, CACHE_EVENT(LL, READ, MISS)},
+    {"dtlb_misses", PERF_TYPE_HW_CACHE, CACHE_EVENT(DTLB, READ, MISS)},
+};
+
+// The counters of the benchmark thread: a descriptor, or -1 and why not
+static int counter_fd[NCOUNTERS];
+static const char *counter_error[NCOUNTERS];
+
+// The counters and the clock, as read at the start of a phase
+struct mark
+{
+  double time;
+  uint64_t raw[NCOUNTERS][3]; // value, time enabled, time running
+};
+
+// The options
+struct config
+{
+  uint64_t seed;
+  int reps;
+  long max_tokens;
+  double budget;
+};
+
+// A growable string
+struct text
+{
+  char *buf;
+  size_t len;
+  size_t cap;
+};
+
+/*
+ * Append a formatted string to a text
+ */
+static void text_printf(struct text *t, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void text_printf(struct text *t, const char *fmt, ...)
+{
+  va_list ap;
+
+  for (;;)
+  {
+    va_start(ap, fmt);
+    int n = vsnprintf(t->buf + t->len, t->cap - t->len, fmt, ap);
+    va_end(ap);
+
+    if (n < t->cap - t->len)
+    {
+      t->len += n;
+      return;
+    }
+
+    t->cap = 2 * t->cap + n + 1;
+    t->buf = realloc(t->buf, t->cap);
+    if (t->buf == NULL)
+    {
+      fprintf(stderr, "ew_bench: out of memory\n");
+      exit(1);
+    }
+  }
+}
+
+/*
+ * xorshift64*: the same sequence everywhere, unlike rand()
+ */
+static uint64_t next_random(uint64_t *state)
+{
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ull;
+}
+
+static int random_below(uint64_t *state, int n)
+{
+  return next_random(state) % n;
+}
+
+/*
+ * A small nonzero literal
+ */
+static void small_literal(struct text *t, uint64_t *rng)
+{
+  text_printf(t, "%d", 1 + random_below(rng, 9));
+}
+
+static char random_op(uint64_t *rng)
+{
+  return "+-*/"[random_below(rng, 4)];
+}
+
+static void gen_flat_sum(struct text *t, uint64_t *rng, long ntokens)
+{
+  small_literal(t, rng);
+  for (long n = 1; n + 2 <= ntokens; n += 2)
+  {
+    text_printf(t, " + ");
+    small_literal(t, rng);
+  }
+}
+
+static void gen_deep_nesting(struct text *t, uint64_t *rng, long ntokens)
+{
+  long depth = (ntokens - 1) / 4;
+
+  for (long i = 0; i < depth; i++)
+    text_printf(t, "(");
+  small_literal(t, rng);
+  for (long i = 0; i < depth; i++)
+  {
+    text_printf(t, " %c ", random_op(rng));
+    small_literal(t, rng);
+    text_printf(t, ")");
+  }
+}
+
+static void gen_power_chain(struct text *t, uint64_t *rng, long ntokens)
+{
+  // bases just above 1 keep the value finite however long the chain
+  text_printf(t, "1.%03d", 1 + random_below(rng, 999));
+  for (long n = 1; n + 2 <= ntokens; n += 2)
+    text_printf(t, " ^ 1.%03d", 1 + random_below(rng, 999));
+}
+
+static void gen_balanced_leaves(struct text *t, uint64_t *rng, long nleaves)
+{
+  if (nleaves == 1)
+  {
+    small_literal(t, rng);
+    return;
+  }
+
+  text_printf(t, "(");
+  gen_balanced_leaves(t, rng, nleaves / 2);
+  text_printf(t, " %c ", random_op(rng));
+  gen_balanced_leaves(t, rng, nleaves - nleaves / 2);
+  text_printf(t, ")");
+}
+
+static void gen_balanced(struct text *t, uint64_t *rng, long ntokens)
+{
+  // L leaves take 4L - 3 tokens: the leaves, L - 1 operators and pairs of parentheses
+  gen_balanced_leaves(t, rng, (ntokens + 3) / 4);
+}
+
+static void gen_literal_heavy(struct text *t, uint64_t *rng, long ntokens)
+{
+  for (long n = 0; n < ntokens; n += 2)
+  {
+    if (n > 0)
+      text_printf(t, " %c ", (random_below(rng, 2) == 0) ? '+' : '*');
+    text_printf(t, "%d.%09de%+d", 1 + random_below(rng, 999999), random_below(rng, 1000000000),
+                random_below(rng, 21) - 10);
+  }
+}
+
+static const struct
+{
+  const char *name;
+  void (*generate)(struct text *t, uint64_t *rng, long ntokens);
+} shapes[] = {
+    {"flat_sum", gen_flat_sum},
+    {"deep_nesting", gen_deep_nesting},
+    {"power_chain", gen_power_chain},
+    {"balanced", gen_balanced},
+    {"literal_heavy", gen_literal_heavy},
+};
+
+/*
+ * Return the time in seconds
+ */
+static double now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Open the counters, for the calling thread only. Those that cannot be
+ * opened are left out.
+ */
+static void open_counters()
+{
+  for (int c = 0; c < NCOUNTERS; c++)
+  {
+    struct perf_event_attr attr = {
+        .size = sizeof(attr),
+        .type = counters[c].type,
+        .config = counters[c].config,
+        .read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING,
+        .exclude_kernel = 1,
+        .exclude_hv = 1,
+    };
+
+    counter_fd[c] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    counter_error[c] = (counter_fd[c] < 0) ? strerror(errno) : NULL;
+  }
+}
+
+static void close_counters()
+{
+  for (int c = 0; c < NCOUNTERS; c++)
+    if (counter_fd[c] >= 0)
+      close(counter_fd[c]);
+}
+
+/*
+ * Read the counters and the clock at the start of a phase
+ */
+static void mark_start(struct mark *m)
+{
+  for (int c = 0; c < NCOUNTERS; c++)
+    if (counter_fd[c] < 0 || read(counter_fd[c], m->raw[c], sizeof(m->raw[c])) != sizeof(m->raw[c]))
+      m->raw[c][0] = m->raw[c][1] = m->raw[c][2] = 0;
+  m->time = now();
+}
+
+/*
+ * Read the clock and the counters at the end of a phase
+ *
+ * Parameters:
+ *   m         The mark taken at the start of the phase
+ *   time      Return space for the time it took, in seconds
+ *   counts    Return space for the count of each counter, scaled up
+ *             for the time it was not running, or NAN where unknown
+ */
+static void mark_end(const struct mark *m, double *time, double counts[NCOUNTERS])
+{
+  uint64_t raw[3];
+
+  *time = now() - m->time;
+
+  for (int c = 0; c < NCOUNTERS; c++)
+  {
+    counts[c] = NAN;
+    if (counter_fd[c] < 0 || read(counter_fd[c], raw, sizeof(raw)) != sizeof(raw))
+      continue;
+
+    uint64_t enabled = raw[1] - m->raw[c][1], running = raw[2] - m->raw[c][2];
+    if (running > 0)
+      counts[c] = (double)(raw[0] - m->raw[c][0]) * enabled / running;
+  }
+}
+
+/*
+ * Print a number of the JSON output, or null if it is unknown
+ */
+static void print_number(const char *key, double value)
+{
+  if (isnan(value))
+    printf("\"%s\": null", key);
+  else
+    printf("\"%s\": %.6g", key, value);
+}
+
+// Keeps the evaluations from being optimized away
+static volatile double sink;
+
+/*
+ * Run every phase once over ncopies copies of an expression
+ *
+ * Parameters:
+ *   input     The expression
+ *   ncopies   How many copies go through each phase
+ *   out       Scratch space for ET_tree2string, or NULL to leave out
+ *             that phase
+ *   out_sz    Its size
+ *   times     Return space for the time each phase took, in seconds
+ *   counts    Return space for the counts of each phase, as for mark_end
+ *
+ * Returns: 0, or -1 if the expression did not parse
+ */
+static int run_sample(const char *input, int ncopies, char *out, size_t out_sz, double times[NPHASES],
+                      double counts[NPHASES][NCOUNTERS])
+{
+  CList *lists = malloc(ncopies * sizeof(CList));
+  ExprTree *trees = malloc(ncopies * sizeof(ExprTree));
+  char errmsg[128];
+  double sum = 0;
+  int status = 0;
+  struct mark m;
+
+  if (lists == NULL || trees == NULL)
+  {
+    fprintf(stderr, "ew_bench: out of memory\n");
+    exit(1);
+  }
+
+  mark_start(&m);
+  for (int k = 0; k < ncopies; k++)
+    lists[k] = TOK_tokenize_input(input, errmsg, sizeof(errmsg));
+  mark_end(&m, &times[0], counts[0]);
+
+  mark_start(&m);
+  for (int k = 0; k < ncopies; k++)
+    trees[k] = Parse(lists[k], errmsg, sizeof(errmsg));
+  mark_end(&m, &times[1], counts[1]);
+
+  // freeing the token lists is not one of the phases
+  for (int k = 0; k < ncopies; k++)
+  {
+    CL_free(lists[k]);
+    if (trees[k] == NULL)
+      status = -1;
+  }
+
+  if (status == 0)
+  {
+    mark_start(&m);
+    for (int k = 0; k < ncopies; k++)
+      sum += ET_evaluate(trees[k]);
+    mark_end(&m, &times[2], counts[2]);
+
+    mark_start(&m);
+    for (int k = 0; out != NULL && k < ncopies; k++)
+      ET_tree2string(trees[k], out, out_sz);
+    mark_end(&m, &times[3], counts[3]);
+  }
+
+  mark_start(&m);
+  for (int k = 0; k < ncopies; k++)
+    ET_free(trees[k]);
+  mark_end(&m, &times[4], counts[4]);
+
+  sink = sum;
+  free(lists);
+  free(trees);
+  return status;
+}
+
+/*
+ * Benchmark one shape at one size and print its JSON object
+ *
+ * Returns: The time one copy took through all the phases, in seconds,
+ *   or a negative number if the expression did not parse
+ */
+static double bench_case(const struct config *cfg, int shape, long target)
+{
+  struct text t = {NULL, 0, 0};
+  uint64_t rng = cfg->seed * 0x9E3779B97F4A7C15ull + shape * 1000003 + target;
+  char errmsg[128];
+  double samples[NPHASES][cfg->reps];
+  double per_token[NPHASES][NCOUNTERS] = {{0}}; // mean counts, NAN where unknown
+  double per_copy = 0;
+
+  if (rng == 0)
+    rng = 1; // xorshift never leaves 0
+
+  text_printf(&t, "%s", "");
+  shapes[shape].generate(&t, &rng, target);
+
+  CList tokens = TOK_tokenize_input(t.buf, errmsg, sizeof(errmsg));
+  long ntokens = (tokens == NULL) ? 0 : CL_length(tokens);
+  ExprTree tree = Parse(tokens, errmsg, sizeof(errmsg));
+  long depth = (tree == NULL) ? 0 : ET_depth(tree);
+  CL_free(tokens);
+  ET_free(tree);
+
+  int ncopies = (ntokens >= MIN_TOKENS_PER_SAMPLE) ? 1 : MIN_TOKENS_PER_SAMPLE / (ntokens + 1) + 1;
+  size_t out_sz = 4 * t.len + 64; // room for the parentheses ET_tree2string adds
+  double print_stack = 2.0 * out_sz * (depth + 1);
+  bool print = print_stack < BENCH_STACK_SIZE / 2;
+  char *out = malloc(out_sz);
+
+  if (out == NULL)
+  {
+    fprintf(stderr, "ew_bench: out of memory\n");
+    exit(1);
+  }
+
+  for (int r = 0; r < cfg->reps; r++)
+  {
+    double times[NPHASES] = {0};
+    double counts[NPHASES][NCOUNTERS];
+
+    if (ntokens == 0 || run_sample(t.buf, ncopies, print ? out : NULL, out_sz, times, counts) != 0)
+    {
+      fprintf(stderr, "ew_bench: %s at %ld tokens does not parse\n", shapes[shape].name, target);
+      free(out);
+      free(t.buf);
+      return -1;
+    }
+
+    double total = 0;
+    for (int p = 0; p < NPHASES; p++)
+    {
+      samples[p][r] = times[p] * 1e9 / ((double)ncopies * ntokens);
+      total += times[p];
+      for (int c = 0; c < NCOUNTERS; c++)
+        per_token[p][c] += counts[p][c] / ((double)ncopies * ntokens) / cfg->reps;
+    }
+    per_copy += total / ncopies / cfg->reps;
+  }
+
+  printf("    {\"shape\": \"%s\", \"target_tokens\": %ld, \"tokens\": %ld, \"bytes\": %zu, \"depth\": %ld, "
+         "\"copies\": %d,\n",
+         shapes[shape].name, target, ntokens, t.len, depth, ncopies);
+  printf("     \"phases\": {");
+  for (int p = 0; p < NPHASES; p++)
+  {
+    double mean = 0, var = 0, min = INFINITY;
+
+    if (p == 3 && !print)
+    {
+      printf(",\n       \"%s\": {\"skipped\": \"needs %.0f MB of stack\"}", phase_names[p], print_stack / 1e6);
+      continue;
+    }
+
+    for (int r = 0; r < cfg->reps; r++)
+    {
+      mean += samples[p][r] / cfg->reps;
+      if (samples[p][r] < min)
+        min = samples[p][r];
+    }
+    for (int r = 0; r < cfg->reps; r++)
+      var += (samples[p][r] - mean) * (samples[p][r] - mean);
+    var = (cfg->reps > 1) ? var / (cfg->reps - 1) : 0;
+
+    printf("%s\n       \"%s\": {\"ns_per_token\": %.3f, \"stddev_ns_per_token\": %.3f, "
+           "\"min_ns_per_token\": %.3f, \"tokens_per_s\": %.0f,\n         ",
+           (p == 0) ? "" : ",", phase_names[p], mean, sqrt(var), min, (mean > 0) ? 1e9 / mean : 0);
+    for (int c = 0; c < NCOUNTERS; c++)
+    {
+      char key[64];
+
+      snprintf(key, sizeof(key), "%s_per_token", counters[c].name);
+      print_number(key, per_token[p][c]);
+      printf(", ");
+    }
+    print_number("ipc", per_token[p][INSTRUCTIONS] / per_token[p][CYCLES]);
+    printf("}");
+  }
+  printf("}}");
+
+  free(out);
+  free(t.buf);
+  return per_copy;
+}
+
+// The expressions of the precision section, over the variables a to d
+static const char *const scoring[] = {
+    "0.3 * a + 0.2 * b - 0.1 * c + d",
+    "sqrt(a * a + b * b) / (1 + abs(c))",
+    "(a < b) ? exp(-c * c) : log(1 + d * d)",
+    "max(a, b) * min(c, d) + sin(a) * cos(b)",
+    "(a - b) ^ 2 + (c - d) ^ 2",
+};
+
+/*
+ * Time one precision: fill its columns from the double ones, then
+ * evaluate the batch cfg->reps times
+ */
+#define BENCH_PRECISION(type, prog, nvars, dcols, nouts, times)               \
+  do                                                                          \
+  {                                                                           \
+    type *cols[nvars], *outs[nouts];                                          \
+                                                                              \
+    for (int v = 0; v < (nvars); v++)                                         \
+    {                                                                         \
+      cols[v] = malloc(PRECISION_ROWS * sizeof(type));                        \
+      for (int i = 0; i < PRECISION_ROWS; i++)                                \
+        cols[v][i] = (dcols)[v][i];                                           \
+    }                                                                         \
+    for (int k = 0; k < (nouts); k++)                                         \
+      outs[k] = malloc(PRECISION_ROWS * sizeof(type));                        \
+                                                                              \
+    for (int r = 0; r < cfg->reps; r++)                                       \
+    {                                                                         \
+      double start = now();                                                   \
+      FP_EVALUATE_BATCH((prog), (const type *const *)cols, outs, PRECISION_ROWS); \
+      (times)[r] = (now() - start) * 1e9 / PRECISION_ROWS;                    \
+      sink = outs[r % (nouts)][r];                                            \
+    }                                                                         \
+                                                                              \
+    for (int v = 0; v < (nvars); v++)                                         \
+      free(cols[v]);                                                          \
+    for (int k = 0; k < (nouts); k++)                                         \
+      free(outs[k]);                                                          \
+  } while (0)
+
+/*
+ * Time the fused evaluator at each precision, and print the results as
+ * the "precision" section
+ *
+ * Returns: 0, or -1 if an expression did not parse
+ */
+static int bench_precision(const struct config *cfg)
+{
+  enum { NOUTS = sizeof(scoring) / sizeof(scoring[0]), NPRECISIONS = 3 };
+  const char *const names[NPRECISIONS] = {"float", "double", "long_double"};
+  VarTable vt = VT_new();
+  ExprTree trees[NOUTS];
+  char errmsg[128];
+  uint64_t rng = cfg->seed;
+
+  for (int k = 0; k < NOUTS; k++)
+  {
+    CList tokens = TOK_tokenize_vars(scoring[k], vt, errmsg, sizeof(errmsg));
+
+    trees[k] = (tokens != NULL) ? Parse(tokens, errmsg, sizeof(errmsg)) : NULL;
+    CL_free(tokens);
+    if (trees[k] == NULL)
+    {
+      fprintf(stderr, "ew_bench: %s: %s\n", scoring[k], errmsg);
+      return -1;
+    }
+  }
+
+  FusedProgram prog = FP_compile(trees, NOUTS);
+  int nvars = FP_var_count(prog);
+  double *dcols[nvars];
+  double times[NPRECISIONS][cfg->reps];
+
+  for (int v = 0; v < nvars; v++)
+  {
+    dcols[v] = malloc(PRECISION_ROWS * sizeof(double));
+    for (int i = 0; i < PRECISION_ROWS; i++)
+      dcols[v][i] = random_below(&rng, 2001) / 100.0 - 10;
+  }
+
+  BENCH_PRECISION(float, prog, nvars, dcols, NOUTS, times[0]);
+  BENCH_PRECISION(double, prog, nvars, dcols, NOUTS, times[1]);
+  BENCH_PRECISION(long double, prog, nvars, dcols, NOUTS, times[2]);
+
+  double mean[NPRECISIONS] = {0}, min[NPRECISIONS];
+
+  for (int p = 0; p < NPRECISIONS; p++)
+  {
+    min[p] = INFINITY;
+    for (int r = 0; r < cfg->reps; r++)
+    {
+      mean[p] += times[p][r] / cfg->reps;
+      min[p] = fmin(min[p], times[p][r]);
+    }
+  }
+
+  printf(",\n  \"precision\": {\"rows\": %d, \"expressions\": %d", PRECISION_ROWS, NOUTS);
+  for (int p = 0; p < NPRECISIONS; p++)
+    printf(",\n    \"%s\": {\"ns_per_row\": %.3f, \"min_ns_per_row\": %.3f, \"rows_per_s\": %.0f, "
+           "\"speedup_vs_double\": %.3f}",
+           names[p], mean[p], min[p], (mean[p] > 0) ? 1e9 / mean[p] : 0, mean[1] / mean[p]);
+  printf("}");
+
+  for (int v = 0; v < nvars; v++)
+    free(dcols[v]);
+  FP_free(prog);
+  for (int k = 0; k < NOUTS; k++)
+    ET_free(trees[k]);
+  VT_free(vt);
+  return 0;
+}
+
+/*
+ * Time cfg->reps intervals of FASTMATH_PASSES passes of body, which
+ * computes out[] from FASTMATH_ARGS arguments, in ns per argument
+ */
+#define BENCH_FASTMATH(times, out, body)                                       \
+  do                                                                          \
+  {                                                                           \
+    for (int r = 0; r < cfg->reps; r++)                                       \
+    {                                                                         \
+      double start = now();                                                   \
+      for (int pass = 0; pass < FASTMATH_PASSES; pass++)                      \
+        body;                                                                 \
+      (times)[r] = (now() - start) * 1e9 / ((double)FASTMATH_PASSES * FASTMATH_ARGS); \
+      sink = (out)[r % FASTMATH_ARGS];                                        \
+    }                                                                         \
+  } while (0)
+
+// The kernels of the fastmath section, in the order they are timed
+static const char *const fastmath_kernels[] = {"exp2", "log2", "pow", "sin", "cos"};
+
+/*
+ * Time every fastmath kernel, scalar and block, against libm, and
+ * print the results as the "fastmath" section
+ */
+static void bench_fastmath(const struct config *cfg)
+{
+  enum { NKERNELS = sizeof(fastmath_kernels) / sizeof(fastmath_kernels[0]), NFORMS = 3 };
+  const char *const forms[NFORMS] = {"libm", "scalar", "block"};
+  static double x[FASTMATH_ARGS], y[FASTMATH_ARGS], e[FASTMATH_ARGS], out[FASTMATH_ARGS];
+  double times[NKERNELS][NFORMS][cfg->reps];
+  uint64_t rng = cfg->seed;
+
+  // exponents in [-30, 30], bases in (0, 100], angles in [-10, 10]
+  for (int i = 0; i < FASTMATH_ARGS; i++)
+  {
+    e[i] = random_below(&rng, 60001) / 1000.0 - 30;
+    x[i] = (1 + random_below(&rng, 100000)) / 1000.0;
+    y[i] = random_below(&rng, 20001) / 1000.0 - 10;
+  }
+
+  BENCH_FASTMATH(times[0][0], out, for (int i = 0; i < FASTMATH_ARGS; i++) out[i] = exp2(e[i]));
+  BENCH_FASTMATH(times[0][1], out, for (int i = 0; i < FASTMATH_ARGS; i++) out[i] = FM_exp2(e[i]));
+  BENCH_FASTMATH(times[0][2], out, FM_exp2_block(out, e, FASTMATH_ARGS));
+  BENCH_FASTMATH(times[1][0], out, for (int i = 0; i < FASTMATH_ARGS; i++) out[i] = log2(x[i]));
+  BENCH_FASTMATH(times[1][1], out, for (int i = 0; i < FASTMATH_ARGS; i++) out[i] = FM_log2(x[i]));
+  BENCH_FASTMATH(times[1][2], out, FM_log2_block(out, x, FASTMATH_ARGS));
+  BENCH_FASTMATH(times[2][0], out, for (int i = 0; i < FASTMATH_ARGS; i++) out[i] = pow(x[i], y[i]));
+  BENCH_FASTMATH(times[2][1], out, for (int i = 0; i < FASTMATH_ARGS; i++) out[i] = FM_pow(x[i], y[i]));
+  BENCH_FASTMATH(times[2][2], out, FM_pow_block(out, x, y, FASTMATH_ARGS));
+  BENCH_FASTMATH(times[3][0], out, for (int i = 0; i < FASTMATH_ARGS; i++) out[i] = sin(y[i]));
+  BENCH_FASTMATH(times[3][1], out, for (int i = 0; i < FASTMATH_ARGS; i++) out[i] = FM_sin(y[i]));
+  BENCH_FASTMATH(times[3][2], out, FM_sin_block(out, y, FASTMATH_ARGS));
+  BENCH_FASTMATH(times[4][0], out, for (int i = 0; i < FASTMATH_ARGS; i++) out[i] = cos(y[i]));
+  BENCH_FASTMATH(times[4][1], out, for (int i = 0; i < FASTMATH_ARGS; i++) out[i] = FM_cos(y[i]));
+  BENCH_FASTMATH(times[4][2], out, FM_cos_block(out, y, FASTMATH_ARGS));
+
+  printf(",\n  \"fastmath\": {\"arguments\": %d", FASTMATH_ARGS);
+  for (int k = 0; k < NKERNELS; k++)
+  {
+    double mean[NFORMS] = {0}, min[NFORMS];
+
+    printf(",\n    \"%s\": {", fastmath_kernels[k]);
+    for (int f = 0; f < NFORMS; f++)
+    {
+      min[f] = INFINITY;
+      for (int r = 0; r < cfg->reps; r++)
+      {
+        mean[f] += times[k][f][r] / cfg->reps;
+        min[f] = fmin(min[f], times[k][f][r]);
+      }
+      printf("\"%s_ns_per_call\": %.3f, \"%s_min_ns_per_call\": %.3f, ", forms[f], mean[f], forms[f], min[f]);
+    }
+    printf("\"scalar_speedup\": %.3f, \"block_speedup\": %.3f}", mean[0] / mean[1], mean[0] / mean[2]);
+  }
+  printf("}");
+}
+
+/*
+ * Run every case, as the body of the big-stack thread
+ */
+static void *run_all(void *arg)
+{
+  const struct config *cfg = arg;
+  bool first = true;
+
+  // opened here, since they count only the thread that opens them
+  open_counters();
+
+  printf("{\n  \"benchmark\": \"ew_bench\",\n  \"seed\": %llu,\n  \"repetitions\": %d,\n"
+         "  \"max_tokens\": %ld,\n  \"time_budget_s\": %g,\n  \"perf_counters\": {",
+         (unsigned long long)cfg->seed, cfg->reps, cfg->max_tokens, cfg->budget);
+  for (int c = 0; c < NCOUNTERS; c++)
+    printf("%s\"%s\": \"%s\"", (c == 0) ? "" : ", ", counters[c].name,
+           (counter_error[c] == NULL) ? "ok" : counter_error[c]);
+  printf("},\n  \"cases\": [\n");
+
+  for (int s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++)
+  {
+    double prev_time = 0, growth = 1; // time of the last case, and its exponent in the size
+    long prev_size = 0;
+
+    for (long size = 10; size <= cfg->max_tokens; size *= 10)
+    {
+      printf("%s", first ? "" : ",\n");
+      first = false;
+
+      // predict from the last case, assuming the growth seen so far
+      double predicted = (prev_size > 0) ? prev_time * pow((double)size / prev_size, growth) * cfg->reps : 0;
+      if (predicted > cfg->budget)
+      {
+        printf("    {\"shape\": \"%s\", \"target_tokens\": %ld, \"skipped\": \"over time budget\", "
+               "\"predicted_s\": %.1f}",
+               shapes[s].name, size, predicted);
+        continue;
+      }
+
+      double time = bench_case(cfg, s, size);
+      if (time < 0)
+        exit(1);
+      fflush(stdout);
+
+      // the exponent is only trusted once the sizes are large enough
+      // for fixed costs not to dominate
+      if (prev_size >= 1000 && prev_time > 0)
+        growth = fmax(1, log(time / prev_time) / log((double)size / prev_size));
+      prev_time = time;
+      prev_size = size;
+    }
+  }
+
+  printf("\n  ]");
+  if (bench_precision(cfg) < 0)
+    exit(1);
+  bench_fastmath(cfg);
+  printf("\n}\n");
+  close_counters();
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  struct config cfg = {1, 5, 10000000, 30};
+  pthread_attr_t attr;
+  pthread_t thread;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:r:m:t:")) != -1)
+  {
+    if (opt == 's')
+      cfg.seed = strtoull(optarg, NULL, 10);
+    else if (opt == 'r' && (cfg.reps = atoi(optarg)) >= 1)
+      continue;
+    else if (opt == 'm' && (cfg.max_tokens = atol(optarg)) >= 10)
+      continue;
+    else if (opt == 't' && (cfg.budget = atof(optarg)) > 0)
+      continue;
+    else
+    {
+      fprintf(stderr, "Usage: %s [-s SEED] [-r REPETITIONS] [-m MAX_TOKENS] [-t BUDGET_SECONDS]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  pthread_attr_init(&attr);
+  if (pthread_attr_setstacksize(&attr, BENCH_STACK_SIZE) != 0 ||
+      pthread_create(&thread, &attr, run_all, &cfg) != 0)
+  {
+    fprintf(stderr, "ew_bench: cannot start the benchmark thread\n");
+    return 1;
+  }
+  pthread_join(thread, NULL);
+  pthread_attr_destroy(&attr);
+  return 0;
+}
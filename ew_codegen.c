@@ -0,0 +1,248 @@
+/*
+ * ew_codegen.c
+ *
+ * Ahead-of-time compiler from expressions to C. Reads a file of named
+ * expressions, one per line:
+ *
+ *   # a comment
+ *   area = w * h
+ *   hyp = (a ^ 2 + b ^ 2) ^ 0.5
+ *
+ * and writes OUT.h, holding one static inline function per expression
+ * plus prototypes, and OUT.c, holding the batch-over-arrays variants.
+ * Each function takes the variables of its expression as parameters,
+ * in order of first use. See codegen.h.
+ *
+ * Usage: ew_codegen INPUT OUT
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "clist.h"
+#include "tokenize.h"
+#include "expr_tree.h"
+#include "parse.h"
+#include "vars.h"
+#include "codegen.h"
+
+// One expression read from the input file
+struct definition
+{
+  char *name;
+  ExprTree tree;
+  VarTable vars;
+};
+
+/*
+ * Strip leading and trailing white space from s, in place
+ *
+ * Returns: The start of the stripped string
+ */
+static char *strip(char *s)
+{
+  while (isspace(*s))
+    s++;
+
+  size_t len = strlen(s);
+  while (len > 0 && isspace(s[len - 1]))
+    s[--len] = '\0';
+
+  return s;
+}
+
+/*
+ * Parse one "name = expression" line into def
+ *
+ * Returns: true on success; false, with errmsg filled in, otherwise
+ */
+static bool parse_definition(char *line, struct definition *def, char *errmsg, size_t errmsg_sz)
+{
+  char *eq = strchr(line, '=');
+
+  if (eq == NULL)
+  {
+    snprintf(errmsg, errmsg_sz, "Expected 'name = expression'");
+    return false;
+  }
+
+  *eq = '\0';
+  char *name = strip(line);
+
+  if (!CG_valid_function_name(name))
+  {
+    snprintf(errmsg, errmsg_sz, "Invalid function name '%s'", name);
+    return false;
+  }
+
+  def->vars = VT_new();
+
+  CList tokens = TOK_tokenize_vars(eq + 1, def->vars, errmsg, errmsg_sz);
+  if (tokens == NULL)
+    goto error;
+
+  def->tree = Parse(tokens, errmsg, errmsg_sz);
+  CL_free(tokens);
+
+  if (def->tree == NULL)
+  {
+    if (errmsg[0] == '\0')
+      snprintf(errmsg, errmsg_sz, "Empty expression");
+    goto error;
+  }
+
+  for (int i = 0; i < VT_count(def->vars); i++)
+  {
+    const char *var = VT_nth(def->vars, i)->name;
+
+    if (!CG_valid_name(var) || strcmp(var, name) == 0)
+    {
+      snprintf(errmsg, errmsg_sz, "Invalid variable name '%s'", var);
+      ET_free(def->tree);
+      goto error;
+    }
+  }
+
+  def->name = strdup(name);
+  return true;
+
+error:
+  VT_free(def->vars);
+  return false;
+}
+
+/*
+ * Write OUT.h and OUT.c for the definitions
+ *
+ * Returns: true on success, false if a file could not be written
+ */
+static bool write_output(const char *out_base, struct definition *defs, int ndefs)
+{
+  size_t len = strlen(out_base) + 3;
+  char hdr_path[len], src_path[len];
+  snprintf(hdr_path, len, "%s.h", out_base);
+  snprintf(src_path, len, "%s.c", out_base);
+
+  // the include guard is derived from the file name, without directories
+  const char *base = strrchr(out_base, '/') ? strrchr(out_base, '/') + 1 : out_base;
+  char guard[strlen(base) + 1];
+  size_t i;
+  for (i = 0; base[i] != '\0'; i++)
+    guard[i] = isalnum(base[i]) ? toupper(base[i]) : '_';
+  guard[i] = '\0';
+
+  FILE *hdr = fopen(hdr_path, "w");
+  FILE *src = fopen(src_path, "w");
+
+  if (hdr == NULL || src == NULL)
+  {
+    fprintf(stderr, "Cannot write %s\n", hdr == NULL ? hdr_path : src_path);
+    if (hdr != NULL)
+      fclose(hdr);
+    if (src != NULL)
+      fclose(src);
+    return false;
+  }
+
+  fprintf(hdr, "/*\n * %s.h\n *\n * Generated by ew_codegen; do not edit.\n */\n\n", base);
+  fprintf(hdr, "#ifndef _%s_H_\n#define _%s_H_\n\n", guard, guard);
+  fprintf(hdr, "#include <stddef.h>\n#include <math.h>\n");
+
+  fprintf(src, "/*\n * %s.c\n *\n * Generated by ew_codegen; do not edit.\n */\n\n", base);
+  fprintf(src, "#include \"%s.h\"\n", base);
+
+  for (int i = 0; i < ndefs; i++)
+  {
+    fputs("\n", hdr);
+    CG_emit_inline(hdr, defs[i].name, defs[i].tree, defs[i].vars);
+    fputs("\n", hdr);
+    CG_emit_batch(hdr, defs[i].name, defs[i].vars, false);
+
+    fputs("\n", src);
+    CG_emit_batch(src, defs[i].name, defs[i].vars, true);
+  }
+
+  fprintf(hdr, "\n#endif /* _%s_H_ */\n", guard);
+
+  bool ok = !ferror(hdr) && !ferror(src);
+  ok = (fclose(hdr) == 0) && ok;
+  ok = (fclose(src) == 0) && ok;
+
+  if (!ok)
+    fprintf(stderr, "Error writing %s\n", out_base);
+
+  return ok;
+}
+
+int main(int argc, char *argv[])
+{
+  char errmsg[128];
+  char *line = NULL;
+  size_t line_sz = 0;
+  struct definition *defs = NULL;
+  int ndefs = 0;
+  int lineno = 0;
+  int status = 1;
+
+  if (argc != 3)
+  {
+    fprintf(stderr, "Usage: %s INPUT OUT\n", argv[0]);
+    return 1;
+  }
+
+  FILE *in = fopen(argv[1], "r");
+  if (in == NULL)
+  {
+    fprintf(stderr, "Cannot open %s\n", argv[1]);
+    return 1;
+  }
+
+  while (getline(&line, &line_sz, in) != -1)
+  {
+    char *text = strip(line);
+    lineno++;
+
+    if (*text == '\0' || *text == '#')
+      continue;
+
+    defs = realloc(defs, (ndefs + 1) * sizeof(struct definition));
+    errmsg[0] = '\0';
+
+    if (!parse_definition(text, &defs[ndefs], errmsg, sizeof(errmsg)))
+    {
+      fprintf(stderr, "%s:%d: %s\n", argv[1], lineno, errmsg);
+      goto done;
+    }
+
+    for (int i = 0; i < ndefs; i++)
+    {
+      if (strcmp(defs[i].name, defs[ndefs].name) == 0)
+      {
+        fprintf(stderr, "%s:%d: '%s' is already defined\n", argv[1], lineno, defs[i].name);
+        ndefs++;
+        goto done;
+      }
+    }
+
+    ndefs++;
+  }
+
+  if (write_output(argv[2], defs, ndefs))
+    status = 0;
+
+done:
+  for (int i = 0; i < ndefs; i++)
+  {
+    free(defs[i].name);
+    ET_free(defs[i].tree);
+    VT_free(defs[i].vars);
+  }
+  free(defs);
+  free(line);
+  fclose(in);
+  return status;
+}
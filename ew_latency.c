@@ -0,0 +1,279 @@
+/*
+ * ew_latency.c
+ *
+ * Round-trip latency of the two ways of reaching a running server:
+ * the batch-mode protocol over a Unix domain socket (expr_server.h)
+ * and the shared memory rings (expr_shm.h). Both servers run in this
+ * process with one thread each, and are reached through their normal
+ * client paths; only the transport differs.
+ *
+ * For each transport it times ROUNDS lock-step round trips of one
+ * expression, and reports the median, the 99th percentile and the
+ * mean, then the time per expression when BATCH expressions are sent
+ * before any answer is read.
+ *
+ * Usage: ew_latency [-n ROUNDS] [-b BATCH]
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "expr_server.h"
+#include "expr_shm.h"
+#include "dtoa.h"
+
+#define EXPR "1 + 2 * 3"
+#define MAX_BATCH 4000 // answers to a batch must fit in the socket buffers
+
+// A client of one transport, as the benchmark drives it
+struct transport
+{
+  const char *name;
+  int (*send)(void *conn, const char *expr, size_t len);
+  int (*send_batch)(void *conn, const char *expr, size_t len, int count);
+  int (*receive)(void *conn);
+  void *conn;
+};
+
+/*
+ * Return the time in nanoseconds
+ */
+static double now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+// A socket client: its descriptor and what it has read ahead
+struct socket_conn
+{
+  int fd;
+  char buf[4096];
+  size_t len;
+};
+
+static int socket_send(void *conn, const char *expr, size_t len)
+{
+  struct socket_conn *sc = conn;
+  char line[256];
+
+  memcpy(line, expr, len);
+  line[len] = '\n';
+  return (write(sc->fd, line, len + 1) == len + 1) ? 0 : -1;
+}
+
+/*
+ * Send count copies of an expression the way a pipelining client
+ * would: in one write
+ */
+static int socket_send_batch(void *conn, const char *expr, size_t len, int count)
+{
+  struct socket_conn *sc = conn;
+  char *lines = malloc(count * (len + 1));
+  int status = 0;
+
+  if (lines == NULL)
+    return -1;
+
+  for (int i = 0; i < count; i++)
+  {
+    memcpy(lines + i * (len + 1), expr, len);
+    lines[i * (len + 1) + len] = '\n';
+  }
+  if (write(sc->fd, lines, count * (len + 1)) != count * (len + 1))
+    status = -1;
+
+  free(lines);
+  return status;
+}
+
+static int socket_receive(void *conn)
+{
+  struct socket_conn *sc = conn;
+
+  for (;;)
+  {
+    char *nl = memchr(sc->buf, '\n', sc->len);
+
+    if (nl != NULL)
+    {
+      size_t used = nl + 1 - sc->buf;
+      memmove(sc->buf, nl + 1, sc->len - used);
+      sc->len -= used;
+      return 0;
+    }
+
+    ssize_t n = read(sc->fd, sc->buf + sc->len, sizeof(sc->buf) - sc->len);
+    if (n <= 0)
+      return -1;
+    sc->len += n;
+  }
+}
+
+static int shm_send(void *conn, const char *expr, size_t len)
+{
+  return SHM_send(conn, expr, len);
+}
+
+static int shm_send_batch(void *conn, const char *expr, size_t len, int count)
+{
+  for (int i = 0; i < count; i++)
+    if (SHM_send(conn, expr, len) != 0)
+      return -1;
+  return 0;
+}
+
+static int shm_receive(void *conn)
+{
+  char errmsg[128];
+  double value;
+
+  return SHM_receive(conn, &value, errmsg, sizeof(errmsg));
+}
+
+/*
+ * Time a transport and print one line of results
+ *
+ * Returns: 0, or -1 if the transport failed
+ */
+static int measure(struct transport *t, int rounds, int batch)
+{
+  double *lat = malloc(rounds * sizeof(double));
+  double total = 0;
+
+  if (lat == NULL)
+    return -1;
+
+  for (int i = 0; i < rounds; i++)
+  {
+    double start = now_ns();
+
+    if (t->send(t->conn, EXPR, strlen(EXPR)) != 0 || t->receive(t->conn) != 0)
+      goto failed;
+    lat[i] = now_ns() - start;
+    total += lat[i];
+  }
+  qsort(lat, rounds, sizeof(double), compare_doubles);
+
+  double start = now_ns();
+  if (t->send_batch(t->conn, EXPR, strlen(EXPR), batch) != 0)
+    goto failed;
+  for (int i = 0; i < batch; i++)
+    if (t->receive(t->conn) != 0)
+      goto failed;
+  double per_expr = (now_ns() - start) / batch;
+
+  printf("%-8s %10.2f %10.2f %10.2f %14.0f\n", t->name, lat[rounds / 2] / 1000,
+         lat[(int)(rounds * 0.99)] / 1000, total / rounds / 1000, per_expr);
+
+  free(lat);
+  return 0;
+
+failed:
+  free(lat);
+  return -1;
+}
+
+static void *run_socket_server(void *arg)
+{
+  ES_run(arg, 1);
+  return NULL;
+}
+
+static void *run_shm_server(void *arg)
+{
+  SHM_run(arg);
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  int rounds = 20000;
+  int batch = 1000;
+  int opt;
+  char path[64], name[64], errmsg[128];
+  struct sockaddr_un sun = {.sun_family = AF_UNIX};
+  pthread_t socket_thread, shm_thread;
+  int status = 0;
+
+  while ((opt = getopt(argc, argv, "n:b:")) != -1)
+  {
+    if (opt == 'n' && (rounds = atoi(optarg)) >= 1)
+      continue;
+    if (opt == 'b' && (batch = atoi(optarg)) >= 1 && batch <= MAX_BATCH)
+      continue;
+    fprintf(stderr, "Usage: %s [-n ROUNDS] [-b BATCH]\n", argv[0]);
+    return 1;
+  }
+
+  snprintf(path, sizeof(path), "/tmp/ew_latency_%d.sock", (int)getpid());
+  snprintf(name, sizeof(name), "/ew_latency_%d", (int)getpid());
+
+  ExprServer server = ES_new(path, DT_SHORTEST, errmsg, sizeof(errmsg));
+  if (server == NULL)
+  {
+    fprintf(stderr, "%s\n", errmsg);
+    return 1;
+  }
+  ShmServer shm = SHM_new(name, 1, errmsg, sizeof(errmsg));
+  if (shm == NULL)
+  {
+    fprintf(stderr, "%s\n", errmsg);
+    ES_free(server);
+    return 1;
+  }
+  pthread_create(&socket_thread, NULL, run_socket_server, server);
+  pthread_create(&shm_thread, NULL, run_shm_server, shm);
+
+  struct socket_conn sc = {.fd = socket(AF_UNIX, SOCK_STREAM, 0), .len = 0};
+  strcpy(sun.sun_path, path);
+  ShmClient client = SHM_connect(name, errmsg, sizeof(errmsg));
+
+  if (sc.fd < 0 || connect(sc.fd, (struct sockaddr *)&sun, sizeof(sun)) != 0 || client == NULL)
+  {
+    fprintf(stderr, "Cannot connect to the servers\n");
+    status = 1;
+  }
+  else
+  {
+    struct transport transports[] = {
+        {"socket", socket_send, socket_send_batch, socket_receive, &sc},
+        {"shm", shm_send, shm_send_batch, shm_receive, client}};
+
+    printf("%-8s %10s %10s %10s %14s\n", "", "p50 (us)", "p99 (us)", "mean (us)", "batch (ns/expr)");
+    for (int i = 0; i < sizeof(transports) / sizeof(transports[0]); i++)
+      if (measure(&transports[i], rounds, batch) != 0)
+      {
+        fprintf(stderr, "%s: transport failed\n", transports[i].name);
+        status = 1;
+      }
+  }
+
+  if (sc.fd >= 0)
+    close(sc.fd);
+  SHM_disconnect(client);
+  ES_stop(server);
+  SHM_stop(shm);
+  pthread_join(socket_thread, NULL);
+  pthread_join(shm_thread, NULL);
+  ES_free(server);
+  SHM_free(shm);
+  return status;
+}
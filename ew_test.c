@@ -13,12 +13,38 @@
 #include <ctype.h>  // isblank
 #include <math.h>   // fabs
 #include <stdbool.h>
+#include <stdint.h>
+#include <float.h>  // DBL_MIN
+#include <limits.h> // LONG_MAX
+#include <time.h>   // clock_gettime
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "clist.h"
 #include "token.h"
 #include "tokenize.h"
 #include "expr_tree.h"
 #include "parse.h"
+#include "thread_pool.h"
+#include "expr_par.h"
+#include "expr_image.h"
+#include "fastmath.h"
+#include "vars.h"
+#include "codegen.h"
+#include "funcs.h"
+#include "expr_grad.h"
+#include "expr_fused.h"
+#include "expr_server.h"
+#include "expr_csv.h"
+#include "dtoa.h"
+#include "exprwhizz.h"
+#include "expr_shm.h"
+#include "latency.h"
+#include "trace.h"
+#include "reparse.h"
+#include "sheet.h"
 
 // If value is not true; prints a failure message and returns 0.
 #define test_assert(value)                                         \
@@ -301,6 +327,57 @@ int test_tokenize_input()
   test_assert(test_tok_eq(CL_nth(list, 4), (Token){TOK_MULTIPLY}));
   CL_free(list);
 
+  // length-bounded: nothing past len is read, and there is no '\0'
+  const char unterminated[] = {'1', '2', '+', '3', 'e', '5', '0'};
+
+  list = TOK_tokenize_n(unterminated, 4, NULL, errmsg, sizeof(errmsg));
+  test_assert(CL_length(list) == 3);
+  test_assert(test_tok_eq(CL_nth(list, 0), (Token){TOK_VALUE, 12}));
+  test_assert(test_tok_eq(CL_nth(list, 2), (Token){TOK_VALUE, 3}));
+  CL_free(list);
+
+  list = TOK_tokenize_n(unterminated, sizeof(unterminated), NULL, errmsg, sizeof(errmsg));
+  test_assert(CL_length(list) == 3);
+  test_assert(test_tok_eq(CL_nth(list, 2), (Token){TOK_VALUE, 3e50}));
+  CL_free(list);
+
+  list = TOK_tokenize_n("12345", 2, NULL, errmsg, sizeof(errmsg));
+  test_assert(CL_length(list) == 1);
+  test_assert(test_tok_eq(CL_nth(list, 0), (Token){TOK_VALUE, 12}));
+  CL_free(list);
+
+  test_assert(TOK_tokenize_n("sqrt(2)", 3, NULL, errmsg, sizeof(errmsg)) == NULL);
+  test_assert(strcasecmp(errmsg, "Position 1: unexpected character s") == 0);
+
+  list = TOK_tokenize_n("", 0, NULL, errmsg, sizeof(errmsg));
+  test_assert(CL_length(list) == 0);
+  CL_free(list);
+
+  // numbers longer than the buffer scan_number keeps on the stack
+  char digits[160];
+  memset(digits, '9', 71);
+  digits[71] = '\0';
+  list = TOK_tokenize_input(digits, errmsg, sizeof(errmsg));
+  test_assert(CL_length(list) == 1);
+  test_assert(CL_nth(list, 0).type == TOK_VALUE && CL_nth(list, 0).value == strtod(digits, NULL));
+  CL_free(list);
+
+  strcpy(digits, "0.");
+  memset(digits + 2, '0', 70);
+  strcpy(digits + 72, "1");
+  list = TOK_tokenize_input(digits, errmsg, sizeof(errmsg));
+  test_assert(CL_length(list) == 1);
+  test_assert(CL_nth(list, 0).type == TOK_VALUE && CL_nth(list, 0).value == 1e-71);
+  CL_free(list);
+
+  memset(digits, '1', 69);
+  strcpy(digits + 69, " + 1");
+  list = TOK_tokenize_n(digits, strlen(digits), NULL, errmsg, sizeof(errmsg));
+  test_assert(CL_length(list) == 3);
+  test_assert(CL_nth(list, 0).end == 69 && CL_nth(list, 1).type == TOK_PLUS);
+  test_assert(test_tok_eq(CL_nth(list, 2), (Token){TOK_VALUE, 1}));
+  CL_free(list);
+
   return 1;
 
 
@@ -356,14 +433,14 @@ int test_parse()
 {
   test_assert(test_parse_once(3.5, 1, (Token[]){{TOK_VALUE, 3.5}, {TOK_END}}));
   test_assert(test_parse_once(3.5, 2, (Token[]){{TOK_VALUE, 3.5}, {TOK_PLUS}, {TOK_VALUE, 0}, {TOK_END}}));
-  test_assert(test_parse_once(3.5, 3, (Token[]){{TOK_VALUE, 3.5}, {TOK_PLUS}, {TOK_VALUE, 0}, {TOK_PLUS}, {TOK_VALUE, 0}, {TOK_END}}));
-  test_assert(test_parse_once(3.5, 4, (Token[]){{TOK_VALUE, 3.5}, {TOK_PLUS}, {TOK_VALUE, 0}, {TOK_PLUS}, {TOK_VALUE, 0}, {TOK_PLUS}, {TOK_VALUE, 0}, {TOK_END}}));
-  test_assert(test_parse_once(3.5, 5, (Token[]){{TOK_VALUE, 3.5}, {TOK_PLUS}, {TOK_VALUE, 0}, {TOK_PLUS}, {TOK_VALUE, 0}, {TOK_PLUS}, {TOK_VALUE, 0}, {TOK_PLUS}, {TOK_VALUE, 0}, {TOK_END}}));
+  test_assert(test_parse_once(3.5, 2, (Token[]){{TOK_VALUE, 3.5}, {TOK_PLUS}, {TOK_VALUE, 0}, {TOK_PLUS}, {TOK_VALUE, 0}, {TOK_END}}));
+  test_assert(test_parse_once(3.5, 2, (Token[]){{TOK_VALUE, 3.5}, {TOK_PLUS}, {TOK_VALUE, 0}, {TOK_PLUS}, {TOK_VALUE, 0}, {TOK_PLUS}, {TOK_VALUE, 0}, {TOK_END}}));
+  test_assert(test_parse_once(3.5, 2, (Token[]){{TOK_VALUE, 3.5}, {TOK_PLUS}, {TOK_VALUE, 0}, {TOK_PLUS}, {TOK_VALUE, 0}, {TOK_PLUS}, {TOK_VALUE, 0}, {TOK_PLUS}, {TOK_VALUE, 0}, {TOK_END}}));
 
   test_assert(test_parse_once(0, 0, (Token[]){{TOK_END}}));
   test_assert(test_parse_once(0, 1, (Token[]){{TOK_VALUE, 0}, {TOK_END}}));
   test_assert(test_parse_once(0, 2, (Token[]){{TOK_VALUE, 0}, {TOK_PLUS}, {TOK_VALUE, 0}, {TOK_END}}));
-  test_assert(test_parse_once(0, 3, (Token[]){{TOK_VALUE, 0}, {TOK_PLUS}, {TOK_VALUE, 0}, {TOK_PLUS}, {TOK_VALUE, 0}, {TOK_END}}));
+  test_assert(test_parse_once(0, 2, (Token[]){{TOK_VALUE, 0}, {TOK_PLUS}, {TOK_VALUE, 0}, {TOK_PLUS}, {TOK_VALUE, 0}, {TOK_END}}));
   test_assert(test_parse_once(3.5, 2, (Token[]){{TOK_VALUE, 3.5}, {TOK_PLUS}, {TOK_PLUS}, {TOK_VALUE, 0}, {TOK_END}}));
 
   return 1;
@@ -374,7 +451,8 @@ test_error:
 
 /*
  * Tests the recursive descent parser for proper associativity: + - *
- * / are left-associative, whereas ^ is right-associative
+ * / are left-associative, whereas ^ is right-associative. A run of +
+ * is a single chain, of depth 2.
  *
  * Returns: 1 if all tests pass, 0 otherwise
  */
@@ -385,9 +463,9 @@ int test_parse_associativity()
   test_assert(test_parse_once(-4, 5, (Token[]){{TOK_VALUE, 10}, {TOK_MINUS}, {TOK_VALUE, 2}, {TOK_MINUS}, {TOK_VALUE, 3}, {TOK_MINUS}, {TOK_VALUE, 4}, {TOK_MINUS}, {TOK_VALUE, 5}, {TOK_END}}));
   test_assert(test_parse_once(1, 3, (Token[]){{TOK_VALUE, 10}, {TOK_DIVIDE}, {TOK_VALUE, 2}, {TOK_DIVIDE}, {TOK_VALUE, 5}, {TOK_END}}));
 
-  test_assert(test_parse_once(10, 3, (Token[]){{TOK_VALUE, 2}, {TOK_PLUS}, {TOK_VALUE, 3}, {TOK_PLUS}, {TOK_VALUE, 5}, {TOK_END}}));
-  test_assert(test_parse_once(10, 4, (Token[]){{TOK_VALUE, 2}, {TOK_PLUS}, {TOK_VALUE, 3}, {TOK_PLUS}, {TOK_VALUE, 1}, {TOK_PLUS}, {TOK_VALUE, 4}, {TOK_END}}));
-  test_assert(test_parse_once(12, 5, (Token[]){{TOK_VALUE, 2}, {TOK_PLUS}, {TOK_VALUE, 3}, {TOK_PLUS}, {TOK_VALUE, 1}, {TOK_PLUS}, {TOK_VALUE, 4}, {TOK_PLUS}, {TOK_VALUE, 2}, {TOK_END}}));
+  test_assert(test_parse_once(10, 2, (Token[]){{TOK_VALUE, 2}, {TOK_PLUS}, {TOK_VALUE, 3}, {TOK_PLUS}, {TOK_VALUE, 5}, {TOK_END}}));
+  test_assert(test_parse_once(10, 2, (Token[]){{TOK_VALUE, 2}, {TOK_PLUS}, {TOK_VALUE, 3}, {TOK_PLUS}, {TOK_VALUE, 1}, {TOK_PLUS}, {TOK_VALUE, 4}, {TOK_END}}));
+  test_assert(test_parse_once(12, 2, (Token[]){{TOK_VALUE, 2}, {TOK_PLUS}, {TOK_VALUE, 3}, {TOK_PLUS}, {TOK_VALUE, 1}, {TOK_PLUS}, {TOK_VALUE, 4}, {TOK_PLUS}, {TOK_VALUE, 2}, {TOK_END}}));
 
   return 1;
 
@@ -542,25 +620,2720 @@ test_error:
   return 0;
 }
 
-int main()
+/*
+ * Builds a pseudo-random tree with the given number of leaves. The
+ * shape, operators and values are all drawn from seed, so the same
+ * seed always produces the same tree.
+ *
+ * Parameters:
+ *   seed       State for rand_r
+ *   nleaves    Number of leaf (value) nodes in the tree
+ *
+ * Returns: The new tree, which the caller must ET_free
+ */
+static ExprTree random_tree(unsigned *seed, int nleaves)
 {
-  int passed = 0;
-  int num_tests = 0;
+  static const ExprNodeType ops[] = {OP_ADD, OP_SUB, OP_MUL, OP_DIV};
 
-  num_tests++;
-  passed += test_cl_token();
-  num_tests++;
-  passed += test_expr_tree();
-  num_tests++;
-  passed += test_tok_next_consume();
-  num_tests++;
-  passed += test_tokenize_input();
-  num_tests++;
-  passed += test_parse();
-  num_tests++;
-  passed += test_parse_associativity();
-  num_tests++;
-  passed += test_parse_errors();
+  if (nleaves <= 1)
+    return ET_value(0.5 + (rand_r(seed) % 1000) / 100.0);
+
+  int split = 1 + rand_r(seed) % (nleaves - 1);
+  ExprTree left = random_tree(seed, split);
+  ExprTree right = random_tree(seed, nleaves - split);
+
+  if (rand_r(seed) % 16 == 0)
+    left = ET_node(UNARY_NEGATE, left, NULL);
+
+  // keep exponents small so that values stay finite
+  if (nleaves - split == 1 && rand_r(seed) % 8 == 0)
+    return ET_node(OP_POWER, left, right);
+
+  return ET_node(ops[rand_r(seed) % 4], left, right);
+}
+
+/*
+ * Returns true if a and b have exactly the same bit pattern
+ */
+static bool same_double(double a, double b)
+{
+  return memcmp(&a, &b, sizeof(double)) == 0;
+}
+
+/*
+ * TP_task_fn: sleep for the microseconds arg points to
+ */
+static void sleep_task(void *arg)
+{
+  usleep(*(int *)arg);
+}
+
+/*
+ * Returns the CPU time, in seconds, the calling thread has used
+ */
+static double thread_cpu_time()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Tests the ET_evaluate_parallel function against ET_evaluate, on
+ * random trees of increasing size and on long lopsided chains, and that
+ * a thread outside the pool sleeps while it waits for a task
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_evaluate_parallel()
+{
+  ThreadPool pool = TP_new(4);
+  ExprTree tree = NULL;
+  unsigned seed = 2023;
+
+  test_assert(pool != NULL);
+  test_assert(TP_size(pool) == 4);
+
+  for (int leaves = 1; leaves <= 100000; leaves *= 10)
+  {
+    tree = random_tree(&seed, leaves);
+    double expected = ET_evaluate(tree);
+
+    test_assert(same_double(ET_evaluate_parallel(tree, pool, 0), expected));
+    test_assert(same_double(ET_evaluate_parallel(tree, pool, 16), expected));
+    test_assert(same_double(ET_evaluate_parallel(tree, pool, 1), expected));
+    test_assert(same_double(ET_evaluate_parallel(tree, NULL, 16), expected));
+
+    ET_free(tree);
+    tree = NULL;
+  }
+
+  // a left-deep chain whose right-hand sides are small subtrees
+  tree = ET_value(1);
+  for (int i = 0; i < 20000; i++)
+    tree = ET_node(OP_ADD, tree, random_tree(&seed, 1 + i % 40));
+
+  test_assert(same_double(ET_evaluate_parallel(tree, pool, 64), ET_evaluate(tree)));
+  test_assert(same_double(ET_evaluate_parallel(tree, pool, 16), ET_evaluate(tree)));
+  ET_free(tree);
+
+  // and a right-deep one, whose left-hand sides are big enough to fork
+  tree = ET_value(1);
+  for (int i = 0; i < 20000; i++)
+    tree = ET_node(OP_SUB, random_tree(&seed, 20 + i % 40), tree);
+
+  test_assert(same_double(ET_evaluate_parallel(tree, pool, 16), ET_evaluate(tree)));
+
+  // waiting 200 ms should cost this thread a small fraction of that
+  int usec = 200000;
+  double cpu = thread_cpu_time();
+  TP_run(pool, sleep_task, &usec);
+  test_assert(thread_cpu_time() - cpu < 0.05);
+
+  ET_free(tree);
+  TP_free(pool);
+  return 1;
+
+test_error:
+  ET_free(tree);
+  TP_free(pool);
+  return 0;
+}
+
+/*
+ * Tests ET_serialize and ET_load, both on an in-memory buffer and on
+ * an mmap'd file, and checks that damaged images are rejected
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_serialize()
+{
+  ExprTree trees[5] = {NULL};
+  const int ntrees = sizeof(trees) / sizeof(trees[0]);
+  char errmsg[128];
+  char expected[1024];
+  char actual[1024];
+  uint64_t *buf = NULL;
+  ExprTree copy = NULL;
+  ExprImage image = NULL;
+  const char *path = "/tmp/ew_test_image.bin";
+  unsigned seed = 42;
+
+  for (int i = 0; i < ntrees; i++)
+    trees[i] = random_tree(&seed, 1 + i * 7);
+
+  // asking for the size writes nothing
+  size_t size = ET_serialize(trees, ntrees, NULL, 0);
+  test_assert(size > 0 && size % 8 == 0);
+
+  buf = malloc(size);
+  test_assert(ET_serialize(trees, ntrees, buf, size - 8) == size);
+  test_assert(ET_serialize(trees, ntrees, buf, size) == size);
+
+  image = ET_load(buf, size, errmsg, sizeof(errmsg));
+  test_assert(image != NULL);
+  test_assert(EI_count(image) == ntrees);
+  test_assert(EI_size(image) == size);
+
+  for (int i = 0; i < ntrees; i++)
+  {
+    test_assert(same_double(EI_evaluate(image, i), ET_evaluate(trees[i])));
+
+    copy = EI_to_tree(image, i);
+    ET_tree2string(trees[i], expected, sizeof(expected));
+    ET_tree2string(copy, actual, sizeof(actual));
+    test_assert(strcmp(expected, actual) == 0);
+    ET_free(copy);
+    copy = NULL;
+  }
+
+  // damaged images
+  test_assert(ET_load(buf, size - 1, errmsg, sizeof(errmsg)) == NULL);
+  test_assert(strcmp(errmsg, "Image truncated or corrupt") == 0);
+
+  ((char *)buf)[size - 1] ^= 1;
+  test_assert(ET_load(buf, size, errmsg, sizeof(errmsg)) == NULL);
+  test_assert(strcmp(errmsg, "Image checksum mismatch") == 0);
+  ((char *)buf)[size - 1] ^= 1;
+
+  ((char *)buf)[0] = 'X';
+  test_assert(ET_load(buf, size, errmsg, sizeof(errmsg)) == NULL);
+  test_assert(strcmp(errmsg, "Not an ExpressionWhizz image") == 0);
+  ((char *)buf)[0] = 'E';
+
+  // round trip through an mmap'd file
+  FILE *fp = fopen(path, "wb");
+  test_assert(fp != NULL);
+  test_assert(fwrite(buf, 1, size, fp) == size);
+  fclose(fp);
+
+  image = EI_open(path, errmsg, sizeof(errmsg));
+  test_assert(image != NULL);
+  for (int i = 0; i < ntrees; i++)
+    test_assert(same_double(EI_evaluate(image, i), ET_evaluate(trees[i])));
+  EI_close(image);
+  remove(path);
+
+  test_assert(EI_open(path, errmsg, sizeof(errmsg)) == NULL);
+
+  for (int i = 0; i < ntrees; i++)
+    ET_free(trees[i]);
+  free(buf);
+  return 1;
+
+test_error:
+  for (int i = 0; i < ntrees; i++)
+    ET_free(trees[i]);
+  ET_free(copy);
+  free(buf);
+  return 0;
+}
+
+/*
+ * Relative error of approx against the libm result exact. Results
+ * smaller than the smallest normal double are measured relative to
+ * DBL_MIN. NaN must match NaN, and infinities must match exactly.
+ */
+static double rel_err(double approx, double exact)
+{
+  if (isnan(exact))
+    return isnan(approx) ? 0 : INFINITY;
+
+  if (isinf(exact) || exact == 0)
+    return (approx == exact) ? 0 : INFINITY;
+
+  return fabs(approx - exact) / fmax(fabs(exact), DBL_MIN);
+}
+
+/*
+ * Tests the fastmath kernels against libm: sweeps over the domain of
+ * each function, in both scalar and block form, plus the special
+ * cases that must match libm exactly
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_fastmath()
+{
+  const int n = 20011; // not a multiple of any vector length
+  double *x = malloc(n * sizeof(double));
+  double *y = malloc(n * sizeof(double));
+  double *out = malloc(n * sizeof(double));
+  unsigned seed = 7;
+
+  test_assert(x != NULL && y != NULL && out != NULL);
+
+  // exp2 from far below the subnormal range to beyond overflow
+  for (int i = 0; i < n; i++)
+    x[i] = -1100 + 2200.0 * i / (n - 1);
+
+  FM_exp2_block(out, x, n);
+  for (int i = 0; i < n; i++)
+  {
+    test_assert(rel_err(FM_exp2(x[i]), exp2(x[i])) <= FM_EXP2_MAX_REL_ERR);
+    test_assert(rel_err(out[i], exp2(x[i])) <= FM_EXP2_MAX_REL_ERR);
+  }
+
+  // log2 across every binary exponent, subnormals included
+  for (int i = 0; i < n; i++)
+    x[i] = ldexp(1 + (double)rand_r(&seed) / RAND_MAX, -1074 + i % 2098);
+  x[0] = 1;
+  x[1] = nextafter(1, 2);
+  x[2] = nextafter(1, 0);
+  x[3] = DBL_MAX;
+
+  FM_log2_block(out, x, n);
+  for (int i = 0; i < n; i++)
+  {
+    test_assert(rel_err(FM_log2(x[i]), log2(x[i])) <= FM_LOG2_MAX_REL_ERR);
+    test_assert(rel_err(out[i], log2(x[i])) <= FM_LOG2_MAX_REL_ERR);
+  }
+
+  // pow wherever the result is a normal double
+  for (int i = 0; i < n; i++)
+  {
+    x[i] = ldexp(1 + (double)rand_r(&seed) / RAND_MAX, rand_r(&seed) % 200 - 100);
+    y[i] = (1000.0 * rand_r(&seed) / RAND_MAX - 500) / fabs(log2(x[i]) + 0.5);
+  }
+
+  FM_pow_block(out, x, y, n);
+  for (int i = 0; i < n; i++)
+  {
+    if (fabs(y[i] * log2(x[i])) >= 1022)
+      continue;
+    test_assert(rel_err(FM_pow(x[i], y[i]), pow(x[i], y[i])) <= FM_POW_MAX_REL_ERR);
+    test_assert(rel_err(out[i], pow(x[i], y[i])) <= FM_POW_MAX_REL_ERR);
+  }
+
+  // special cases go to libm
+  const double special[] = {0, -0.0, -1, -2.5, 1, 2, 0.5, INFINITY, -INFINITY, NAN, 3, -3};
+  const int nspecial = sizeof(special) / sizeof(special[0]);
+
+  for (int i = 0; i < nspecial; i++)
+  {
+    test_assert(rel_err(FM_exp2(special[i]), exp2(special[i])) <= FM_EXP2_MAX_REL_ERR);
+    if (special[i] <= 0 || isinf(special[i]) || isnan(special[i]))
+      test_assert(rel_err(FM_log2(special[i]), log2(special[i])) == 0);
+
+    for (int j = 0; j < nspecial; j++)
+    {
+      x[i * nspecial + j] = special[i];
+      y[i * nspecial + j] = special[j];
+
+      if (special[i] <= 0 || !isfinite(special[i]) || !isfinite(special[j]))
+        test_assert(same_double(FM_pow(special[i], special[j]), pow(special[i], special[j])));
+    }
+  }
+
+  FM_pow_block(out, x, y, nspecial * nspecial);
+  for (int i = 0; i < nspecial * nspecial; i++)
+    test_assert(rel_err(out[i], pow(x[i], y[i])) <= FM_POW_MAX_REL_ERR);
+
+  // sin and cos: small arguments, multiples of pi/2, and up to beyond
+  // the end of the reduction
+  for (int i = 0; i < n; i++)
+    x[i] = ldexp((double)rand_r(&seed) / RAND_MAX - 0.5, i % 24);
+  for (int i = 0; i < 1000; i++)
+    x[i] = (i - 500) * M_PI_2;
+  x[1000] = INFINITY;
+  x[1001] = NAN;
+  x[1002] = -0.0;
+
+  FM_sin_block(out, x, n);
+  FM_cos_block(y, x, n);
+  for (int i = 0; i < n; i++)
+  {
+    if (isnan(sin(x[i])))
+    {
+      test_assert(isnan(FM_sin(x[i])) && isnan(out[i]) && isnan(FM_cos(x[i])) && isnan(y[i]));
+      continue;
+    }
+    test_assert(fabs(FM_sin(x[i]) - sin(x[i])) <= FM_SINCOS_MAX_ABS_ERR);
+    test_assert(fabs(out[i] - sin(x[i])) <= FM_SINCOS_MAX_ABS_ERR);
+    test_assert(fabs(FM_cos(x[i]) - cos(x[i])) <= FM_SINCOS_MAX_ABS_ERR);
+    test_assert(fabs(y[i] - cos(x[i])) <= FM_SINCOS_MAX_ABS_ERR);
+  }
+  test_assert(signbit(out[1002]) && signbit(FM_sin(-0.0)));
+
+  // in place
+  for (int i = 0; i < n; i++)
+    x[i] = i / 100.0;
+  FM_log2_block(x, x, n);
+  for (int i = 0; i < n; i++)
+    test_assert(rel_err(x[i], log2(i / 100.0)) <= FM_LOG2_MAX_REL_ERR);
+
+  free(x);
+  free(y);
+  free(out);
+  return 1;
+
+test_error:
+  free(x);
+  free(y);
+  free(out);
+  return 0;
+}
+
+/*
+ * Tests per-expression evaluation modes of an image
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_image_approx()
+{
+  ExprTree trees[2] = {NULL};
+  char errmsg[128];
+  uint64_t *buf = NULL;
+  ExprImage image = NULL;
+
+  // 1.5 ^ 7.25 + 2 ^ -0.5
+  trees[0] = ET_node(OP_ADD,
+                     ET_node(OP_POWER, ET_value(1.5), ET_value(7.25)),
+                     ET_node(OP_POWER, ET_value(2), ET_node(UNARY_NEGATE, ET_value(0.5), NULL)));
+  trees[1] = ET_node(OP_POWER, ET_value(10), ET_value(0.3));
+
+  size_t size = ET_serialize(trees, 2, NULL, 0);
+  buf = malloc(size);
+  test_assert(ET_serialize(trees, 2, buf, size) == size);
+
+  image = ET_load(buf, size, errmsg, sizeof(errmsg));
+  test_assert(image != NULL);
+  test_assert(EI_mode(image, 0) == EI_EXACT && EI_mode(image, 1) == EI_EXACT);
+
+  EI_set_mode(buf, 0, EI_APPROX);
+  image = ET_load(buf, size, errmsg, sizeof(errmsg));
+  test_assert(image != NULL);
+  test_assert(EI_mode(image, 0) == EI_APPROX && EI_mode(image, 1) == EI_EXACT);
+
+  test_assert(rel_err(EI_evaluate(image, 0), ET_evaluate(trees[0])) <= FM_POW_MAX_REL_ERR);
+  test_assert(same_double(EI_evaluate(image, 1), ET_evaluate(trees[1])));
+
+  EI_set_mode(buf, 0, EI_EXACT);
+  image = ET_load(buf, size, errmsg, sizeof(errmsg));
+  test_assert(image != NULL);
+  test_assert(same_double(EI_evaluate(image, 0), ET_evaluate(trees[0])));
+
+  for (int i = 0; i < 2; i++)
+    ET_free(trees[i]);
+  free(buf);
+  return 1;
+
+test_error:
+  for (int i = 0; i < 2; i++)
+    ET_free(trees[i]);
+  free(buf);
+  return 0;
+}
+
+/*
+ * Tests variables: the VarTable, tokenizing and parsing names, and
+ * evaluating with different bindings
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_variables()
+{
+  VarTable vt = VT_new();
+  CList tokens = NULL;
+  ExprTree tree = NULL;
+  char errmsg[128];
+  char buf[128];
+
+  tokens = TOK_tokenize_vars("x * (y_2 + 2) - x", vt, errmsg, sizeof(errmsg));
+  test_assert(tokens != NULL);
+  test_assert(CL_length(tokens) == 9);
+  test_assert(VT_count(vt) == 2);
+  test_assert(strcmp(VT_nth(vt, 0)->name, "x") == 0 && VT_nth(vt, 0)->index == 0);
+  test_assert(strcmp(VT_nth(vt, 1)->name, "y_2") == 0 && VT_nth(vt, 1)->index == 1);
+  test_assert(CL_nth(tokens, 0).type == TOK_VARIABLE && CL_nth(tokens, 0).var == VT_nth(vt, 0));
+  test_assert(CL_nth(tokens, 8).var == VT_nth(vt, 0));
+
+  tree = Parse(tokens, errmsg, sizeof(errmsg));
+  test_assert(tree != NULL);
+  test_assert(ET_count(tree) == 7);
+  test_assert(ET_depth(tree) == 4);
+  ET_tree2string(tree, buf, sizeof(buf));
+  test_assert(strcmp(buf, "((x * (y_2 + 2)) - x)") == 0);
+
+  VT_set(vt, "x", 3);
+  VT_set(vt, "y_2", 4);
+  test_assert(ET_evaluate(tree) == 15);
+  VT_set(vt, "x", 1);
+  test_assert(ET_evaluate(tree) == 5);
+  test_assert(ET_evaluate_parallel(tree, NULL, 0) == 5);
+
+  // a variable from another table, with the same index as x
+  VarTable other = VT_new();
+  ExprTree mixed[2] = {tree, ET_variable(VT_set(other, "w", 0))};
+  test_assert(ET_serialize(mixed, 2, NULL, 0) == 0);
+  ET_free(mixed[1]);
+  VT_free(other);
+
+  // names are an error without a table
+  CL_free(tokens);
+  tokens = TOK_tokenize_input("x + 1", errmsg, sizeof(errmsg));
+  test_assert(tokens == NULL);
+  test_assert(strcmp(errmsg, "Position 1: unexpected character x") == 0);
+
+  // a number followed by a name is two tokens, and a syntax error
+  tokens = TOK_tokenize_vars("3pi", vt, errmsg, sizeof(errmsg));
+  test_assert(tokens != NULL && CL_length(tokens) == 2);
+  test_assert(Parse(tokens, errmsg, sizeof(errmsg)) == NULL);
+  test_assert(strcmp(errmsg, "Syntax error on token VARIABLE") == 0);
+
+  // growing the table keeps every variable where it was
+  Variable x = VT_lookup(vt, "x", 1);
+  test_assert(x == VT_nth(vt, 0));
+  test_assert(VT_lookup(vt, "xx", 2) == NULL);
+  test_assert(VT_lookup(vt, "x + 1", 1) == x);
+
+  for (int i = 0; i < 1000; i++)
+  {
+    snprintf(buf, sizeof(buf), "v%d", i);
+    test_assert(VT_set(vt, buf, i)->index == VT_count(vt) - 1);
+  }
+  test_assert(VT_count(vt) == 1003);
+  test_assert(VT_lookup(vt, "x", 1) == x);
+  test_assert(VT_lookup(vt, "v517", 4)->value == 517);
+  test_assert(ET_evaluate(tree) == 5);
+
+  CL_free(tokens);
+  ET_free(tree);
+  VT_free(vt);
+  return 1;
+
+test_error:
+  CL_free(tokens);
+  ET_free(tree);
+  VT_free(vt);
+  return 0;
+}
+
+/*
+ * Tests the C code generated for expressions
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_codegen()
+{
+  VarTable vt = VT_new();
+  VarTable none = VT_new();
+  CList tokens = NULL;
+  ExprTree tree = NULL;
+  char errmsg[128];
+  char *code = NULL;
+  size_t code_sz = 0;
+  FILE *out = NULL;
+
+  const char *expected =
+      "static inline double f(double x, double y)\n"
+      "{\n"
+      "  const double ew_t0 = x * 2.0;\n"
+      "  const double ew_t1 = -y;\n"
+      "  const double ew_t2 = pow(ew_t1, 0.5);\n"
+      "  const double ew_t3 = ew_t0 - ew_t2;\n"
+      "  return ew_t3;\n"
+      "}\n"
+      "void f_batch(double *restrict ew_out, const double *restrict x, const double *restrict y, size_t ew_n);\n"
+      "void f_batch(double *restrict ew_out, const double *restrict x, const double *restrict y, size_t ew_n)\n"
+      "{\n"
+      "  for (size_t ew_i = 0; ew_i < ew_n; ew_i++)\n"
+      "    ew_out[ew_i] = f(x[ew_i], y[ew_i]);\n"
+      "}\n"
+      "static inline double g(void)\n"
+      "{\n"
+      "  const double ew_t0 = 1.0000000000000001e+300 - (-0.25);\n"
+      "  return ew_t0;\n"
+      "}\n";
+
+  tokens = TOK_tokenize_vars("x * 2 - (-y) ^ .5", vt, errmsg, sizeof(errmsg));
+  tree = Parse(tokens, errmsg, sizeof(errmsg));
+  test_assert(tree != NULL);
+
+  out = open_memstream(&code, &code_sz);
+  test_assert(out != NULL);
+  CG_emit_inline(out, "f", tree, vt);
+  CG_emit_batch(out, "f", vt, false);
+  CG_emit_batch(out, "f", vt, true);
+  ET_free(tree);
+
+  tree = ET_node(OP_SUB, ET_value(1e300), ET_value(-0.25));
+  CG_emit_inline(out, "g", tree, none);
+  fclose(out);
+  out = NULL;
+
+  test_assert(strcmp(code, expected) == 0);
+
+  test_assert(CG_valid_name("area_2"));
+  test_assert(CG_valid_name("_x"));
+  test_assert(!CG_valid_name("2x"));
+  test_assert(!CG_valid_name("double"));
+  test_assert(!CG_valid_name("pow"));
+  test_assert(!CG_valid_name("ew_t0"));
+  test_assert(!CG_valid_name("a-b"));
+  test_assert(!CG_valid_name("M_PI"));
+  test_assert(!CG_valid_name("INFINITY"));
+  test_assert(!CG_valid_name("linux"));
+  test_assert(!CG_valid_name("__x"));
+  test_assert(!CG_valid_name("asm") && !CG_valid_name("typeof"));
+  test_assert(!CG_valid_name("bool") && !CG_valid_name("nullptr") && !CG_valid_name("constexpr"));
+  test_assert(CG_valid_name("y0"));
+
+  test_assert(CG_valid_function_name("area_2"));
+  test_assert(CG_valid_function_name("batch"));
+  test_assert(!CG_valid_function_name("y0"));
+  test_assert(!CG_valid_function_name("exp2f"));
+  test_assert(!CG_valid_function_name("sinf128"));
+  test_assert(!CG_valid_function_name("lgamma_r"));
+  test_assert(!CG_valid_function_name("malloc"));
+  test_assert(!CG_valid_function_name("printf"));
+  test_assert(!CG_valid_function_name("main"));
+  test_assert(!CG_valid_function_name("f_batch"));
+
+  CL_free(tokens);
+  ET_free(tree);
+  VT_free(vt);
+  VT_free(none);
+  free(code);
+  return 1;
+
+test_error:
+  if (out != NULL)
+    fclose(out);
+  CL_free(tokens);
+  ET_free(tree);
+  VT_free(vt);
+  VT_free(none);
+  free(code);
+  return 0;
+}
+
+/*
+ * Builds a random tree over the variables of vt, with comparisons and
+ * conditionals among the arithmetic
+ */
+static ExprTree random_piecewise(unsigned *seed, int nleaves, VarTable vt)
+{
+  static const ExprNodeType ops[] = {OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_POWER};
+  static const ExprNodeType cmps[] = {OP_LT, OP_LE, OP_GT, OP_GE, OP_EQ, OP_NE};
+
+  if (nleaves <= 1)
+  {
+    if (rand_r(seed) % 2 == 0)
+      return ET_variable(VT_nth(vt, rand_r(seed) % VT_count(vt)));
+    return ET_value((rand_r(seed) % 8) / 2.0);
+  }
+
+  if (nleaves >= 3 && rand_r(seed) % 3 == 0)
+  {
+    int split = 1 + rand_r(seed) % (nleaves - 2);
+    ExprTree cond = ET_node(cmps[rand_r(seed) % 6], random_piecewise(seed, 1, vt), random_piecewise(seed, 1, vt));
+    ExprTree if_true = random_piecewise(seed, split, vt);
+
+    return ET_cond(cond, if_true, random_piecewise(seed, nleaves - split - 1, vt));
+  }
+
+  ExprTree left = random_piecewise(seed, nleaves / 2, vt);
+  return ET_node(ops[rand_r(seed) % 5], left, random_piecewise(seed, nleaves - nleaves / 2, vt));
+}
+
+/*
+ * Tests comparison operators and conditionals: tokenizing, parsing,
+ * printing and evaluating them
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_conditionals()
+{
+  CList tokens = NULL;
+  ExprTree tree = NULL;
+  char errmsg[128];
+  char buf[128];
+
+  tokens = TOK_tokenize_input("< <= > >= == != ? : , if(", errmsg, sizeof(errmsg));
+  test_assert(tokens != NULL);
+  test_assert(test_tok_eq(CL_nth(tokens, 0), (Token){TOK_LESS}));
+  test_assert(test_tok_eq(CL_nth(tokens, 1), (Token){TOK_LESS_EQUAL}));
+  test_assert(test_tok_eq(CL_nth(tokens, 2), (Token){TOK_GREATER}));
+  test_assert(test_tok_eq(CL_nth(tokens, 3), (Token){TOK_GREATER_EQUAL}));
+  test_assert(test_tok_eq(CL_nth(tokens, 4), (Token){TOK_EQUAL}));
+  test_assert(test_tok_eq(CL_nth(tokens, 5), (Token){TOK_NOT_EQUAL}));
+  test_assert(test_tok_eq(CL_nth(tokens, 6), (Token){TOK_QUESTION}));
+  test_assert(test_tok_eq(CL_nth(tokens, 7), (Token){TOK_COLON}));
+  test_assert(test_tok_eq(CL_nth(tokens, 8), (Token){TOK_COMMA}));
+  test_assert(test_tok_eq(CL_nth(tokens, 9), (Token){TOK_IF}));
+  test_assert(test_tok_eq(CL_nth(tokens, 10), (Token){TOK_OPEN_PAREN}));
+  test_assert(CL_length(tokens) == 11);
+  CL_free(tokens);
+  tokens = NULL;
+
+  struct
+  {
+    const char *input;
+    double value;
+    const char *printed;
+  } cases[] = {
+      {"1 < 2", 1, "(1 < 2)"},
+      {"2 <= 1", 0, "(2 <= 1)"},
+      {"2 > 1", 1, "(2 > 1)"},
+      {"1 >= 1", 1, "(1 >= 1)"},
+      {"3 == 3", 1, "(3 == 3)"},
+      {"1 + 1 != 2", 0, "((1 + 1) != 2)"},
+      {"1 < 2 == 1", 1, "((1 < 2) == 1)"},
+      {"1 < 2 ? 10 : 20", 10, "((1 < 2) ? 10 : 20)"},
+      {"0 ? 1 : 0 ? 2 : 3", 3, "(0 ? 1 : (0 ? 2 : 3))"},
+      {"(1 ? 2 : 3) * 4", 8, "((1 ? 2 : 3) * 4)"},
+      {"if(2 > 1, 5, 6)", 5, "((2 > 1) ? 5 : 6)"},
+      {"if(0, 5, if(1, 7, 8)) - 1", 6, "((0 ? 5 : (1 ? 7 : 8)) - 1)"},
+      {"0 ? (0 - 1) ^ 0.5 : 4", 4, "(0 ? ((0 - 1) ^ 0.5) : 4)"},
+  };
+
+  for (int i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+  {
+    tokens = TOK_tokenize_input(cases[i].input, errmsg, sizeof(errmsg));
+    test_assert(tokens != NULL);
+    tree = Parse(tokens, errmsg, sizeof(errmsg));
+    test_assert(tree != NULL);
+    test_assert(ET_evaluate(tree) == cases[i].value);
+    ET_tree2string(tree, buf, sizeof(buf));
+    test_assert(strcmp(buf, cases[i].printed) == 0);
+    CL_free(tokens);
+    tokens = NULL;
+    ET_free(tree);
+    tree = NULL;
+  }
+
+  tree = ET_cond(ET_value(NAN), ET_value(1), ET_value(2));
+  test_assert(ET_evaluate(tree) == 1);
+  test_assert(ET_count(tree) == 4);
+  test_assert(ET_depth(tree) == 2);
+  ET_free(tree);
+  tree = NULL;
+
+  struct
+  {
+    const char *input;
+    const char *errmsg;
+  } errors[] = {
+      {"1 ? 2", "Expected ':'"},
+      {"if(1, 2)", "Expected ','"},
+      {"if 1", "Expected '('"},
+      {"if(1, 2, 3", "Expected ')'"},
+      {"1 ? : 2", "Unexpected token COLON"},
+      {"1 = 2", "Syntax error on token ASSIGN"},
+  };
+
+  for (int i = 0; i < sizeof(errors) / sizeof(errors[0]); i++)
+  {
+    tokens = TOK_tokenize_input(errors[i].input, errmsg, sizeof(errmsg));
+    test_assert(tokens != NULL);
+    test_assert(Parse(tokens, errmsg, sizeof(errmsg)) == NULL);
+    test_assert(strcmp(errmsg, errors[i].errmsg) == 0);
+    CL_free(tokens);
+    tokens = NULL;
+  }
+
+  test_assert(TOK_tokenize_input("1 $ 2", errmsg, sizeof(errmsg)) == NULL);
+  test_assert(strcmp(errmsg, "Position 3: unexpected character $") == 0);
+  test_assert(TOK_tokenize_input("!1", errmsg, sizeof(errmsg)) == NULL);
+  test_assert(strcmp(errmsg, "Position 1: unexpected character !") == 0);
+  test_assert(TOK_tokenize_input("ifx", errmsg, sizeof(errmsg)) == NULL);
+  test_assert(strcmp(errmsg, "Position 1: unexpected character i") == 0);
+
+  return 1;
+
+test_error:
+  CL_free(tokens);
+  ET_free(tree);
+  return 0;
+}
+
+/*
+ * Tests EI_evaluate_batch against EI_evaluate_at and ET_evaluate, on
+ * random piecewise trees over three variables
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_evaluate_batch()
+{
+  VarTable vt = VT_new();
+  ExprTree trees[6] = {NULL};
+  const int ntrees = sizeof(trees) / sizeof(trees[0]);
+  const int nrows = 1000; // not a multiple of the block size
+  double *columns[3] = {NULL};
+  double *out = malloc(nrows * sizeof(double));
+  uint64_t *buf = NULL;
+  ExprTree copy = NULL;
+  VarTable copy_vars = VT_new();
+  char errmsg[128];
+  char expected[1024];
+  char actual[1024];
+  unsigned seed = 99;
+
+  VT_set(vt, "x", 0);
+  VT_set(vt, "y", 0);
+  VT_set(vt, "z", 0);
+
+  for (int v = 0; v < 3; v++)
+  {
+    columns[v] = malloc(nrows * sizeof(double));
+    for (int r = 0; r < nrows; r++)
+      columns[v][r] = (rand_r(&seed) % 9) / 2.0 - 2;
+  }
+  columns[1][7] = NAN;
+
+  for (int i = 0; i < ntrees; i++)
+    trees[i] = random_piecewise(&seed, 1 + i * 9, vt);
+
+  size_t size = ET_serialize(trees, ntrees, NULL, 0);
+  buf = malloc(size);
+  test_assert(ET_serialize(trees, ntrees, buf, size) == size);
+
+  ExprImage image = ET_load(buf, size, errmsg, sizeof(errmsg));
+  test_assert(image != NULL);
+  test_assert(EI_var_count(image) == 3);
+  test_assert(strcmp(EI_var_name(image, 1), "y") == 0);
+
+  for (int i = 0; i < ntrees; i++)
+  {
+    EI_evaluate_batch(image, i, (const double *const *)columns, out, nrows);
+
+    for (int r = 0; r < nrows; r++)
+    {
+      double row[3] = {columns[0][r], columns[1][r], columns[2][r]};
+
+      for (int v = 0; v < 3; v++)
+        VT_nth(vt, v)->value = row[v];
+
+      test_assert(same_double(out[r], EI_evaluate_at(image, i, row)));
+      test_assert(same_double(out[r], ET_evaluate(trees[i])));
+    }
+
+    copy = EI_to_tree_vars(image, i, copy_vars);
+    ET_tree2string(trees[i], expected, sizeof(expected));
+    ET_tree2string(copy, actual, sizeof(actual));
+    test_assert(strcmp(expected, actual) == 0);
+    ET_free(copy);
+    copy = NULL;
+  }
+
+  // only the columns an expression uses are needed
+  ExprTree only_z = ET_node(OP_MUL, ET_variable(VT_nth(vt, 2)), ET_value(2));
+  size = ET_serialize(&only_z, 1, NULL, 0);
+  free(buf);
+  buf = malloc(size);
+  ET_serialize(&only_z, 1, buf, size);
+  ET_free(only_z);
+
+  image = ET_load(buf, size, errmsg, sizeof(errmsg));
+  test_assert(image != NULL);
+  test_assert(EI_var_count(image) == 3);
+  test_assert(strcmp(EI_var_name(image, 0), "") == 0);
+  EI_evaluate_batch(image, 0, (const double *const[]){NULL, NULL, columns[2]}, out, nrows);
+  for (int r = 0; r < nrows; r++)
+    test_assert(out[r] == columns[2][r] * 2);
+
+  for (int i = 0; i < ntrees; i++)
+    ET_free(trees[i]);
+  for (int v = 0; v < 3; v++)
+    free(columns[v]);
+  free(out);
+  free(buf);
+  VT_free(vt);
+  VT_free(copy_vars);
+  return 1;
+
+test_error:
+  for (int i = 0; i < ntrees; i++)
+    ET_free(trees[i]);
+  for (int v = 0; v < 3; v++)
+    free(columns[v]);
+  ET_free(copy);
+  free(out);
+  free(buf);
+  VT_free(vt);
+  VT_free(copy_vars);
+  return 0;
+}
+
+/*
+ * Tests the built-in functions: name lookup, tokenizing, parsing,
+ * printing, and evaluating them one at a time and in batches
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_functions()
+{
+  VarTable vt = VT_new();
+  CList tokens = NULL;
+  ExprTree tree = NULL;
+  ExprTree trees[3] = {NULL};
+  const int ntrees = sizeof(trees) / sizeof(trees[0]);
+  const int nrows = 777;
+  double *columns[2] = {NULL};
+  double *out = malloc(nrows * sizeof(double));
+  double *approx = malloc(nrows * sizeof(double));
+  uint64_t *buf = NULL;
+  char *code = NULL;
+  size_t code_sz = 0;
+  FILE *stream = NULL;
+  char errmsg[128];
+  char str[128];
+  unsigned seed = 31;
+
+  // every name hashes to its own slot
+  for (int i = 0; i < FN_COUNT; i++)
+  {
+    MathFunc func = &FN_registry[i];
+
+    test_assert(FN_lookup(func->name, strlen(func->name)) == func);
+    test_assert(FN_for_op(func->op) == func);
+  }
+  test_assert(FN_lookup("sine", 4) == NULL);
+  test_assert(FN_lookup("sinh", 3) == FN_for_op(OP_SIN));
+  test_assert(FN_lookup("mix", 3) == NULL);
+  test_assert(FN_lookup("sq", 2) == NULL);
+  test_assert(FN_lookup("", 0) == NULL);
+
+  const struct
+  {
+    const char *input;
+    double value;
+    const char *str;
+  } cases[] = {
+      {"sqrt(16)", 4, "sqrt(16)"},
+      {"abs(-3) + 1", 4, "(abs((-3)) + 1)"},
+      {"min(3, 2 ^ 3)", 3, "min(3, (2 ^ 3))"},
+      {"max(1, if(0, 5, 2))", 2, "max(1, (0 ? 5 : 2))"},
+      {"-cos(0) * exp(0)", -1, "((-cos(0)) * exp(0))"},
+      {"log(1) + sin(0)", 0, "(log(1) + sin(0))"},
+      {"sqrt(max(9, 4)) ^ 2", 9, "(sqrt(max(9, 4)) ^ 2)"},
+  };
+
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+  {
+    tokens = TOK_tokenize_input(cases[i].input, errmsg, sizeof(errmsg));
+    test_assert(tokens != NULL);
+    tree = Parse(tokens, errmsg, sizeof(errmsg));
+    test_assert(tree != NULL);
+    test_assert(ET_evaluate(tree) == cases[i].value);
+    ET_tree2string(tree, str, sizeof(str));
+    test_assert(strcmp(str, cases[i].str) == 0);
+    ET_free(tree);
+    tree = NULL;
+    CL_free(tokens);
+    tokens = NULL;
+  }
+
+  tokens = TOK_tokenize_input("sqrt(", errmsg, sizeof(errmsg));
+  test_assert(CL_length(tokens) == 2);
+  test_assert(test_tok_eq(CL_nth(tokens, 0), (Token){TOK_FUNCTION}));
+  test_assert(CL_nth(tokens, 0).func == FN_for_op(OP_SQRT));
+  CL_free(tokens);
+
+  const struct
+  {
+    const char *input;
+    const char *errmsg;
+  } errors[] = {
+      {"sqrt 4", "Expected '('"},
+      {"sqrt(1, 2)", "Expected ')'"},
+      {"min(1)", "Expected ','"},
+      {"max(1, 2, 3)", "Expected ')'"},
+      {"cos()", "Unexpected token CLOSE_PAREN"},
+  };
+
+  for (size_t i = 0; i < sizeof(errors) / sizeof(errors[0]); i++)
+  {
+    tokens = TOK_tokenize_input(errors[i].input, errmsg, sizeof(errmsg));
+    test_assert(tokens != NULL);
+    test_assert(Parse(tokens, errmsg, sizeof(errmsg)) == NULL);
+    test_assert(strcmp(errmsg, errors[i].errmsg) == 0);
+    CL_free(tokens);
+  }
+  tokens = NULL;
+
+  // other names are still variables, or errors without a table
+  test_assert(TOK_tokenize_input("sin + cosh", errmsg, sizeof(errmsg)) == NULL);
+  test_assert(strcmp(errmsg, "Position 7: unexpected character c") == 0);
+  tokens = TOK_tokenize_vars("sine * cos(x)", vt, errmsg, sizeof(errmsg));
+  tree = Parse(tokens, errmsg, sizeof(errmsg));
+  test_assert(tree != NULL);
+  test_assert(VT_count(vt) == 2 && strcmp(VT_nth(vt, 0)->name, "sine") == 0);
+  ET_free(tree);
+  tree = NULL;
+  CL_free(tokens);
+  tokens = NULL;
+
+  // batches, in both modes
+  const char *inputs[] = {
+      "sqrt(abs(x)) + min(x, y) * max(y, 0)",
+      "exp(x / 4) - log(abs(y) + 1)",
+      "sin(x) * cos(y * 100)",
+  };
+
+  for (int i = 0; i < ntrees; i++)
+  {
+    tokens = TOK_tokenize_vars(inputs[i], vt, errmsg, sizeof(errmsg));
+    trees[i] = Parse(tokens, errmsg, sizeof(errmsg));
+    test_assert(trees[i] != NULL);
+    CL_free(tokens);
+    tokens = NULL;
+  }
+
+  // x and y, with sine as a column that is not used
+  for (int v = 0; v < 2; v++)
+  {
+    columns[v] = malloc(nrows * sizeof(double));
+    for (int r = 0; r < nrows; r++)
+      columns[v][r] = 20.0 * rand_r(&seed) / RAND_MAX - 10;
+  }
+  columns[1][5] = NAN;
+  columns[0][6] = -INFINITY;
+
+  size_t size = ET_serialize(trees, ntrees, NULL, 0);
+  buf = malloc(size);
+  test_assert(ET_serialize(trees, ntrees, buf, size) == size);
+
+  for (int i = 0; i < ntrees; i++)
+  {
+    const double *const vars[3] = {NULL, columns[0], columns[1]};
+    ExprImage image = ET_load(buf, size, errmsg, sizeof(errmsg));
+
+    test_assert(image != NULL);
+    EI_evaluate_batch(image, i, vars, out, nrows);
+
+    for (int r = 0; r < nrows; r++)
+    {
+      double row[3] = {0, columns[0][r], columns[1][r]};
+
+      VT_nth(vt, 1)->value = row[1];
+      VT_nth(vt, 2)->value = row[2];
+      test_assert(same_double(out[r], ET_evaluate(trees[i])));
+      test_assert(same_double(out[r], EI_evaluate_at(image, i, row)));
+    }
+
+    EI_set_mode(buf, i, EI_APPROX);
+    image = ET_load(buf, size, errmsg, sizeof(errmsg));
+    test_assert(image != NULL);
+    EI_evaluate_batch(image, i, vars, approx, nrows);
+
+    // each kernel is within the 1e-6 budget of fastmath.h, and these
+    // expressions combine a few of them on results of modest size
+    for (int r = 0; r < nrows; r++)
+    {
+      double row[3] = {0, columns[0][r], columns[1][r]};
+
+      test_assert(fabs(approx[r] - out[r]) <= 1e-6 * (1 + fabs(out[r])) || same_double(approx[r], out[r]));
+      test_assert(fabs(EI_evaluate_at(image, i, row) - out[r]) <= 1e-6 * (1 + fabs(out[r])) ||
+                  same_double(EI_evaluate_at(image, i, row), out[r]));
+    }
+  }
+
+  // generated code
+  stream = open_memstream(&code, &code_sz);
+  test_assert(stream != NULL);
+  CG_emit_inline(stream, "f", trees[0], vt);
+  fclose(stream);
+  stream = NULL;
+  test_assert(strcmp(code,
+                     "static inline double f(double sine, double x, double y)\n"
+                     "{\n"
+                     "  const double ew_t0 = fabs(x);\n"
+                     "  const double ew_t1 = sqrt(ew_t0);\n"
+                     "  const double ew_t2 = x < y ? x : y;\n"
+                     "  const double ew_t3 = y > 0.0 ? y : 0.0;\n"
+                     "  const double ew_t4 = ew_t2 * ew_t3;\n"
+                     "  const double ew_t5 = ew_t1 + ew_t4;\n"
+                     "  return ew_t5;\n"
+                     "}\n") == 0);
+  test_assert(!CG_valid_name("sqrt") && !CG_valid_name("fabs"));
+
+  for (int i = 0; i < ntrees; i++)
+    ET_free(trees[i]);
+  for (int v = 0; v < 2; v++)
+    free(columns[v]);
+  free(out);
+  free(approx);
+  free(buf);
+  free(code);
+  VT_free(vt);
+  return 1;
+
+test_error:
+  if (stream != NULL)
+    fclose(stream);
+  CL_free(tokens);
+  ET_free(tree);
+  for (int i = 0; i < ntrees; i++)
+    ET_free(trees[i]);
+  for (int v = 0; v < 2; v++)
+    free(columns[v]);
+  free(out);
+  free(approx);
+  free(buf);
+  free(code);
+  VT_free(vt);
+  return 0;
+}
+
+/*
+ * Tests automatic differentiation: both modes against known
+ * derivatives and central differences, and against each other on
+ * random trees
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_gradient()
+{
+  VarTable vt = VT_new();
+  CList tokens = NULL;
+  ExprTree tree = NULL;
+  char errmsg[128];
+  unsigned seed = 5;
+
+  const double x = 1.3, y = -0.7;
+  const struct
+  {
+    const char *input;
+    double dx, dy; // at (x, y)
+  } cases[] = {
+      {"x * y + sin(x)", y + cos(x), x},
+      {"x ^ 3 - 2 ^ y", 3 * x * x, -pow(2, y) * log(2)},
+      {"x ^ (y + 2)", (y + 2) * pow(x, y + 1), pow(x, y + 2) * log(x)},
+      {"y ^ 2", 0, 2 * y},
+      {"exp(x) / (1 + y ^ 2)", exp(x) / (1 + y * y), -exp(x) * 2 * y / pow(1 + y * y, 2)},
+      {"sqrt(x * x + y * y)", x / sqrt(x * x + y * y), y / sqrt(x * x + y * y)},
+      {"log(x) - cos(y) + abs(y)", 1 / x, sin(y) - 1},
+      {"min(x, y) * max(x, 3)", 0, 3},
+      {"if(x < y, x * x, -y * x)", -y, -x},
+      {"x > y ? 1 / x : y", -1 / (x * x), 0},
+      {"-(x - y) + (x == y) + 4", -1, 1},
+      {"2 ^ 10", 0, 0},
+  };
+
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+  {
+    tokens = TOK_tokenize_vars(cases[i].input, vt, errmsg, sizeof(errmsg));
+    tree = Parse(tokens, errmsg, sizeof(errmsg));
+    test_assert(tree != NULL);
+    VT_set(vt, "x", x);
+    VT_set(vt, "y", y);
+
+    for (GradMode mode = ET_GRAD_FORWARD; mode <= ET_GRAD_REVERSE; mode++)
+    {
+      double grad[2];
+      double value = ET_evaluate_grad(tree, vt, grad, mode);
+
+      test_assert(same_double(value, ET_evaluate(tree)));
+      test_assert(fabs(grad[0] - cases[i].dx) <= 1e-13 * (1 + fabs(cases[i].dx)));
+      test_assert(fabs(grad[1] - cases[i].dy) <= 1e-13 * (1 + fabs(cases[i].dy)));
+
+      // and central differences agree
+      for (int v = 0; v < 2; v++)
+      {
+        const double h = 1e-6;
+        Variable var = VT_nth(vt, v);
+        double saved = var->value;
+
+        var->value = saved + h;
+        double up = ET_evaluate(tree);
+        var->value = saved - h;
+        double down = ET_evaluate(tree);
+        var->value = saved;
+
+        test_assert(fabs((up - down) / (2 * h) - grad[v]) <= 1e-6 * (1 + fabs(grad[v])));
+      }
+    }
+
+    ET_free(tree);
+    tree = NULL;
+    CL_free(tokens);
+    tokens = NULL;
+  }
+
+  // variables the tree does not use have a zero partial
+  VT_set(vt, "unused", 1);
+  tree = ET_node(OP_MUL, ET_variable(VT_nth(vt, 0)), ET_value(4));
+  for (GradMode mode = ET_GRAD_FORWARD; mode <= ET_GRAD_REVERSE; mode++)
+  {
+    double grad[3] = {-1, -1, -1};
+
+    test_assert(ET_evaluate_grad(tree, vt, grad, mode) == 4 * x);
+    test_assert(grad[0] == 4 && grad[1] == 0 && grad[2] == 0);
+  }
+  ET_free(tree);
+  tree = NULL;
+
+  // the two modes agree on random trees, wherever the gradient is finite
+  for (int i = 0; i < 200; i++)
+  {
+    double fwd[3], rev[3];
+
+    tree = random_piecewise(&seed, 1 + i % 40, vt);
+    for (int v = 0; v < 3; v++)
+      VT_nth(vt, v)->value = 0.25 + (rand_r(&seed) % 16) / 4.0;
+
+    double value = ET_evaluate_grad(tree, vt, fwd, ET_GRAD_FORWARD);
+    test_assert(same_double(value, ET_evaluate(tree)));
+    test_assert(same_double(ET_evaluate_grad(tree, vt, rev, ET_GRAD_REVERSE), value));
+
+    for (int v = 0; v < 3; v++)
+      if (isfinite(fwd[v]) && isfinite(rev[v]))
+        test_assert(fabs(fwd[v] - rev[v]) <= 1e-9 * (1 + fabs(fwd[v])));
+
+    ET_free(tree);
+    tree = NULL;
+  }
+
+  VT_free(vt);
+  return 1;
+
+test_error:
+  CL_free(tokens);
+  ET_free(tree);
+  VT_free(vt);
+  return 0;
+}
+
+/*
+ * Tests fused programs: how much they share, and that every output
+ * matches ET_evaluate, row by row and in batches
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_fused()
+{
+  VarTable vt = VT_new();
+  ExprTree trees[24] = {NULL};
+  const int nrows = 600;
+  double *columns[3] = {NULL};
+  double *outs[24] = {NULL};
+  FusedProgram prog = NULL;
+  char errmsg[128];
+  unsigned seed = 17;
+
+  const char *inputs[] = {
+      "sqrt(x * x + y * y) + 1",
+      "2 * sqrt(y * y + x * x)",
+      "x * x",
+      "if(x < y, sqrt(x * x + y * y), x - y)",
+      "x * x",
+  };
+  const int ninputs = sizeof(inputs) / sizeof(inputs[0]);
+
+  for (int i = 0; i < ninputs; i++)
+  {
+    CList tokens = TOK_tokenize_vars(inputs[i], vt, errmsg, sizeof(errmsg));
+    trees[i] = Parse(tokens, errmsg, sizeof(errmsg));
+    CL_free(tokens);
+    test_assert(trees[i] != NULL);
+  }
+
+  // x, y, x * x, y * y, + , sqrt, 1, +, 2, *, <, -, cond: the second
+  // tree is all shared but for 2 and *, and the last one entirely
+  prog = FP_compile(trees, ninputs);
+  FPStats stats = FP_stats(prog);
+  test_assert(stats.nexprs == 5);
+  test_assert(stats.tree_nodes == 10 + 10 + 3 + 15 + 3);
+  test_assert(stats.program_nodes == 13);
+  test_assert(stats.shared_nodes == 2); // x * x and the sqrt
+  test_assert(stats.registers == 7); // the outputs keep theirs to the end
+  test_assert(FP_var_count(prog) == 2);
+
+  // in float and long double, within the rounding of the type
+  float xf[50], yf[50], rowf_out[5][50], batchf_out[5][50];
+  long double xl[50], yl[50], rowl_out[5][50], batchl_out[5][50];
+
+  for (int r = 0; r < 50; r++)
+  {
+    double row[2] = {(rand_r(&seed) % 17) / 4.0 - 2, (rand_r(&seed) % 17) / 4.0 - 2};
+    double results[5];
+    float rowf[2] = {row[0], row[1]}, resultsf[5];
+    long double rowl[2] = {row[0], row[1]}, resultsl[5];
+
+    VT_set(vt, "x", row[0]);
+    VT_set(vt, "y", row[1]);
+    FP_evaluate(prog, row, results);
+    FP_EVALUATE(prog, rowf, resultsf);
+    FP_EVALUATE(prog, rowl, resultsl);
+    for (int i = 0; i < ninputs; i++)
+    {
+      test_assert(same_double(results[i], ET_evaluate(trees[i])));
+      test_assert(fabs(resultsf[i] - results[i]) <= 1e-6 * (1 + fabs(results[i])));
+      test_assert(fabsl(resultsl[i] - results[i]) <= 1e-15 * (1 + fabs(results[i])));
+      rowf_out[i][r] = resultsf[i];
+      rowl_out[i][r] = resultsl[i];
+    }
+
+    xf[r] = rowf[0];
+    yf[r] = rowf[1];
+    xl[r] = rowl[0];
+    yl[r] = rowl[1];
+  }
+
+  // and a batch gives the same as row by row
+  FP_EVALUATE_BATCH(prog, ((const float *const[]){xf, yf}),
+                    ((float *const[]){batchf_out[0], batchf_out[1], batchf_out[2], batchf_out[3], batchf_out[4]}), 50);
+  FP_EVALUATE_BATCH(prog, ((const long double *const[]){xl, yl}),
+                    ((long double *const[]){batchl_out[0], batchl_out[1], batchl_out[2], batchl_out[3], batchl_out[4]}),
+                    50);
+  test_assert(memcmp(batchf_out, rowf_out, sizeof(rowf_out)) == 0);
+  for (int i = 0; i < ninputs; i++)
+    for (int r = 0; r < 50; r++)
+      test_assert(batchl_out[i][r] == rowl_out[i][r]);
+
+  FP_free(prog);
+  prog = NULL;
+  for (int i = 0; i < ninputs; i++)
+  {
+    ET_free(trees[i]);
+    trees[i] = NULL;
+  }
+
+  // many random trees over the same three columns, each one twice
+  VT_set(vt, "z", 0);
+  for (int v = 0; v < 3; v++)
+  {
+    columns[v] = malloc(nrows * sizeof(double));
+    for (int r = 0; r < nrows; r++)
+      columns[v][r] = (rand_r(&seed) % 9) / 2.0 - 2;
+  }
+  columns[2][3] = NAN;
+
+  for (int i = 0; i < 24; i += 2)
+  {
+    unsigned again = seed;
+
+    trees[i] = random_piecewise(&seed, 1 + i, vt);
+    trees[i + 1] = random_piecewise(&again, 1 + i, vt);
+    outs[i] = malloc(nrows * sizeof(double));
+    outs[i + 1] = malloc(nrows * sizeof(double));
+  }
+
+  prog = FP_compile(trees, 24);
+  stats = FP_stats(prog);
+  test_assert(stats.program_nodes <= stats.tree_nodes / 2);
+
+  FP_evaluate_batch(prog, (const double *const *)columns, outs, nrows);
+  for (int r = 0; r < nrows; r++)
+  {
+    for (int v = 0; v < 3; v++)
+      VT_nth(vt, v)->value = columns[v][r];
+
+    for (int i = 0; i < 24; i++)
+      test_assert(same_double(outs[i][r], ET_evaluate(trees[i])));
+  }
+
+  FP_free(prog);
+  for (int i = 0; i < 24; i++)
+  {
+    ET_free(trees[i]);
+    free(outs[i]);
+  }
+  for (int v = 0; v < 3; v++)
+    free(columns[v]);
+  VT_free(vt);
+  return 1;
+
+test_error:
+  FP_free(prog);
+  for (int i = 0; i < 24; i++)
+  {
+    ET_free(trees[i]);
+    free(outs[i]);
+  }
+  for (int v = 0; v < 3; v++)
+    free(columns[v]);
+  VT_free(vt);
+  return 0;
+}
+
+/*
+ * Number of significant digits in a number printed by DT_format
+ */
+static int significant_digits(const char *s)
+{
+  int digits = 0, zeros = 0;
+
+  for (; *s != '\0' && *s != 'e'; s++)
+  {
+    if (*s < '0' || *s > '9' || (*s == '0' && digits == 0))
+      continue;
+    if (*s == '0')
+      zeros++;
+    else
+    {
+      digits += zeros + 1;
+      zeros = 0;
+    }
+  }
+  return digits;
+}
+
+/*
+ * Tests DT_format: layout, special values, the precision mode, and
+ * that the shortest form reads back exactly and is the shortest
+ */
+int test_dtoa()
+{
+  char buf[DT_BUFFER_SIZE];
+  char ref[DT_BUFFER_SIZE];
+  const struct
+  {
+    double value;
+    const char *expected;
+  } cases[] = {
+      {0, "0"}, {-0.0, "-0"}, {1, "1"}, {-3.5, "-3.5"}, {0.1, "0.1"}, {0.3, "0.3"},
+      {0.1 + 0.2, "0.30000000000000004"}, {1.0 / 3, "0.3333333333333333"},
+      {1e-4, "0.0001"}, {1.5e-5, "1.5e-05"}, {1024, "1024"}, {1e16, "10000000000000000"},
+      {1e17, "1e+17"}, {123456789012345678.0, "1.2345678901234568e+17"},
+      {5e-324, "5e-324"}, {1e23, "1e+23"}, {9007199254740993.0, "9007199254740992"},
+      {1.7976931348623157e308, "1.7976931348623157e+308"},
+      {2.2250738585072014e-308, "2.2250738585072014e-308"}, {INFINITY, "inf"}, {-INFINITY, "-inf"}};
+
+  for (int i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+  {
+    test_assert(DT_format(cases[i].value, DT_SHORTEST, buf) == strlen(cases[i].expected));
+    test_assert(strcmp(buf, cases[i].expected) == 0);
+  }
+
+  DT_format(NAN, DT_SHORTEST, buf);
+  test_assert(strstr(buf, "nan") != NULL);
+
+  // with a precision, the same as printf
+  test_assert(DT_format(M_PI, 6, buf) == 7);
+  test_assert(strcmp(buf, "3.14159") == 0);
+  test_assert(DT_format(1e-300 / 3, 17, buf) > 0);
+  snprintf(ref, sizeof(ref), "%.17g", 1e-300 / 3);
+  test_assert(strcmp(buf, ref) == 0);
+
+  // random doubles of every magnitude read back exactly, and one digit
+  // fewer would not
+  srand(39);
+  for (int i = 0; i < 100000; i++)
+  {
+    uint64_t bits = ((uint64_t)rand() << 62) ^ ((uint64_t)rand() << 31) ^ rand();
+    double value;
+
+    memcpy(&value, &bits, sizeof(value));
+    if (!isfinite(value))
+      continue;
+
+    int len = DT_format(value, DT_SHORTEST, buf);
+
+    test_assert(len == strlen(buf));
+    test_assert(strtod(buf, NULL) == value);
+    test_assert(len <= snprintf(ref, sizeof(ref), "%.17g", value));
+
+    int digits = significant_digits(buf);
+
+    snprintf(ref, sizeof(ref), "%.*e", digits - 2, value);
+    test_assert(digits == 1 || strtod(ref, NULL) != value);
+  }
+
+  return 1;
+
+test_error:
+  return 0;
+}
+
+/*
+ * Thread function for test_server: run the server until it is stopped
+ */
+static void *serve(void *arg)
+{
+  ES_run(arg, 2);
+  return NULL;
+}
+
+/*
+ * Connect to a Unix domain socket
+ *
+ * Returns: The socket, or -1
+ */
+static int connect_unix(const char *path)
+{
+  struct sockaddr_un sun = {.sun_family = AF_UNIX};
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  strcpy(sun.sun_path, path);
+  if (fd >= 0 && connect(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/*
+ * Tests the evaluation server: pipelined requests, a request split
+ * across writes, errors, and more than one connection
+ */
+int test_server()
+{
+  char path[64];
+  char errmsg[128];
+  char reply[256];
+  size_t reply_len = 0;
+  ssize_t n;
+  int fd = -1, fd2 = -1;
+  pthread_t thread;
+  bool running = false;
+
+  snprintf(path, sizeof(path), "/tmp/ew_test_%d.sock", (int)getpid());
+  unlink(path);
+
+  test_assert(ES_new("no_such_port", DT_SHORTEST, errmsg, sizeof(errmsg)) == NULL);
+  test_assert(strcmp(errmsg, "Not a socket path or port: no_such_port") == 0);
+
+  ExprServer server = ES_new(path, DT_SHORTEST, errmsg, sizeof(errmsg));
+  test_assert(server != NULL);
+  test_assert(pthread_create(&thread, NULL, serve, server) == 0);
+  running = true;
+
+  test_assert((fd = connect_unix(path)) >= 0);
+  test_assert((fd2 = connect_unix(path)) >= 0);
+
+  const char *part1 = "1+2\n\nfoo\n2*";
+  const char *part2 = "3\nmax(2, 7) - 1";
+  test_assert(write(fd, part1, strlen(part1)) == strlen(part1));
+  test_assert(write(fd2, "2^10\n", 5) == 5);
+  test_assert(write(fd, part2, strlen(part2)) == strlen(part2));
+  shutdown(fd, SHUT_WR);
+
+  while ((n = read(fd, reply + reply_len, sizeof(reply) - 1 - reply_len)) > 0)
+    reply_len += n;
+  reply[reply_len] = '\0';
+  test_assert(strcmp(reply, "3\n\nline 3: Position 1: unexpected character f\n6\n6\n") == 0);
+
+  // the other connection is still served
+  reply_len = 0;
+  while (reply_len < 5 && (n = read(fd2, reply + reply_len, sizeof(reply) - 1 - reply_len)) > 0)
+    reply_len += n;
+  reply[reply_len] = '\0';
+  test_assert(strcmp(reply, "1024\n") == 0);
+
+  close(fd);
+  close(fd2);
+  ES_stop(server);
+  pthread_join(thread, NULL);
+  ES_free(server);
+  test_assert(access(path, F_OK) != 0);
+  return 1;
+
+test_error:
+  if (fd >= 0)
+    close(fd);
+  if (fd2 >= 0)
+    close(fd2);
+  if (running)
+  {
+    ES_stop(server);
+    pthread_join(thread, NULL);
+    ES_free(server);
+  }
+  return 0;
+}
+
+static void *serve_shm(void *arg)
+{
+  SHM_run(arg);
+  return NULL;
+}
+
+/*
+ * Send many requests through a shared memory client, for test_shm:
+ * more than fit in the rings, so both sides fill up and wait
+ */
+static void *send_shm(void *arg)
+{
+  char expr[64];
+
+  for (int i = 0; i < 20000; i++)
+  {
+    int len = snprintf(expr, sizeof(expr), "%d * 2 + 0.5          ", i);
+    if (SHM_send(arg, expr, len) != 0)
+      return (void *)1;
+  }
+  return NULL;
+}
+
+/*
+ * Tests the shared memory transport: answers in order, errors,
+ * requests written in place, full rings, several clients, and stopping
+ */
+int test_shm()
+{
+  char name[64];
+  char errmsg[128];
+  double value;
+  ShmServer server = NULL;
+  ShmClient client = NULL, client2 = NULL;
+  pthread_t thread, sender;
+  bool running = false;
+
+  snprintf(name, sizeof(name), "/ew_test_%d", (int)getpid());
+
+  test_assert(SHM_new("no_slash", 1, errmsg, sizeof(errmsg)) == NULL);
+  test_assert(SHM_connect(name, errmsg, sizeof(errmsg)) == NULL);
+
+  server = SHM_new(name, 2, errmsg, sizeof(errmsg));
+  test_assert(server != NULL);
+  test_assert(SHM_new(name, 2, errmsg, sizeof(errmsg)) == NULL); // exists
+  test_assert(pthread_create(&thread, NULL, serve_shm, server) == 0);
+  running = true;
+
+  test_assert((client = SHM_connect(name, errmsg, sizeof(errmsg))) != NULL);
+  test_assert((client2 = SHM_connect(name, errmsg, sizeof(errmsg))) != NULL);
+
+  test_assert(SHM_send(client, "1+2", 3) == 0);
+  test_assert(SHM_send(client, "foo", 3) == 0);
+  test_assert(SHM_send(client2, "2^10", 4) == 0);
+  test_assert(SHM_send(client, "", 0) == 0);
+  char *dest = SHM_reserve(client, 14);
+  test_assert(dest != NULL);
+  memcpy(dest, "max(2, 7) - 1 ", 14);
+  SHM_submit(client);
+
+  test_assert(SHM_receive(client, &value, errmsg, sizeof(errmsg)) == 0 && value == 3);
+  test_assert(SHM_receive(client, &value, errmsg, sizeof(errmsg)) == -1);
+  test_assert(strcmp(errmsg, "Position 1: unexpected character f") == 0);
+  test_assert(SHM_receive(client, &value, errmsg, sizeof(errmsg)) == -1);
+  test_assert(strcmp(errmsg, "Empty expression") == 0);
+  test_assert(SHM_receive(client, &value, errmsg, sizeof(errmsg)) == 0 && value == 6);
+  test_assert(SHM_receive(client2, &value, errmsg, sizeof(errmsg)) == 0 && value == 1024);
+  test_assert(SHM_reserve(client, SHM_MAX_EXPR + 1) == NULL);
+
+  // lengths the client corrupts in the ring are caught, not trusted
+  uint32_t bad_lens[] = {SHM_MAX_EXPR + 1, SHM_RING_SIZE - 8, 0xfffffff0};
+  for (int i = 0; i < 3; i++)
+  {
+    dest = SHM_reserve(client, 3);
+    test_assert(dest != NULL);
+    memcpy(dest, "1+2", 3);
+    ((uint32_t *)dest)[-2] = bad_lens[i]; // the length in the record
+    SHM_submit(client);
+    test_assert(SHM_receive(client, &value, errmsg, sizeof(errmsg)) == -1);
+    test_assert(strcmp(errmsg, "Corrupt request") == 0);
+    test_assert(SHM_send(client, "2*3", 3) == 0);
+    test_assert(SHM_receive(client, &value, errmsg, sizeof(errmsg)) == 0 && value == 6);
+  }
+
+  // a client that leaves with answers unread hands on a clean channel
+  test_assert(SHM_send(client2, "1", 1) == 0);
+  SHM_disconnect(client2);
+  client2 = NULL;
+
+  test_assert(pthread_create(&sender, NULL, send_shm, client) == 0);
+  int bad = 0;
+  for (int i = 0; i < 20000; i++)
+    if (SHM_receive(client, &value, errmsg, sizeof(errmsg)) != 0 || value != i * 2 + 0.5)
+      bad++;
+  void *send_status;
+  pthread_join(sender, &send_status);
+  test_assert(bad == 0 && send_status == NULL);
+
+  SHM_stop(server);
+  pthread_join(thread, NULL);
+  running = false;
+  test_assert(SHM_receive(client, &value, errmsg, sizeof(errmsg)) == -1);
+  test_assert(strcmp(errmsg, "Server stopped") == 0);
+  SHM_disconnect(client);
+  SHM_free(server);
+  test_assert(SHM_connect(name, errmsg, sizeof(errmsg)) == NULL);
+  return 1;
+
+test_error:
+  if (running)
+  {
+    SHM_stop(server);
+    pthread_join(thread, NULL);
+  }
+  SHM_disconnect(client);
+  SHM_disconnect(client2);
+  SHM_free(server);
+  return 0;
+}
+
+/*
+ * Tests CSV evaluation: column lookup, quoted fields, the fast and
+ * slow number parsers against strtod, bad rows, and rows across block
+ * and buffer boundaries
+ */
+int test_csv()
+{
+  char errmsg[128];
+  char line[256];
+  FILE *csv = tmpfile();
+  FILE *out = tmpfile();
+  const char *formats[] = {"%.17g", "%.3f", "%.0f", "%g", "%.10e", " %.2f "};
+
+  test_assert(csv != NULL && out != NULL);
+
+  fprintf(csv, "id,x,\"label, quoted\",y,unused,exact_x\r\n");
+  srand(38);
+  for (int i = 0; i < 3000; i++)
+  {
+    double x = (rand() - RAND_MAX / 2) / (double)(1 << (rand() % 40));
+    double y = rand() / 1e5;
+
+    fprintf(csv, "%d,", i);
+    fprintf(csv, formats[i % 6], x);
+    fprintf(csv, (i % 3 == 0) ? ",\"a \"\"b\"\", c\"," : ",plain,");
+    fprintf(csv, formats[(i / 6) % 6], y);
+    fprintf(csv, ",%s,", (i % 7 == 0) ? "not a number" : "0");
+
+    // x as it was printed, in hex, which only strtod parses
+    snprintf(line, sizeof(line), formats[i % 6], x);
+    fprintf(csv, "%a\n", strtod(line, NULL));
+  }
+  fprintf(csv, "3000,1,x\n");      // too few columns
+  fprintf(csv, "3001,1e,x,2,0\n"); // bad x
+  fprintf(csv, "3002,\"4\",x,0.5"); // no newline at the end
+  rewind(csv);
+
+  test_assert(CSV_evaluate(fileno(csv), "x * y - id", DT_SHORTEST, out, errmsg, sizeof(errmsg)) == 3003);
+  rewind(out);
+  rewind(csv);
+
+  test_assert(fgets(line, sizeof(line), csv) != NULL); // the header
+  for (int i = 0; i < 3000; i++)
+  {
+    char row[256];
+    double x, y;
+
+    test_assert(fgets(row, sizeof(row), csv) != NULL);
+    x = strtod(strchr(row, ',') + 1, NULL);
+    y = strtod(strchr(strstr(row, (i % 3 == 0) ? "c\"," : "plain,"), ',') + 1, NULL);
+
+    // printed in full, so it reads back exactly
+    test_assert(fgets(line, sizeof(line), out) != NULL);
+    test_assert(strtod(line, NULL) == x * y - i);
+  }
+  test_assert(fgets(line, sizeof(line), out) != NULL);
+  test_assert(strcmp(line, "line 3002: too few columns\n") == 0);
+  test_assert(fgets(line, sizeof(line), out) != NULL);
+  test_assert(strcmp(line, "line 3003: column x is not a number\n") == 0);
+  test_assert(fgets(line, sizeof(line), out) != NULL);
+  test_assert(strcmp(line, "-3000\n") == 0);
+  test_assert(fgets(line, sizeof(line), out) == NULL);
+
+  // the fast number parser rounds exactly like strtod
+  rewind(csv);
+  rewind(out);
+  test_assert(CSV_evaluate(fileno(csv), "x == exact_x", DT_SHORTEST, out, errmsg, sizeof(errmsg)) == 3003);
+  rewind(out);
+  for (int i = 0; i < 3000; i++)
+  {
+    test_assert(fgets(line, sizeof(line), out) != NULL);
+    test_assert(strcmp(line, "1\n") == 0);
+  }
+
+  // errors that stop the evaluation
+  rewind(csv);
+  test_assert(CSV_evaluate(fileno(csv), "x + z", DT_SHORTEST, out, errmsg, sizeof(errmsg)) == -1);
+  test_assert(strcmp(errmsg, "Unknown column z") == 0);
+  rewind(csv);
+  test_assert(CSV_evaluate(fileno(csv), "x +", DT_SHORTEST, out, errmsg, sizeof(errmsg)) == -1);
+  test_assert(CSV_evaluate(fileno(csv), "", DT_SHORTEST, out, errmsg, sizeof(errmsg)) == -1);
+  test_assert(strcmp(errmsg, "Empty expression") == 0);
+
+  fclose(csv);
+  fclose(out);
+  return 1;
+
+test_error:
+  if (csv != NULL)
+    fclose(csv);
+  if (out != NULL)
+    fclose(out);
+  return 0;
+}
+
+/*
+ * An allocator that fails once a budget of allocations is spent, and
+ * counts the bytes it has out
+ */
+struct budget
+{
+  long allocs_left;
+  size_t bytes_out;
+};
+
+static void *budget_alloc(void *user, size_t size)
+{
+  struct budget *b = user;
+
+  if (b->allocs_left-- <= 0)
+    return NULL;
+
+  b->bytes_out += size;
+  return malloc(size);
+}
+
+static void budget_release(void *user, void *ptr, size_t size)
+{
+  struct budget *b = user;
+
+  b->bytes_out -= size;
+  free(ptr);
+}
+
+/*
+ * Compile and evaluate in a context of its own, for test_library
+ */
+static void *library_worker(void *arg)
+{
+  long id = (long)arg;
+  char src[64];
+  EW_Context ctx = EW_new(NULL);
+  long bad = 0;
+
+  for (int i = 0; i < 2000; i++)
+  {
+    snprintf(src, sizeof(src), "x * %d + %ld", i % 50, id);
+    EW_set(ctx, "x", i);
+
+    EW_Expr expr = EW_compile(ctx, src, strlen(src));
+    if (expr == NULL || EW_evaluate(expr) != (double)i * (i % 50) + id)
+      bad++;
+    EW_release(ctx, expr);
+  }
+
+  EW_free(ctx);
+  return (void *)bad;
+}
+
+int test_library()
+{
+  const char *src = "sqrt(a) * b + (c > 1 ? long_name : -long_name)";
+  struct budget b = {0, 0};
+  EW_Allocator allocator = {budget_alloc, budget_release, &b};
+  EW_Context ctx = NULL;
+  EW_Expr expr = NULL, again = NULL;
+  pthread_t threads[4];
+
+  // errors are reported, and leave nothing behind
+  ctx = EW_new(NULL);
+  test_assert(ctx != NULL && EW_status(ctx) == EW_OK);
+  size_t empty = EW_memory(ctx);
+  test_assert(EW_compile(ctx, "a + ", 4) == NULL);
+  test_assert(EW_status(ctx) == EW_ERR_SYNTAX && EW_error(ctx)[0] != '\0');
+  test_assert(EW_compile(ctx, "a $ b", 5) == NULL);
+  test_assert(EW_status(ctx) == EW_ERR_SYNTAX);
+  test_assert(EW_compile(ctx, "", 0) == NULL);
+  test_assert(strcmp(EW_error(ctx), "Empty expression") == 0);
+  test_assert(EW_memory(ctx) == empty);
+
+  // the cache hands back the same expression for the same text
+  expr = EW_compile(ctx, src, strlen(src));
+  test_assert(expr != NULL && EW_status(ctx) == EW_OK && strcmp(EW_error(ctx), "") == 0);
+  again = EW_compile(ctx, src, strlen(src));
+  test_assert(again == expr);
+  test_assert(EW_set(ctx, "a", 16) == 0 && EW_set(ctx, "b", 2) == 0);
+  test_assert(EW_set(ctx, "c", 0) == 0 && EW_set(ctx, "long_name", 1) == 0);
+  test_assert(EW_evaluate(expr) == 7);
+  EW_release(ctx, again);
+  test_assert(EW_evaluate(expr) == 7);
+  EW_release(ctx, expr);
+  expr = again = NULL;
+  EW_free(ctx);
+  ctx = NULL;
+
+  // running out of memory at every allocation in turn: the call fails
+  // with EW_ERR_NOMEM and the context is as it was
+  for (long budget = 0;; budget++)
+  {
+    b.allocs_left = LONG_MAX;
+    ctx = EW_new(&allocator);
+    test_assert(ctx != NULL);
+    test_assert(EW_set(ctx, "b", 3) == 0);
+    size_t before = EW_memory(ctx);
+
+    b.allocs_left = budget;
+    expr = EW_compile(ctx, src, strlen(src));
+    b.allocs_left = LONG_MAX;
+
+    bool failed = (expr == NULL);
+    if (failed)
+    {
+      test_assert(EW_status(ctx) == EW_ERR_NOMEM);
+      test_assert(EW_memory(ctx) == before);
+      expr = EW_compile(ctx, src, strlen(src));
+      test_assert(expr != NULL);
+    }
+    test_assert(EW_set(ctx, "a", 4) == 0 && EW_set(ctx, "c", 2) == 0);
+    test_assert(EW_evaluate(expr) == 6);
+
+    b.allocs_left = 0;
+    test_assert(EW_set(ctx, "brand_new", 1) == -1);
+    test_assert(EW_status(ctx) == EW_ERR_NOMEM);
+    test_assert(EW_set(ctx, "a", 9) == 0); // needs no memory
+    test_assert(EW_evaluate(expr) == 9);
+
+    EW_release(ctx, expr);
+    expr = NULL;
+    EW_free(ctx);
+    ctx = NULL;
+    test_assert(b.bytes_out == 0);
+
+    // a budget that was enough is enough for every larger one
+    if (!failed)
+      break;
+  }
+
+  b.allocs_left = 0;
+  test_assert(EW_new(&allocator) == NULL);
+  test_assert(b.bytes_out == 0);
+
+  // contexts in different threads share nothing
+  for (long t = 0; t < 4; t++)
+    test_assert(pthread_create(&threads[t], NULL, library_worker, (void *)t) == 0);
+  long bad = 0;
+  for (int t = 0; t < 4; t++)
+  {
+    void *ret;
+    pthread_join(threads[t], &ret);
+    bad += (long)ret;
+  }
+  test_assert(bad == 0);
+
+  return 1;
+
+test_error:
+  EW_release(ctx, expr);
+  EW_free(ctx);
+  return 0;
+}
+
+int test_stats()
+{
+  char errmsg[128];
+  CList tokens = NULL;
+  ExprTree tree = NULL;
+  EW_Context ctx = NULL;
+  EW_Stats st;
+
+  // nothing is counted until the counting is on
+  EW_stats_reset();
+  tokens = TOK_tokenize_input("1 + 2", errmsg, sizeof(errmsg));
+  CL_free(tokens);
+  EW_stats(&st);
+  test_assert(st.clist.allocs == 0 && st.tokenize.allocs == 0 && st.other.frees == 0);
+
+  EW_stats_enable(1);
+
+  // tokenizing allocates the list, and nothing else
+  tokens = TOK_tokenize_input("1 + 2", errmsg, sizeof(errmsg));
+  test_assert(tokens != NULL);
+  EW_stats(&st);
+  test_assert(st.clist.allocs == CL_length(tokens) + 1 && st.clist.frees == 0);
+  test_assert(st.clist.live == st.clist.bytes && st.clist.peak == st.clist.live);
+  test_assert(st.tokenize.allocs == st.clist.allocs && st.tokenize.bytes == st.clist.bytes);
+  test_assert(st.expr_tree.allocs == 0 && st.parse.allocs == 0 && st.other.allocs == 0);
+
+  // parsing builds the tree, consuming the tokens on the way
+  tree = Parse(tokens, errmsg, sizeof(errmsg));
+  test_assert(tree != NULL);
+  EW_stats(&st);
+  test_assert(st.expr_tree.allocs == 3 && st.parse.allocs == 3);
+  test_assert(st.parse.frees == st.clist.frees && st.clist.frees == 3);
+  test_assert(st.parse.peak >= st.tokenize.peak);
+
+  // freeing happens in no phase, and leaves nothing live
+  CL_free(tokens);
+  tokens = NULL;
+  ET_free(tree);
+  tree = NULL;
+  EW_stats(&st);
+  test_assert(st.clist.live == 0 && st.clist.frees == st.clist.allocs);
+  test_assert(st.expr_tree.live == 0 && st.expr_tree.frees == 3);
+  test_assert(st.other.frees == st.clist.frees - st.parse.frees + 3 && st.other.allocs == 0);
+  test_assert(st.expr_tree.peak == st.expr_tree.bytes);
+
+  // so are the blocks of a context, including when it is freed at once
+  EW_stats_reset();
+  ctx = EW_new(NULL);
+  test_assert(ctx != NULL);
+  test_assert(EW_compile(ctx, "a * (b + 1)", 11) != NULL);
+  test_assert(EW_compile(ctx, "a +", 3) == NULL);
+  EW_stats(&st);
+  test_assert(st.context.allocs > 0 && st.vars.allocs > 0 && st.expr_tree.live > 0 && st.sheet.live > 0);
+  test_assert(st.context.live + st.vars.live + st.expr_tree.live + st.clist.live + st.sheet.live == EW_memory(ctx));
+  test_assert(st.tokenize.allocs > 0 && st.parse.allocs > 0);
+  EW_free(ctx);
+  ctx = NULL;
+  EW_stats(&st);
+  test_assert(st.context.live == 0 && st.vars.live == 0 && st.expr_tree.live == 0 && st.clist.live == 0 &&
+              st.sheet.live == 0);
+
+  // the counters start again from zero, keeping what is live
+  EW_stats_reset();
+  EW_stats(&st);
+  test_assert(st.clist.allocs == 0 && st.clist.peak == 0 && st.parse.peak == 0);
+
+  EW_stats_enable(0);
+  return 1;
+
+test_error:
+  EW_stats_enable(0);
+  CL_free(tokens);
+  ET_free(tree);
+  EW_free(ctx);
+  return 0;
+}
+
+static void *latency_worker(void *arg)
+{
+  // each thread records the same times, 1 to 1000 ns
+  for (uint64_t ns = 1; ns <= 1000; ns++)
+    LH_record(LH_EVALUATE, ns);
+  return NULL;
+}
+
+int test_latency()
+{
+  LatencySummary s;
+  pthread_t threads[3];
+  char out[ES_RESULT_MAX];
+
+  // nothing is timed until recording is on
+  test_assert(LH_start() == 0 && LH_lap(LH_PARSE, 0) == 0);
+
+  LH_enable();
+
+  // a percentile is within a bucket of the true value, never above max
+  for (uint64_t ns = 1; ns <= 1000; ns++)
+    LH_record(LH_EVALUATE, ns);
+  LH_summary(LH_EVALUATE, &s);
+  test_assert(s.count == 1000 && s.max == 1000);
+  test_assert(s.p50 >= 500 && s.p50 <= 500 + 500 / LH_SUB_BUCKETS);
+  test_assert(s.p90 >= 900 && s.p90 <= 900 + 900 / LH_SUB_BUCKETS);
+  test_assert(s.p99 >= 990 && s.p999 <= 1000 && s.p99 <= s.p999);
+
+  // small times have a bucket each, and huge ones still fit
+  LH_record(LH_FORMAT, 7);
+  LH_summary(LH_FORMAT, &s);
+  test_assert(s.count == 1 && s.p50 == 7 && s.p999 == 7 && s.max == 7);
+  LH_record(LH_FORMAT, UINT64_MAX);
+  LH_summary(LH_FORMAT, &s);
+  test_assert(s.count == 2 && s.p50 == 7 && s.max == UINT64_MAX && s.p999 == UINT64_MAX);
+
+  // the histograms of other threads are merged in
+  for (int t = 0; t < 3; t++)
+    test_assert(pthread_create(&threads[t], NULL, latency_worker, NULL) == 0);
+  for (int t = 0; t < 3; t++)
+    pthread_join(threads[t], NULL);
+  LH_summary(LH_EVALUATE, &s);
+  test_assert(s.count == 4000 && s.max == 1000);
+  test_assert(s.p50 >= 500 && s.p50 <= 500 + 500 / LH_SUB_BUCKETS);
+
+  // a line evaluated goes through every phase; an error stops early
+  LatencySummary before[LH_NPHASES], after[LH_NPHASES];
+  for (int phase = 0; phase < LH_NPHASES; phase++)
+    LH_summary(phase, &before[phase]);
+  ES_eval_line("1 + 2", 5, 1, DT_SHORTEST, out);
+  ES_eval_line("1 +", 3, 2, DT_SHORTEST, out);
+  ES_eval_line("$", 1, 3, DT_SHORTEST, out);
+  for (int phase = 0; phase < LH_NPHASES; phase++)
+    LH_summary(phase, &after[phase]);
+  test_assert(after[LH_TOKENIZE].count == before[LH_TOKENIZE].count + 3);
+  test_assert(after[LH_PARSE].count == before[LH_PARSE].count + 2);
+  test_assert(after[LH_EVALUATE].count == before[LH_EVALUATE].count + 1);
+  test_assert(after[LH_FORMAT].count == before[LH_FORMAT].count + 1);
+
+  return 1;
+
+test_error:
+  return 0;
+}
+
+#ifdef EW_TRACE
+static void *trace_worker(void *arg)
+{
+  char errmsg[128];
+  CList tokens = TOK_tokenize_input("2 * 3", errmsg, sizeof(errmsg));
+
+  CL_free(tokens);
+  return NULL;
+}
+#endif
+
+int test_trace()
+{
+  char errmsg[128];
+
+#ifdef EW_TRACE
+  char path[64];
+  char json[1 << 16];
+  CList tokens = NULL;
+  ExprTree tree = NULL;
+  char buf[64];
+  pthread_t thread;
+  FILE *in = NULL;
+
+  // nothing is recorded before the trace is opened
+  test_assert(!TR_enabled());
+  tokens = TOK_tokenize_input("7", errmsg, sizeof(errmsg));
+  CL_free(tokens);
+
+  snprintf(path, sizeof(path), "/tmp/ew_test_%d.json", (int)getpid());
+  test_assert(TR_open("/nonexistent/dir/trace.json", errmsg, sizeof(errmsg)) == -1);
+  test_assert(TR_open(path, errmsg, sizeof(errmsg)) == 0 && TR_enabled());
+  test_assert(TR_open(path, errmsg, sizeof(errmsg)) == -1);
+
+  tokens = TOK_tokenize_input("1 + 2 * x", errmsg, sizeof(errmsg));
+  test_assert(tokens == NULL); // x is not a variable here
+  tokens = TOK_tokenize_input("(1 + 2) * 4", errmsg, sizeof(errmsg));
+  tree = Parse(tokens, errmsg, sizeof(errmsg));
+  test_assert(tree != NULL && ET_evaluate(tree) == 12);
+  ET_tree2string(tree, buf, sizeof(buf));
+  ET_free(tree);
+  tree = NULL;
+  CL_free(tokens);
+  tokens = NULL;
+  test_assert(pthread_create(&thread, NULL, trace_worker, NULL) == 0);
+  pthread_join(thread, NULL);
+
+  TR_flush();
+  test_assert(!TR_enabled());
+  TR_flush(); // does nothing
+
+  in = fopen(path, "r");
+  test_assert(in != NULL);
+  size_t len = fread(json, 1, sizeof(json) - 1, in);
+  json[len] = '\0';
+  fclose(in);
+  in = NULL;
+  unlink(path);
+
+  // every span is there, with its counters; each span ends
+  test_assert(strncmp(json, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", 39) == 0);
+  test_assert(strcmp(json + len - 4, "\n]}\n") == 0);
+  const char *names[] = {"tokenize", "parse", "evaluate", "tree2string", "free"};
+  for (int i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+  {
+    char begin[64], end[64];
+
+    snprintf(begin, sizeof(begin), "{\"name\":\"%s\",\"ph\":\"B\"", names[i]);
+    snprintf(end, sizeof(end), "{\"name\":\"%s\",\"ph\":\"E\"", names[i]);
+    test_assert(strstr(json, begin) != NULL && strstr(json, end) != NULL);
+  }
+  test_assert(strstr(json, "\"args\":{\"nodes\":5}") != NULL);
+  test_assert(strstr(json, "\"args\":{\"depth\":3}") != NULL);
+  test_assert(strstr(json, "\"ts\":") != NULL);
+
+  // the worker thread has a track of its own
+  test_assert(strstr(json, "\"args\":{\"name\":\"thread 1\"}") != NULL);
+  test_assert(strstr(json, "\"args\":{\"name\":\"thread 2\"}") != NULL);
+  test_assert(strstr(json, "\"args\":{\"name\":\"thread 3\"}") == NULL);
+#else
+  // not built in: the macros are nothing, and a trace cannot be started
+  TR_BEGIN(NULL);
+  TR_COUNTER("nodes", *(int *)NULL); // never evaluated
+  TR_END(NULL);
+  test_assert(TR_open("/tmp/ew_test_trace.json", errmsg, sizeof(errmsg)) == -1);
+  test_assert(strstr(errmsg, "TRACE=1") != NULL && !TR_enabled());
+#endif
+
+  return 1;
+
+test_error:
+#ifdef EW_TRACE
+  CL_free(tokens);
+  ET_free(tree);
+  if (in != NULL)
+    fclose(in);
+#endif
+  return 0;
+}
+
+/*
+ * Tests chains: that a run of + or * is parsed into one node, that it
+ * prints and counts as the nested nodes would, and that every
+ * evaluator combines a long chain in the same order
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_chains()
+{
+  VarTable vt = VT_new();
+  CList tokens = NULL;
+  ExprTree tree = NULL;
+  ExprTree nested = NULL;
+  ThreadPool pool = NULL;
+  FusedProgram prog = NULL;
+  uint64_t *image_buf = NULL;
+  char errmsg[128];
+  char expected[64];
+  char actual[64];
+  const int nterms = 100000;
+
+  tokens = TOK_tokenize_vars("x * y * 2 * x + 1 + x + 2 * y - 3", vt, errmsg, sizeof(errmsg));
+  tree = Parse(tokens, errmsg, sizeof(errmsg));
+  test_assert(tree != NULL);
+  test_assert(ET_count(tree) == 17);
+  test_assert(ET_depth(tree) == 4);
+  ET_tree2string(tree, actual, sizeof(actual));
+  test_assert(strcmp(actual, "(((((((x * y) * 2) * x) + 1) + x) + (2 * y)) - 3)") == 0);
+  ET_free(tree);
+  tree = NULL;
+  CL_free(tokens);
+  tokens = NULL;
+
+  // printed just as the nested nodes, truncated or not
+  tree = ET_value(1);
+  nested = ET_value(1);
+  for (int i = 2; i <= 6; i++)
+  {
+    tree = ET_chain(OP_MUL, tree, ET_value(i / 4.0));
+    nested = ET_node(OP_MUL, nested, ET_value(i / 4.0));
+  }
+  test_assert(ET_depth(tree) == 2 && ET_depth(nested) == 6);
+  test_assert(ET_count(tree) == ET_count(nested));
+  test_assert(ET_evaluate(tree) == ET_evaluate(nested));
+  for (size_t sz = 2; sz <= sizeof(actual); sz++)
+  {
+    test_assert(ET_tree2string(tree, actual, sz) == ET_tree2string(nested, expected, sz));
+    test_assert(strcmp(actual, expected) == 0);
+  }
+  ET_free(tree);
+  tree = NULL;
+  ET_free(nested);
+  nested = NULL;
+
+  // 0.1 + 0.1 + ... + x * y, summed pairwise
+  tree = ET_value(0.1);
+  for (int i = 1; i < nterms - 1; i++)
+    tree = ET_chain(OP_ADD, tree, ET_value(0.1));
+  tree = ET_chain(OP_ADD, tree, ET_node(OP_MUL, ET_variable(VT_nth(vt, 0)), ET_variable(VT_nth(vt, 1))));
+
+  test_assert(ET_depth(tree) == 3);
+  test_assert(ET_count(tree) == 2 * nterms + 1);
+  test_assert(ET_tree2string(tree, actual, sizeof(actual)) == sizeof(actual) - 1);
+  test_assert(strncmp(actual, "((((((", 6) == 0 && actual[sizeof(actual) - 2] == '$');
+
+  VT_set(vt, "x", 2);
+  VT_set(vt, "y", 3);
+  double value = ET_evaluate(tree);
+  test_assert(fabs(value - (0.1 * (nterms - 1) + 6)) < 1e-9); // summed in order, 2e-8 off
+
+  pool = TP_new(4);
+  test_assert(same_double(ET_evaluate_parallel(tree, pool, 16), value));
+
+  double out;
+  prog = FP_compile(&tree, 1);
+  FP_evaluate(prog, (double[]){2, 3}, &out);
+  test_assert(same_double(out, value));
+
+  size_t size = ET_serialize(&tree, 1, NULL, 0);
+  image_buf = malloc(size);
+  test_assert(image_buf != NULL && ET_serialize(&tree, 1, image_buf, size) == size);
+  ExprImage image = ET_load(image_buf, size, errmsg, sizeof(errmsg));
+  test_assert(image != NULL);
+  test_assert(same_double(EI_evaluate_at(image, 0, (double[]){2, 3}), value));
+
+  for (GradMode mode = ET_GRAD_FORWARD; mode <= ET_GRAD_REVERSE; mode++)
+  {
+    double grad[2];
+
+    test_assert(same_double(ET_evaluate_grad(tree, vt, grad, mode), value));
+    test_assert(grad[0] == 3 && grad[1] == 2);
+  }
+
+  free(image_buf);
+  FP_free(prog);
+  TP_free(pool);
+  ET_free(tree);
+  VT_free(vt);
+  return 1;
+
+test_error:
+  free(image_buf);
+  if (prog != NULL)
+    FP_free(prog);
+  if (pool != NULL)
+    TP_free(pool);
+  ET_free(tree);
+  ET_free(nested);
+  CL_free(tokens);
+  VT_free(vt);
+  return 0;
+}
+
+/*
+ * Returns true if RP_parse gives the same as tokenizing and parsing
+ * text from scratch: the same tree and target, or the same error
+ */
+static bool same_as_full(Reparser rp, VarTable vt, const char *text)
+{
+  char errmsg[128], full_errmsg[128];
+  char buf[4096], full_buf[4096];
+  ExprTree tree = RP_parse(rp, text, errmsg, sizeof(errmsg));
+  CList tokens = NULL;
+  ExprTree full = NULL;
+  Variable target = NULL;
+  bool same;
+
+  // Parse leaves errmsg alone when there are no tokens
+  full_errmsg[0] = '\0';
+  tokens = TOK_tokenize_vars(text, vt, full_errmsg, sizeof(full_errmsg));
+  if (tokens != NULL)
+    full = Parse_statement(tokens, &target, full_errmsg, sizeof(full_errmsg));
+
+  if (tree == NULL || full == NULL)
+    same = (tree == NULL && full == NULL && strcmp(errmsg, full_errmsg) == 0);
+  else
+  {
+    ET_tree2string(tree, buf, sizeof(buf));
+    ET_tree2string(full, full_buf, sizeof(full_buf));
+    same = strcmp(buf, full_buf) == 0 && ET_count(tree) == ET_count(full) && ET_depth(tree) == ET_depth(full) &&
+           same_double(ET_evaluate(tree), ET_evaluate(full)) && RP_target(rp) == target;
+  }
+
+  CL_free(tokens);
+  ET_free(full);
+  return same;
+}
+
+/*
+ * Tests RP_parse: that it parses again only the group around an edit,
+ * and that after any sequence of edits its tree is the one a parse
+ * from scratch gives
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_reparse()
+{
+  static const char alphabet[] = "0123456789+-*/^().,<=?: xep=";
+  VarTable vt = VT_new();
+  Reparser rp = RP_new(vt);
+  ExprTree tree = NULL;
+  char text[8192];
+  char errmsg[128];
+  unsigned seed = 49;
+
+  test_assert(same_as_full(rp, vt, "(1 + 2) * (3 + 4) - 5"));
+  test_assert(RP_stats(rp).relexed == 13 && RP_stats(rp).reparsed == 13);
+
+  // only the group that changed
+  test_assert(same_as_full(rp, vt, "(1 + 2) * (3 + 40) - 5"));
+  test_assert(RP_stats(rp).reparsed == 3);
+  test_assert(same_as_full(rp, vt, "(1 + 2) * (3 + 40)  -  5"));
+  test_assert(RP_stats(rp).reparsed == 0);
+  test_assert(same_as_full(rp, vt, "(1 + 2) * ((3) + 40) - 5"));
+  test_assert(RP_stats(rp).reparsed == 5);
+  test_assert(same_as_full(rp, vt, "(1 + 2) * ((3) + 40) - 6"));
+  test_assert(RP_stats(rp).reparsed == 15);
+
+  // a group whose sum would otherwise join the chain around it
+  test_assert(same_as_full(rp, vt, "(1 + 2 + 3) + 4"));
+  test_assert(same_as_full(rp, vt, "(1 + 2 + 3 + 5) + 4"));
+  ExprTree parsed = RP_parse(rp, "(1e16 + 1 + -1e16) + 1", errmsg, sizeof(errmsg));
+  test_assert(parsed != NULL && ET_evaluate(parsed) == 1);
+  test_assert(same_as_full(rp, vt, "((1e16 + 1 + -1e16)) + 1"));
+  test_assert(same_as_full(rp, vt, "((1e16 + 2 + -1e16)) + 1"));
+
+  // tokens that an edit merges or splits
+  test_assert(same_as_full(rp, vt, "2 e+5 * x"));
+  test_assert(same_as_full(rp, vt, "2e+5 * x"));
+  test_assert(same_as_full(rp, vt, "2e+x * x"));
+  test_assert(same_as_full(rp, vt, "2e+5 * x"));
+  test_assert(same_as_full(rp, vt, "0xg + 1"));
+  test_assert(same_as_full(rp, vt, "0x1 + 1"));
+  test_assert(same_as_full(rp, vt, "5+ +3"));
+  test_assert(same_as_full(rp, vt, "5++*3"));
+  test_assert(same_as_full(rp, vt, "5++ *3"));
+  test_assert(same_as_full(rp, vt, "1 < 2"));
+  test_assert(same_as_full(rp, vt, "1 <= 2"));
+
+  // assignments, whose targets are found again with the tree
+  test_assert(same_as_full(rp, vt, "y = (1 + 2) * x"));
+  test_assert(RP_target(rp) == VT_lookup(vt, "y", 1));
+  test_assert(same_as_full(rp, vt, "y = (1 + 3) * x"));
+  test_assert(RP_stats(rp).reparsed == 3 && RP_target(rp) == VT_lookup(vt, "y", 1));
+  test_assert(same_as_full(rp, vt, "z = (1 + 3) * x"));
+  test_assert(RP_target(rp) == VT_lookup(vt, "z", 1));
+  test_assert(same_as_full(rp, vt, "z == (1 + 3) * x"));
+  test_assert(RP_target(rp) == NULL);
+  test_assert(same_as_full(rp, vt, "z = "));
+  test_assert(same_as_full(rp, vt, "z = 1 = 2"));
+  tree = RP_parse(rp, "z = x + 1", errmsg, sizeof(errmsg));
+  test_assert(tree != NULL && RP_take(rp) == tree && RP_target(rp) == NULL);
+  ET_free(tree);
+  tree = NULL;
+  test_assert(same_as_full(rp, vt, "z = x + 2"));
+  test_assert(RP_stats(rp).reparsed == 5);
+
+  // errors, and recovering from them
+  test_assert(same_as_full(rp, vt, "(1 + 2"));
+  test_assert(same_as_full(rp, vt, "(1 + 2))"));
+  test_assert(same_as_full(rp, vt, "(1 + 2) $ 3"));
+  test_assert(same_as_full(rp, vt, "(1 + 2) + 3"));
+  test_assert(same_as_full(rp, vt, "()"));
+  test_assert(same_as_full(rp, vt, "   "));
+  test_assert(same_as_full(rp, vt, "sqrt(1 + min(2, 3))"));
+  test_assert(same_as_full(rp, vt, "sqrt(1 + min(2, 4))"));
+
+  // an edit deep in a large expression
+  tree = random_tree(&seed, 400);
+  ET_tree2string(tree, text, sizeof(text));
+  ET_free(tree);
+  tree = NULL;
+  test_assert(strlen(text) < sizeof(text) - 1);
+  test_assert(same_as_full(rp, vt, text));
+  int ntokens = RP_stats(rp).relexed;
+  test_assert(ntokens > 500);
+
+  for (int i = 0; i < 50; i++)
+  {
+    char *digit = strpbrk(text + (rand_r(&seed) % (strlen(text) - 10)), "0123456789");
+
+    if (digit == NULL)
+      continue;
+    *digit = '0' + (*digit - '0' + 1) % 10;
+    test_assert(same_as_full(rp, vt, text));
+    test_assert(RP_stats(rp).relexed <= 32 && RP_stats(rp).reparsed < ntokens / 10);
+  }
+
+  // random edits, mostly errors
+  strcpy(text, "(x + 2.5) * (e - (3 / p)) ^ 2 < (1 ? 2 : 3)");
+  for (int i = 0; i < 3000; i++)
+  {
+    size_t len = strlen(text);
+    size_t pos = rand_r(&seed) % (len + 1);
+    size_t cut = (pos < len) ? rand_r(&seed) % 3 : 0;
+    char insert[3] = {0};
+
+    for (int k = rand_r(&seed) % 3; k > 0; k--)
+      insert[k - 1] = alphabet[rand_r(&seed) % (sizeof(alphabet) - 1)];
+
+    if (cut > len - pos)
+      cut = len - pos;
+    if (len + strlen(insert) >= 200)
+      strcpy(text, "(x + 2.5) * (e - (3 / p)) ^ 2");
+    else
+    {
+      memmove(text + pos + strlen(insert), text + pos + cut, len - pos - cut + 1);
+      memcpy(text + pos, insert, strlen(insert));
+    }
+    test_assert(same_as_full(rp, vt, text));
+  }
+
+  RP_free(rp);
+  VT_free(vt);
+  return 1;
+
+test_error:
+  ET_free(tree);
+  RP_free(rp);
+  VT_free(vt);
+  return 0;
+}
+
+/*
+ * Parse text, "name = expression", and hand it to SH_define
+ *
+ * Returns: As for SH_define, or -1 if text does not parse as a
+ *   definition
+ */
+static int define(Sheet sh, VarTable vt, const char *text, char *errmsg, size_t errmsg_sz)
+{
+  Variable target = NULL;
+  ExprTree tree = NULL;
+  CList tokens = TOK_tokenize_vars(text, vt, errmsg, errmsg_sz);
+
+  if (tokens != NULL)
+  {
+    tree = Parse_statement(tokens, &target, errmsg, errmsg_sz);
+    CL_free(tokens);
+  }
+
+  if (target == NULL || SH_define(sh, target, tree, errmsg, errmsg_sz) != 0)
+  {
+    ET_free(tree);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Tests Sheet: levels, cycles, undefined names, that SH_recompute
+ * evaluates only what a change reaches, and that evaluating a level in
+ * parallel gives the same values; and the same through EW_define
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_sheet()
+{
+  VarTable vt = VT_new();
+  VarTable seq_vt = VT_new();
+  ThreadPool pool = TP_new(4);
+  Sheet sh = SH_new(vt, NULL);
+  Sheet par = NULL, seq = NULL;
+  CList tokens = NULL;
+  ExprTree tree = NULL;
+  EW_Context ctx = NULL;
+  EW_Expr expr = NULL;
+  struct budget b = {0, 0};
+  EW_Allocator allocator = {budget_alloc, budget_release, &b};
+  char errmsg[128];
+  char text[8192];
+
+#define VAR(name) VT_define(vt, name, strlen(name))
+
+  // definitions, and the inputs they read
+  SH_set(sh, VAR("a"), 3);
+  SH_set(sh, VAR("b"), 4);
+  test_assert(define(sh, vt, "x = a + b", errmsg, sizeof(errmsg)) == 0);
+  test_assert(define(sh, vt, "y = x ^ 2 / c", errmsg, sizeof(errmsg)) == 0);
+  SH_set(sh, VAR("c"), 7);
+  test_assert(SH_recompute(sh) == 2);
+  test_assert(VAR("x")->value == 7 && VAR("y")->value == 7);
+  test_assert(SH_level(sh, VAR("a")) == -1 && SH_level(sh, VAR("x")) == 0 && SH_level(sh, VAR("y")) == 1);
+  test_assert(SH_definition(sh, VAR("a")) == NULL && SH_definition(sh, VAR("x")) != NULL);
+  test_assert(SH_recompute(sh) == 0);
+
+  // only what a change reaches, and only while values change
+  SH_set(sh, VAR("a"), 10);
+  test_assert(SH_recompute(sh) == 2);
+  test_assert(VAR("x")->value == 14 && VAR("y")->value == 28);
+  SH_set(sh, VAR("a"), 10);
+  test_assert(SH_recompute(sh) == 0);
+  test_assert(define(sh, vt, "z = x * 0", errmsg, sizeof(errmsg)) == 0);
+  test_assert(define(sh, vt, "w = z + 1", errmsg, sizeof(errmsg)) == 0);
+  test_assert(SH_recompute(sh) == 2 && VAR("w")->value == 1);
+  SH_set(sh, VAR("a"), 11);
+  test_assert(SH_recompute(sh) == 3); // x, y and z, but not w
+  test_assert(VAR("y")->value == 225.0 / 7 && VAR("w")->value == 1);
+  SH_set(sh, VAR("c"), 5);
+  test_assert(SH_recompute(sh) == 1 && VAR("y")->value == 45);
+
+  // cycles are refused, and leave the sheet as it was
+  test_assert(define(sh, vt, "x = x + 1", errmsg, sizeof(errmsg)) == -1);
+  test_assert(strcmp(errmsg, "Circular definition: x reads itself") == 0);
+  test_assert(define(sh, vt, "a = w - y", errmsg, sizeof(errmsg)) == -1);
+  test_assert(strcmp(errmsg, "Circular definition: a reads w, which depends on a") == 0 ||
+              strcmp(errmsg, "Circular definition: a reads y, which depends on a") == 0);
+  test_assert(SH_level(sh, VAR("a")) == -1 && SH_level(sh, VAR("w")) == 2);
+  test_assert(SH_recompute(sh) == 0);
+  SH_set(sh, VAR("b"), 5);
+  test_assert(SH_recompute(sh) == 3 && VAR("x")->value == 16);
+
+  // redefining moves what is downstream to other levels
+  test_assert(define(sh, vt, "d = 5", errmsg, sizeof(errmsg)) == 0);
+  test_assert(define(sh, vt, "x = d * a", errmsg, sizeof(errmsg)) == 0);
+  test_assert(SH_level(sh, VAR("d")) == 0 && SH_level(sh, VAR("x")) == 1);
+  test_assert(SH_level(sh, VAR("y")) == 2 && SH_level(sh, VAR("z")) == 2 && SH_level(sh, VAR("w")) == 3);
+  test_assert(SH_recompute(sh) == 4 && VAR("x")->value == 55 && VAR("y")->value == 605);
+  SH_set(sh, VAR("b"), 6);
+  test_assert(SH_recompute(sh) == 0);
+  test_assert(define(sh, vt, "d = 2 + 3", errmsg, sizeof(errmsg)) == 0);
+  test_assert(SH_recompute(sh) == 1);
+
+  // setting a definition makes it an input
+  SH_set(sh, VAR("x"), 2);
+  test_assert(SH_definition(sh, VAR("x")) == NULL && SH_level(sh, VAR("x")) == -1);
+  test_assert(SH_level(sh, VAR("y")) == 0 && SH_level(sh, VAR("w")) == 1);
+  test_assert(SH_recompute(sh) == 2 && VAR("y")->value == 0.8);
+  SH_set(sh, VAR("d"), 1);
+  test_assert(SH_recompute(sh) == 0);
+
+  // a name read ahead of its definition, or never defined, is undefined
+  test_assert(define(sh, vt, "e = later * 2", errmsg, sizeof(errmsg)) == 0);
+  test_assert(SH_undefined(sh, SH_definition(sh, VAR("e"))) == VAR("later"));
+  test_assert(SH_undefined(sh, SH_definition(sh, VAR("y"))) == NULL);
+  tokens = TOK_tokenize_vars("sine + a", vt, errmsg, sizeof(errmsg));
+  test_assert(tokens != NULL);
+  tree = Parse(tokens, errmsg, sizeof(errmsg));
+  test_assert(tree != NULL);
+  test_assert(SH_undefined(sh, tree) == VAR("sine"));
+  test_assert(define(sh, vt, "later = 4", errmsg, sizeof(errmsg)) == 0);
+  test_assert(SH_undefined(sh, SH_definition(sh, VAR("e"))) == NULL);
+  SH_set(sh, VAR("sine"), 0);
+  test_assert(SH_undefined(sh, tree) == NULL);
+  ET_free(tree);
+  tree = NULL;
+  CL_free(tokens);
+  tokens = NULL;
+
+#undef VAR
+
+  // a wide level in parallel, and the same sequentially
+  test_assert(pool != NULL);
+  par = SH_new(vt, pool);
+  seq = SH_new(seq_vt, NULL);
+  char *end = text + sprintf(text, "total = 0");
+  for (int i = 0; i < 200; i++)
+  {
+    char def[64];
+
+    snprintf(def, sizeof(def), "v%d = sqrt(base * %d + %d) / (base + 1)", i, i, 200 - i);
+    test_assert(define(par, vt, def, errmsg, sizeof(errmsg)) == 0);
+    test_assert(define(seq, seq_vt, def, errmsg, sizeof(errmsg)) == 0);
+    end += sprintf(end, " + v%d", i);
+  }
+  test_assert(define(par, vt, text, errmsg, sizeof(errmsg)) == 0);
+  test_assert(define(seq, seq_vt, text, errmsg, sizeof(errmsg)) == 0);
+
+  for (int round = 0; round < 5; round++)
+  {
+    SH_set(par, VT_define(vt, "base", 4), round * 1.5);
+    SH_set(seq, VT_define(seq_vt, "base", 4), round * 1.5);
+    test_assert(SH_recompute(par) == 201 && SH_recompute(seq) == 201);
+    test_assert(SH_level(par, VT_lookup(vt, "total", 5)) == 1);
+    test_assert(same_double(VT_lookup(vt, "total", 5)->value, VT_lookup(seq_vt, "total", 5)->value));
+    for (int i = 0; i < VT_count(seq_vt); i++)
+      test_assert(same_double(VT_lookup(vt, VT_nth(seq_vt, i)->name, strlen(VT_nth(seq_vt, i)->name))->value,
+                              VT_nth(seq_vt, i)->value));
+  }
+
+  // the same through a context
+  ctx = EW_new(NULL);
+  test_assert(ctx != NULL);
+  test_assert(EW_define(ctx, "x = a + b", 9) == 0);
+  test_assert(EW_define(ctx, "y = x ^ 2 / c", 13) == 0);
+  test_assert(EW_set(ctx, "a", 3) == 0 && EW_set(ctx, "b", 4) == 0 && EW_set(ctx, "c", 7) == 0);
+  test_assert(EW_recompute(ctx) == 2);
+  expr = EW_compile(ctx, "y", 1);
+  test_assert(expr != NULL && EW_evaluate(expr) == 7);
+  test_assert(EW_set(ctx, "a", 10) == 0 && EW_recompute(ctx) == 2 && EW_evaluate(expr) == 28);
+  size_t before = EW_memory(ctx);
+  test_assert(EW_define(ctx, "a = y", 5) == -1);
+  test_assert(EW_status(ctx) == EW_ERR_CYCLE);
+  test_assert(strcmp(EW_error(ctx), "Circular definition: a reads y, which depends on a") == 0);
+  test_assert(EW_define(ctx, "a + y", 5) == -1 && EW_status(ctx) == EW_ERR_SYNTAX);
+  test_assert(EW_define(ctx, "a = ", 4) == -1 && EW_status(ctx) == EW_ERR_SYNTAX);
+  test_assert(EW_memory(ctx) == before);
+  test_assert(EW_define(ctx, "q = nowhere + 1", 15) == 0 && EW_recompute(ctx) == 1);
+  test_assert(EW_set_threads(ctx, 3) == 0 && EW_set(ctx, "b", 0) == 0);
+  test_assert(EW_recompute(ctx) == 2 && EW_evaluate(expr) == 100.0 / 7);
+  test_assert(EW_set_threads(ctx, 1) == 0);
+  EW_release(ctx, expr);
+  expr = NULL;
+  EW_free(ctx);
+  ctx = NULL;
+
+  // running out of memory part of the way through a definition
+  for (long budget = 0;; budget++)
+  {
+    b.allocs_left = LONG_MAX;
+    ctx = EW_new(&allocator);
+    test_assert(ctx != NULL);
+    test_assert(EW_define(ctx, "x = a + b", 9) == 0);
+    size_t before = EW_memory(ctx);
+
+    b.allocs_left = budget;
+    bool failed = EW_define(ctx, "y = x * c + x", 13) != 0;
+    b.allocs_left = LONG_MAX;
+
+    if (failed)
+    {
+      test_assert(EW_status(ctx) == EW_ERR_NOMEM && EW_memory(ctx) == before);
+      test_assert(EW_define(ctx, "y = x * c + x", 13) == 0);
+    }
+    test_assert(EW_set(ctx, "a", 1) == 0 && EW_set(ctx, "b", 2) == 0 && EW_set(ctx, "c", 3) == 0);
+    test_assert(EW_recompute(ctx) == 2);
+    expr = EW_compile(ctx, "y", 1);
+    test_assert(expr != NULL && EW_evaluate(expr) == 12);
+
+    EW_release(ctx, expr);
+    expr = NULL;
+    EW_free(ctx);
+    ctx = NULL;
+    test_assert(b.bytes_out == 0);
+
+    if (!failed)
+      break;
+  }
+
+  SH_free(sh);
+  SH_free(par);
+  SH_free(seq);
+  TP_free(pool);
+  VT_free(vt);
+  VT_free(seq_vt);
+  return 1;
+
+test_error:
+  CL_free(tokens);
+  ET_free(tree);
+  EW_release(ctx, expr);
+  EW_free(ctx);
+  SH_free(sh);
+  SH_free(par);
+  SH_free(seq);
+  if (pool != NULL)
+    TP_free(pool);
+  VT_free(vt);
+  VT_free(seq_vt);
+  return 0;
+}
+
+int main()
+{
+  int passed = 0;
+  int num_tests = 0;
+
+  num_tests++;
+  passed += test_cl_token();
+  num_tests++;
+  passed += test_expr_tree();
+  num_tests++;
+  passed += test_tok_next_consume();
+  num_tests++;
+  passed += test_tokenize_input();
+  num_tests++;
+  passed += test_parse();
+  num_tests++;
+  passed += test_parse_associativity();
+  num_tests++;
+  passed += test_parse_errors();
+  num_tests++;
+  passed += test_evaluate_parallel();
+  num_tests++;
+  passed += test_serialize();
+  num_tests++;
+  passed += test_fastmath();
+  num_tests++;
+  passed += test_image_approx();
+  num_tests++;
+  passed += test_variables();
+  num_tests++;
+  passed += test_codegen();
+  num_tests++;
+  passed += test_conditionals();
+  num_tests++;
+  passed += test_evaluate_batch();
+  num_tests++;
+  passed += test_functions();
+  num_tests++;
+  passed += test_gradient();
+  num_tests++;
+  passed += test_fused();
+  num_tests++;
+  passed += test_dtoa();
+  num_tests++;
+  passed += test_server();
+  num_tests++;
+  passed += test_shm();
+  num_tests++;
+  passed += test_csv();
+  num_tests++;
+  passed += test_library();
+  num_tests++;
+  passed += test_stats();
+  num_tests++;
+  passed += test_latency();
+  num_tests++;
+  passed += test_trace();
+  num_tests++;
+  passed += test_chains();
+  num_tests++;
+  passed += test_reparse();
+  num_tests++;
+  passed += test_sheet();
 
   printf("Passed %d/%d test cases\n", passed, num_tests);
   fflush(stdout);
@@ -0,0 +1,535 @@
+/*
+ * expr_csv.c
+ *
+ * Columnar evaluation of an expression over a CSV file.
+ *
+ * Rows are found with memchr. Within a row, the commas are found 16
+ * bytes at a time: one SSE2 compare gives a bit mask of all the commas
+ * in the block, which is then walked bit by bit, so a row of short
+ * fields costs a few instructions per field. Only as many fields as
+ * the last referenced column needs are split off. A quote anywhere in
+ * that part of the row sends the row to the slower scalar splitter.
+ *
+ * Numbers are parsed without strtod when they are plain decimals:
+ * eight digits at a time are checked and converted inside one 64-bit
+ * word (SWAR), and when the digits fit in 53 bits and the power of ten
+ * is at most 22, one multiplication or division by an exact power of
+ * ten gives the correctly rounded double. Anything else (more digits,
+ * larger exponents, inf, nan, hex) falls back to strtod.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "expr_csv.h"
+#include "clist.h"
+#include "tokenize.h"
+#include "parse.h"
+#include "expr_fused.h"
+#include "vars.h"
+#include "dtoa.h"
+
+#define CSV_BLOCK 1024 // rows evaluated together
+#define NUMBER_MAX 63  // longest field handed to strtod
+
+// the row errors, besides a bad value in column c, which is c >= 0
+#define ROW_OK -1
+#define ROW_SHORT -2
+
+// a field of a row, without its quotes
+struct field
+{
+  const char *start;
+  const char *end;
+};
+
+/*
+ * Reads whole rows through a buffer of CSV_MAX_ROW bytes
+ */
+struct reader
+{
+  int fd;
+  char *buf;
+  size_t len;  // bytes in buf
+  size_t pos;  // start of the next row
+  bool eof;
+  long lineno; // lines returned so far
+};
+
+// powers of ten that are exact in a double
+static const double exact_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+/*
+ * Return the next row of the file, without its '\n' or '\r\n'
+ *
+ * Parameters:
+ *   rd       The reader
+ *   row      Return space for the row; valid until the next call
+ *
+ * Returns: 1 if there was a row, 0 at the end of the file, -1 if a row
+ *   is longer than CSV_MAX_ROW or the file cannot be read
+ */
+static int next_row(struct reader *rd, struct field *row)
+{
+  for (;;)
+  {
+    char *start = rd->buf + rd->pos;
+    char *newline = memchr(start, '\n', rd->len - rd->pos);
+
+    if (newline != NULL || (rd->eof && rd->pos < rd->len))
+    {
+      char *end = (newline != NULL) ? newline : rd->buf + rd->len;
+
+      rd->pos = end - rd->buf + (newline != NULL);
+      if (end > start && end[-1] == '\r')
+        end--;
+
+      *row = (struct field){start, end};
+      rd->lineno++;
+      return 1;
+    }
+
+    if (rd->eof)
+      return 0;
+
+    if (rd->pos == 0 && rd->len == CSV_MAX_ROW)
+    {
+      errno = EFBIG;
+      return -1;
+    }
+
+    // keep the partial row, and read more after it
+    memmove(rd->buf, start, rd->len - rd->pos);
+    rd->len -= rd->pos;
+    rd->pos = 0;
+
+    ssize_t n = read(rd->fd, rd->buf + rd->len, CSV_MAX_ROW - rd->len);
+
+    if (n < 0 && errno != EINTR)
+      return -1;
+    if (n == 0)
+      rd->eof = true;
+    if (n > 0)
+      rd->len += n;
+  }
+}
+
+/*
+ * Split off the next field of a row, with the scalar splitter
+ *
+ * Parameters:
+ *   p        The start of the field; updated to the start of the next
+ *            one, or NULL after the last field
+ *   end      The end of the row
+ *   field    Return space for the field, without its quotes if any
+ *
+ * Returns: false if there are no more fields
+ */
+static bool next_field(const char **p, const char *end, struct field *field)
+{
+  const char *s = *p;
+
+  if (s == NULL)
+    return false;
+
+  const char *q = s;
+
+  while (q < end && *q == ' ')
+    q++;
+
+  bool quoted = (q < end && *q == '"');
+
+  if (quoted)
+  {
+    const char *close = q + 1;
+
+    // the closing quote is one not followed by another
+    while ((close = memchr(close, '"', end - close)) != NULL && close + 1 < end && close[1] == '"')
+      close += 2;
+    if (close == NULL)
+      close = end;
+
+    *field = (struct field){q + 1, close};
+    s = (close < end) ? close + 1 : end;
+  }
+
+  const char *comma = memchr(s, ',', end - s);
+
+  if (!quoted)
+    *field = (struct field){*p, (comma != NULL) ? comma : end};
+
+  *p = (comma != NULL) ? comma + 1 : NULL;
+  return true;
+}
+
+/*
+ * Split the first nfields fields of a row
+ *
+ * Parameters:
+ *   row      The row
+ *   fields   Return space for nfields + 1 fields
+ *   nfields  How many are wanted
+ *
+ * Returns: How many there were, at most nfields
+ */
+static int split_row(struct field row, struct field *fields, int nfields)
+{
+  const char *p = row.start;
+  int n = 0;
+
+  fields[0].start = row.start;
+
+#ifdef __SSE2__
+  const __m128i comma = _mm_set1_epi8(',');
+  const __m128i quote = _mm_set1_epi8('"');
+
+  for (; row.end - p >= 16 && n < nfields; p += 16)
+  {
+    __m128i block = _mm_loadu_si128((const __m128i *)p);
+    unsigned commas = _mm_movemask_epi8(_mm_cmpeq_epi8(block, comma));
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(block, quote)) != 0)
+      break;
+
+    for (; commas != 0 && n < nfields; commas &= commas - 1)
+    {
+      const char *c = p + __builtin_ctz(commas);
+
+      fields[n].end = c;
+      fields[++n].start = c + 1;
+    }
+  }
+#endif
+
+  // the rest of the row, from the start of the first field not yet split
+  const char *start = fields[n].start;
+
+  for (; n < nfields && next_field(&start, row.end, &fields[n]); n++)
+    ;
+
+  return n;
+}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+/*
+ * Returns true if all of p[0..7] are decimal digits
+ */
+static bool eight_digits(const char *p)
+{
+  uint64_t v;
+
+  memcpy(&v, p, 8);
+  return ((v & 0xF0F0F0F0F0F0F0F0) | (((v + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4)) == 0x3333333333333333;
+}
+
+/*
+ * Returns the value of the eight decimal digits p[0..7]
+ */
+static uint32_t eight_digits_value(const char *p)
+{
+  uint64_t v;
+
+  memcpy(&v, p, 8);
+  v = ((v & 0x0F0F0F0F0F0F0F0F) * 2561) >> 8;
+  v = ((v & 0x00FF00FF00FF00FF) * 6553601) >> 16;
+  return (uint32_t)(((v & 0x0000FFFF0000FFFF) * 42949672960001) >> 32);
+}
+#endif
+
+/*
+ * Read the digits at *p into *m, advancing *p past them
+ *
+ * Returns: The number of digits
+ */
+static int scan_digits(const char **p, const char *end, uint64_t *m)
+{
+  const char *s = *p;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (end - s >= 8 && eight_digits(s))
+  {
+    *m = *m * 100000000 + eight_digits_value(s);
+    s += 8;
+  }
+#endif
+
+  while (s < end && *s >= '0' && *s <= '9')
+    *m = *m * 10 + (*s++ - '0');
+
+  int n = s - *p;
+  *p = s;
+  return n;
+}
+
+/*
+ * Convert a field to a number; the whole field must be one number,
+ * with optional spaces around it
+ *
+ * Returns: true if it was a number
+ */
+static bool parse_number(struct field field, double *value)
+{
+  const char *p = field.start;
+  const char *end = field.end;
+
+  while (p < end && *p == ' ')
+    p++;
+  while (end > p && end[-1] == ' ')
+    end--;
+
+  const char *s = p;
+  bool negative = (p < end && *p == '-');
+  uint64_t m = 0;
+  int exp10 = 0;
+
+  if (p < end && (*p == '-' || *p == '+'))
+    p++;
+
+  int ndigits = scan_digits(&p, end, &m);
+
+  if (p < end && *p == '.')
+  {
+    p++;
+    int nfrac = scan_digits(&p, end, &m);
+
+    ndigits += nfrac;
+    exp10 -= nfrac;
+  }
+
+  if (ndigits > 0 && p < end && (*p == 'e' || *p == 'E'))
+  {
+    const char *e = p + 1;
+    bool exp_negative = (e < end && *e == '-');
+    int exp = 0;
+
+    if (e < end && (*e == '-' || *e == '+'))
+      e++;
+    if (e == end || *e < '0' || *e > '9')
+      goto slow;
+    for (; e < end && *e >= '0' && *e <= '9' && exp < 10000; e++)
+      exp = exp * 10 + (*e - '0');
+
+    exp10 += exp_negative ? -exp : exp;
+    p = e;
+  }
+
+  // m may have wrapped around if there were more than 19 digits
+  if (ndigits == 0 || p != end || ndigits > 19 || m > (1ULL << 53) || exp10 < -22 || exp10 > 22)
+    goto slow;
+
+  *value = (exp10 < 0) ? (double)m / exact_pow10[-exp10] : (double)m * exact_pow10[exp10];
+  if (negative)
+    *value = -*value;
+  return true;
+
+slow:
+  if (end == s || end - s > NUMBER_MAX)
+    return false;
+
+  char buf[NUMBER_MAX + 1];
+  char *buf_end;
+
+  memcpy(buf, s, end - s);
+  buf[end - s] = '\0';
+  *value = strtod(buf, &buf_end);
+  return buf_end == buf + (end - s);
+}
+
+/*
+ * Evaluate a block of rows and write their results
+ */
+static void write_block(FusedProgram prog, double *const *columns, const int *status, const long *lines,
+                        const char *const *col_names, double *results, int nrows, int precision, FILE *out)
+{
+  char value[DT_BUFFER_SIZE];
+
+  FP_evaluate_batch(prog, (const double *const *)columns, &results, nrows);
+
+  for (int r = 0; r < nrows; r++)
+  {
+    if (status[r] == ROW_OK)
+    {
+      int len = DT_format(results[r], precision, value);
+
+      value[len++] = '\n';
+      fwrite(value, 1, len, out);
+    }
+    else if (status[r] == ROW_SHORT)
+      fprintf(out, "line %ld: too few columns\n", lines[r]);
+    else
+      fprintf(out, "line %ld: column %s is not a number\n", lines[r], col_names[status[r]]);
+  }
+}
+
+/*
+ * Compile the expression against a fresh VarTable
+ *
+ * Returns: The tree, or NULL with errmsg filled in
+ */
+static ExprTree compile(const char *expr, VarTable vars, char *errmsg, size_t errmsg_sz)
+{
+  CList tokens = TOK_tokenize_vars(expr, vars, errmsg, errmsg_sz);
+
+  if (tokens == NULL)
+    return NULL;
+
+  ExprTree tree = NULL;
+
+  if (CL_length(tokens) == 0)
+    snprintf(errmsg, errmsg_sz, "Empty expression");
+  else
+    tree = Parse(tokens, errmsg, errmsg_sz);
+
+  CL_free(tokens);
+  return tree;
+}
+
+// Documented in .h file
+long CSV_evaluate(int fd, const char *expr, int precision, FILE *out, char *errmsg, size_t errmsg_sz)
+{
+  VarTable vars = VT_new();
+  ExprTree tree = compile(expr, vars, errmsg, errmsg_sz);
+  int nvars = VT_count(vars);
+  struct reader rd = {fd, malloc(CSV_MAX_ROW), 0, 0, false, 0};
+  int *var_col = malloc((nvars + 1) * sizeof(int));      // the column of each variable
+  double **columns = calloc(nvars + 1, sizeof(double *)); // a block of each variable
+  double *results = malloc(CSV_BLOCK * sizeof(double));
+  int status[CSV_BLOCK];
+  long lines[CSV_BLOCK];
+  FusedProgram prog = NULL;
+  struct field *fields = NULL;
+  const char **col_names = NULL;
+  int *col_var = NULL;
+  struct field row;
+  long nrows = -1;
+  int ncols = 0;
+
+  assert(rd.buf != NULL && var_col != NULL && columns != NULL && results != NULL);
+
+  if (tree == NULL)
+    goto done;
+
+  int got = next_row(&rd, &row);
+
+  if (got == 0)
+    snprintf(errmsg, errmsg_sz, "Missing header line");
+  if (got < 0)
+    snprintf(errmsg, errmsg_sz, "line 1: %s", strerror(errno));
+  if (got <= 0)
+    goto done;
+
+  // find each variable in the header
+  for (int v = 0; v < nvars; v++)
+  {
+    const char *p = row.start;
+    const char *name = VT_nth(vars, v)->name;
+    struct field field;
+    int col = 0;
+
+    var_col[v] = -1;
+    for (; var_col[v] < 0 && next_field(&p, row.end, &field); col++)
+    {
+      while (field.start < field.end && field.start[0] == ' ')
+        field.start++;
+      while (field.end > field.start && field.end[-1] == ' ')
+        field.end--;
+
+      if ((size_t)(field.end - field.start) == strlen(name) && memcmp(field.start, name, strlen(name)) == 0)
+        var_col[v] = col;
+    }
+
+    if (var_col[v] < 0)
+    {
+      snprintf(errmsg, errmsg_sz, "Unknown column %s", name);
+      goto done;
+    }
+    if (var_col[v] + 1 > ncols)
+      ncols = var_col[v] + 1;
+  }
+
+  // which variable each column up to the last one used holds
+  fields = malloc((ncols + 1) * sizeof(struct field));
+  col_var = malloc((ncols + 1) * sizeof(int));
+  col_names = malloc((ncols + 1) * sizeof(char *));
+  assert(fields != NULL && col_var != NULL && col_names != NULL);
+
+  for (int c = 0; c < ncols; c++)
+    col_var[c] = -1;
+  for (int v = 0; v < nvars; v++)
+  {
+    col_var[var_col[v]] = v;
+    col_names[var_col[v]] = VT_nth(vars, v)->name;
+    columns[v] = malloc(CSV_BLOCK * sizeof(double));
+    assert(columns[v] != NULL);
+  }
+
+  prog = FP_compile(&tree, 1);
+  nrows = 0;
+
+  int n = 0; // rows in the current block
+
+  while ((got = next_row(&rd, &row)) > 0)
+  {
+    status[n] = ROW_OK;
+    lines[n] = rd.lineno;
+
+    if (split_row(row, fields, ncols) < ncols)
+      status[n] = ROW_SHORT;
+
+    for (int c = 0; c < ncols && status[n] == ROW_OK; c++)
+    {
+      int v = col_var[c];
+
+      if (v >= 0 && !parse_number(fields[c], &columns[v][n]))
+        status[n] = c;
+    }
+
+    // the value of a bad row is computed but never written
+    if (status[n] != ROW_OK)
+      for (int v = 0; v < nvars; v++)
+        columns[v][n] = 0;
+
+    if (++n == CSV_BLOCK)
+    {
+      write_block(prog, columns, status, lines, col_names, results, n, precision, out);
+      nrows += n;
+      n = 0;
+    }
+  }
+
+  write_block(prog, columns, status, lines, col_names, results, n, precision, out);
+  nrows += n;
+
+  if (got < 0)
+  {
+    snprintf(errmsg, errmsg_sz, "line %ld: %s", rd.lineno + 1, strerror(errno));
+    nrows = -1;
+  }
+
+done:
+  for (int v = 0; v < nvars; v++)
+    free(columns[v]);
+  free(columns);
+  free(var_col);
+  free(results);
+  free(fields);
+  free(col_var);
+  free(col_names);
+  free(rd.buf);
+  FP_free(prog);
+  ET_free(tree);
+  VT_free(vars);
+  return nrows;
+}
@@ -0,0 +1,54 @@
+/*
+ * expr_csv.h
+ *
+ * Columnar evaluation of an expression over a CSV file: the variables
+ * of the expression are the columns of the file, named by its header
+ * line, and the expression is evaluated once per row.
+ *
+ * The file is read through a fixed-size buffer and evaluated a block
+ * of rows at a time, so memory use does not depend on the size of the
+ * file. Only the columns the expression refers to are converted to
+ * numbers; the other fields are only stepped over.
+ *
+ * Fields are separated by commas, and rows by '\n' (a '\r' before it
+ * is ignored). A field may be quoted with '"', with "" for a quote
+ * inside it, but may not span lines. Spaces around a number are
+ * ignored, as are spaces around a column name in the header.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#ifndef _EXPR_CSV_H_
+#define _EXPR_CSV_H_
+
+#include <stdio.h>
+
+// The longest row, in bytes, that the reader can hold
+#define CSV_MAX_ROW (1 << 20)
+
+/*
+ * Evaluate an expression for every row of a CSV file, and write the
+ * results to out, one line per row in the order of the rows: the value
+ * printed by DT_format, or, for a row that lacks one of the columns or
+ * has something other than a number in it, an error in the form
+ * "line N: message", N counting the lines of the file from 1.
+ *
+ * Parameters:
+ *   fd         The CSV file, read from its current position to its
+ *              end; the first line is the header
+ *   expr       The expression
+ *   precision  How values are printed, DT_SHORTEST or a number of
+ *              significant digits (see DT_format)
+ *   out        Where the results go
+ *   errmsg     Return space for an error message, filled in in case of error
+ *   errmsg_sz  The size of errmsg
+ *
+ * Returns: The number of rows, or -1 in case of an error that stops
+ *   the evaluation: the expression does not parse or uses a name that
+ *   is not a column, the header is missing, a row is longer than
+ *   CSV_MAX_ROW, or the file cannot be read. Rows before the error
+ *   may already have been written.
+ */
+long CSV_evaluate(int fd, const char *expr, int precision, FILE *out, char *errmsg, size_t errmsg_sz);
+
+#endif /* _EXPR_CSV_H_ */
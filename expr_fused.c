@@ -0,0 +1,341 @@
+/*
+ * expr_fused.c
+ *
+ * Fused programs: sets of ExprTrees merged into one DAG by structural
+ * hashing (hash-consing), and evaluated one node at a time.
+ *
+ * The nodes of a program are kept in post-order, children before
+ * parents, which is the order they are evaluated in. Each interior
+ * node gets a register: a scratch block of FP_BLOCK values in the
+ * batch evaluator, a single value in the row evaluator. A register
+ * is handed on to a later node as soon as the last node reading it
+ * has been computed, so the number of registers stays near the width
+ * of the DAG rather than its size.
+ *
+ * The evaluators are in expr_fused_eval.h, made once for each of float,
+ * double and long double.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <tgmath.h> // the math functions of the float and long double evaluators
+
+#include "expr_fused.h"
+#include "expr_tree_priv.h"
+#include "trace.h"
+
+#define FP_BLOCK 256 // rows evaluated together by FP_evaluate_batch
+
+struct fp_node
+{
+  ExprNodeType type;
+  uint32_t arg[3]; // the children, by node index
+  double value;    // VALUE only
+  int var;         // VARIABLE only: the variable index
+  int slot;        // the register of an interior node, or the
+                   // constant block of a VALUE
+};
+
+struct _fused_program
+{
+  struct fp_node *nodes; // in post-order
+  int nnodes;
+  uint32_t *outputs;     // the node of each output
+  int noutputs;
+  int nregs;             // registers, for the interior nodes
+  int nconsts;           // constant blocks, for the VALUE nodes
+  int nvars;
+  FPStats stats;
+};
+
+/*
+ * State of FP_compile while it merges the trees
+ */
+struct builder
+{
+  struct fp_node *nodes;
+  int nnodes;
+  uint32_t *table; // node index + 1 for each slot; 0 marks an empty slot
+  uint32_t mask;   // table size - 1
+  int *uses;       // references to each node, by nodes and outputs
+};
+
+/*
+ * Returns true if the operands of type can be swapped without
+ * changing any result, NaN and signed zeros included
+ */
+static bool commutative(ExprNodeType type)
+{
+  return type == OP_ADD || type == OP_MUL || type == OP_EQ || type == OP_NE;
+}
+
+/*
+ * Returns true if two nodes are the same: same type, same constant
+ * (bit for bit) or variable, same children
+ */
+static bool same_node(const struct fp_node *n1, const struct fp_node *n2)
+{
+  if (n1->type != n2->type)
+    return false;
+
+  if (n1->type == VALUE)
+    return memcmp(&n1->value, &n2->value, sizeof(double)) == 0;
+
+  if (n1->type == VARIABLE)
+    return n1->var == n2->var;
+
+  for (int i = 0; i < ET_arity(n1->type); i++)
+    if (n1->arg[i] != n2->arg[i])
+      return false;
+
+  return true;
+}
+
+/*
+ * Hash of a node, over the same fields that same_node compares
+ */
+static uint64_t hash_node(const struct fp_node *node)
+{
+  uint64_t h = 0xcbf29ce484222325ULL ^ node->type;
+  uint64_t words[3] = {0, 0, 0};
+
+  if (node->type == VALUE)
+    memcpy(&words[0], &node->value, sizeof(double));
+  else if (node->type == VARIABLE)
+    words[0] = node->var;
+  else
+    for (int i = 0; i < ET_arity(node->type); i++)
+      words[i] = node->arg[i];
+
+  for (int i = 0; i < 3; i++)
+  {
+    h = (h ^ words[i]) * 0x100000001b3ULL;
+    h ^= h >> 29;
+  }
+
+  return h;
+}
+
+/*
+ * Add a node to the program being built, unless there is one the
+ * same already
+ *
+ * Returns: The index of the node
+ */
+static uint32_t insert(struct builder *b, struct fp_node node)
+{
+  int arity = ET_arity(node.type);
+
+  if (commutative(node.type) && node.arg[0] > node.arg[1])
+  {
+    uint32_t tmp = node.arg[0];
+    node.arg[0] = node.arg[1];
+    node.arg[1] = tmp;
+  }
+
+  uint32_t s = hash_node(&node) & b->mask;
+
+  for (; b->table[s] != 0; s = (s + 1) & b->mask)
+    if (same_node(&b->nodes[b->table[s] - 1], &node))
+      return b->table[s] - 1;
+
+  // a new node
+  for (int i = 0; i < arity; i++)
+    b->uses[node.arg[i]]++;
+
+  b->nodes[b->nnodes] = node;
+  b->table[s] = ++b->nnodes;
+  return b->nnodes - 1;
+}
+
+static uint32_t intern(struct builder *b, ExprTree tree);
+
+/*
+ * Add a range of the operands of a chain to the program being built,
+ * as the binary nodes that combine them in the order of ET_split
+ *
+ * Returns: The index of the node for the combined range
+ */
+static uint32_t intern_range(struct builder *b, ExprTree tree, int first, int count)
+{
+  if (count == 1)
+    return intern(b, tree->n.list.ops[first]);
+
+  int half = ET_split(count);
+  struct fp_node node = {ET_chain_op(tree->type), {0, 0, 0}, 0, -1, -1};
+
+  node.arg[0] = intern_range(b, tree, first, half);
+  node.arg[1] = intern_range(b, tree, first + half, count - half);
+  return insert(b, node);
+}
+
+/*
+ * Add tree to the program being built, merging it with the nodes
+ * that are already there
+ *
+ * Returns: The index of the node for the root of tree
+ */
+static uint32_t intern(struct builder *b, ExprTree tree)
+{
+  struct fp_node node = {tree->type, {0, 0, 0}, 0, -1, -1};
+
+  if (ET_is_chain(tree))
+    return intern_range(b, tree, 0, tree->n.list.count);
+
+  if (tree->type == VALUE)
+    node.value = tree->n.value;
+  else if (tree->type == VARIABLE)
+    node.var = tree->n.var->index;
+
+  for (int i = 0; i < ET_arity(tree->type); i++)
+    node.arg[i] = intern(b, tree->n.child[i]);
+
+  return insert(b, node);
+}
+
+/*
+ * Assign registers to the interior nodes and constant blocks to the
+ * VALUE nodes of prog
+ */
+static void assign_slots(FusedProgram prog)
+{
+  int *last_use = malloc(prog->nnodes * sizeof(int));
+  int *free_regs = malloc(prog->nnodes * sizeof(int));
+  int nfree = 0;
+
+  assert(last_use != NULL && free_regs != NULL);
+
+  // outputs are read at the very end
+  for (int i = 0; i < prog->nnodes; i++)
+    last_use[i] = -1;
+  for (int i = 0; i < prog->nnodes; i++)
+    for (int k = 0; k < ET_arity(prog->nodes[i].type); k++)
+      last_use[prog->nodes[i].arg[k]] = i;
+  for (int i = 0; i < prog->noutputs; i++)
+    last_use[prog->outputs[i]] = prog->nnodes;
+
+  for (int i = 0; i < prog->nnodes; i++)
+  {
+    struct fp_node *node = &prog->nodes[i];
+
+    if (node->type == VALUE)
+      node->slot = prog->nconsts++;
+    if (node->type == VALUE || node->type == VARIABLE)
+      continue;
+
+    // taken before the children's registers are given back, so that
+    // a node never writes the register it reads
+    node->slot = (nfree > 0) ? free_regs[--nfree] : prog->nregs++;
+
+    for (int k = 0; k < ET_arity(node->type); k++)
+    {
+      const struct fp_node *child = &prog->nodes[node->arg[k]];
+      bool seen = (k > 0 && node->arg[k] == node->arg[0]) || (k > 1 && node->arg[k] == node->arg[1]);
+
+      if (!seen && last_use[node->arg[k]] == i && child->type != VALUE && child->type != VARIABLE)
+        free_regs[nfree++] = child->slot;
+    }
+  }
+
+  free(last_use);
+  free(free_regs);
+}
+
+// Documented in .h file
+FusedProgram FP_compile(const ExprTree *trees, int ntrees)
+{
+  assert(ntrees >= 1);
+
+  FusedProgram prog = calloc(1, sizeof(struct _fused_program));
+  struct builder b = {NULL, 0, NULL, 0, NULL};
+  int total = 0;
+
+  assert(prog != NULL);
+
+  for (int i = 0; i < ntrees; i++)
+    total += ET_count(trees[i]);
+
+  // at most half full, even if nothing is shared
+  uint32_t size = 16;
+  while (size < 2 * (uint32_t)total)
+    size *= 2;
+
+  b.nodes = malloc(total * sizeof(struct fp_node));
+  b.table = calloc(size, sizeof(uint32_t));
+  b.uses = calloc(total, sizeof(int));
+  b.mask = size - 1;
+  prog->outputs = malloc(ntrees * sizeof(uint32_t));
+  assert(b.nodes != NULL && b.table != NULL && b.uses != NULL && prog->outputs != NULL);
+
+  for (int i = 0; i < ntrees; i++)
+  {
+    prog->outputs[i] = intern(&b, trees[i]);
+    b.uses[prog->outputs[i]]++;
+  }
+
+  prog->nodes = realloc(b.nodes, b.nnodes * sizeof(struct fp_node));
+  prog->nnodes = b.nnodes;
+  prog->noutputs = ntrees;
+  assert(prog->nodes != NULL);
+
+  for (int i = 0; i < prog->nnodes; i++)
+    if (prog->nodes[i].type == VARIABLE && prog->nodes[i].var >= prog->nvars)
+      prog->nvars = prog->nodes[i].var + 1;
+
+  assign_slots(prog);
+
+  prog->stats.nexprs = ntrees;
+  prog->stats.tree_nodes = total;
+  prog->stats.program_nodes = prog->nnodes;
+  prog->stats.registers = prog->nregs;
+  for (int i = 0; i < prog->nnodes; i++)
+    if (b.uses[i] > 1 && prog->nodes[i].type != VALUE && prog->nodes[i].type != VARIABLE)
+      prog->stats.shared_nodes++;
+
+  free(b.table);
+  free(b.uses);
+  return prog;
+}
+
+// Documented in .h file
+void FP_free(FusedProgram prog)
+{
+  if (prog == NULL)
+    return;
+
+  free(prog->nodes);
+  free(prog->outputs);
+  free(prog);
+}
+
+// Documented in .h file
+FPStats FP_stats(FusedProgram prog)
+{
+  return prog->stats;
+}
+
+// Documented in .h file
+int FP_var_count(FusedProgram prog)
+{
+  return prog->nvars;
+}
+
+// the evaluators, at each precision
+#define FP_REAL double
+#define FP_SUFFIX
+#define FP_APPLY ET_apply
+#define FP_APPLY_BLOCK(op, out, left, right, n) ET_apply_block(op, out, left, right, n, false)
+#include "expr_fused_eval.h"
+
+#define FP_REAL float
+#define FP_SUFFIX _f
+#include "expr_fused_eval.h"
+
+#define FP_REAL long double
+#define FP_SUFFIX _l
+#include "expr_fused_eval.h"
@@ -0,0 +1,147 @@
+/*
+ * expr_fused.h
+ *
+ * Fused evaluation of many related expressions over the same inputs.
+ * FP_compile merges a set of ExprTrees into one program, a DAG in
+ * which structurally identical subtrees, within one tree or across
+ * trees, become a single node. The program computes each such node
+ * once per row, and produces all of the outputs in the same pass.
+ *
+ * Two subtrees are identical if they have the same node types, the
+ * same constants (bit for bit) and the same variables. The operands
+ * of +, *, == and != are put in a canonical order first, so a + b
+ * and b + a are merged as well; this never changes a result, since
+ * those operators are exactly commutative.
+ *
+ * A program can be evaluated at three precisions: in double, like the
+ * rest of ExpressionWhizz, or in float or long double, with the _f and
+ * _l forms of FP_evaluate and FP_evaluate_batch. Those take their
+ * inputs and give their outputs in that type, round the constants to
+ * it, and do every operation in it, functions included (sqrtf, expl,
+ * ...). Float halves the memory each value takes and doubles the
+ * number of values to a vector register, for about 7 significant
+ * digits; long double is slower, and more accurate than ET_evaluate.
+ * FP_EVALUATE and FP_EVALUATE_BATCH choose the form from the type of
+ * the outputs.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#ifndef _EXPR_FUSED_H_
+#define _EXPR_FUSED_H_
+
+#include <stddef.h>
+
+#include "expr_tree.h"
+
+typedef struct _fused_program *FusedProgram;
+
+// How much FP_compile merged
+typedef struct
+{
+  int nexprs;        // number of expressions compiled
+  int tree_nodes;    // nodes in all of the trees together
+  int program_nodes; // distinct nodes left after merging
+  int shared_nodes;  // interior nodes used more than once, by other
+                     // nodes or as outputs
+  int registers;     // scratch blocks FP_evaluate_batch needs
+} FPStats;
+
+/*
+ * Compile a set of trees into one program. The trees are not
+ * referenced afterwards, but their variables must all belong to the
+ * same VarTable; the program's inputs are indexed like that table.
+ *
+ * Parameters:
+ *   trees    The trees; output i of the program is trees[i]
+ *   ntrees   Number of trees, at least 1
+ *
+ * Returns: The program, which the caller must FP_free
+ */
+FusedProgram FP_compile(const ExprTree *trees, int ntrees);
+
+/*
+ * Destroy a program
+ *
+ * Parameters:
+ *   prog     The program; may be NULL
+ *
+ * Returns: None
+ */
+void FP_free(FusedProgram prog);
+
+/*
+ * Return the sharing statistics of a program
+ *
+ * Parameters:
+ *   prog     The program
+ *
+ * Returns: The statistics
+ */
+FPStats FP_stats(FusedProgram prog);
+
+/*
+ * Return the number of inputs the program reads: one more than the
+ * largest variable index that any of its trees uses, or 0
+ *
+ * Parameters:
+ *   prog     The program
+ *
+ * Returns: The number of inputs
+ */
+int FP_var_count(FusedProgram prog);
+
+/*
+ * Evaluate every output of the program for one row of inputs. Each
+ * result is identical to ET_evaluate on the corresponding tree, with
+ * its variables set to vars.
+ *
+ * Parameters:
+ *   prog     The program
+ *   vars     The value of each variable, by index; may be NULL if
+ *            FP_var_count(prog) is 0
+ *   outs     Return space for one result per output
+ *
+ * Returns: None
+ */
+void FP_evaluate(FusedProgram prog, const double *vars, double *outs);
+
+/*
+ * Evaluate every output of the program for many rows of inputs, a
+ * block of rows at a time, like EI_evaluate_batch; conditionals are
+ * branchless. Each result is identical to that of FP_evaluate for
+ * the same row.
+ *
+ * Parameters:
+ *   prog     The program
+ *   vars     One column of nrows values per variable, by index;
+ *            columns the program does not use may be NULL
+ *   outs     One column of nrows results per output
+ *   nrows    Number of rows
+ *
+ * Returns: None
+ */
+void FP_evaluate_batch(FusedProgram prog, const double *const *vars, double *const *outs, size_t nrows);
+
+/*
+ * FP_evaluate and FP_evaluate_batch in float and in long double. The
+ * parameters are the same, of the other type. The results are those of
+ * the same operations in that type, so are not identical to
+ * ET_evaluate; each batch result is identical to that of the row form
+ * for the same row.
+ */
+void FP_evaluate_f(FusedProgram prog, const float *vars, float *outs);
+void FP_evaluate_batch_f(FusedProgram prog, const float *const *vars, float *const *outs, size_t nrows);
+void FP_evaluate_l(FusedProgram prog, const long double *vars, long double *outs);
+void FP_evaluate_batch_l(FusedProgram prog, const long double *const *vars, long double *const *outs,
+                         size_t nrows);
+
+// FP_evaluate or FP_evaluate_batch at the precision of outs: float,
+// double or long double
+#define FP_EVALUATE(prog, vars, outs) \
+  _Generic(*(outs), float: FP_evaluate_f, long double: FP_evaluate_l, default: FP_evaluate)(prog, vars, outs)
+#define FP_EVALUATE_BATCH(prog, vars, outs, nrows)                                             \
+  _Generic(**(outs), float: FP_evaluate_batch_f, long double: FP_evaluate_batch_l,              \
+           default: FP_evaluate_batch)(prog, vars, outs, nrows)
+
+#endif /* _EXPR_FUSED_H_ */
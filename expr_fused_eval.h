@@ -0,0 +1,278 @@
+/*
+ * expr_fused_eval.h
+ *
+ * The evaluators of fused programs, written once for any floating
+ * type. Not a header to include elsewhere: expr_fused.c includes it
+ * once per precision, having defined
+ *
+ *   FP_REAL         The type: float, double or long double
+ *   FP_SUFFIX       Appended to the name of each function made from
+ *                   this file: _f for float, nothing for double, _l
+ *                   for long double
+ *   FP_APPLY        Optionally, ET_apply and ET_apply_block for the
+ *   FP_APPLY_BLOCK  type; if they are not given, kernels of the same
+ *                   shape are made here, with the math functions of
+ *                   tgmath.h for the type
+ *
+ * and it undefines them all again at the end, ready for the next.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#if !defined(FP_REAL) || !defined(FP_SUFFIX)
+#error "expr_fused_eval.h is included only by expr_fused.c, with FP_REAL and FP_SUFFIX defined"
+#endif
+
+#define FP_CAT_(a, b) a##b
+#define FP_CAT(a, b) FP_CAT_(a, b)
+#define FP_NAME(name) FP_CAT(name, FP_SUFFIX)
+
+#ifndef FP_APPLY
+
+/*
+ * ET_apply at this precision; min and max treat NaN as fn_min and
+ * fn_max do
+ */
+static FP_REAL FP_NAME(apply)(ExprNodeType op, FP_REAL left, FP_REAL right)
+{
+  switch (op)
+  {
+  case OP_ADD:
+    return left + right;
+  case OP_SUB:
+    return left - right;
+  case OP_MUL:
+    return left * right;
+  case OP_DIV:
+    return left / right;
+  case OP_POWER:
+    return pow(left, right);
+  case UNARY_NEGATE:
+    return -left;
+  case OP_LT:
+    return left < right;
+  case OP_LE:
+    return left <= right;
+  case OP_GT:
+    return left > right;
+  case OP_GE:
+    return left >= right;
+  case OP_EQ:
+    return left == right;
+  case OP_NE:
+    return left != right;
+  case OP_SQRT:
+    return sqrt(left);
+  case OP_EXP:
+    return exp(left);
+  case OP_LOG:
+    return log(left);
+  case OP_SIN:
+    return sin(left);
+  case OP_COS:
+    return cos(left);
+  case OP_ABS:
+    return fabs(left);
+  case OP_MIN:
+    return left < right ? left : right;
+  case OP_MAX:
+    return left > right ? left : right;
+  default:
+    assert(0);
+  }
+  return 0;
+}
+
+#define FP_LOOP(expr)         \
+  for (int i = 0; i < n; i++) \
+    out[i] = (expr);          \
+  break
+
+/*
+ * ET_apply_block at this precision: one loop per operator, so that
+ * each loop can be vectorized
+ */
+static void FP_NAME(apply_block)(ExprNodeType op, FP_REAL *out, const FP_REAL *left, const FP_REAL *right, int n)
+{
+  switch (op)
+  {
+  case OP_ADD:
+    FP_LOOP(left[i] + right[i]);
+  case OP_SUB:
+    FP_LOOP(left[i] - right[i]);
+  case OP_MUL:
+    FP_LOOP(left[i] * right[i]);
+  case OP_DIV:
+    FP_LOOP(left[i] / right[i]);
+  case OP_POWER:
+    FP_LOOP(pow(left[i], right[i]));
+  case UNARY_NEGATE:
+    FP_LOOP(-left[i]);
+  case OP_LT:
+    FP_LOOP(left[i] < right[i]);
+  case OP_LE:
+    FP_LOOP(left[i] <= right[i]);
+  case OP_GT:
+    FP_LOOP(left[i] > right[i]);
+  case OP_GE:
+    FP_LOOP(left[i] >= right[i]);
+  case OP_EQ:
+    FP_LOOP(left[i] == right[i]);
+  case OP_NE:
+    FP_LOOP(left[i] != right[i]);
+  case OP_SQRT:
+    FP_LOOP(sqrt(left[i]));
+  case OP_EXP:
+    FP_LOOP(exp(left[i]));
+  case OP_LOG:
+    FP_LOOP(log(left[i]));
+  case OP_SIN:
+    FP_LOOP(sin(left[i]));
+  case OP_COS:
+    FP_LOOP(cos(left[i]));
+  case OP_ABS:
+    FP_LOOP(fabs(left[i]));
+  case OP_MIN:
+    FP_LOOP(left[i] < right[i] ? left[i] : right[i]);
+  case OP_MAX:
+    FP_LOOP(left[i] > right[i] ? left[i] : right[i]);
+  default:
+    assert(0);
+  }
+}
+
+#undef FP_LOOP
+
+#define FP_APPLY FP_NAME(apply)
+#define FP_APPLY_BLOCK FP_NAME(apply_block)
+
+#endif /* FP_APPLY */
+
+/*
+ * The value of node index i, once it has been computed
+ */
+static FP_REAL FP_NAME(operand)(FusedProgram prog, const FP_REAL *regs, const FP_REAL *vars, uint32_t i)
+{
+  const struct fp_node *node = &prog->nodes[i];
+
+  if (node->type == VALUE)
+    return node->value;
+
+  if (node->type == VARIABLE)
+  {
+    assert(vars != NULL);
+    return vars[node->var];
+  }
+
+  return regs[node->slot];
+}
+
+// Documented in .h file
+void FP_NAME(FP_evaluate)(FusedProgram prog, const FP_REAL *vars, FP_REAL *outs)
+{
+  TR_BEGIN("evaluate_fused");
+  FP_REAL *regs = malloc(prog->nregs * sizeof(FP_REAL));
+  assert(regs != NULL || prog->nregs == 0);
+
+  for (int i = 0; i < prog->nnodes; i++)
+  {
+    const struct fp_node *node = &prog->nodes[i];
+
+    if (node->type == VALUE || node->type == VARIABLE)
+      continue;
+
+    FP_REAL a = FP_NAME(operand)(prog, regs, vars, node->arg[0]);
+    FP_REAL b = (ET_arity(node->type) > 1) ? FP_NAME(operand)(prog, regs, vars, node->arg[1]) : 0;
+
+    if (node->type == OP_COND)
+      regs[node->slot] = (a != 0) ? b : FP_NAME(operand)(prog, regs, vars, node->arg[2]);
+    else
+      regs[node->slot] = FP_APPLY(node->type, a, b);
+  }
+
+  for (int i = 0; i < prog->noutputs; i++)
+    outs[i] = FP_NAME(operand)(prog, regs, vars, prog->outputs[i]);
+
+  free(regs);
+  TR_END("evaluate_fused");
+}
+
+// Documented in .h file
+void FP_NAME(FP_evaluate_batch)(FusedProgram prog, const FP_REAL *const *vars, FP_REAL *const *outs, size_t nrows)
+{
+  TR_BEGIN("evaluate_fused_batch");
+  FP_REAL *regs = malloc((size_t)prog->nregs * FP_BLOCK * sizeof(FP_REAL));
+  FP_REAL *consts = malloc((size_t)prog->nconsts * FP_BLOCK * sizeof(FP_REAL));
+  const FP_REAL **val = malloc(prog->nnodes * sizeof(FP_REAL *));
+
+  assert((regs != NULL || prog->nregs == 0) && (consts != NULL || prog->nconsts == 0) && val != NULL);
+
+  // the constants are the same for every block
+  for (int i = 0; i < prog->nnodes; i++)
+  {
+    const struct fp_node *node = &prog->nodes[i];
+
+    if (node->type != VALUE)
+      continue;
+
+    FP_REAL *block = consts + (size_t)node->slot * FP_BLOCK;
+    for (int j = 0; j < FP_BLOCK; j++)
+      block[j] = node->value;
+    val[i] = block;
+  }
+
+  for (size_t row = 0; row < nrows; row += FP_BLOCK)
+  {
+    int n = (nrows - row < FP_BLOCK) ? nrows - row : FP_BLOCK;
+
+    for (int i = 0; i < prog->nnodes; i++)
+    {
+      const struct fp_node *node = &prog->nodes[i];
+      FP_REAL *out = regs + (size_t)node->slot * FP_BLOCK;
+
+      if (node->type == VALUE)
+        continue;
+
+      if (node->type == VARIABLE)
+      {
+        assert(vars != NULL && vars[node->var] != NULL);
+        val[i] = vars[node->var] + row;
+        continue;
+      }
+
+      const FP_REAL *left = val[node->arg[0]];
+
+      if (node->type == OP_COND)
+      {
+        const FP_REAL *if_true = val[node->arg[1]];
+        const FP_REAL *if_false = val[node->arg[2]];
+
+        for (int j = 0; j < n; j++)
+          out[j] = (left[j] != 0) ? if_true[j] : if_false[j];
+      }
+      else
+      {
+        const FP_REAL *right = (ET_arity(node->type) > 1) ? val[node->arg[1]] : left;
+        FP_APPLY_BLOCK(node->type, out, left, right, n);
+      }
+
+      val[i] = out;
+    }
+
+    for (int k = 0; k < prog->noutputs; k++)
+      memcpy(outs[k] + row, val[prog->outputs[k]], n * sizeof(FP_REAL));
+  }
+
+  free(regs);
+  free(consts);
+  free(val);
+  TR_END("evaluate_fused_batch");
+}
+
+#undef FP_CAT_
+#undef FP_CAT
+#undef FP_NAME
+#undef FP_REAL
+#undef FP_SUFFIX
+#undef FP_APPLY
+#undef FP_APPLY_BLOCK
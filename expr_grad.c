@@ -0,0 +1,435 @@
+/*
+ * expr_grad.c
+ *
+ * Forward- and reverse-mode automatic differentiation of ExprTrees.
+ *
+ * Both modes split the tree into the parts that depend on a variable
+ * and the parts that do not. Constant parts are evaluated and carry
+ * no derivatives at all, so that, for instance, the partial of x ^ 2
+ * in the exponent (x^2 ln x, NaN for x < 0) is never computed into
+ * anything.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "expr_grad.h"
+#include "expr_tree_priv.h"
+#include "trace.h"
+
+/*
+ * The local partial derivatives of an interior node, given the values
+ * of its children and its own value
+ *
+ * Parameters:
+ *   type     The node type; not a leaf and not OP_COND
+ *   a, b     Values of the children (b is ignored for unary nodes)
+ *   v        ET_apply(type, a, b)
+ *   da, db   Return space for d v / d a and d v / d b
+ *
+ * Returns: None
+ */
+static void partials(ExprNodeType type, double a, double b, double v, double *da, double *db)
+{
+  *da = 0;
+  *db = 0;
+
+  switch (type)
+  {
+  case UNARY_NEGATE:
+    *da = -1;
+    break;
+  case OP_ADD:
+    *da = 1;
+    *db = 1;
+    break;
+  case OP_SUB:
+    *da = 1;
+    *db = -1;
+    break;
+  case OP_MUL:
+    *da = b;
+    *db = a;
+    break;
+  case OP_DIV:
+    *da = 1 / b;
+    *db = -v / b;
+    break;
+  case OP_POWER:
+    // the limits for b = 0 and v = 0, where the formulas give 0 * inf
+    *da = (b == 0) ? 0 : b * pow(a, b - 1);
+    *db = (v == 0) ? 0 : v * log(a);
+    break;
+  case OP_SQRT:
+    *da = 0.5 / v;
+    break;
+  case OP_EXP:
+    *da = v;
+    break;
+  case OP_LOG:
+    *da = 1 / a;
+    break;
+  case OP_SIN:
+    *da = cos(a);
+    break;
+  case OP_COS:
+    *da = -sin(a);
+    break;
+  case OP_ABS:
+    *da = (a > 0) - (a < 0);
+    break;
+  case OP_MIN:
+    *da = a < b;
+    *db = !(a < b);
+    break;
+  case OP_MAX:
+    *da = a > b;
+    *db = !(a > b);
+    break;
+  default:
+    // comparisons are piecewise constant
+    break;
+  }
+}
+
+/*
+ * State of one forward-mode evaluation
+ */
+struct forward
+{
+  int nvars;
+  double *scratch; // nvars doubles per level of the tree
+};
+
+/*
+ * Apply an operator in forward mode, to the values and partials of
+ * its children
+ *
+ * Parameters:
+ *   type       The operator; not a leaf and not OP_COND
+ *   fw         The evaluation state
+ *   a, b       Values of the children (b is ignored for unary operators)
+ *   tan, rtan  Partials of the children; tan is overwritten with those
+ *              of the result
+ *   lvarying, rvarying  Whether each child depends on any variable
+ *   varying    Return space: whether the result does
+ *
+ * Returns: The value of the result
+ */
+static double forward_step(ExprNodeType type, const struct forward *fw, double a, double *tan, bool lvarying,
+                           double b, const double *rtan, bool rvarying, bool *varying)
+{
+  double v = ET_apply(type, a, b);
+  double da, db;
+
+  partials(type, a, b, v, &da, &db);
+
+  bool use_left = lvarying && da != 0;
+  bool use_right = rvarying && db != 0;
+
+  *varying = use_left || use_right;
+
+  if (use_left && use_right)
+    for (int i = 0; i < fw->nvars; i++)
+      tan[i] = da * tan[i] + db * rtan[i];
+  else if (use_left)
+    for (int i = 0; i < fw->nvars; i++)
+      tan[i] = da * tan[i];
+  else if (use_right)
+    for (int i = 0; i < fw->nvars; i++)
+      tan[i] = db * rtan[i];
+
+  return v;
+}
+
+static double forward(ExprTree tree, const struct forward *fw, int level, double *tan, bool *varying);
+
+/*
+ * Evaluate a range of the operands of a chain in forward mode, as the
+ * binary nodes that combine them in the order of ET_split; the
+ * parameters are those of forward
+ */
+static double forward_range(ExprTree tree, int first, int count, const struct forward *fw, int level,
+                            double *tan, bool *varying)
+{
+  if (count == 1)
+    return forward(tree->n.list.ops[first], fw, level, tan, varying);
+
+  int half = ET_split(count);
+  double *rtan = fw->scratch + (size_t)level * fw->nvars;
+  bool lvarying, rvarying;
+  double a = forward_range(tree, first, half, fw, level + 1, tan, &lvarying);
+  double b = forward_range(tree, first + half, count - half, fw, level + 1, rtan, &rvarying);
+
+  return forward_step(ET_chain_op(tree->type), fw, a, tan, lvarying, b, rtan, rvarying, varying);
+}
+
+/*
+ * Evaluate tree in forward mode
+ *
+ * Parameters:
+ *   tree     The tree
+ *   fw       The evaluation state
+ *   level    Depth of tree in the whole tree, from 0; the right child
+ *            of tree keeps its partials in scratch level level
+ *   tan      Return space for the partials of tree, filled in only
+ *            if it turns out to be varying
+ *   varying  Return space: whether tree depends on any variable
+ *
+ * Returns: The value of tree
+ */
+static double forward(ExprTree tree, const struct forward *fw, int level, double *tan, bool *varying)
+{
+  switch (tree->type)
+  {
+  case VALUE:
+    *varying = false;
+    return tree->n.value;
+  case VARIABLE:
+    assert(tree->n.var->index < fw->nvars);
+    memset(tan, 0, fw->nvars * sizeof(double));
+    tan[tree->n.var->index] = 1;
+    *varying = true;
+    return tree->n.var->value;
+  case OP_COND:
+    // only the branch that is taken gets evaluated
+    if (ET_evaluate(tree->n.child[COND_TEST]) != 0)
+      return forward(tree->n.child[COND_TRUE], fw, level, tan, varying);
+    return forward(tree->n.child[COND_FALSE], fw, level, tan, varying);
+  default:
+    break;
+  }
+
+  if (ET_is_chain(tree))
+    return forward_range(tree, 0, tree->n.list.count, fw, level, tan, varying);
+
+  double *rtan = fw->scratch + (size_t)level * fw->nvars;
+  bool lvarying, rvarying = false;
+  double a = forward(tree->n.child[LEFT], fw, level + 1, tan, &lvarying);
+  double b = (ET_arity(tree->type) == 1) ? 0 : forward(tree->n.child[RIGHT], fw, level + 1, rtan, &rvarying);
+
+  return forward_step(tree->type, fw, a, tan, lvarying, b, rtan, rvarying, varying);
+}
+
+/*
+ * One entry of the reverse-mode tape: a node that depends on a
+ * variable. Entries are in post-order, so each entry's arguments
+ * come before it.
+ */
+struct tape_entry
+{
+  int var;           // the variable index, for a VARIABLE leaf; -1 otherwise
+  int arg[2];        // tape entries of the children, -1 for constant ones
+  double partial[2]; // d entry / d arg
+};
+
+struct tape
+{
+  struct tape_entry *entries;
+  int count;
+};
+
+/*
+ * Apply an operator in the forward sweep of reverse mode, appending an
+ * entry for the result to the tape if it depends on a variable
+ *
+ * Parameters:
+ *   type         The operator; not a leaf and not OP_COND
+ *   tape         The tape
+ *   a, b         Values of the children (b is ignored for unary operators)
+ *   left, right  Tape entries of the children, -1 for constant ones
+ *   index        Return space for the tape entry of the result, or -1
+ *
+ * Returns: The value of the result
+ */
+static double record_step(ExprNodeType type, struct tape *tape, double a, int left, double b, int right,
+                          int *index)
+{
+  double v = ET_apply(type, a, b);
+  double da, db;
+
+  partials(type, a, b, v, &da, &db);
+
+  if (da == 0)
+    left = -1;
+  if (db == 0)
+    right = -1;
+
+  if (left < 0 && right < 0)
+  {
+    *index = -1;
+    return v;
+  }
+
+  tape->entries[tape->count] = (struct tape_entry){-1, {left, right}, {da, db}};
+  *index = tape->count++;
+  return v;
+}
+
+static double record(ExprTree tree, struct tape *tape, int *index);
+
+/*
+ * The forward sweep of reverse mode for a range of the operands of a
+ * chain, as the binary nodes that combine them in the order of
+ * ET_split; the parameters are those of record
+ */
+static double record_range(ExprTree tree, int first, int count, struct tape *tape, int *index)
+{
+  if (count == 1)
+    return record(tree->n.list.ops[first], tape, index);
+
+  int half = ET_split(count);
+  int left, right;
+  double a = record_range(tree, first, half, tape, &left);
+  double b = record_range(tree, first + half, count - half, tape, &right);
+
+  return record_step(ET_chain_op(tree->type), tape, a, left, b, right, index);
+}
+
+/*
+ * The forward sweep of reverse mode: evaluate tree, appending an entry
+ * to the tape for every node that depends on a variable
+ *
+ * Parameters:
+ *   tree     The tree
+ *   tape     The tape
+ *   index    Return space for the tape entry of tree, or -1 if it is
+ *            constant
+ *
+ * Returns: The value of tree
+ */
+static double record(ExprTree tree, struct tape *tape, int *index)
+{
+  switch (tree->type)
+  {
+  case VALUE:
+    *index = -1;
+    return tree->n.value;
+  case VARIABLE:
+    tape->entries[tape->count] = (struct tape_entry){tree->n.var->index, {-1, -1}, {0, 0}};
+    *index = tape->count++;
+    return tree->n.var->value;
+  case OP_COND:
+    // the node is its taken branch, so it needs no entry of its own
+    if (ET_evaluate(tree->n.child[COND_TEST]) != 0)
+      return record(tree->n.child[COND_TRUE], tape, index);
+    return record(tree->n.child[COND_FALSE], tape, index);
+  default:
+    break;
+  }
+
+  if (ET_is_chain(tree))
+    return record_range(tree, 0, tree->n.list.count, tape, index);
+
+  int left, right = -1;
+  double a = record(tree->n.child[LEFT], tape, &left);
+  double b = (ET_arity(tree->type) == 1) ? 0 : record(tree->n.child[RIGHT], tape, &right);
+
+  return record_step(tree->type, tape, a, left, b, right, index);
+}
+
+/*
+ * The reverse sweep: propagate d root / d entry from root back to the
+ * variables, adding each variable's share into grad
+ */
+static void sweep_back(const struct tape *tape, int root, int nvars, double *grad)
+{
+  double *adjoint = calloc(tape->count, sizeof(double));
+  assert(adjoint != NULL);
+
+  adjoint[root] = 1;
+
+  for (int i = root; i >= 0; i--)
+  {
+    const struct tape_entry *entry = &tape->entries[i];
+
+    if (adjoint[i] == 0)
+      continue;
+
+    if (entry->var >= 0)
+    {
+      assert(entry->var < nvars);
+      grad[entry->var] += adjoint[i];
+    }
+
+    for (int k = 0; k < 2; k++)
+      if (entry->arg[k] >= 0)
+        adjoint[entry->arg[k]] += adjoint[i] * entry->partial[k];
+  }
+
+  free(adjoint);
+}
+
+/*
+ * The depth of tree with its chains expanded into binary nodes, which
+ * is the number of levels of scratch that forward mode needs
+ */
+static int levels(ExprTree tree)
+{
+  int nchildren = ET_is_chain(tree) ? tree->n.list.count : ET_arity(tree->type);
+  ExprTree *children = ET_is_chain(tree) ? tree->n.list.ops : tree->n.child;
+  int depth = 0;
+
+  for (int i = 0; i < nchildren; i++)
+  {
+    int child = levels(children[i]);
+    if (child > depth)
+      depth = child;
+  }
+
+  // the halves of a chain of count operands are nested ceil(log2(count)) deep
+  if (ET_is_chain(tree))
+    return depth + 32 - __builtin_clz(tree->n.list.count - 1);
+
+  return 1 + depth;
+}
+
+// Documented in .h file
+double ET_evaluate_grad(ExprTree tree, VarTable vars, double *grad, GradMode mode)
+{
+  int nvars = VT_count(vars);
+  double value;
+
+  memset(grad, 0, nvars * sizeof(double));
+
+  if (tree == NULL)
+    return 0;
+
+  TR_BEGIN("evaluate_grad");
+  if (mode == ET_GRAD_FORWARD)
+  {
+    struct forward fw = {nvars, malloc((size_t)levels(tree) * nvars * sizeof(double))};
+    bool varying;
+
+    assert(fw.scratch != NULL || nvars == 0);
+
+    value = forward(tree, &fw, 0, grad, &varying);
+
+    if (!varying)
+      memset(grad, 0, nvars * sizeof(double));
+
+    free(fw.scratch);
+  }
+  else
+  {
+    struct tape tape = {malloc(ET_count(tree) * sizeof(struct tape_entry)), 0};
+    int root;
+
+    assert(tape.entries != NULL);
+
+    value = record(tree, &tape, &root);
+
+    if (root >= 0)
+      sweep_back(&tape, root, nvars, grad);
+
+    free(tape.entries);
+  }
+  TR_END("evaluate_grad");
+
+  return value;
+}
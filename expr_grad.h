@@ -0,0 +1,49 @@
+/*
+ * expr_grad.h
+ *
+ * Automatic differentiation of ExprTrees: the value of an expression
+ * together with its partial derivatives with respect to every
+ * variable, in one evaluation instead of one per variable.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#ifndef _EXPR_GRAD_H_
+#define _EXPR_GRAD_H_
+
+#include "expr_tree.h"
+#include "vars.h"
+
+// How ET_evaluate_grad computes the derivatives
+typedef enum
+{
+  ET_GRAD_FORWARD, // one sweep, carrying all partials up the tree with
+                   // each value; time grows with nodes * variables
+  ET_GRAD_REVERSE  // a sweep that records a tape of local partials,
+                   // then one back along it; time grows with nodes
+} GradMode;
+
+/*
+ * Evaluate an ExprTree and its gradient. Only the branch of an
+ * OP_COND that is taken is evaluated, and it alone contributes to
+ * the gradient; comparisons have derivative 0, and min and max take
+ * the derivative of the argument they return. At points where a
+ * derivative does not exist, the result is one of the one-sided
+ * derivatives, or inf or NaN: sqrt(x) at 0 gives inf, abs(x) at 0
+ * gives 0, and x ^ y with x < 0 gives NaN for the partial in y.
+ *
+ * The two modes agree up to rounding; the value is bit-for-bit
+ * identical to ET_evaluate(tree) in both.
+ *
+ * Parameters:
+ *   tree     The tree, whose variables must all belong to vars
+ *   vars     The variables, at their current values
+ *   grad     Return space for VT_count(vars) partial derivatives, by
+ *            variable index; 0 for variables the tree does not use
+ *   mode     How to compute them
+ *
+ * Returns: The value of the tree
+ */
+double ET_evaluate_grad(ExprTree tree, VarTable vars, double *grad, GradMode mode);
+
+#endif /* _EXPR_GRAD_H_ */
@@ -0,0 +1,865 @@
+/*
+ * expr_image.c
+ *
+ * Serialization of ExprTrees into flat, position-independent images,
+ * and in-place evaluation of those images
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "expr_image.h"
+#include "expr_tree_priv.h"
+#include "fastmath.h"
+#include "trace.h"
+
+#define EI_MAGIC 0x47495745u // "EWIG", read as a little-endian word
+#define EI_BYTE_ORDER_MARK 0x0102
+
+// bits of _ei_expr.flags
+#define EI_FLAG_APPROX 0x1u
+#define EI_KNOWN_FLAGS EI_FLAG_APPROX
+
+// rows evaluated together by EI_evaluate_batch
+#define EI_BLOCK 256
+
+struct _ei_header
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t byte_order;
+  uint32_t nexprs;
+  uint32_t nnodes;
+  uint32_t nconsts;
+  uint32_t nvars;
+  uint32_t names_size; // bytes of variable names, terminators included
+  uint32_t reserved;
+  uint64_t total_size;
+  uint64_t checksum; // of the bytes following the header
+};
+
+struct _ei_expr
+{
+  uint32_t root;
+  uint32_t flags;
+  uint32_t first; // the expression's nodes are first .. root
+  uint32_t stack; // operand stack depth needed to evaluate them in order
+};
+
+struct _ei_node
+{
+  uint32_t type; // an ExprNodeType
+  uint32_t a;    // VALUE: index into consts; VARIABLE: variable index;
+                 // otherwise the first child
+  uint32_t b;    // the second child, for binary operators and OP_COND
+  uint32_t c;    // the third child, for OP_COND
+};
+
+/*
+ * Section offsets for an image with the given counts. Computed in 64
+ * bits, so that hostile counts in ET_load cannot overflow.
+ */
+struct ei_layout
+{
+  uint64_t exprs_off;
+  uint64_t nodes_off;
+  uint64_t consts_off;
+  uint64_t vars_off;  // offset of each name within the names
+  uint64_t names_off;
+  uint64_t total_size;
+};
+
+static struct ei_layout ei_layout(uint64_t nexprs, uint64_t nnodes, uint64_t nconsts,
+                                  uint64_t nvars, uint64_t names_size)
+{
+  struct ei_layout lo;
+
+  lo.exprs_off = sizeof(struct _ei_header);
+  lo.nodes_off = lo.exprs_off + nexprs * sizeof(struct _ei_expr);
+  lo.consts_off = lo.nodes_off + nnodes * sizeof(struct _ei_node);
+  lo.vars_off = lo.consts_off + nconsts * sizeof(double);
+  lo.names_off = lo.vars_off + nvars * sizeof(uint32_t);
+  lo.total_size = (lo.names_off + names_size + 7) & ~(uint64_t)7;
+
+  return lo;
+}
+
+static struct ei_layout image_layout(ExprImage image)
+{
+  return ei_layout(image->nexprs, image->nnodes, image->nconsts, image->nvars, image->names_size);
+}
+
+static const struct _ei_expr *ei_exprs(ExprImage image)
+{
+  return (const struct _ei_expr *)((const char *)image + sizeof(struct _ei_header));
+}
+
+static const struct _ei_node *ei_nodes(ExprImage image)
+{
+  return (const struct _ei_node *)((const char *)image + image_layout(image).nodes_off);
+}
+
+static const double *ei_consts(ExprImage image)
+{
+  return (const double *)((const char *)image + image_layout(image).consts_off);
+}
+
+/*
+ * Checksum a run of 8-byte words. Four independent lanes keep the
+ * multiplies from forming one long dependency chain, so validating a
+ * large image runs at several bytes per cycle.
+ *
+ * Parameters:
+ *   data     Start of the data; must be 8-byte aligned
+ *   nwords   Number of 64-bit words
+ *
+ * Returns: The checksum
+ */
+static uint64_t ei_checksum(const void *data, size_t nwords)
+{
+  const unsigned char *p = data;
+  uint64_t lane[4] = {0x9E3779B97F4A7C15ull, 0xC2B2AE3D27D4EB4Full, 0x165667B19E3779F9ull, 0x27D4EB2F165667C5ull};
+
+  for (size_t i = 0; i < nwords; i++)
+  {
+    uint64_t word;
+    memcpy(&word, p + 8 * i, sizeof(word));
+
+    uint64_t h = (lane[i & 3] ^ word) * 0xFF51AFD7ED558CCDull;
+    lane[i & 3] = h ^ (h >> 29);
+  }
+
+  uint64_t h = nwords;
+  for (int i = 0; i < 4; i++)
+  {
+    h = (h ^ lane[i]) * 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 32;
+  }
+
+  return h;
+}
+
+/*
+ * A constant pool under construction: the distinct values seen so
+ * far, plus an open-addressing hash from bit pattern to pool index
+ */
+struct const_pool
+{
+  double *values;
+  uint32_t count;
+  uint32_t *slots; // pool index + 1; 0 marks an empty slot
+  uint32_t nslots; // always a power of two
+};
+
+static uint32_t hash_double(double value)
+{
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+
+  bits *= 0x9E3779B97F4A7C15ull;
+  return (uint32_t)(bits >> 32);
+}
+
+static void pool_init(struct const_pool *cp)
+{
+  cp->count = 0;
+  cp->nslots = 64;
+  cp->values = malloc(cp->nslots / 2 * sizeof(double));
+  cp->slots = calloc(cp->nslots, sizeof(uint32_t));
+  assert(cp->values != NULL && cp->slots != NULL);
+}
+
+static void pool_destroy(struct const_pool *cp)
+{
+  free(cp->values);
+  free(cp->slots);
+}
+
+/*
+ * Return the pool index of value, adding it to the pool if it is not
+ * there yet. Values are matched by bit pattern, so 0 and -0 (and
+ * different NaNs) are kept apart.
+ */
+static uint32_t pool_intern(struct const_pool *cp, double value)
+{
+  uint32_t mask = cp->nslots - 1;
+
+  for (uint32_t s = hash_double(value) & mask;; s = (s + 1) & mask)
+  {
+    if (cp->slots[s] == 0)
+    {
+      // not found; keep the table at most half full
+      if (2 * (cp->count + 1) > cp->nslots)
+      {
+        free(cp->slots);
+        cp->nslots *= 2;
+        cp->slots = calloc(cp->nslots, sizeof(uint32_t));
+        cp->values = realloc(cp->values, cp->nslots / 2 * sizeof(double));
+        assert(cp->slots != NULL && cp->values != NULL);
+
+        for (uint32_t i = 0; i < cp->count; i++)
+        {
+          uint32_t t = hash_double(cp->values[i]) & (cp->nslots - 1);
+          while (cp->slots[t] != 0)
+            t = (t + 1) & (cp->nslots - 1);
+          cp->slots[t] = i + 1;
+        }
+
+        return pool_intern(cp, value);
+      }
+
+      cp->values[cp->count] = value;
+      cp->slots[s] = ++cp->count;
+      return cp->count - 1;
+    }
+
+    if (memcmp(&cp->values[cp->slots[s] - 1], &value, sizeof(double)) == 0)
+      return cp->slots[s] - 1;
+  }
+}
+
+/*
+ * The state of ET_serialize: the constant pool, and the variables
+ * seen so far, by index
+ */
+struct serializer
+{
+  struct const_pool cp;
+  Variable *vars;
+  uint32_t nvars;
+  uint64_t names_size;
+  bool conflict; // two different variables with the same index
+};
+
+/*
+ * Record a variable; the image keeps its index
+ */
+static void add_variable(struct serializer *ser, Variable var)
+{
+  if ((uint32_t)var->index >= ser->nvars)
+  {
+    ser->vars = realloc(ser->vars, (var->index + 1) * sizeof(Variable));
+    assert(ser->vars != NULL);
+
+    memset(ser->vars + ser->nvars, 0, (var->index + 1 - ser->nvars) * sizeof(Variable));
+    ser->nvars = var->index + 1;
+  }
+
+  if (ser->vars[var->index] == NULL)
+  {
+    ser->vars[var->index] = var;
+    ser->names_size += strlen(var->name);
+  }
+  else if (ser->vars[var->index] != var)
+    ser->conflict = true;
+}
+
+/*
+ * First pass of ET_serialize: count the nodes of tree and collect its
+ * constants and variables
+ */
+static uint64_t collect(ExprTree tree, struct serializer *ser)
+{
+  if (tree->type == VALUE)
+  {
+    pool_intern(&ser->cp, tree->n.value);
+    return 1;
+  }
+
+  if (tree->type == VARIABLE)
+  {
+    add_variable(ser, tree->n.var);
+    return 1;
+  }
+
+  // a chain is written as the count - 1 binary nodes it stands for
+  if (ET_is_chain(tree))
+  {
+    uint64_t count = tree->n.list.count - 1;
+
+    for (int i = 0; i < tree->n.list.count; i++)
+      count += collect(tree->n.list.ops[i], ser);
+    return count;
+  }
+
+  uint64_t count = 1;
+
+  for (int i = 0; i < ET_arity(tree->type); i++)
+    count += collect(tree->n.child[i], ser);
+
+  return count;
+}
+
+static uint32_t emit(ExprTree tree, struct _ei_node *nodes, uint32_t *next, struct const_pool *cp,
+                     uint32_t depth, uint32_t *stack);
+
+/*
+ * Like emit, for a range of the operands of a chain: writes the binary
+ * nodes that combine them in the order of ET_split
+ *
+ * Returns: The index of the node for the combined range
+ */
+static uint32_t emit_range(ExprTree tree, int first, int count, struct _ei_node *nodes, uint32_t *next,
+                           struct const_pool *cp, uint32_t depth, uint32_t *stack)
+{
+  if (count == 1)
+    return emit(tree->n.list.ops[first], nodes, next, cp, depth, stack);
+
+  int half = ET_split(count);
+  struct _ei_node node = {ET_chain_op(tree->type), 0, 0, 0};
+
+  node.a = emit_range(tree, first, half, nodes, next, cp, depth, stack);
+  node.b = emit_range(tree, first + half, count - half, nodes, next, cp, depth + 1, stack);
+
+  if (depth + 2 > *stack)
+    *stack = depth + 2;
+
+  nodes[*next] = node;
+  return (*next)++;
+}
+
+/*
+ * Second pass of ET_serialize: write tree into nodes in post-order
+ *
+ * Parameters:
+ *   tree     The tree
+ *   nodes    The node section of the image
+ *   next     Index of the next free node; advanced past the nodes written
+ *   cp       The constant pool built by collect
+ *   depth    Number of operands already on the stack when tree is evaluated
+ *   stack    Return space for the deepest the stack gets; only ever raised
+ *
+ * Returns: The index of the node for the root of tree
+ */
+static uint32_t emit(ExprTree tree, struct _ei_node *nodes, uint32_t *next, struct const_pool *cp,
+                     uint32_t depth, uint32_t *stack)
+{
+  if (ET_is_chain(tree))
+    return emit_range(tree, 0, tree->n.list.count, nodes, next, cp, depth, stack);
+
+  struct _ei_node node = {tree->type, 0, 0, 0};
+  uint32_t *child[3] = {&node.a, &node.b, &node.c};
+  int arity = ET_arity(tree->type);
+
+  if (tree->type == VALUE)
+    node.a = pool_intern(cp, tree->n.value);
+  else if (tree->type == VARIABLE)
+    node.a = tree->n.var->index;
+
+  // the operands are pushed one after the other, and replaced by the result
+  for (int i = 0; i < arity; i++)
+    *child[i] = emit(tree->n.child[i], nodes, next, cp, depth + i, stack);
+
+  if (depth + (arity > 0 ? arity : 1) > *stack)
+    *stack = depth + (arity > 0 ? arity : 1);
+
+  nodes[*next] = node;
+  return (*next)++;
+}
+
+// Documented in .h file
+size_t ET_serialize(const ExprTree *trees, int ntrees, void *buf, size_t buf_sz)
+{
+  struct serializer ser = {.vars = NULL, .nvars = 0, .names_size = 0, .conflict = false};
+  uint64_t nnodes = 0;
+
+  for (int i = 0; i < ntrees; i++)
+    if (trees[i] == NULL)
+      return 0;
+
+  pool_init(&ser.cp);
+
+  for (int i = 0; i < ntrees; i++)
+    nnodes += collect(trees[i], &ser);
+
+  // every name is followed by a \0, including the empty names of
+  // indices that no tree uses
+  uint64_t names_size = ser.names_size + ser.nvars;
+  struct ei_layout lo = ei_layout(ntrees, nnodes, ser.cp.count, ser.nvars, names_size);
+
+  if (ser.conflict || nnodes > UINT32_MAX || names_size > UINT32_MAX)
+    lo.total_size = 0;
+
+  if (lo.total_size == 0 || lo.total_size > buf_sz || buf == NULL)
+  {
+    pool_destroy(&ser.cp);
+    free(ser.vars);
+    return lo.total_size;
+  }
+
+  assert(((uintptr_t)buf & 7) == 0);
+
+  // zero everything first, so that padding is deterministic
+  memset(buf, 0, lo.total_size);
+
+  struct _ei_header *hdr = buf;
+  struct _ei_expr *exprs = (struct _ei_expr *)((char *)buf + lo.exprs_off);
+  struct _ei_node *nodes = (struct _ei_node *)((char *)buf + lo.nodes_off);
+  double *consts = (double *)((char *)buf + lo.consts_off);
+  uint32_t *var_names = (uint32_t *)((char *)buf + lo.vars_off);
+  char *names = (char *)buf + lo.names_off;
+  uint32_t next = 0;
+
+  for (int i = 0; i < ntrees; i++)
+  {
+    exprs[i].first = next;
+    exprs[i].root = emit(trees[i], nodes, &next, &ser.cp, 0, &exprs[i].stack);
+  }
+
+  memcpy(consts, ser.cp.values, ser.cp.count * sizeof(double));
+
+  for (uint32_t i = 0, off = 0; i < ser.nvars; i++)
+  {
+    const char *name = (ser.vars[i] != NULL) ? ser.vars[i]->name : "";
+
+    var_names[i] = off;
+    strcpy(names + off, name);
+    off += strlen(name) + 1;
+  }
+
+  hdr->magic = EI_MAGIC;
+  hdr->version = EI_VERSION;
+  hdr->byte_order = EI_BYTE_ORDER_MARK;
+  hdr->nexprs = ntrees;
+  hdr->nnodes = nnodes;
+  hdr->nconsts = ser.cp.count;
+  hdr->nvars = ser.nvars;
+  hdr->names_size = names_size;
+  hdr->total_size = lo.total_size;
+  hdr->checksum = ei_checksum(exprs, (lo.total_size - lo.exprs_off) / 8);
+
+  pool_destroy(&ser.cp);
+  free(ser.vars);
+  return lo.total_size;
+}
+
+/*
+ * Check that one node refers only to things that exist. Children
+ * must precede their parent, which rules out cycles and bounds the
+ * recursion in EI_evaluate.
+ */
+static bool valid_node(const struct _ei_node *node, uint32_t index, ExprImage hdr)
+{
+  switch (node->type)
+  {
+  case VALUE:
+    return node->a < hdr->nconsts;
+  case VARIABLE:
+    return node->a < hdr->nvars;
+  case UNARY_NEGATE:
+  case OP_SQRT:
+  case OP_EXP:
+  case OP_LOG:
+  case OP_SIN:
+  case OP_COS:
+  case OP_ABS:
+    return node->a < index;
+  case OP_ADD:
+  case OP_SUB:
+  case OP_MUL:
+  case OP_DIV:
+  case OP_POWER:
+  case OP_LT:
+  case OP_LE:
+  case OP_GT:
+  case OP_GE:
+  case OP_EQ:
+  case OP_NE:
+  case OP_MIN:
+  case OP_MAX:
+    return node->a < index && node->b < index;
+  case OP_COND:
+    return node->a < index && node->b < index && node->c < index;
+  default:
+    return false;
+  }
+}
+
+/*
+ * Check one expression: its nodes must form a valid program for the
+ * operand stack of EI_evaluate_batch, never taking more operands than
+ * have been pushed and never growing deeper than expr->stack
+ */
+static bool valid_expr(const struct _ei_expr *expr, const struct _ei_node *nodes, uint32_t nnodes)
+{
+  uint32_t depth = 0;
+
+  if (expr->root >= nnodes || expr->first > expr->root || (expr->flags & ~EI_KNOWN_FLAGS) != 0)
+    return false;
+
+  for (uint32_t i = expr->first; i <= expr->root; i++)
+  {
+    uint32_t arity = ET_arity(nodes[i].type);
+
+    if (depth < arity || depth + (arity > 0 ? 0 : 1) > expr->stack)
+      return false;
+
+    depth = depth - arity + 1;
+  }
+
+  return depth == 1;
+}
+
+// Documented in .h file
+ExprImage ET_load(const void *buf, size_t buf_sz, char *errmsg, size_t errmsg_sz)
+{
+  const struct _ei_header *hdr = buf;
+
+  if (buf == NULL || ((uintptr_t)buf & 7) != 0)
+  {
+    snprintf(errmsg, errmsg_sz, "Image must be 8-byte aligned");
+    return NULL;
+  }
+
+  if (buf_sz < sizeof(struct _ei_header) || hdr->magic != EI_MAGIC)
+  {
+    snprintf(errmsg, errmsg_sz, "Not an ExpressionWhizz image");
+    return NULL;
+  }
+
+  if (hdr->byte_order != EI_BYTE_ORDER_MARK)
+  {
+    snprintf(errmsg, errmsg_sz, "Image byte order does not match this machine");
+    return NULL;
+  }
+
+  if (hdr->version != EI_VERSION)
+  {
+    snprintf(errmsg, errmsg_sz, "Unsupported image version %d", hdr->version);
+    return NULL;
+  }
+
+  struct ei_layout lo = image_layout(hdr);
+
+  if (hdr->total_size != lo.total_size || lo.total_size > buf_sz)
+  {
+    snprintf(errmsg, errmsg_sz, "Image truncated or corrupt");
+    return NULL;
+  }
+
+  if (ei_checksum((const char *)buf + lo.exprs_off, (lo.total_size - lo.exprs_off) / 8) != hdr->checksum)
+  {
+    snprintf(errmsg, errmsg_sz, "Image checksum mismatch");
+    return NULL;
+  }
+
+  const struct _ei_node *nodes = ei_nodes(hdr);
+  for (uint32_t i = 0; i < hdr->nnodes; i++)
+  {
+    if (!valid_node(&nodes[i], i, hdr))
+    {
+      snprintf(errmsg, errmsg_sz, "Image node %u is invalid", i);
+      return NULL;
+    }
+  }
+
+  const struct _ei_expr *exprs = ei_exprs(hdr);
+  for (uint32_t i = 0; i < hdr->nexprs; i++)
+  {
+    if (!valid_expr(&exprs[i], nodes, hdr->nnodes))
+    {
+      snprintf(errmsg, errmsg_sz, "Image expression %u is invalid", i);
+      return NULL;
+    }
+  }
+
+  // every name must start inside the names, which must end in a \0
+  const uint32_t *var_names = (const uint32_t *)((const char *)buf + lo.vars_off);
+  const char *names = (const char *)buf + lo.names_off;
+  for (uint32_t i = 0; i < hdr->nvars; i++)
+  {
+    if (var_names[i] >= hdr->names_size || names[hdr->names_size - 1] != '\0')
+    {
+      snprintf(errmsg, errmsg_sz, "Image variable %u is invalid", i);
+      return NULL;
+    }
+  }
+
+  return hdr;
+}
+
+// Documented in .h file
+ExprImage EI_open(const char *path, char *errmsg, size_t errmsg_sz)
+{
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &st) < 0)
+  {
+    snprintf(errmsg, errmsg_sz, "Cannot open %s", path);
+    if (fd >= 0)
+      close(fd);
+    return NULL;
+  }
+
+  void *map = (st.st_size > 0) ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+
+  if (map == MAP_FAILED)
+  {
+    snprintf(errmsg, errmsg_sz, "Cannot map %s", path);
+    return NULL;
+  }
+
+  ExprImage image = ET_load(map, st.st_size, errmsg, errmsg_sz);
+
+  // EI_close unmaps exactly the image, so there must be nothing after it
+  if (image != NULL && image->total_size != (uint64_t)st.st_size)
+  {
+    snprintf(errmsg, errmsg_sz, "Trailing data after image in %s", path);
+    image = NULL;
+  }
+
+  if (image == NULL)
+    munmap(map, st.st_size);
+
+  return image;
+}
+
+// Documented in .h file
+void EI_close(ExprImage image)
+{
+  if (image != NULL)
+    munmap((void *)image, image->total_size);
+}
+
+// Documented in .h file
+size_t EI_size(ExprImage image)
+{
+  return image->total_size;
+}
+
+// Documented in .h file
+int EI_count(ExprImage image)
+{
+  return image->nexprs;
+}
+
+// Documented in .h file
+int EI_var_count(ExprImage image)
+{
+  return image->nvars;
+}
+
+// Documented in .h file
+const char *EI_var_name(ExprImage image, int index)
+{
+  struct ei_layout lo = image_layout(image);
+
+  assert(index >= 0 && (uint32_t)index < image->nvars);
+
+  const uint32_t *var_names = (const uint32_t *)((const char *)image + lo.vars_off);
+  return (const char *)image + lo.names_off + var_names[index];
+}
+
+// Documented in .h file
+void EI_set_mode(void *buf, int index, EvalMode mode)
+{
+  struct _ei_header *hdr = buf;
+  struct _ei_expr *expr = (struct _ei_expr *)ei_exprs(hdr) + index;
+
+  assert(index >= 0 && (uint32_t)index < hdr->nexprs);
+
+  if (mode == EI_APPROX)
+    expr->flags |= EI_FLAG_APPROX;
+  else
+    expr->flags &= ~EI_FLAG_APPROX;
+
+  hdr->checksum = ei_checksum(ei_exprs(hdr), (hdr->total_size - sizeof(struct _ei_header)) / 8);
+}
+
+// Documented in .h file
+EvalMode EI_mode(ExprImage image, int index)
+{
+  assert(index >= 0 && (uint32_t)index < image->nexprs);
+
+  return (ei_exprs(image)[index].flags & EI_FLAG_APPROX) ? EI_APPROX : EI_EXACT;
+}
+
+/*
+ * The values needed to evaluate the nodes of one image
+ */
+struct eval_ctx
+{
+  const struct _ei_node *nodes;
+  const double *consts;
+  const double *vars;
+  bool approx;
+};
+
+/*
+ * Evaluate the subexpression rooted at node index i
+ */
+static double eval_node(const struct eval_ctx *ctx, uint32_t i)
+{
+  const struct _ei_node *node = &ctx->nodes[i];
+
+  switch (node->type)
+  {
+  case VALUE:
+    return ctx->consts[node->a];
+  case VARIABLE:
+    assert(ctx->vars != NULL);
+    return ctx->vars[node->a];
+  case OP_COND:
+    // only the branch that is taken gets evaluated
+    return eval_node(ctx, (eval_node(ctx, node->a) != 0) ? node->b : node->c);
+  default:
+    break;
+  }
+
+  double left = eval_node(ctx, node->a);
+  double right = (ET_arity(node->type) == 1) ? 0 : eval_node(ctx, node->b);
+
+  if (ctx->approx && node->type == OP_POWER)
+    return FM_pow(left, right);
+
+  if (ctx->approx && FN_is_function(node->type))
+    return FN_for_op(node->type)->approx(left, right);
+
+  return ET_apply(node->type, left, right);
+}
+
+// Documented in .h file
+double EI_evaluate_at(ExprImage image, int index, const double *vars)
+{
+  assert(index >= 0 && (uint32_t)index < image->nexprs);
+
+  const struct _ei_expr *expr = &ei_exprs(image)[index];
+  struct eval_ctx ctx = {ei_nodes(image), ei_consts(image), vars, expr->flags & EI_FLAG_APPROX};
+
+  TR_BEGIN("evaluate_image");
+  double value = eval_node(&ctx, expr->root);
+  TR_END("evaluate_image");
+  return value;
+}
+
+// Documented in .h file
+double EI_evaluate(ExprImage image, int index)
+{
+  return EI_evaluate_at(image, index, NULL);
+}
+
+// Documented in .h file
+void EI_evaluate_batch(ExprImage image, int index, const double *const *vars, double *out, size_t nrows)
+{
+  assert(index >= 0 && (uint32_t)index < image->nexprs);
+  TR_BEGIN("evaluate_image_batch");
+
+  const struct _ei_expr *expr = &ei_exprs(image)[index];
+  const struct _ei_node *nodes = ei_nodes(image);
+  const double *consts = ei_consts(image);
+  bool approx = expr->flags & EI_FLAG_APPROX;
+
+  // the operand stack: a pointer to each operand's values, which are
+  // either a variable's column or the slot's own scratch block
+  double *scratch = malloc(expr->stack * EI_BLOCK * sizeof(double));
+  const double **stack = malloc(expr->stack * sizeof(double *));
+  assert(scratch != NULL && stack != NULL);
+
+  for (size_t row = 0; row < nrows; row += EI_BLOCK)
+  {
+    int n = (nrows - row < EI_BLOCK) ? nrows - row : EI_BLOCK;
+    uint32_t sp = 0;
+
+    for (uint32_t i = expr->first; i <= expr->root; i++)
+    {
+      const struct _ei_node *node = &nodes[i];
+      uint32_t arity = ET_arity(node->type);
+      // the result replaces the operands, starting at the first one
+      double *slot = scratch + (size_t)(sp - arity) * EI_BLOCK;
+
+      if (node->type == VALUE)
+      {
+        for (int j = 0; j < n; j++)
+          slot[j] = consts[node->a];
+        stack[sp++] = slot;
+      }
+      else if (node->type == VARIABLE)
+      {
+        assert(vars != NULL && vars[node->a] != NULL);
+        stack[sp++] = vars[node->a] + row;
+      }
+      else if (node->type == OP_COND)
+      {
+        // branchless: both branches were computed; select per row
+        const double *test = stack[sp - 3];
+        const double *if_true = stack[sp - 2];
+        const double *if_false = stack[sp - 1];
+
+        for (int j = 0; j < n; j++)
+          slot[j] = (test[j] != 0) ? if_true[j] : if_false[j];
+        sp -= 2;
+        stack[sp - 1] = slot;
+      }
+      else
+      {
+        ET_apply_block(node->type, slot, stack[sp - arity], stack[sp - 1], n, approx);
+        sp -= arity - 1;
+        stack[sp - 1] = slot;
+      }
+    }
+
+    memcpy(out + row, stack[0], n * sizeof(double));
+  }
+
+  free(scratch);
+  free(stack);
+  TR_END("evaluate_image_batch");
+}
+
+/*
+ * Rebuild the ExprTree for the subexpression rooted at node index i
+ */
+static ExprTree node_to_tree(ExprImage image, uint32_t i, VarTable vars)
+{
+  const struct _ei_node *node = &ei_nodes(image)[i];
+
+  switch (node->type)
+  {
+  case VALUE:
+    return ET_value(ei_consts(image)[node->a]);
+  case VARIABLE:
+  {
+    assert(vars != NULL);
+    const char *name = EI_var_name(image, node->a);
+    return ET_variable(VT_define(vars, name, strlen(name)));
+  }
+  case OP_COND:
+  {
+    ExprTree cond = node_to_tree(image, node->a, vars);
+    ExprTree if_true = node_to_tree(image, node->b, vars);
+    return ET_cond(cond, if_true, node_to_tree(image, node->c, vars));
+  }
+  default:
+    break;
+  }
+
+  ExprTree left = node_to_tree(image, node->a, vars);
+  ExprTree right = (ET_arity(node->type) == 1) ? NULL : node_to_tree(image, node->b, vars);
+
+  return ET_node(node->type, left, right);
+}
+
+// Documented in .h file
+ExprTree EI_to_tree_vars(ExprImage image, int index, VarTable vars)
+{
+  assert(index >= 0 && (uint32_t)index < image->nexprs);
+
+  return node_to_tree(image, ei_exprs(image)[index].root, vars);
+}
+
+// Documented in .h file
+ExprTree EI_to_tree(ExprImage image, int index)
+{
+  return EI_to_tree_vars(image, index, NULL);
+}
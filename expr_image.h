@@ -0,0 +1,244 @@
+/*
+ * expr_image.h
+ *
+ * A flat, position-independent binary image of one or more compiled
+ * ExprTrees. An image can be written to disk with ET_serialize, and
+ * later used in place -- straight out of an mmap'd file -- after a
+ * single validation pass in ET_load. EI_evaluate never allocates
+ * memory.
+ *
+ * Layout (all fields in native byte order, the whole image 8-byte
+ * aligned):
+ *
+ *   header      magic, version, byte-order mark, section counts,
+ *               total size and a checksum of everything after it
+ *   exprs[]     one entry per expression: its root node, its
+ *               evaluation mode and the range of nodes it consists of
+ *   nodes[]     every node, children before parents, each expression's
+ *               nodes contiguous; children are referred to by index,
+ *               never by pointer
+ *   consts[]    the constant pool; VALUE nodes index into it
+ *   vars[]      the offset of each variable's name in names[];
+ *               VARIABLE nodes index into it
+ *   names[]     the variable names, each terminated by a \0
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#ifndef _EXPR_IMAGE_H_
+#define _EXPR_IMAGE_H_
+
+#include <stddef.h>
+
+#include "expr_tree.h"
+#include "vars.h"
+
+// Bumped whenever the layout or the meaning of a node changes
+#define EI_VERSION 2
+
+typedef const struct _ei_header *ExprImage;
+
+// How OP_POWER and the functions exp, log, sin and cos are computed
+// for one expression of an image
+typedef enum
+{
+  EI_EXACT,  // libm, identical to ET_evaluate
+  EI_APPROX  // the fastmath kernels, see fastmath.h for the error bounds
+} EvalMode;
+
+/*
+ * Compile a set of ExprTrees into an image stored in buf. Identical
+ * constants are stored only once in the constant pool. Variable i of
+ * the image is the variable with index i in the VarTable the trees
+ * refer to (see vars.h), so all trees must use the same table.
+ * A chain (see ET_chain) is stored as the binary nodes that combine
+ * its operands, in the order ET_evaluate combines them.
+ *
+ * Parameters:
+ *   trees      The trees; expression i of the image is trees[i]
+ *   ntrees     Number of trees
+ *   buf        Where to write the image; must be 8-byte aligned
+ *   buf_sz     Size of buf, in bytes
+ *
+ * Returns: The size of the complete image, in bytes. If this is
+ *   larger than buf_sz, nothing is written, and the caller may retry
+ *   with a bigger buffer. Returns 0 if any of the trees is NULL, or
+ *   if the trees use variables from different tables.
+ */
+size_t ET_serialize(const ExprTree *trees, int ntrees, void *buf, size_t buf_sz);
+
+/*
+ * Validate an image produced by ET_serialize and make it available
+ * for use. The image is used in place: nothing is copied or
+ * allocated, and buf must stay valid (and unmodified) for as long as
+ * the returned ExprImage is in use.
+ *
+ * Parameters:
+ *   buf        The image, typically an mmap'd file; must be 8-byte aligned
+ *   buf_sz     Number of valid bytes at buf
+ *   errmsg     Return space for an error message, filled in in case of error
+ *   errmsg_sz  The size of errmsg
+ *
+ * Returns: The image, or NULL if buf does not hold a valid image of
+ *   this version, in which case errmsg describes the problem.
+ */
+ExprImage ET_load(const void *buf, size_t buf_sz, char *errmsg, size_t errmsg_sz);
+
+/*
+ * Map an image file into memory and ET_load it
+ *
+ * Parameters:
+ *   path       The file
+ *   errmsg     Return space for an error message, filled in in case of error
+ *   errmsg_sz  The size of errmsg
+ *
+ * Returns: The image, or NULL on error. The caller must release the
+ *   image with EI_close.
+ */
+ExprImage EI_open(const char *path, char *errmsg, size_t errmsg_sz);
+
+/*
+ * Unmap an image obtained from EI_open
+ *
+ * Parameters:
+ *   image    The image
+ *
+ * Returns: None
+ */
+void EI_close(ExprImage image);
+
+/*
+ * Return the total size of the image in bytes
+ *
+ * Parameters:
+ *   image    The image
+ *
+ * Returns: The size
+ */
+size_t EI_size(ExprImage image);
+
+/*
+ * Return the number of expressions stored in the image
+ *
+ * Parameters:
+ *   image    The image
+ *
+ * Returns: The number of expressions
+ */
+int EI_count(ExprImage image);
+
+/*
+ * Return the number of variables of the image. This is one more than
+ * the highest index of any variable the expressions use.
+ *
+ * Parameters:
+ *   image    The image
+ *
+ * Returns: The number of variables
+ */
+int EI_var_count(ExprImage image);
+
+/*
+ * Return the name of one variable of the image
+ *
+ * Parameters:
+ *   image    The image
+ *   index    Which variable, in the range [0, EI_var_count(image) - 1]
+ *
+ * Returns: The name, which lives in the image. Variables that none of
+ *   the expressions use have the empty name.
+ */
+const char *EI_var_name(ExprImage image, int index);
+
+/*
+ * Select how one expression of a writable image is evaluated. The
+ * mode is stored in the image itself (and so survives being written
+ * to a file); the checksum is updated to match. Images start out with
+ * every expression in EI_EXACT mode.
+ *
+ * Parameters:
+ *   buf      A valid image, as passed to ET_load; must be writable
+ *   index    Which expression, in the range [0, EI_count(image) - 1]
+ *   mode     The new mode
+ *
+ * Returns: None
+ */
+void EI_set_mode(void *buf, int index, EvalMode mode);
+
+/*
+ * Return the evaluation mode of one expression of the image
+ *
+ * Parameters:
+ *   image    The image
+ *   index    Which expression, in the range [0, EI_count(image) - 1]
+ *
+ * Returns: The mode
+ */
+EvalMode EI_mode(ExprImage image, int index);
+
+/*
+ * Evaluate one expression of the image. In EI_EXACT mode the result
+ * is identical to calling ET_evaluate on the tree that was serialized,
+ * with its variables set to vars. Like ET_evaluate, only the branch
+ * of an OP_COND that is taken is evaluated.
+ *
+ * Parameters:
+ *   image    The image
+ *   index    Which expression, in the range [0, EI_count(image) - 1]
+ *   vars     The value of each variable, indexed like EI_var_name;
+ *            may be NULL if the expression uses no variables
+ *
+ * Returns: The computed value
+ */
+double EI_evaluate_at(ExprImage image, int index, const double *vars);
+
+/*
+ * Same as EI_evaluate_at(image, index, NULL)
+ */
+double EI_evaluate(ExprImage image, int index);
+
+/*
+ * Evaluate one expression of the image for many rows of variable
+ * values at once. Rows are processed in blocks, one operator at a
+ * time across the whole block, so that each step is a tight loop over
+ * arrays that the compiler can vectorize. Functions use the block
+ * kernels of their registry entries (see funcs.h), and in EI_APPROX
+ * mode OP_POWER uses FM_pow_block. Conditionals are branchless: both
+ * branches are computed for the whole block, and each row selects its
+ * result. In EI_EXACT mode each result is identical to that of
+ * EI_evaluate_at for the same row.
+ *
+ * Parameters:
+ *   image    The image
+ *   index    Which expression, in the range [0, EI_count(image) - 1]
+ *   vars     One column per variable, indexed like EI_var_name, each
+ *            with nrows values; columns the expression does not use
+ *            may be NULL, as may vars itself if it uses none
+ *   out      Return space for nrows results
+ *   nrows    Number of rows
+ *
+ * Returns: None
+ */
+void EI_evaluate_batch(ExprImage image, int index, const double *const *vars, double *out, size_t nrows);
+
+/*
+ * Rebuild an ExprTree from one expression of the image, e.g. to
+ * print it with ET_tree2string. A chain comes back as its binary
+ * nodes, so it prints with the parentheses of its pairwise order.
+ *
+ * Parameters:
+ *   image    The image
+ *   index    Which expression, in the range [0, EI_count(image) - 1]
+ *   vars     The table the variables are defined in, by name; may be
+ *            NULL if the expression uses no variables
+ *
+ * Returns: A newly-created tree, which the caller must ET_free
+ */
+ExprTree EI_to_tree_vars(ExprImage image, int index, VarTable vars);
+
+/*
+ * Same as EI_to_tree_vars(image, index, NULL)
+ */
+ExprTree EI_to_tree(ExprImage image, int index);
+
+#endif /* _EXPR_IMAGE_H_ */
@@ -0,0 +1,379 @@
+/*
+ * expr_par.c
+ *
+ * Task-parallel evaluation of large ExprTrees. The tree is descended
+ * from the root; at each binary node the sizes of the two children
+ * are estimated, and when both are big enough one child becomes a
+ * task on the thread pool while the current thread carries on with
+ * the other. Small subtrees drop straight into ET_evaluate. A chain
+ * is descended in the same way, through the halves that ET_split
+ * makes of its operands.
+ *
+ * The descent carries on into the bigger child in a loop rather than
+ * by recursion, keeping the nodes it passed, and the siblings it
+ * forked, on a stack of its own; the forked sibling is always the
+ * smaller one. So a long, lopsided spine costs heap rather than thread
+ * stack, whichever side it leans to, and a TP_sync on the way back up
+ * only ever runs a sibling, never the rest of the spine.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "expr_par.h"
+#include "expr_tree_priv.h"
+#include "trace.h"
+
+// first size limit tried when comparing the two children of a node
+#define INITIAL_SIZE_PROBE 16
+
+// nodes of a spine par_eval keeps before it needs the heap
+#define SPINE_STACK_STEPS 64
+
+// how far past threshold two big siblings are compared
+#define SPLIT_PROBE_FACTOR 8
+
+struct par_eval_arg
+{
+  ExprTree tree;
+  ThreadPool pool;
+  int threshold;
+  double result;
+};
+
+// a range of the operands of a chain, as a task
+struct par_range_arg
+{
+  ExprTree tree;
+  int first;
+  int count;
+  ThreadPool pool;
+  int threshold;
+  double result;
+};
+
+// a sibling forked off on the way down
+struct par_fork
+{
+  TPTask task;
+  struct par_eval_arg arg;
+};
+
+// a node passed on the way down, waiting for the child it went on into
+struct spine_step
+{
+  ExprTree tree;
+  bool left_big;         // which child the descent went on into
+  double small;          // the value of the other child, if it has one
+  struct par_fork *fork; // or the task computing it
+};
+
+static int range_upto(ExprTree tree, int first, int count, int limit);
+
+/*
+ * Like ET_count, but gives up as soon as limit nodes have been seen,
+ * so the cost is bounded by limit rather than by the size of the tree
+ *
+ * Parameters:
+ *   tree     The tree
+ *   limit    The maximum count of interest
+ *
+ * Returns: The smaller of the number of nodes in tree and limit
+ */
+static int count_upto(ExprTree tree, int limit)
+{
+  if (tree == NULL || limit <= 0)
+    return 0;
+
+  if (ET_is_leaf(tree))
+    return 1;
+
+  if (ET_is_chain(tree))
+    return range_upto(tree, 0, tree->n.list.count, limit);
+
+  int count = 1;
+
+  for (int i = 0; i < ET_arity(tree->type) && count < limit; i++)
+    count += count_upto(tree->n.child[i], limit - count);
+
+  return count;
+}
+
+/*
+ * Like count_upto, for a range of the operands of a chain, counting
+ * the count - 1 nodes that combine them as ET_count does
+ */
+static int range_upto(ExprTree tree, int first, int count, int limit)
+{
+  int total = count - 1;
+
+  for (int i = first; i < first + count && total < limit; i++)
+    total += count_upto(tree->n.list.ops[i], limit - total);
+
+  return (total < limit) ? total : limit;
+}
+
+/*
+ * Estimate the sizes of two sibling subtrees. Both are counted up to
+ * a limit that doubles until one of them turns out to be smaller than
+ * the limit, or the limit reaches threshold. The work done is
+ * therefore proportional to the smaller sibling (capped at
+ * threshold), which keeps the descent down a long, lopsided chain
+ * linear in its length.
+ *
+ * Parameters:
+ *   left, right   The two subtrees
+ *   threshold     The largest limit worth probing
+ *   lsize, rsize  Return space for the (capped) sizes
+ *
+ * Returns: The final limit. A size below the limit is exact; a size
+ *   equal to it means "at least that many".
+ */
+static int child_sizes(ExprTree left, ExprTree right, int threshold, int *lsize, int *rsize)
+{
+  int limit = INITIAL_SIZE_PROBE;
+
+  while (true)
+  {
+    if (limit > threshold)
+      limit = threshold;
+
+    *lsize = count_upto(left, limit);
+    *rsize = count_upto(right, limit);
+
+    if (*lsize < limit || *rsize < limit || limit == threshold)
+      return limit;
+
+    limit *= 2;
+  }
+}
+
+static double par_eval(ExprTree tree, ThreadPool pool, int threshold);
+static double par_range(ExprTree tree, int first, int count, ThreadPool pool, int threshold);
+
+static void par_eval_task(void *arg)
+{
+  struct par_eval_arg *pa = arg;
+
+  pa->result = par_eval(pa->tree, pa->pool, pa->threshold);
+}
+
+static void par_range_task(void *arg)
+{
+  struct par_range_arg *pa = arg;
+
+  pa->result = par_range(pa->tree, pa->first, pa->count, pa->pool, pa->threshold);
+}
+
+/*
+ * The parallel descent of a range of the operands of a chain, split
+ * as ET_reduce splits it so that the result is the same
+ */
+static double par_range(ExprTree tree, int first, int count, ThreadPool pool, int threshold)
+{
+  if (count == 1)
+    return par_eval(tree->n.list.ops[first], pool, threshold);
+
+  int half = ET_split(count);
+  bool left_small = range_upto(tree, first, half, threshold) < threshold;
+  bool right_small = range_upto(tree, first + half, count - half, threshold) < threshold;
+  double lval, rval;
+
+  if (left_small && right_small)
+    return ET_reduce(tree, first, count);
+
+  if (!left_small && !right_small)
+  {
+    // both halves are big: fork the left one, keep the right one
+    struct par_range_arg arg = {tree, first, half, pool, threshold, 0};
+    TPTask task;
+
+    TP_spawn(pool, &task, par_range_task, &arg);
+    rval = par_range(tree, first + half, count - half, pool, threshold);
+    TP_sync(pool, &task);
+    lval = arg.result;
+  }
+  else if (left_small)
+  {
+    lval = ET_reduce(tree, first, half);
+    rval = par_range(tree, first + half, count - half, pool, threshold);
+  }
+  else
+  {
+    lval = par_range(tree, first, half, pool, threshold);
+    rval = ET_reduce(tree, first + half, count - half);
+  }
+
+  return ET_apply(ET_chain_op(tree->type), lval, rval);
+}
+
+/*
+ * Tell which of two siblings, both of at least threshold nodes, is the
+ * bigger, probing as child_sizes does up to SPLIT_PROBE_FACTOR times
+ * threshold; past that they count as equal
+ *
+ * Returns: true if the left one is at least as big as the right one
+ */
+static bool left_bigger(ExprTree left, ExprTree right, int threshold)
+{
+  for (int limit = 2 * threshold; limit <= SPLIT_PROBE_FACTOR * threshold; limit *= 2)
+  {
+    int lsize = count_upto(left, limit);
+    int rsize = count_upto(right, limit);
+
+    if (lsize < limit || rsize < limit)
+      return lsize >= rsize;
+  }
+  return true;
+}
+
+/*
+ * Add a step to the spine, moving it to the heap once it outgrows the
+ * caller's array
+ */
+static struct spine_step *push_step(struct spine_step *steps, struct spine_step *local, int *nsteps, int *cap,
+                                    struct spine_step step)
+{
+  if (*nsteps == *cap)
+  {
+    struct spine_step *grown = malloc(2 * *cap * sizeof(struct spine_step));
+    assert(grown != NULL);
+
+    for (int i = 0; i < *nsteps; i++)
+      grown[i] = steps[i];
+    if (steps != local)
+      free(steps);
+    steps = grown;
+    *cap *= 2;
+  }
+
+  steps[(*nsteps)++] = step;
+  return steps;
+}
+
+/*
+ * The parallel descent; see ET_evaluate_parallel
+ */
+static double par_eval(ExprTree tree, ThreadPool pool, int threshold)
+{
+  struct spine_step local[SPINE_STACK_STEPS];
+  struct spine_step *steps = local;
+  int nsteps = 0, cap = SPINE_STACK_STEPS;
+  double value;
+
+  // down the bigger child of each node, forking the other if it is big
+  // too, until a node has nothing big below it
+  while (true)
+  {
+    if (tree == NULL)
+    {
+      value = 0;
+      break;
+    }
+
+    if (ET_is_leaf(tree))
+    {
+      value = ET_evaluate(tree);
+      break;
+    }
+
+    if (ET_is_chain(tree))
+    {
+      value = par_range(tree, 0, tree->n.list.count, pool, threshold);
+      break;
+    }
+
+    if (ET_arity(tree->type) == 1)
+    {
+      steps = push_step(steps, local, &nsteps, &cap, (struct spine_step){tree, true, 0, NULL});
+      tree = tree->n.child[LEFT];
+      continue;
+    }
+
+    // as in ET_evaluate, only the branch that is taken gets evaluated
+    if (tree->type == OP_COND)
+    {
+      if (par_eval(tree->n.child[COND_TEST], pool, threshold) != 0)
+        tree = tree->n.child[COND_TRUE];
+      else
+        tree = tree->n.child[COND_FALSE];
+      continue;
+    }
+
+    ExprTree left = tree->n.child[LEFT];
+    ExprTree right = tree->n.child[RIGHT];
+    int lsize, rsize;
+    int limit = child_sizes(left, right, threshold, &lsize, &rsize);
+    bool left_small = lsize < limit;
+    bool right_small = rsize < limit;
+    struct spine_step step = {tree, !left_small, 0, NULL};
+
+    if (left_small && right_small)
+    {
+      value = ET_evaluate(tree);
+      break;
+    }
+
+    if (!left_small && !right_small)
+    {
+      // both are big: fork the smaller, so that what a TP_sync may
+      // have to run on this stack is never the rest of a long spine
+      step.left_big = left_bigger(left, right, threshold);
+      step.fork = malloc(sizeof(struct par_fork));
+      assert(step.fork != NULL);
+      step.fork->arg = (struct par_eval_arg){step.left_big ? right : left, pool, threshold, 0};
+      TP_spawn(pool, &step.fork->task, par_eval_task, &step.fork->arg);
+    }
+    else
+      step.small = ET_evaluate(left_small ? left : right);
+
+    steps = push_step(steps, local, &nsteps, &cap, step);
+    tree = step.left_big ? left : right;
+  }
+
+  // and back up, combining as ET_evaluate would
+  while (nsteps > 0)
+  {
+    struct spine_step *step = &steps[--nsteps];
+
+    if (step->fork != NULL)
+    {
+      TP_sync(pool, &step->fork->task);
+      step->small = step->fork->arg.result;
+      free(step->fork);
+    }
+
+    if (ET_arity(step->tree->type) == 1)
+      value = ET_apply(step->tree->type, value, 0);
+    else if (step->left_big)
+      value = ET_apply(step->tree->type, value, step->small);
+    else
+      value = ET_apply(step->tree->type, step->small, value);
+  }
+
+  if (steps != local)
+    free(steps);
+  return value;
+}
+
+// Documented in .h file
+double ET_evaluate_parallel(ExprTree tree, ThreadPool pool, int threshold)
+{
+  if (threshold <= 0)
+    threshold = ET_PAR_THRESHOLD;
+
+  // the sequential fast path: no pool, or nothing worth splitting
+  if (pool == NULL || count_upto(tree, 2 * threshold) < 2 * threshold)
+    return ET_evaluate(tree);
+
+  struct par_eval_arg arg = {tree, pool, threshold, 0};
+
+  TR_BEGIN("evaluate_parallel");
+  TP_run(pool, par_eval_task, &arg);
+  TR_END("evaluate_parallel");
+
+  return arg.result;
+}
@@ -0,0 +1,36 @@
+/*
+ * expr_par.h
+ *
+ * Task-parallel evaluation of large ExprTrees
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#ifndef _EXPR_PAR_H_
+#define _EXPR_PAR_H_
+
+#include "expr_tree.h"
+#include "thread_pool.h"
+
+// Default minimum subtree size (in nodes) worth running as its own task
+#define ET_PAR_THRESHOLD 4096
+
+/*
+ * Evaluate an ExprTree using the workers of a thread pool. Wherever
+ * both children of a node contain at least threshold nodes, one of
+ * them is split off as a task; everything smaller is evaluated with
+ * the sequential evaluator. Trees below the threshold never touch the
+ * pool at all.
+ *
+ * The result is bit-for-bit identical to ET_evaluate(tree).
+ *
+ * Parameters:
+ *   tree       The tree to compute
+ *   pool       The pool to run tasks on; if NULL, evaluates sequentially
+ *   threshold  Minimum subtree size to split off, or 0 for ET_PAR_THRESHOLD
+ *
+ * Returns: The computed value
+ */
+double ET_evaluate_parallel(ExprTree tree, ThreadPool pool, int threshold);
+
+#endif /* _EXPR_PAR_H_ */
@@ -0,0 +1,460 @@
+/*
+ * expr_server.c
+ *
+ * The local evaluation server: one epoll loop per thread, all waiting
+ * on the same listening socket (EPOLLEXCLUSIVE wakes only one of them
+ * per new connection), and each serving the connections it accepted.
+ *
+ * A connection is level-triggered. On input, everything that is there
+ * is read at once, every complete line in it is answered into the
+ * output buffer, and the answers go out in one write. If the client
+ * is not reading them, the connection stops reading too, and waits
+ * for EPOLLOUT until its output has drained.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#define _GNU_SOURCE // for accept4
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "expr_server.h"
+#include "clist.h"
+#include "tokenize.h"
+#include "parse.h"
+#include "expr_tree.h"
+#include "dtoa.h"
+#include "latency.h"
+
+#define ERRMSG_SIZE 128
+#define INITIAL_BUFFER_SIZE (64 * 1024) // for each of input and output
+#define MAX_EVENTS 64
+
+struct _expr_server
+{
+  int listen_fd;
+  int stop_fd;         // an eventfd; readable once ES_stop is called
+  int precision;       // for ES_eval_line
+  char *unix_path;     // the socket to remove, or NULL for TCP
+};
+
+struct conn
+{
+  int fd;              // -1 while the connection is on the free list
+  char *in;            // received bytes not yet answered
+  size_t in_len;
+  size_t in_cap;
+  char *out;           // answers not yet sent
+  size_t out_len;
+  size_t out_pos;      // how much of out has been sent
+  size_t out_cap;
+  long lineno;         // lines answered so far
+  bool closing;        // the client has finished sending
+  struct conn *next;   // every connection of the loop, used or free
+};
+
+// one event loop
+struct loop
+{
+  ExprServer server;
+  int epfd;
+  struct conn *conns;  // all connections ever allocated by this loop
+};
+
+// Documented in .h file
+int ES_eval_line(const char *line, size_t len, long lineno, int precision, char *out)
+{
+  char errmsg[ERRMSG_SIZE] = "";
+  ExprTree tree = NULL;
+  uint64_t t = LH_start();
+  CList tokens = TOK_tokenize_n(line, len, NULL, errmsg, sizeof(errmsg));
+  int out_len;
+
+  t = LH_lap(LH_TOKENIZE, t);
+  if (tokens != NULL)
+  {
+    tree = Parse(tokens, errmsg, sizeof(errmsg));
+    CL_free(tokens);
+    t = LH_lap(LH_PARSE, t);
+  }
+
+  if (tree != NULL)
+  {
+    double value = ET_evaluate(tree);
+
+    t = LH_lap(LH_EVALUATE, t);
+    out_len = DT_format(value, precision, out);
+    out[out_len++] = '\n';
+    LH_lap(LH_FORMAT, t);
+  }
+  else if (errmsg[0] != '\0')
+    out_len = snprintf(out, ES_RESULT_MAX, "line %ld: %s\n", lineno, errmsg);
+  else
+    out_len = snprintf(out, ES_RESULT_MAX, "\n");
+
+  ET_free(tree);
+  return out_len;
+}
+
+// Documented in .h file
+ExprServer ES_new(const char *addr, int precision, char *errmsg, size_t errmsg_sz)
+{
+  ExprServer server = calloc(1, sizeof(struct _expr_server));
+  assert(server != NULL);
+
+  server->listen_fd = -1;
+  server->precision = precision;
+  server->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  if (strchr(addr, '/') != NULL)
+  {
+    struct sockaddr_un sun = {.sun_family = AF_UNIX};
+
+    if (strlen(addr) >= sizeof(sun.sun_path))
+    {
+      snprintf(errmsg, errmsg_sz, "Socket path too long: %s", addr);
+      goto error;
+    }
+    strcpy(sun.sun_path, addr);
+
+    server->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server->listen_fd < 0 || bind(server->listen_fd, (struct sockaddr *)&sun, sizeof(sun)) != 0)
+      goto system_error;
+
+    server->unix_path = strdup(addr);
+  }
+  else
+  {
+    char *end;
+    long port = strtol(addr, &end, 10);
+    struct sockaddr_in sin = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    int one = 1;
+
+    if (*addr == '\0' || *end != '\0' || port < 0 || port > 65535)
+    {
+      snprintf(errmsg, errmsg_sz, "Not a socket path or port: %s", addr);
+      goto error;
+    }
+    sin.sin_port = htons(port);
+
+    server->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server->listen_fd < 0)
+      goto system_error;
+    setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(server->listen_fd, (struct sockaddr *)&sin, sizeof(sin)) != 0)
+      goto system_error;
+  }
+
+  if (server->stop_fd < 0 || listen(server->listen_fd, SOMAXCONN) != 0)
+    goto system_error;
+
+  return server;
+
+system_error:
+  snprintf(errmsg, errmsg_sz, "%s: %s", addr, strerror(errno));
+error:
+  ES_free(server);
+  return NULL;
+}
+
+// Documented in .h file
+void ES_free(ExprServer server)
+{
+  if (server == NULL)
+    return;
+
+  if (server->listen_fd >= 0)
+    close(server->listen_fd);
+  if (server->stop_fd >= 0)
+    close(server->stop_fd);
+  if (server->unix_path != NULL)
+    unlink(server->unix_path);
+
+  free(server->unix_path);
+  free(server);
+}
+
+// Documented in .h file
+void ES_stop(ExprServer server)
+{
+  uint64_t one = 1;
+
+  // level-triggered and never read, so every loop sees it
+  if (write(server->stop_fd, &one, sizeof(one)) < 0)
+    return;
+}
+
+/*
+ * Set the events a connection waits for: input while it can take
+ * more, or room to write while it has answers pending
+ */
+static void watch(struct loop *loop, struct conn *conn)
+{
+  struct epoll_event ev = {.data.ptr = conn};
+
+  ev.events = (conn->out_pos < conn->out_len) ? EPOLLOUT : EPOLLIN;
+  epoll_ctl(loop->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/*
+ * Close a connection and put it on the free list, keeping its buffers
+ */
+static void close_conn(struct loop *loop, struct conn *conn)
+{
+  epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  conn->fd = -1;
+}
+
+/*
+ * Accept every pending connection, taking a free connection for each
+ * one if there is any
+ */
+static void accept_conns(struct loop *loop)
+{
+  int fd;
+
+  while ((fd = accept4(loop->server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+  {
+    struct conn *conn = loop->conns;
+    int one = 1;
+
+    while (conn != NULL && conn->fd >= 0)
+      conn = conn->next;
+
+    if (conn == NULL)
+    {
+      conn = calloc(1, sizeof(struct conn));
+      assert(conn != NULL);
+      conn->in_cap = conn->out_cap = INITIAL_BUFFER_SIZE;
+      conn->in = malloc(conn->in_cap);
+      conn->out = malloc(conn->out_cap);
+      assert(conn->in != NULL && conn->out != NULL);
+      conn->next = loop->conns;
+      loop->conns = conn;
+    }
+
+    conn->fd = fd;
+    conn->in_len = conn->out_len = conn->out_pos = 0;
+    conn->lineno = 0;
+    conn->closing = false;
+
+    // fails harmlessly on a Unix domain socket
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = conn};
+    epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev);
+  }
+}
+
+/*
+ * Answer one request line into the output buffer of conn
+ */
+static void answer(struct conn *conn, const char *line, size_t len, int precision)
+{
+  if (conn->out_cap - conn->out_len < ES_RESULT_MAX)
+  {
+    conn->out_cap = 2 * conn->out_cap;
+    conn->out = realloc(conn->out, conn->out_cap);
+    assert(conn->out != NULL);
+  }
+
+  conn->out_len += ES_eval_line(line, len, ++conn->lineno, precision, conn->out + conn->out_len);
+}
+
+/*
+ * Send as much pending output as the socket takes
+ *
+ * Returns: false if the connection failed
+ */
+static bool flush_conn(struct conn *conn)
+{
+  while (conn->out_pos < conn->out_len)
+  {
+    ssize_t n = send(conn->fd, conn->out + conn->out_pos, conn->out_len - conn->out_pos, MSG_NOSIGNAL);
+
+    if (n < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+
+    conn->out_pos += n;
+  }
+
+  conn->out_pos = conn->out_len = 0;
+  return true;
+}
+
+/*
+ * Read what the client sent, and answer every complete line of it
+ *
+ * Returns: false if the connection failed
+ */
+static bool read_conn(struct conn *conn, int precision)
+{
+  if (conn->in_len == conn->in_cap)
+  {
+    if (conn->in_cap >= ES_MAX_LINE)
+      return false;
+
+    conn->in_cap *= 2;
+    conn->in = realloc(conn->in, conn->in_cap);
+    assert(conn->in != NULL);
+  }
+
+  ssize_t n = read(conn->fd, conn->in + conn->in_len, conn->in_cap - conn->in_len);
+
+  if (n < 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+  conn->in_len += n;
+  conn->closing = (n == 0);
+
+  char *pos = conn->in;
+  char *end = conn->in + conn->in_len;
+  char *newline;
+
+  while ((newline = memchr(pos, '\n', end - pos)) != NULL)
+  {
+    answer(conn, pos, newline - pos, precision);
+    pos = newline + 1;
+  }
+
+  // a last line without its '\n'
+  if (conn->closing && pos < end)
+  {
+    answer(conn, pos, end - pos, precision);
+    pos = end;
+  }
+
+  conn->in_len = end - pos;
+  memmove(conn->in, pos, conn->in_len);
+  return true;
+}
+
+/*
+ * Thread function: run one event loop until the server is stopped
+ *
+ * Parameters:
+ *   arg      The struct loop
+ *
+ * Returns: NULL
+ */
+static void *run_loop(void *arg)
+{
+  struct loop *loop = arg;
+  struct epoll_event events[MAX_EVENTS];
+  bool stopped = false;
+
+  while (!stopped)
+  {
+    int nevents = epoll_wait(loop->epfd, events, MAX_EVENTS, -1);
+
+    for (int i = 0; i < nevents; i++)
+    {
+      struct conn *conn = events[i].data.ptr;
+
+      if (conn == NULL)
+      {
+        accept_conns(loop);
+        continue;
+      }
+      if (conn == (struct conn *)loop)
+      {
+        stopped = true;
+        continue;
+      }
+
+      bool ok = true;
+
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+        ok = read_conn(conn, loop->server->precision);
+
+      ok = ok && flush_conn(conn);
+
+      if (!ok || (conn->closing && conn->out_len == 0))
+        close_conn(loop, conn);
+      else
+        watch(loop, conn);
+    }
+  }
+
+  while (loop->conns != NULL)
+  {
+    struct conn *conn = loop->conns;
+
+    loop->conns = conn->next;
+    if (conn->fd >= 0)
+      close(conn->fd);
+    free(conn->in);
+    free(conn->out);
+    free(conn);
+  }
+
+  return NULL;
+}
+
+// Documented in .h file
+int ES_run(ExprServer server, int nthreads)
+{
+  struct loop *loops = calloc(nthreads, sizeof(struct loop));
+  pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+  int nstarted = 0;
+  int status = 0;
+
+  assert(nthreads >= 1 && loops != NULL && threads != NULL);
+
+  for (int i = 0; i < nthreads; i++)
+    loops[i].epfd = -1;
+
+  for (int i = 0; i < nthreads; i++)
+  {
+    struct epoll_event listen_ev = {.events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL};
+    struct epoll_event stop_ev = {.events = EPOLLIN, .data.ptr = &loops[i]};
+
+    loops[i].server = server;
+    loops[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (loops[i].epfd < 0 ||
+        epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, server->listen_fd, &listen_ev) != 0 ||
+        epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, server->stop_fd, &stop_ev) != 0)
+    {
+      status = -1;
+      break;
+    }
+  }
+
+  // the calling thread runs loop 0
+  for (nstarted = 1; status == 0 && nstarted < nthreads; nstarted++)
+    if (pthread_create(&threads[nstarted], NULL, run_loop, &loops[nstarted]) != 0)
+    {
+      // the loops that did start are told to stop at once
+      status = -1;
+      ES_stop(server);
+      break;
+    }
+
+  if (status == 0 || nstarted > 1)
+    run_loop(&loops[0]);
+
+  for (int i = 1; i < nstarted; i++)
+    pthread_join(threads[i], NULL);
+
+  for (int i = 0; i < nthreads; i++)
+    if (loops[i].epfd >= 0)
+      close(loops[i].epfd);
+
+  free(loops);
+  free(threads);
+  return status;
+}
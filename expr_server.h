@@ -0,0 +1,106 @@
+/*
+ * expr_server.h
+ *
+ * A local evaluation server, so that other programs can evaluate
+ * expressions without starting a process per request.
+ *
+ * The protocol is the one of expr_whizz's batch mode, over a stream
+ * socket: the client sends expressions, one per line, and gets back
+ * one line per expression, in order: the value (in full by default,
+ * see DT_format), "line N: message" for an error (N counting the
+ * lines of the connection from 1), or an empty line for a blank one. A client may send any number of lines
+ * before reading the answers. The server answers everything that
+ * arrived in one read with a single write, so pipelining many
+ * requests costs about as many system calls as sending one.
+ *
+ * Each server thread runs its own epoll loop over the connections it
+ * accepted, so connections never move between threads and nothing is
+ * locked while serving them. Connection buffers are kept and reused
+ * for later connections.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#ifndef _EXPR_SERVER_H_
+#define _EXPR_SERVER_H_
+
+#include <stddef.h>
+
+typedef struct _expr_server *ExprServer;
+
+// The longest line ES_eval_line writes, '\n' included
+#define ES_RESULT_MAX 160
+
+// The longest request line a connection may send, '\n' included;
+// a connection that exceeds it is closed
+#define ES_MAX_LINE (1 << 20)
+
+/*
+ * Evaluate one line of the protocol and format the answer line
+ *
+ * Parameters:
+ *   line       The request line, without its '\n'; need not be
+ *              NUL-terminated
+ *   len        Its length
+ *   lineno     Its line number, for error messages
+ *   precision  How values are printed: DT_SHORTEST for the shortest
+ *              form that reads back exactly, or a number of
+ *              significant digits (see DT_format)
+ *   out        Return space for the answer, '\n' included; must hold
+ *              at least ES_RESULT_MAX bytes
+ *
+ * Returns: The length of the answer
+ */
+int ES_eval_line(const char *line, size_t len, long lineno, int precision, char *out);
+
+/*
+ * Create a server and start listening. Nothing is served until
+ * ES_run is called.
+ *
+ * Parameters:
+ *   addr       Where to listen: a path (anything containing a '/') for
+ *              a Unix domain socket, which is created and must not
+ *              exist yet; or a port number for TCP on 127.0.0.1
+ *   precision  How values are printed, as for ES_eval_line
+ *   errmsg     Return space for an error message, filled in in case of error
+ *   errmsg_sz  The size of errmsg
+ *
+ * Returns: The server, or NULL in case of error
+ */
+ExprServer ES_new(const char *addr, int precision, char *errmsg, size_t errmsg_sz);
+
+/*
+ * Serve connections until ES_stop is called. The calling thread runs
+ * one of the event loops.
+ *
+ * Parameters:
+ *   server     The server
+ *   nthreads   Number of event loops, at least 1
+ *
+ * Returns: 0, or -1 if the loops could not be started
+ */
+int ES_run(ExprServer server, int nthreads);
+
+/*
+ * Make ES_run close all connections and return. May be called from
+ * any thread, and from a signal handler.
+ *
+ * Parameters:
+ *   server     The server
+ *
+ * Returns: None
+ */
+void ES_stop(ExprServer server);
+
+/*
+ * Stop listening and destroy the server; a Unix domain socket is
+ * removed. ES_run must not be running.
+ *
+ * Parameters:
+ *   server     The server; may be NULL
+ *
+ * Returns: None
+ */
+void ES_free(ExprServer server);
+
+#endif /* _EXPR_SERVER_H_ */
@@ -0,0 +1,720 @@
+/*
+ * expr_shm.c
+ *
+ * The shared-memory transport. Rings hold records, each a length and
+ * a kind followed by the payload padded to 8 bytes; a record never
+ * wraps around the end of a ring, a padding record fills the gap
+ * instead. Ring positions are byte counts that only grow (modulo
+ * 2^32), so head == tail means empty and tail - head is the fill.
+ *
+ * The server reads nothing the client wrote, positions and lengths
+ * included, without checking that it stays inside the ring; a client
+ * that breaks the framing gets one error answer, and what it had sent
+ * is dropped.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include <emmintrin.h> // _mm_pause
+
+#include "expr_shm.h"
+#include "clist.h"
+#include "tokenize.h"
+#include "parse.h"
+#include "expr_tree.h"
+#include "latency.h"
+
+#define SEGMENT_MAGIC 0x45575348 // "EWSH"
+#define SEGMENT_VERSION 1
+
+#define ERRMSG_SIZE 128
+#define SPIN_LIMIT 200                   // polls before going to sleep, with CPUs to spare
+#define WAIT_TIMEOUT_NS (100 * 1000000L) // longest sleep between checks for a stop
+#define RING_MASK (SHM_RING_SIZE - 1)
+
+enum record_kind
+{
+  REC_EXPR,  // a request: the text of the expression
+  REC_VALUE, // an answer: the value, a double
+  REC_ERROR, // an answer: the error message
+  REC_PAD    // nothing, up to the end of the ring
+};
+
+struct record
+{
+  uint32_t len; // of the payload, before padding
+  uint32_t kind;
+};
+
+// The longest answer record
+#define ANSWER_MAX ERRMSG_SIZE
+
+struct ring
+{
+  _Alignas(64) atomic_uint tail; // written by the producer
+  atomic_uint consumer_asleep;
+  _Alignas(64) atomic_uint head; // written by the consumer
+  atomic_uint producer_asleep;
+  _Alignas(64) char data[SHM_RING_SIZE];
+};
+
+enum channel_state
+{
+  CHANNEL_FREE,
+  CHANNEL_OPEN,   // claimed by a client
+  CHANNEL_CLOSING // given back by its client, not yet drained by the server
+};
+
+struct channel
+{
+  _Alignas(64) atomic_uint state;
+  atomic_uint server_blocked; // requests are waiting for room for answers
+  struct ring requests;
+  struct ring answers;
+};
+
+struct doorbell
+{
+  _Alignas(64) atomic_uint rings; // bumped by clients with news
+  atomic_uint asleep;
+};
+
+struct segment
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t nthreads;
+  atomic_uint stopped;
+  struct doorbell bells[SHM_CHANNELS]; // one per server thread
+  struct channel channels[SHM_CHANNELS];
+};
+
+struct _shm_server
+{
+  char name[NAME_MAX + 1];
+  struct segment *seg;
+};
+
+struct _shm_client
+{
+  struct segment *seg;
+  struct channel *ch;
+  struct doorbell *bell;
+  unsigned req_tail;        // our copy of ch->requests.tail
+  unsigned ans_head;        // our copy of ch->answers.head
+  struct record *reserved;  // by SHM_reserve, for SHM_submit
+};
+
+struct worker
+{
+  struct segment *seg;
+  int id;
+};
+
+// How many times to poll before sleeping: with a single CPU the other
+// side cannot make progress while we poll, so we never do
+static int spin_limit = SPIN_LIMIT;
+
+__attribute__((constructor)) static void choose_spin_limit()
+{
+  if (sysconf(_SC_NPROCESSORS_ONLN) < 2)
+    spin_limit = 0;
+}
+
+/*
+ * Return the size of a record with a payload of len bytes
+ */
+static unsigned record_size(size_t len)
+{
+  return sizeof(struct record) + ((len + 7) & ~(size_t)7);
+}
+
+/*
+ * Wake whoever is sleeping on a word of the segment
+ */
+static void futex_wake(atomic_uint *word)
+{
+  syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/*
+ * Wait until *word is no longer seen or the server stops: poll for a
+ * while, then sleep with *asleep set so that the other side knows to
+ * wake us. The stores and loads of the word and the flag are
+ * sequentially consistent, so either the other side sees the flag or
+ * we see its new value before sleeping.
+ */
+static void wait_change(atomic_uint *word, unsigned seen, atomic_uint *asleep, atomic_uint *stopped)
+{
+  const struct timespec timeout = {0, WAIT_TIMEOUT_NS};
+
+  for (int i = 0; i < spin_limit; i++)
+  {
+    if (atomic_load_explicit(word, memory_order_acquire) != seen)
+      return;
+    _mm_pause();
+  }
+
+  while (atomic_load(word) == seen && !atomic_load(stopped))
+  {
+    atomic_store(asleep, 1);
+    if (atomic_load(word) == seen)
+      syscall(SYS_futex, word, FUTEX_WAIT, seen, &timeout, NULL, 0);
+    atomic_store(asleep, 0);
+  }
+}
+
+/*
+ * Store a new value in a word of the segment, and wake the other side
+ * if it is asleep on it
+ */
+static void publish(atomic_uint *word, unsigned value, atomic_uint *asleep)
+{
+  atomic_store(word, value);
+  if (atomic_load(asleep))
+    futex_wake(word);
+}
+
+/*
+ * Tell a server thread that one of its channels has news
+ */
+static void ring_doorbell(struct doorbell *bell)
+{
+  atomic_fetch_add(&bell->rings, 1);
+  if (atomic_load(&bell->asleep))
+    futex_wake(&bell->rings);
+}
+
+/*
+ * Find room for a record with len bytes of payload at the producer
+ * position *pos of a ring whose consumer is at head. If the record
+ * would run past the end of the ring, a padding record is written up
+ * to the end and *pos moved past it.
+ *
+ * Returns: Where the record goes, or NULL if the ring has not the room
+ */
+static struct record *ring_room(struct ring *ring, unsigned *pos, unsigned head, size_t len)
+{
+  unsigned size = record_size(len);
+  unsigned off = *pos & RING_MASK;
+  unsigned pad = (off + size > SHM_RING_SIZE) ? SHM_RING_SIZE - off : 0;
+
+  if (SHM_RING_SIZE - (*pos - head) < pad + size)
+    return NULL;
+
+  if (pad > 0)
+  {
+    struct record *rec = (struct record *)&ring->data[off];
+    rec->len = pad - sizeof(struct record);
+    rec->kind = REC_PAD;
+    *pos += pad;
+  }
+
+  return (struct record *)&ring->data[*pos & RING_MASK];
+}
+
+/*
+ * Return the record at the consumer position *pos of a ring whose
+ * producer is at tail, skipping padding, or NULL if there is none
+ */
+static struct record *ring_next(struct ring *ring, unsigned *pos, unsigned tail)
+{
+  while (*pos != tail)
+  {
+    struct record *rec = (struct record *)&ring->data[*pos & RING_MASK];
+
+    if (rec->kind != REC_PAD)
+      return rec;
+    *pos += record_size(rec->len);
+  }
+
+  return NULL;
+}
+
+/*
+ * Like ring_next, for the server's side of a request ring, whose
+ * client may have written anything into it: each record, padding
+ * included, must lie within what the client has published and within
+ * the ring, and a request may be no longer than SHM_MAX_EXPR. The
+ * length is read once, so the client cannot change it afterwards.
+ *
+ * Parameters:
+ *   ring     The request ring
+ *   pos      The consumer position, moved past any padding
+ *   tail     The producer position, as the client published it
+ *   expr     Return space for where the expression is
+ *   len      Return space for its length
+ *
+ * Returns: 1 if there is a request, 0 if there is none, or -1 if the
+ *   ring does not hold well-formed records
+ */
+static int next_request(struct ring *ring, unsigned *pos, unsigned tail, const char **expr, size_t *len)
+{
+  while (*pos != tail)
+  {
+    unsigned off = *pos & RING_MASK;
+    unsigned avail = tail - *pos;
+
+    if (avail > SHM_RING_SIZE || avail < sizeof(struct record))
+      return -1;
+
+    volatile struct record *rec = (volatile struct record *)&ring->data[off];
+    uint32_t rec_len = rec->len;
+    uint32_t kind = rec->kind;
+
+    if (rec_len > SHM_RING_SIZE)
+      return -1;
+
+    unsigned size = record_size(rec_len);
+
+    if (size > avail || off + size > SHM_RING_SIZE)
+      return -1;
+
+    if (kind == REC_PAD)
+    {
+      // padding only ever fills the ring up to its end
+      if (off + size != SHM_RING_SIZE)
+        return -1;
+      *pos += size;
+      continue;
+    }
+
+    if (kind != REC_EXPR || rec_len > SHM_MAX_EXPR)
+      return -1;
+
+    *expr = (const char *)&ring->data[off + sizeof(struct record)];
+    *len = rec_len;
+    return 1;
+  }
+
+  return 0;
+}
+
+/*
+ * Write an error answer record
+ */
+static void answer_error(struct record *ans, const char *errmsg)
+{
+  ans->kind = REC_ERROR;
+  ans->len = strlen(errmsg);
+  memcpy(ans + 1, errmsg, ans->len);
+}
+
+/*
+ * Evaluate an expression and write the answer record
+ */
+static void answer(struct record *ans, const char *expr, size_t len)
+{
+  char errmsg[ERRMSG_SIZE] = "Empty expression";
+  ExprTree tree = NULL;
+  uint64_t t = LH_start();
+  CList tokens = TOK_tokenize_n(expr, len, NULL, errmsg, sizeof(errmsg));
+
+  t = LH_lap(LH_TOKENIZE, t);
+  if (tokens != NULL)
+  {
+    tree = Parse(tokens, errmsg, sizeof(errmsg));
+    CL_free(tokens);
+    t = LH_lap(LH_PARSE, t);
+  }
+
+  // values go back as doubles, so there is no formatting to time
+  if (tree != NULL)
+  {
+    double value = ET_evaluate(tree);
+
+    LH_lap(LH_EVALUATE, t);
+
+    ans->kind = REC_VALUE;
+    ans->len = sizeof(value);
+    memcpy(ans + 1, &value, sizeof(value));
+  }
+  else
+    answer_error(ans, errmsg);
+
+  ET_free(tree);
+}
+
+/*
+ * Answer the requests waiting on a channel, as far as there is room
+ * for the answers, or drain a channel its client has given back
+ *
+ * Returns: The number of requests taken
+ */
+static int serve_channel(struct channel *ch)
+{
+  unsigned state = atomic_load_explicit(&ch->state, memory_order_acquire);
+
+  if (state == CHANNEL_FREE)
+    return 0;
+
+  unsigned head = atomic_load_explicit(&ch->requests.head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(&ch->requests.tail, memory_order_acquire);
+
+  if (state == CHANNEL_CLOSING)
+  {
+    // nobody is left to read the answers
+    atomic_store(&ch->requests.head, tail);
+    atomic_store(&ch->server_blocked, 0);
+    atomic_store_explicit(&ch->state, CHANNEL_FREE, memory_order_release);
+    return 1;
+  }
+
+  unsigned ans_tail = atomic_load_explicit(&ch->answers.tail, memory_order_relaxed);
+  const char *expr;
+  size_t len;
+  int found;
+  int ntaken = 0;
+
+  while ((found = next_request(&ch->requests, &head, tail, &expr, &len)) != 0)
+  {
+    struct record *ans = ring_room(&ch->answers, &ans_tail, atomic_load(&ch->answers.head), ANSWER_MAX);
+
+    if (ans == NULL)
+    {
+      // ask the client to ring when it has read some answers, then
+      // look again in case it already has
+      atomic_store(&ch->server_blocked, 1);
+      ans = ring_room(&ch->answers, &ans_tail, atomic_load(&ch->answers.head), ANSWER_MAX);
+      if (ans == NULL)
+        break;
+    }
+    atomic_store_explicit(&ch->server_blocked, 0, memory_order_relaxed);
+
+    if (found < 0)
+    {
+      // the framing is lost: say so once, and drop the rest
+      answer_error(ans, "Corrupt request");
+      ans_tail += record_size(ans->len);
+      head = tail;
+      ntaken++;
+      break;
+    }
+
+    // the expression is tokenized where the client wrote it
+    answer(ans, expr, len);
+    ans_tail += record_size(ans->len);
+    head += record_size(len);
+    ntaken++;
+  }
+
+  // the positions move once per batch, not once per request
+  if (ntaken > 0)
+  {
+    publish(&ch->requests.head, head, &ch->requests.producer_asleep);
+    publish(&ch->answers.tail, ans_tail, &ch->answers.consumer_asleep);
+  }
+
+  return ntaken;
+}
+
+/*
+ * A server thread: serve its share of the channels until stopped
+ */
+static void *serve(void *arg)
+{
+  struct worker *w = arg;
+  struct segment *seg = w->seg;
+  struct doorbell *bell = &seg->bells[w->id];
+
+  while (!atomic_load(&seg->stopped))
+  {
+    // news that arrives during the sweep changes the count, so the
+    // wait below returns at once rather than missing it
+    unsigned seen = atomic_load(&bell->rings);
+    int ntaken = 0;
+
+    for (int c = w->id; c < SHM_CHANNELS; c += seg->nthreads)
+      ntaken += serve_channel(&seg->channels[c]);
+
+    if (ntaken == 0)
+      wait_change(&bell->rings, seen, &bell->asleep, &seg->stopped);
+  }
+
+  return NULL;
+}
+
+// Documented in .h file
+ShmServer SHM_new(const char *name, int nthreads, char *errmsg, size_t errmsg_sz)
+{
+  if (nthreads < 1 || nthreads > SHM_CHANNELS)
+  {
+    snprintf(errmsg, errmsg_sz, "Between 1 and %d threads", SHM_CHANNELS);
+    return NULL;
+  }
+  if (name[0] != '/' || strlen(name) >= NAME_MAX || strchr(name + 1, '/') != NULL)
+  {
+    snprintf(errmsg, errmsg_sz, "Bad segment name %s", name);
+    return NULL;
+  }
+
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0)
+  {
+    snprintf(errmsg, errmsg_sz, "%s: %s", name, strerror(errno));
+    return NULL;
+  }
+
+  // ftruncate zero-fills: every channel starts out free and empty
+  struct segment *seg = MAP_FAILED;
+  if (ftruncate(fd, sizeof(struct segment)) == 0)
+    seg = mmap(NULL, sizeof(struct segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  if (seg == MAP_FAILED)
+  {
+    snprintf(errmsg, errmsg_sz, "%s: %s", name, strerror(errno));
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+  }
+  close(fd);
+
+  seg->nthreads = nthreads;
+  seg->version = SEGMENT_VERSION;
+  atomic_thread_fence(memory_order_release);
+  seg->magic = SEGMENT_MAGIC;
+
+  ShmServer server = malloc(sizeof(struct _shm_server));
+  assert(server != NULL);
+  snprintf(server->name, sizeof(server->name), "%s", name);
+  server->seg = seg;
+
+  return server;
+}
+
+// Documented in .h file
+int SHM_run(ShmServer server)
+{
+  int nthreads = server->seg->nthreads;
+  struct worker *workers = calloc(nthreads, sizeof(struct worker));
+  pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+  int nstarted;
+  int status = 0;
+
+  assert(workers != NULL && threads != NULL);
+
+  for (int i = 0; i < nthreads; i++)
+  {
+    workers[i].seg = server->seg;
+    workers[i].id = i;
+  }
+
+  // the calling thread serves as thread 0
+  for (nstarted = 1; nstarted < nthreads; nstarted++)
+    if (pthread_create(&threads[nstarted], NULL, serve, &workers[nstarted]) != 0)
+    {
+      status = -1;
+      SHM_stop(server);
+      break;
+    }
+
+  serve(&workers[0]);
+
+  for (int i = 1; i < nstarted; i++)
+    pthread_join(threads[i], NULL);
+
+  free(workers);
+  free(threads);
+  return status;
+}
+
+// Documented in .h file
+void SHM_stop(ShmServer server)
+{
+  struct segment *seg = server->seg;
+
+  atomic_store(&seg->stopped, 1);
+
+  for (int i = 0; i < SHM_CHANNELS; i++)
+  {
+    ring_doorbell(&seg->bells[i]);
+    futex_wake(&seg->channels[i].answers.tail);
+    futex_wake(&seg->channels[i].requests.head);
+  }
+}
+
+// Documented in .h file
+void SHM_free(ShmServer server)
+{
+  if (server == NULL)
+    return;
+
+  shm_unlink(server->name);
+  munmap(server->seg, sizeof(struct segment));
+  free(server);
+}
+
+// Documented in .h file
+ShmClient SHM_connect(const char *name, char *errmsg, size_t errmsg_sz)
+{
+  struct stat st;
+  int fd = shm_open(name, O_RDWR, 0);
+
+  if (fd < 0)
+  {
+    snprintf(errmsg, errmsg_sz, "%s: %s", name, strerror(errno));
+    return NULL;
+  }
+
+  struct segment *seg = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size == sizeof(struct segment))
+    seg = mmap(NULL, sizeof(struct segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (seg == MAP_FAILED || seg->magic != SEGMENT_MAGIC || seg->version != SEGMENT_VERSION)
+  {
+    snprintf(errmsg, errmsg_sz, "%s: not an expression server segment", name);
+    if (seg != MAP_FAILED)
+      munmap(seg, sizeof(struct segment));
+    return NULL;
+  }
+
+  for (int c = 0; c < SHM_CHANNELS; c++)
+  {
+    struct channel *ch = &seg->channels[c];
+    unsigned expected = CHANNEL_FREE;
+
+    if (!atomic_compare_exchange_strong(&ch->state, &expected, CHANNEL_OPEN))
+      continue;
+
+    ShmClient client = malloc(sizeof(struct _shm_client));
+    assert(client != NULL);
+
+    client->seg = seg;
+    client->ch = ch;
+    client->bell = &seg->bells[c % seg->nthreads];
+    client->reserved = NULL;
+
+    // the server has drained the requests of the last owner; its
+    // unread answers are skipped
+    client->req_tail = atomic_load(&ch->requests.tail);
+    client->ans_head = atomic_load(&ch->answers.tail);
+    atomic_store(&ch->answers.head, client->ans_head);
+
+    return client;
+  }
+
+  snprintf(errmsg, errmsg_sz, "%s: all %d channels are taken", name, SHM_CHANNELS);
+  munmap(seg, sizeof(struct segment));
+  return NULL;
+}
+
+// Documented in .h file
+char *SHM_reserve(ShmClient client, size_t len)
+{
+  struct ring *ring = &client->ch->requests;
+
+  if (len > SHM_MAX_EXPR)
+    return NULL;
+
+  for (;;)
+  {
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    struct record *rec = ring_room(ring, &client->req_tail, head, len);
+
+    if (rec != NULL)
+    {
+      rec->len = len;
+      rec->kind = REC_EXPR;
+      client->reserved = rec;
+      return (char *)(rec + 1);
+    }
+
+    if (atomic_load(&client->seg->stopped))
+      return NULL;
+    wait_change(&ring->head, head, &ring->producer_asleep, &client->seg->stopped);
+  }
+}
+
+// Documented in .h file
+void SHM_submit(ShmClient client)
+{
+  assert(client->reserved != NULL);
+
+  client->req_tail += record_size(client->reserved->len);
+  client->reserved = NULL;
+
+  atomic_store(&client->ch->requests.tail, client->req_tail);
+  ring_doorbell(client->bell);
+}
+
+// Documented in .h file
+int SHM_send(ShmClient client, const char *expr, size_t len)
+{
+  char *dest = SHM_reserve(client, len);
+
+  if (dest == NULL)
+    return -1;
+
+  memcpy(dest, expr, len);
+  SHM_submit(client);
+  return 0;
+}
+
+// Documented in .h file
+int SHM_receive(ShmClient client, double *value, char *errmsg, size_t errmsg_sz)
+{
+  struct channel *ch = client->ch;
+
+  for (;;)
+  {
+    unsigned tail = atomic_load_explicit(&ch->answers.tail, memory_order_acquire);
+    struct record *rec = ring_next(&ch->answers, &client->ans_head, tail);
+
+    if (rec != NULL)
+    {
+      int status = 0;
+
+      if (rec->kind == REC_VALUE)
+        memcpy(value, rec + 1, sizeof(*value));
+      else
+      {
+        snprintf(errmsg, errmsg_sz, "%.*s", (int)rec->len, (const char *)(rec + 1));
+        status = -1;
+      }
+
+      client->ans_head += record_size(rec->len);
+      atomic_store(&ch->answers.head, client->ans_head);
+      if (atomic_load(&ch->server_blocked))
+        ring_doorbell(client->bell);
+
+      return status;
+    }
+
+    if (atomic_load(&client->seg->stopped))
+    {
+      snprintf(errmsg, errmsg_sz, "Server stopped");
+      return -1;
+    }
+    wait_change(&ch->answers.tail, tail, &ch->answers.consumer_asleep, &client->seg->stopped);
+  }
+}
+
+// Documented in .h file
+void SHM_disconnect(ShmClient client)
+{
+  if (client == NULL)
+    return;
+
+  atomic_store_explicit(&client->ch->state, CHANNEL_CLOSING, memory_order_release);
+  ring_doorbell(client->bell);
+
+  munmap(client->seg, sizeof(struct segment));
+  free(client);
+}
@@ -0,0 +1,170 @@
+/*
+ * expr_shm.h
+ *
+ * A shared-memory transport, for programs on the same host that want
+ * to submit expressions without a system call or a copy per request.
+ *
+ * The server creates a named POSIX shared memory segment holding
+ * SHM_CHANNELS channels. A client claims a free channel and owns it
+ * until it disconnects; each channel is a pair of single-producer
+ * single-consumer rings, one for requests and one for answers. The
+ * client writes an expression straight into the request ring, and the
+ * server thread that owns the channel tokenizes it where it lies and
+ * writes back the value, as a double, or an error message. Answers
+ * come back in the order of the requests.
+ *
+ * Each server thread serves a fixed share of the channels, so every
+ * ring has exactly one writer and one reader, and nothing is locked.
+ * A side that finds nothing to do spins briefly and then sleeps on a
+ * futex in the segment; the other side only makes the wake-up system
+ * call when it sees that someone is asleep. Clients wake a server
+ * thread through a doorbell word it shares with its other channels.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#ifndef _EXPR_SHM_H_
+#define _EXPR_SHM_H_
+
+#include <stddef.h>
+
+typedef struct _shm_server *ShmServer;
+typedef struct _shm_client *ShmClient;
+
+// The number of channels, and so of clients at a time, in a segment
+#define SHM_CHANNELS 32
+
+// The size in bytes of each ring
+#define SHM_RING_SIZE (1 << 16)
+
+// The longest expression a request may hold
+#define SHM_MAX_EXPR (SHM_RING_SIZE / 4)
+
+/*
+ * Create the shared memory segment and get ready to serve it. Nothing
+ * is served until SHM_run is called.
+ *
+ * Parameters:
+ *   name       The name of the segment, as for shm_open: "/" and up to
+ *              NAME_MAX characters with no other '/'; it must not exist
+ *   nthreads   The number of server threads, 1 to SHM_CHANNELS
+ *   errmsg     Return space for an error message, filled in in case of error
+ *   errmsg_sz  The size of errmsg
+ *
+ * Returns: The server, or NULL in case of error
+ */
+ShmServer SHM_new(const char *name, int nthreads, char *errmsg, size_t errmsg_sz);
+
+/*
+ * Serve the channels until SHM_stop is called. The calling thread is
+ * one of the server threads.
+ *
+ * Parameters:
+ *   server     The server
+ *
+ * Returns: 0, or -1 if the threads could not be started
+ */
+int SHM_run(ShmServer server);
+
+/*
+ * Make SHM_run return, and the clients' calls that wait on the server
+ * fail. May be called from any thread, and from a signal handler.
+ *
+ * Parameters:
+ *   server     The server
+ *
+ * Returns: None
+ */
+void SHM_stop(ShmServer server);
+
+/*
+ * Destroy the server and remove the segment's name; clients still
+ * attached keep their mapping until they disconnect. SHM_run must not
+ * be running.
+ *
+ * Parameters:
+ *   server     The server; may be NULL
+ *
+ * Returns: None
+ */
+void SHM_free(ShmServer server);
+
+/*
+ * Attach to a server's segment and claim a channel
+ *
+ * Parameters:
+ *   name       The name the server was created with
+ *   errmsg     Return space for an error message, filled in in case of error
+ *   errmsg_sz  The size of errmsg
+ *
+ * Returns: The client, or NULL in case of error, such as no free channel
+ */
+ShmClient SHM_connect(const char *name, char *errmsg, size_t errmsg_sz);
+
+/*
+ * Make room for a request in the ring, waiting for the server to take
+ * earlier ones if it is full. The caller writes the expression at the
+ * address returned, and sends it with SHM_submit. A client that sends
+ * more than a ringful of requests before receiving their answers must
+ * receive some in between, or the server stops taking its requests.
+ * A client that writes outside what it reserved, breaking the records
+ * of the ring, gets the one answer "Corrupt request" for all of the
+ * requests the server had not yet taken.
+ *
+ * Parameters:
+ *   client     The client
+ *   len        The length of the expression, at most SHM_MAX_EXPR
+ *
+ * Returns: Where to write the expression, or NULL if len is too large
+ *   or the server has stopped
+ */
+char *SHM_reserve(ShmClient client, size_t len);
+
+/*
+ * Send the request made room for by the last SHM_reserve
+ *
+ * Parameters:
+ *   client     The client
+ *
+ * Returns: None
+ */
+void SHM_submit(ShmClient client);
+
+/*
+ * Send a request: SHM_reserve, copy and SHM_submit
+ *
+ * Parameters:
+ *   client     The client
+ *   expr       The expression; need not be NUL-terminated
+ *   len        Its length, at most SHM_MAX_EXPR
+ *
+ * Returns: 0, or -1 if len is too large or the server has stopped
+ */
+int SHM_send(ShmClient client, const char *expr, size_t len);
+
+/*
+ * Wait for the answer to the oldest request not yet answered
+ *
+ * Parameters:
+ *   client     The client
+ *   value      Return space for the value of the expression
+ *   errmsg     Return space for an error message, filled in in case of error
+ *   errmsg_sz  The size of errmsg
+ *
+ * Returns: 0 if *value was set, or -1 if the expression was in error
+ *   or the server has stopped, as errmsg says
+ */
+int SHM_receive(ShmClient client, double *value, char *errmsg, size_t errmsg_sz);
+
+/*
+ * Give back the channel, dropping any answers not yet received, and
+ * detach from the segment
+ *
+ * Parameters:
+ *   client     The client; may be NULL
+ *
+ * Returns: None
+ */
+void SHM_disconnect(ShmClient client);
+
+#endif /* _EXPR_SHM_H_ */
@@ -13,52 +13,60 @@
 #include <math.h>
 
 #include "expr_tree.h"
+#include "expr_tree_priv.h"
+#include "fastmath.h"
+#include "dtoa.h"
+#include "heap.h"
+#include "trace.h"
 
-#define LEFT 0
-#define RIGHT 1
-
-struct _expr_tree_node
-{
-  ExprNodeType type;
-  union
-  {
-    struct _expr_tree_node *child[2];
-    double value;
-  } n;
-};
+#define CHAIN_CAPACITY 4  // operands a chain has room for at first
+#define REDUCE_BLOCK 16   // operands ET_reduce combines in a local array
 
 /*
- * Convert an ExprNodeType into a printable character
+ * Convert an ExprNodeType into a printable operator
  *
  * Parameters:
  *   ent    The ExprNodeType to convert
  *
- * Returns: A single character representing the ent
+ * Returns: A string representing the ent
  */
-static char ExprNodeType_to_char(ExprNodeType ent)
+static const char *ExprNodeType_to_str(ExprNodeType ent)
 {
   switch (ent)
   {
   case OP_SUB:
   case UNARY_NEGATE:
-    return '-';
+    return "-";
   case OP_ADD:
-    return '+';
+    return "+";
   case OP_MUL:
-    return '*';
+    return "*";
   case OP_DIV:
-    return '/';
+    return "/";
   case OP_POWER:
-    return '^';
+    return "^";
+  case OP_LT:
+    return "<";
+  case OP_LE:
+    return "<=";
+  case OP_GT:
+    return ">";
+  case OP_GE:
+    return ">=";
+  case OP_EQ:
+    return "==";
+  case OP_NE:
+    return "!=";
   default:
     assert(0);
   }
+  return "?";
 }
 
 // Documented in .h file
 ExprTree ET_value(double value)
 {
-  ExprTree tree = malloc(sizeof(struct _expr_tree_node));
+  ExprTree tree = HP_malloc(HP_EXPR_TREE, sizeof(struct _expr_tree_node));
   assert(tree != NULL);
   
   tree->type = VALUE;
@@ -66,15 +74,28 @@ ExprTree ET_value(double value)
   return tree;
 }
 
+// Documented in .h file
+ExprTree ET_variable(Variable var)
+{
+  ExprTree tree = HP_malloc(HP_EXPR_TREE, sizeof(struct _expr_tree_node));
+  assert(tree != NULL);
+
+  tree->type = VARIABLE;
+  tree->n.var = var;
+  return tree;
+}
+
 // Documented in .h file
 ExprTree ET_node(ExprNodeType op, ExprTree left, ExprTree right)
 {
-  if (op == UNARY_NEGATE)
-    assert(right == NULL);
+  assert(op != VALUE && op != VARIABLE && op != OP_COND);
+
+  if (ET_arity(op) == 1)
+    assert(left != NULL && right == NULL);
   else
     assert(left != NULL && right != NULL);
 
-  ExprTree tree = malloc(sizeof(struct _expr_tree_node));
+  ExprTree tree = HP_malloc(HP_EXPR_TREE, sizeof(struct _expr_tree_node));
   tree->type = op;
   tree->n.child[LEFT] = left;
   tree->n.child[RIGHT] = right;
@@ -82,18 +103,107 @@ ExprTree ET_node(ExprNodeType op, ExprTree left, ExprTree right)
 }
 
 // Documented in .h file
-void ET_free(ExprTree tree)
+ExprTree ET_cond(ExprTree cond, ExprTree if_true, ExprTree if_false)
 {
-  if (tree == NULL)
-    return;
+  assert(cond != NULL && if_true != NULL && if_false != NULL);
+
+  ExprTree tree = HP_malloc(HP_EXPR_TREE, sizeof(struct _expr_tree_node));
+  assert(tree != NULL);
+
+  tree->type = OP_COND;
+  tree->n.child[COND_TEST] = cond;
+  tree->n.child[COND_TRUE] = if_true;
+  tree->n.child[COND_FALSE] = if_false;
+  return tree;
+}
+
+// Documented in .h file
+ExprTree ET_chain(ExprNodeType op, ExprTree left, ExprTree right)
+{
+  if (op != OP_ADD && op != OP_MUL)
+    return ET_node(op, left, right);
 
-  if (tree->type != VALUE)
+  assert(left != NULL && right != NULL);
+
+  ExprNodeType type = (op == OP_ADD) ? OP_SUM : OP_PRODUCT;
+
+  // the third operand turns the node of the first two into a chain
+  if (left->type == op)
+  {
+    ExprTree *ops = HP_malloc(HP_EXPR_TREE, CHAIN_CAPACITY * sizeof(ExprTree));
+    assert(ops != NULL);
+
+    ops[0] = left->n.child[LEFT];
+    ops[1] = left->n.child[RIGHT];
+    left->type = type;
+    left->n.list.ops = ops;
+    left->n.list.count = 2;
+    left->n.list.capacity = CHAIN_CAPACITY;
+  }
+
+  if (left->type != type)
+    return ET_node(op, left, right);
+
+  if (left->n.list.count == left->n.list.capacity)
+  {
+    left->n.list.capacity *= 2;
+    left->n.list.ops = HP_realloc(HP_EXPR_TREE, left->n.list.ops, left->n.list.capacity * sizeof(ExprTree));
+    assert(left->n.list.ops != NULL);
+  }
+
+  left->n.list.ops[left->n.list.count++] = right;
+  return left;
+}
+
+static void free_tree(ExprTree tree);
+
+/*
+ * Free everything below the node at the root of a tree, but not the
+ * node itself
+ */
+static void free_children(ExprTree tree)
+{
+  if (ET_is_chain(tree))
   {
-    ET_free(tree->n.child[LEFT]);
-    ET_free(tree->n.child[RIGHT]);
+    for (int i = 0; i < tree->n.list.count; i++)
+      free_tree(tree->n.list.ops[i]);
+
+    HP_free(HP_EXPR_TREE, tree->n.list.ops);
+    return;
   }
 
-  free(tree);
+  for (int i = 0; i < ET_arity(tree->type); i++)
+    free_tree(tree->n.child[i]);
+}
+
+/*
+ * ET_free, less the tracing
+ */
+static void free_tree(ExprTree tree)
+{
+  if (tree == NULL)
+    return;
+
+  free_children(tree);
+  HP_free(HP_EXPR_TREE, tree);
+}
+
+// Documented in expr_tree_priv.h
+void ET_replace(ExprTree tree, ExprTree with)
+{
+  assert(tree != NULL && with != NULL && tree != with);
+
+  free_children(tree);
+  *tree = *with;
+  HP_free(HP_EXPR_TREE, with);
+}
+
+// Documented in .h file
+void ET_free(ExprTree tree)
+{
+  TR_BEGIN("free");
+  free_tree(tree);
+  TR_END("free");
 }
 
 // Documented in .h file
@@ -102,10 +212,20 @@ int ET_count(ExprTree tree)
   if (tree == NULL)
     return 0;
 
-  if (tree->type == VALUE)
-    return 1;
+  // a chain counts as the nodes it stands for, one fewer than its operands
+  int count = ET_is_chain(tree) ? tree->n.list.count - 1 : 1;
+
+  if (ET_is_chain(tree))
+  {
+    for (int i = 0; i < tree->n.list.count; i++)
+      count += ET_count(tree->n.list.ops[i]);
+    return count;
+  }
 
-  return 1 + ET_count(tree->n.child[LEFT]) + ET_count(tree->n.child[RIGHT]);
+  for (int i = 0; i < ET_arity(tree->type); i++)
+    count += ET_count(tree->n.child[i]);
+
+  return count;
 }
 
 // Documented in .h file
@@ -114,17 +234,83 @@ int ET_depth(ExprTree tree)
   if (tree == NULL)
     return 0;
 
-  if (tree->type == VALUE)
-    return 1;
+  int depth = 0;
+  int nchildren = ET_is_chain(tree) ? tree->n.list.count : ET_arity(tree->type);
+  ExprTree *children = ET_is_chain(tree) ? tree->n.list.ops : tree->n.child;
 
-  int left = ET_depth(tree->n.child[LEFT]);
-  int right = ET_depth(tree->n.child[RIGHT]);
+  for (int i = 0; i < nchildren; i++)
+  {
+    int child = ET_depth(children[i]);
+    if (child > depth)
+      depth = child;
+  }
 
-  return 1 + (left > right ? left : right);
+  return 1 + depth;
 }
 
-// Documented in .h file
-double ET_evaluate(ExprTree tree)
+static double evaluate(ExprTree tree);
+
+/*
+ * Combine count values in the order of ET_split, level by level: each
+ * pass combines adjacent pairs, the odd one out (if any) passing
+ * through to the next. The pairs of a pass are independent of each
+ * other, so they can be computed side by side.
+ *
+ * Parameters:
+ *   op       OP_ADD or OP_MUL
+ *   vals     The values; overwritten
+ *   count    Number of values, at least 1
+ *
+ * Returns: The combined value
+ */
+static double reduce_block(ExprNodeType op, double *vals, int count)
+{
+  while (count > 1)
+  {
+    int half = count / 2;
+
+    if (op == OP_ADD)
+      for (int i = 0; i < half; i++)
+        vals[i] = vals[2 * i] + vals[2 * i + 1];
+    else
+      for (int i = 0; i < half; i++)
+        vals[i] = vals[2 * i] * vals[2 * i + 1];
+
+    if (count % 2 != 0)
+      vals[half] = vals[count - 1];
+
+    count -= half;
+  }
+
+  return vals[0];
+}
+
+// Documented in expr_tree_priv.h
+double ET_reduce(ExprTree tree, int first, int count)
+{
+  ExprNodeType op = ET_chain_op(tree->type);
+
+  if (count <= REDUCE_BLOCK)
+  {
+    double vals[REDUCE_BLOCK];
+
+    for (int i = 0; i < count; i++)
+      vals[i] = evaluate(tree->n.list.ops[first + i]);
+
+    return reduce_block(op, vals, count);
+  }
+
+  int half = ET_split(count);
+  double left = ET_reduce(tree, first, half);
+  double right = ET_reduce(tree, first + half, count - half);
+
+  return ET_apply(op, left, right);
+}
+
+/*
+ * ET_evaluate, less the tracing
+ */
+static double evaluate(ExprTree tree)
 {
   if (tree == NULL)
     return 0;
@@ -132,30 +318,91 @@ double ET_evaluate(ExprTree tree)
   if (tree->type == VALUE)
     return tree->n.value;
 
-  double left = ET_evaluate(tree->n.child[LEFT]);
-  double right = ET_evaluate(tree->n.child[RIGHT]);
+  if (tree->type == VARIABLE)
+    return tree->n.var->value;
 
-  switch (tree->type)
+  // only the branch that is taken gets evaluated
+  if (tree->type == OP_COND)
   {
-  case OP_ADD:
-    return left + right;
-  case OP_SUB:
-    return left - right;
-  case OP_MUL:
-    return left * right;
-  case OP_DIV:
-    return left / right;
-  case OP_POWER:
-    return pow(left, right);
-  case UNARY_NEGATE:
-    return -left;
-  default:
-    assert(0);
+    if (evaluate(tree->n.child[COND_TEST]) != 0)
+      return evaluate(tree->n.child[COND_TRUE]);
+    return evaluate(tree->n.child[COND_FALSE]);
   }
+
+  if (ET_is_chain(tree))
+    return ET_reduce(tree, 0, tree->n.list.count);
+
+  double left = evaluate(tree->n.child[LEFT]);
+  double right = evaluate(tree->n.child[RIGHT]);
+
+  return ET_apply(tree->type, left, right);
 }
 
 // Documented in .h file
-size_t ET_tree2string(ExprTree tree, char *buf, size_t buf_sz)
+double ET_evaluate(ExprTree tree)
+{
+  TR_BEGIN("evaluate");
+  double value = evaluate(tree);
+  TR_END("evaluate");
+  return value;
+}
+
+static size_t tree2string(ExprTree tree, char *buf, size_t buf_sz);
+
+/*
+ * Write s into buf from offset at, as much of it as fits
+ *
+ * Returns: The length of s
+ */
+static size_t append(char *buf, size_t buf_sz, size_t at, const char *s)
+{
+  if (at < buf_sz)
+    snprintf(buf + at, buf_sz - at, "%s", s);
+
+  return strlen(s);
+}
+
+/*
+ * Write a chain into buf just as its nested nodes would be written:
+ * a '(' for each operand but the first, then the operands, each one
+ * but the first followed by a ')'
+ *
+ * Returns: The length of the whole string, even if it did not fit
+ */
+static size_t chain2string(ExprTree tree, char *buf, size_t buf_sz)
+{
+  const char *op = ExprNodeType_to_str(ET_chain_op(tree->type));
+  char operand[buf_sz];
+  size_t length = 0;
+
+  for (int i = 1; i < tree->n.list.count; i++)
+    length += append(buf, buf_sz, length, "(");
+
+  // once the buffer is full, the rest of a long chain need not be formatted
+  for (int i = 0; i < tree->n.list.count && length < buf_sz; i++)
+  {
+    tree2string(tree->n.list.ops[i], operand, buf_sz);
+
+    if (i > 0)
+    {
+      length += append(buf, buf_sz, length, " ");
+      length += append(buf, buf_sz, length, op);
+      length += append(buf, buf_sz, length, " ");
+    }
+
+    length += append(buf, buf_sz, length, operand);
+
+    if (i > 0)
+      length += append(buf, buf_sz, length, ")");
+  }
+
+  return length;
+}
+
+/*
+ * ET_tree2string, less the tracing
+ */
+static size_t tree2string(ExprTree tree, char *buf, size_t buf_sz)
 {
   if (tree == NULL || buf == NULL || buf_sz == 0)
     return 0;
@@ -164,25 +411,52 @@ size_t ET_tree2string(ExprTree tree, char *buf, size_t buf_sz)
   char leftBuffer[buf_sz];
   char rightBuffer[buf_sz];
 
-  // write to buffer if it is a value
+  // write to buffer if it is a value, in full: it reads back the same
   if (tree->type == VALUE)
-    length = snprintf(buf, buf_sz, "%g", tree->n.value);
+  {
+    char value[DT_BUFFER_SIZE];
+
+    DT_format(tree->n.value, DT_SHORTEST, value);
+    length = snprintf(buf, buf_sz, "%s", value);
+  }
+  else if (tree->type == VARIABLE)
+    length = snprintf(buf, buf_sz, "%s", tree->n.var->name);
+  else if (ET_is_chain(tree))
+    length = chain2string(tree, buf, buf_sz);
   else
   {
     // process the left child
-    size_t leftLength = ET_tree2string(tree->n.child[LEFT], leftBuffer, buf_sz);
+    size_t leftLength = tree2string(tree->n.child[LEFT], leftBuffer, buf_sz);
 
     // print to the buffer if unary negate
     if (tree->type == UNARY_NEGATE)
       length = snprintf(buf, buf_sz, "(-%s)", leftBuffer);
 
+    else if (FN_is_function(tree->type) && ET_arity(tree->type) == 1)
+      length = snprintf(buf, buf_sz, "%s(%s)", FN_for_op(tree->type)->name, leftBuffer);
+
+    else if (FN_is_function(tree->type))
+    {
+      tree2string(tree->n.child[RIGHT], rightBuffer, buf_sz);
+      length = snprintf(buf, buf_sz, "%s(%s, %s)", FN_for_op(tree->type)->name, leftBuffer, rightBuffer);
+    }
+
+    else if (tree->type == OP_COND)
+    {
+      char falseBuffer[buf_sz];
+
+      tree2string(tree->n.child[COND_TRUE], rightBuffer, buf_sz);
+      tree2string(tree->n.child[COND_FALSE], falseBuffer, buf_sz);
+      length = snprintf(buf, buf_sz, "(%s ? %s : %s)", leftBuffer, rightBuffer, falseBuffer);
+    }
+
     else
     {
       // process the right child
-      size_t rightLength = ET_tree2string(tree->n.child[RIGHT], rightBuffer, buf_sz);
+      size_t rightLength = tree2string(tree->n.child[RIGHT], rightBuffer, buf_sz);
 
       // print to the buffer both children
-      if (tree->n.child[LEFT]->type != VALUE)
+      if (!ET_is_leaf(tree->n.child[LEFT]))
       {
         char tempBuffer[buf_sz];
         snprintf(tempBuffer, buf_sz, "%s", leftBuffer);
@@ -190,7 +464,7 @@ size_t ET_tree2string(ExprTree tree, char *buf, size_t buf_sz)
         leftLength += 2;
       }
 
-      if (tree->n.child[RIGHT]->type != VALUE)
+      if (!ET_is_leaf(tree->n.child[RIGHT]))
       {
         char tempBuffer[buf_sz];
         snprintf(tempBuffer, buf_sz, "%s", rightBuffer);
@@ -199,7 +473,7 @@ size_t ET_tree2string(ExprTree tree, char *buf, size_t buf_sz)
       }
 
       // finally print to the buffer the whole expression
-      length = snprintf(buf, buf_sz, "(%s %c %s)", leftBuffer, ExprNodeType_to_char(tree->type), rightBuffer);
+      length = snprintf(buf, buf_sz, "(%s %s %s)", leftBuffer, ExprNodeType_to_str(tree->type), rightBuffer);
     }
   }
 
@@ -213,4 +487,82 @@ size_t ET_tree2string(ExprTree tree, char *buf, size_t buf_sz)
 
   buf[length] = '\0';
   return length;
-}
\ No newline at end of file
+}
+
+// Documented in .h file
+size_t ET_tree2string(ExprTree tree, char *buf, size_t buf_sz)
+{
+  TR_BEGIN("tree2string");
+  size_t length = tree2string(tree, buf, buf_sz);
+  TR_END("tree2string");
+  return length;
+}
+
+// Documented in expr_tree_priv.h
+void ET_apply_block(ExprNodeType type, double *out, const double *left, const double *right, int n, bool approx)
+{
+  if (FN_is_function(type))
+  {
+    MathFunc func = FN_for_op(type);
+
+    (approx ? func->approx_block : func->block)(out, left, right, n);
+    return;
+  }
+
+  switch (type)
+  {
+  case UNARY_NEGATE:
+    for (int i = 0; i < n; i++)
+      out[i] = -left[i];
+    break;
+  case OP_ADD:
+    for (int i = 0; i < n; i++)
+      out[i] = left[i] + right[i];
+    break;
+  case OP_SUB:
+    for (int i = 0; i < n; i++)
+      out[i] = left[i] - right[i];
+    break;
+  case OP_MUL:
+    for (int i = 0; i < n; i++)
+      out[i] = left[i] * right[i];
+    break;
+  case OP_DIV:
+    for (int i = 0; i < n; i++)
+      out[i] = left[i] / right[i];
+    break;
+  case OP_POWER:
+    if (approx)
+      FM_pow_block(out, left, right, n);
+    else
+      for (int i = 0; i < n; i++)
+        out[i] = pow(left[i], right[i]);
+    break;
+  case OP_LT:
+    for (int i = 0; i < n; i++)
+      out[i] = left[i] < right[i];
+    break;
+  case OP_LE:
+    for (int i = 0; i < n; i++)
+      out[i] = left[i] <= right[i];
+    break;
+  case OP_GT:
+    for (int i = 0; i < n; i++)
+      out[i] = left[i] > right[i];
+    break;
+  case OP_GE:
+    for (int i = 0; i < n; i++)
+      out[i] = left[i] >= right[i];
+    break;
+  case OP_EQ:
+    for (int i = 0; i < n; i++)
+      out[i] = left[i] == right[i];
+    break;
+  case OP_NE:
+    for (int i = 0; i < n; i++)
+      out[i] = left[i] != right[i];
+    break;
+  default:
+    assert(0);
+  }
+}
@@ -14,6 +14,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "vars.h"
+
 typedef struct _expr_tree_node *ExprTree;
 
 typedef enum
@@ -24,7 +26,25 @@ typedef enum
   OP_SUB,
   OP_MUL,
   OP_DIV,
-  OP_POWER
+  OP_POWER,
+  VARIABLE,
+  OP_LT, // comparisons give 1 if true and 0 if false
+  OP_LE,
+  OP_GT,
+  OP_GE,
+  OP_EQ,
+  OP_NE,
+  OP_COND, // cond ? if_true : if_false
+  OP_SQRT,  // the built-in functions; see funcs.h
+  OP_EXP,
+  OP_LOG,
+  OP_SIN,
+  OP_COS,
+  OP_ABS,
+  OP_MIN,
+  OP_MAX,
+  OP_SUM, // a chain of OP_ADD or OP_MUL, as made by ET_chain
+  OP_PRODUCT
 } ExprNodeType;
 
 /*
@@ -41,14 +61,30 @@ typedef enum
  */
 ExprTree ET_value(double value);
 
+/*
+ * Create a variable node on the tree. Like a value node, a variable
+ * node is always a leaf; it evaluates to the current value of var.
+ *
+ * Parameters:
+ *   var      The variable, which must outlive the tree
+ *
+ * Returns:
+ *   The new tree, which will consist of a single leaf node
+ *
+ * It is the responsibility of the caller to call ET_free on a tree
+ * that contains this leaf.
+ */
+ExprTree ET_variable(Variable var);
+
 /*
  * Create an interior node on tree. An interior node always represents
- * an arithmetic operation.
+ * an arithmetic operation or a call to a built-in function.
  *
  * Parameters:
- *   op       The operator
- *   left     Left side of the operator
- *   right    Right side of the operator
+ *   op       The operator or function
+ *   left     Left side of the operator, or the first argument
+ *   right    Right side of the operator, or the second argument; NULL
+ *            for UNARY_NEGATE and the functions of one argument
  *
  * Returns: The new tree, which will consist of an interior node with
  *   two children.
@@ -58,6 +94,45 @@ ExprTree ET_value(double value);
  */
 ExprTree ET_node(ExprNodeType op, ExprTree left, ExprTree right);
 
+/*
+ * Like ET_node, except that OP_ADD and OP_MUL extend a chain: if left
+ * is already a sum (or product) of two operands or more, right is
+ * added to its operands rather than put in a new node above it. A
+ * chain of n operands is then one node, as deep as its deepest
+ * operand plus one, rather than n - 1 nodes each above the last, and
+ * the evaluators combine its operands pairwise (see ET_evaluate).
+ * ET_tree2string prints a chain just as it would the nested nodes.
+ *
+ * Parameters:
+ *   op       The operator or function
+ *   left     Left side of the operator; taken over if it is a chain
+ *   right    Right side of the operator
+ *
+ * Returns: The new tree, or left with right added to it
+ *
+ * It is the responsibility of the caller to call ET_free on a tree
+ * that contains this node
+ */
+ExprTree ET_chain(ExprNodeType op, ExprTree left, ExprTree right);
+
+/*
+ * Create a conditional node on the tree: if_true when cond evaluates
+ * to anything other than 0 (NaN included), and if_false otherwise.
+ * Only the branch that is taken is evaluated by ET_evaluate.
+ *
+ * Parameters:
+ *   cond      The condition
+ *   if_true   Value of the node when the condition holds
+ *   if_false  Value of the node otherwise
+ *
+ * Returns: The new tree, which will consist of an interior node with
+ *   three children.
+ *
+ * It is the responsibility of the caller to call ET_free on a tree
+ * that contains this node
+ */
+ExprTree ET_cond(ExprTree cond, ExprTree if_true, ExprTree if_false);
+
 /*
  * Destroy an ExprTree, calling free() on all malloc'd memory
  *
@@ -70,7 +145,9 @@ void ET_free(ExprTree tree);
 
 /*
  * Return the number of nodes in the tree, including both leaf and
- * interior nodes in the count.
+ * interior nodes in the count. A chain of n operands counts as the
+ * n - 1 nodes it stands for, so the count does not depend on whether
+ * the tree was built with ET_node or ET_chain.
  *
  * Parameters:
  *   tree     The tree
@@ -91,7 +168,16 @@ int ET_count(ExprTree tree);
 int ET_depth(ExprTree tree);
 
 /*
- * Evaluate an ExprTree and return the resulting value
+ * Evaluate an ExprTree and return the resulting value. Variables take
+ * their current values.
+ *
+ * The operands of a chain are combined pairwise: a range of them is
+ * split after the largest power of two below its length, and the two
+ * halves are combined recursively, which is the same as combining
+ * adjacent pairs level by level. The rounding error of a sum then
+ * grows with the log of its length rather than the length, and its
+ * additions do not wait on one another. Chains of up to 3 operands
+ * give exactly the result of the nested nodes.
  *
  * Parameters:
  *   tree     The tree to compute
@@ -116,6 +202,9 @@ double ET_evaluate(ExprTree tree);
  * Buf will always be terminated with a \0 and in no case will this
  * function write characters beyond the end of buf.
  *
+ * Constants are written in full (see DT_format), so they read back as
+ * exactly the same doubles.
+ *
  * Returns: The number of characters written to buf, not counting the
  * \0 terminator.
  */
@@ -0,0 +1,222 @@
+/*
+ * expr_tree_priv.h
+ *
+ * Private definitions shared by the modules that walk an ExprTree
+ * directly. Not part of the public interface; users of the tree
+ * should include expr_tree.h only.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#ifndef _EXPR_TREE_PRIV_H_
+#define _EXPR_TREE_PRIV_H_
+
+#include <assert.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "expr_tree.h"
+#include "vars.h"
+#include "funcs.h"
+
+#define LEFT 0
+#define RIGHT 1
+#define COND_TEST 0  // the children of an OP_COND node
+#define COND_TRUE 1
+#define COND_FALSE 2
+
+struct _expr_tree_node
+{
+  ExprNodeType type;
+  union
+  {
+    struct _expr_tree_node *child[3];
+    double value;
+    Variable var;
+    struct
+    {
+      struct _expr_tree_node **ops;
+      int count;
+      int capacity;
+    } list; // the operands of OP_SUM and OP_PRODUCT, in order
+  } n;
+};
+
+/*
+ * Returns true if tree is a leaf, i.e. a VALUE or a VARIABLE node
+ */
+static inline bool ET_is_leaf(ExprTree tree)
+{
+  return tree->type == VALUE || tree->type == VARIABLE;
+}
+
+/*
+ * Returns true if tree is a chain, i.e. an OP_SUM or an OP_PRODUCT
+ * node, whose operands are in n.list rather than n.child
+ */
+static inline bool ET_is_chain(ExprTree tree)
+{
+  return tree->type == OP_SUM || tree->type == OP_PRODUCT;
+}
+
+/*
+ * Return the binary operator that a chain applies between operands
+ */
+static inline ExprNodeType ET_chain_op(ExprNodeType type)
+{
+  assert(type == OP_SUM || type == OP_PRODUCT);
+  return (type == OP_SUM) ? OP_ADD : OP_MUL;
+}
+
+/*
+ * Where to split a range of count >= 2 operands of a chain: after the
+ * largest power of two below count. The evaluators all combine the
+ * operands in this order, each half first and then the two halves
+ * with ET_apply(ET_chain_op(type), ...), so that they produce
+ * bit-identical results; the compilers expand a chain into the
+ * binary nodes of this order.
+ *
+ * Returns: The number of operands in the first half
+ */
+static inline int ET_split(int count)
+{
+  assert(count >= 2);
+  return 1 << (31 - __builtin_clz(count - 1));
+}
+
+/*
+ * Return the number of children of a node type: 0 for leaves, 1 for
+ * UNARY_NEGATE and the functions of one argument, 3 for OP_COND and 2
+ * for every other operator. Chains have a number of their own, in
+ * n.list.count.
+ */
+static inline int ET_arity(ExprNodeType type)
+{
+  switch (type)
+  {
+  case VALUE:
+  case VARIABLE:
+    return 0;
+  case UNARY_NEGATE:
+  case OP_SQRT:
+  case OP_EXP:
+  case OP_LOG:
+  case OP_SIN:
+  case OP_COS:
+  case OP_ABS:
+    return 1;
+  case OP_COND:
+    return 3;
+  case OP_SUM:
+  case OP_PRODUCT:
+    assert(0);
+    return 0;
+  default:
+    return 2;
+  }
+}
+
+/*
+ * Apply a binary or unary operator to already-evaluated operands. All
+ * evaluators go through this function, so that they produce
+ * bit-identical results for the same tree.
+ *
+ * Parameters:
+ *   op       The operator; must not be a leaf type or OP_COND
+ *   left     Value of the left child
+ *   right    Value of the right child (ignored for unary operators)
+ *
+ * Returns: The computed value
+ */
+static inline double ET_apply(ExprNodeType op, double left, double right)
+{
+  switch (op)
+  {
+  case OP_ADD:
+    return left + right;
+  case OP_SUB:
+    return left - right;
+  case OP_MUL:
+    return left * right;
+  case OP_DIV:
+    return left / right;
+  case OP_POWER:
+    return pow(left, right);
+  case UNARY_NEGATE:
+    return -left;
+  case OP_LT:
+    return left < right;
+  case OP_LE:
+    return left <= right;
+  case OP_GT:
+    return left > right;
+  case OP_GE:
+    return left >= right;
+  case OP_EQ:
+    return left == right;
+  case OP_NE:
+    return left != right;
+  case OP_SQRT:
+  case OP_EXP:
+  case OP_LOG:
+  case OP_SIN:
+  case OP_COS:
+  case OP_ABS:
+  case OP_MIN:
+  case OP_MAX:
+    return FN_for_op(op)->scalar(left, right);
+  default:
+    assert(0);
+  }
+  return 0;
+}
+
+/*
+ * Evaluate a range of the operands of a chain, combined in the order
+ * of ET_split; ET_reduce(tree, 0, tree->n.list.count) is the value of
+ * the chain
+ *
+ * Parameters:
+ *   tree     The chain
+ *   first    Index of the first operand
+ *   count    Number of operands, at least 1
+ *
+ * Returns: The computed value
+ */
+double ET_reduce(ExprTree tree, int first, int count);
+
+/*
+ * Replace a subtree with another in place, so that every pointer to
+ * the old one now leads to the new one: the old subtree is freed,
+ * except for its root node, into which the root of the new one is
+ * moved
+ *
+ * Parameters:
+ *   tree     The subtree to replace
+ *   with     The new subtree, whose root node is freed; pointers to
+ *            it must be changed to point to tree
+ *
+ * Returns: None
+ */
+void ET_replace(ExprTree tree, ExprTree with);
+
+/*
+ * Apply an operator elementwise: out[i] = ET_apply(type, left[i],
+ * right[i]) for 0 <= i < n. One loop per operator, so that each loop
+ * can be vectorized; functions use the block kernels of the registry.
+ * The batch evaluators go through this function.
+ *
+ * Parameters:
+ *   type     The operator or function; must not be a leaf type or OP_COND
+ *   out      The results; may be the same array as left or right
+ *   left     Values of the left child
+ *   right    Values of the right child (ignored for unary operators)
+ *   n        Number of elements
+ *   approx   true to use the fastmath kernels for OP_POWER and the
+ *            functions that have them (EI_APPROX mode)
+ *
+ * Returns: None
+ */
+void ET_apply_block(ExprNodeType type, double *out, const double *left, const double *right, int n, bool approx);
+
+#endif /* _EXPR_TREE_PRIV_H_ */
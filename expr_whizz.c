@@ -5,12 +5,79 @@
  * the operators + - * / % ^, and unary minus. Values are held as
  * doubles.
  *
+ * Usage: expr_whizz [OPTIONS] [-p DIGITS] [-j N] [FILE]
+ *        expr_whizz [OPTIONS] [-p DIGITS] [-j N] -l ADDR
+ *        expr_whizz [OPTIONS] [-j N] --shm NAME
+ *        expr_whizz [OPTIONS] [-p DIGITS] --csv FILE EXPR
+ *
+ * where the OPTIONS are --stats, --latency and --trace FILE.
+ *
+ * Results are printed in full, with as many digits as it takes for
+ * them to read back as the same double, or, with -p, rounded to
+ * DIGITS significant digits (1 to 17) like printf's %g.
+ *
+ * On a terminal, with no FILE, it runs an interactive read-eval-print
+ * loop, which parses each line incrementally against the one before
+ * it (see reparse.h). A line "name = expression" there defines the
+ * variable as the expression, as a cell of a spreadsheet is, and
+ * recomputes whatever depends on it (see sheet.h); -j N then
+ * recomputes the independent definitions on N threads. Otherwise it
+ * runs in batch mode: it reads expressions from
+ * FILE (or from stdin), one per line, and writes one line per input
+ * line to stdout: the value of the expression, an error in the form
+ * "line N: message", or an empty line for a blank one, so that line N
+ * of the output always belongs to line N of the input. Output goes
+ * through a large buffer, and nothing else is printed.
+ *
+ * A FILE that can be mapped is mmap'd and tokenized in place, so its
+ * lines are never copied; stdin, and anything else that cannot be
+ * mapped, is read through a large stdio buffer.
+ *
+ * With -j N, batch mode uses N threads. The input is cut into chunks
+ * of whole lines, which worker threads tokenize, parse and evaluate
+ * into per-chunk output buffers; a ring of chunks in flight serves as
+ * the reorder buffer, and the main thread writes them out strictly in
+ * input order, so the output is the same as with one thread.
+ *
+ * With -l, it serves the batch-mode protocol on ADDR, a Unix domain
+ * socket path or a TCP port on 127.0.0.1, until it gets SIGINT or
+ * SIGTERM; -j N then runs N event loops (see expr_server.h).
+ *
+ * With --shm, it serves clients on the same host through the shared
+ * memory segment NAME, created for the purpose and removed on SIGINT
+ * or SIGTERM; -j N then runs N server threads (see expr_shm.h).
+ *
+ * With --csv, it evaluates EXPR once for every row of the CSV file
+ * FILE, whose columns are the variables (see expr_csv.h), and writes
+ * one result per row.
+ *
+ * With --stats, in any mode, it counts the allocations of the lists,
+ * trees and variables, and prints the counts to stderr on exit, by
+ * module and by phase (see EW_stats in exprwhizz.h).
+ *
+ * With --latency, it times the tokenizing, parsing, evaluating and
+ * formatting of every expression, and prints the percentiles of each
+ * to stderr on exit, and whenever it gets SIGUSR1 (see latency.h).
+ *
+ * With --trace, in a build with tracing (make TRACE=1), it writes a
+ * Chrome trace-event file of the spans of every phase, for
+ * chrome://tracing or Perfetto, to FILE on exit (see trace.h).
+ *
  * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 
@@ -19,15 +86,318 @@
 #include "tokenize.h"
 #include "expr_tree.h"
 #include "parse.h"
+#include "reparse.h"
+#include "sheet.h"
+#include "thread_pool.h"
+#include "expr_server.h"
+#include "expr_shm.h"
+#include "expr_csv.h"
+#include "dtoa.h"
+#include "exprwhizz.h"
+#include "latency.h"
+#include "trace.h"
 
-int main(int argc, char *argv[])
+// how results are printed: set by -p, see DT_format
+static int output_precision = DT_SHORTEST;
+
+#define BATCH_BUFFER_SIZE (1 << 20) // for each of input and output
+#define CHUNK_SIZE (64 * 1024)      // input bytes per chunk
+#define CHUNKS_PER_THREAD 4         // chunks in flight, per thread
+
+/*
+ * Where batch mode reads its lines from: a mapped file, or a stream
+ */
+struct input
+{
+  const char *map; // the mapped file, or NULL to read from file
+  size_t map_len;
+  size_t map_pos;  // where the next chunk starts
+  FILE *file;
+  char *line;      // getline's buffer
+  size_t line_sz;
+  long lineno;     // lines handed out so far
+};
+
+/*
+ * A chunk of input lines and the output for them. The buffers belong
+ * to the chunk and are reused from one batch of lines to the next,
+ * so a worker only allocates the tokens and trees it builds, and it
+ * allocates them from its own malloc arena.
+ */
+struct chunk
+{
+  const char *in;   // the lines, each ended by '\n' except maybe the last;
+                    // in the mapped file, or else in buf
+  size_t in_len;
+  char *buf;        // copy of the lines, when they come from a stream
+  size_t buf_cap;
+  long first_line;  // line number of the first line
+  char *out;        // the result lines
+  size_t out_len;
+  size_t out_cap;
+  TPTask task;
+};
+
+/*
+ * Task function: evaluate every line of a chunk into its output buffer
+ *
+ * Parameters:
+ *   arg      The struct chunk
+ *
+ * Returns: None
+ */
+static void eval_chunk(void *arg)
+{
+  struct chunk *chunk = arg;
+  const char *pos = chunk->in;
+  const char *end = chunk->in + chunk->in_len;
+  long lineno = chunk->first_line;
+
+  chunk->out_len = 0;
+
+  for (; pos < end; lineno++)
+  {
+    const char *newline = memchr(pos, '\n', end - pos);
+    size_t len = (newline != NULL) ? (size_t)(newline - pos) : (size_t)(end - pos);
+
+    if (chunk->out_cap - chunk->out_len < ES_RESULT_MAX)
+    {
+      chunk->out_cap = 2 * chunk->out_cap + ES_RESULT_MAX;
+      chunk->out = realloc(chunk->out, chunk->out_cap);
+      assert(chunk->out != NULL);
+    }
+
+    chunk->out_len += ES_eval_line(pos, len, lineno, output_precision, chunk->out + chunk->out_len);
+    pos += len + 1;
+  }
+}
+
+/*
+ * Map a file for batch mode, if it can be mapped
+ *
+ * Parameters:
+ *   in       The input; its map fields are filled in on success
+ *   file     The open file
+ *
+ * Returns: true if the file was mapped
+ */
+static bool map_input(struct input *in, FILE *file)
+{
+  struct stat st;
+
+  if (fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    return false;
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+
+  if (map == MAP_FAILED)
+    return false;
+
+  // only hints: a failure just means the kernel will not do it
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+  madvise(map, st.st_size, MADV_HUGEPAGE);
+#endif
+
+  in->map = map;
+  in->map_len = st.st_size;
+  return true;
+}
+
+/*
+ * Give a chunk the next lines of the input, at least CHUNK_SIZE bytes
+ * of them unless the input ends first. Lines of a mapped file are
+ * referenced where they are; lines of a stream are copied into the
+ * chunk's own buffer.
+ *
+ * Parameters:
+ *   in       The input
+ *   chunk    The chunk, whose previous lines are discarded
+ *
+ * Returns: true if the chunk holds at least one line
+ */
+static bool next_chunk(struct input *in, struct chunk *chunk)
+{
+  chunk->first_line = in->lineno + 1;
+
+  if (in->map != NULL)
+  {
+    const char *start = in->map + in->map_pos;
+    size_t avail = in->map_len - in->map_pos;
+    size_t len = (avail < CHUNK_SIZE) ? avail : CHUNK_SIZE;
+    const char *newline = memchr(start + len, '\n', avail - len);
+
+    // extend to the end of the line that crosses CHUNK_SIZE
+    if (len < avail)
+      len = (newline != NULL) ? (size_t)(newline - start) + 1 : avail;
+
+    for (const char *p = start; (p = memchr(p, '\n', start + len - p)) != NULL; p++)
+      in->lineno++;
+    if (len > 0 && start[len - 1] != '\n')
+      in->lineno++; // the last line, with no '\n'
+
+    chunk->in = start;
+    chunk->in_len = len;
+    in->map_pos += len;
+    return len > 0;
+  }
+
+  ssize_t len;
+
+  chunk->in_len = 0;
+
+  while (chunk->in_len < CHUNK_SIZE && (len = getline(&in->line, &in->line_sz, in->file)) != -1)
+  {
+    in->lineno++;
+
+    if (chunk->buf_cap - chunk->in_len < (size_t)len)
+    {
+      chunk->buf_cap = 2 * chunk->buf_cap + len;
+      chunk->buf = realloc(chunk->buf, chunk->buf_cap);
+      assert(chunk->buf != NULL);
+    }
+
+    memcpy(chunk->buf + chunk->in_len, in->line, len);
+    chunk->in_len += len;
+  }
+
+  chunk->in = chunk->buf;
+  return chunk->in_len > 0;
+}
+
+/*
+ * Release the buffers of a set of chunks
+ *
+ * Parameters:
+ *   chunks   The chunks
+ *   nchunks  How many there are
+ *
+ * Returns: None
+ */
+static void free_chunks(struct chunk *chunks, int nchunks)
+{
+  for (int i = 0; i < nchunks; i++)
+  {
+    free(chunks[i].buf);
+    free(chunks[i].out);
+  }
+  free(chunks);
+}
+
+/*
+ * The body of batch mode with more than one thread: keep up to
+ * CHUNKS_PER_THREAD * nthreads chunks in flight, and write each one
+ * out once it and all the chunks before it are done
+ *
+ * Parameters:
+ *   in       The input
+ *   nthreads Number of worker threads
+ *
+ * Returns: None
+ */
+static void run_chunks(struct input *in, int nthreads)
+{
+  ThreadPool pool = TP_new(nthreads);
+  int nchunks = CHUNKS_PER_THREAD * nthreads;
+  struct chunk *chunks = calloc(nchunks, sizeof(struct chunk));
+  long next_read = 0;  // the next chunk to fill, counting from 0
+  long next_write = 0; // the oldest chunk still in flight
+  bool at_end = false;
+
+  assert(pool != NULL && chunks != NULL);
+
+  while (!at_end || next_write < next_read)
+  {
+    if (!at_end && next_read - next_write < nchunks)
+    {
+      struct chunk *chunk = &chunks[next_read % nchunks];
+
+      if (next_chunk(in, chunk))
+      {
+        TP_spawn(pool, &chunk->task, eval_chunk, chunk);
+        next_read++;
+      }
+      else
+        at_end = true;
+    }
+    else
+    {
+      struct chunk *chunk = &chunks[next_write % nchunks];
+
+      TP_sync(pool, &chunk->task);
+      fwrite(chunk->out, 1, chunk->out_len, stdout);
+      next_write++;
+    }
+  }
+
+  free_chunks(chunks, nchunks);
+  TP_free(pool);
+}
+
+/*
+ * The batch mode: evaluate every line of file
+ *
+ * Parameters:
+ *   file     The input
+ *   nthreads Number of threads to evaluate with
+ *
+ * Returns: The exit status
+ */
+static int run_batch(FILE *file, int nthreads)
+{
+  struct input in = {NULL, 0, 0, file, NULL, 0, 0};
+
+  if (!map_input(&in, file))
+    setvbuf(file, NULL, _IOFBF, BATCH_BUFFER_SIZE);
+  setvbuf(stdout, NULL, _IOFBF, BATCH_BUFFER_SIZE);
+
+  if (nthreads > 1)
+    run_chunks(&in, nthreads);
+  else
+  {
+    struct chunk *chunk = calloc(1, sizeof(struct chunk));
+    assert(chunk != NULL);
+
+    while (next_chunk(&in, chunk))
+    {
+      eval_chunk(chunk);
+      fwrite(chunk->out, 1, chunk->out_len, stdout);
+    }
+
+    free_chunks(chunk, 1);
+  }
+
+  free(in.line);
+  if (in.map != NULL)
+    munmap((void *)in.map, in.map_len);
+
+  if (ferror(file) || fflush(stdout) != 0)
+  {
+    perror("expr_whizz");
+    return 1;
+  }
+
+  return 0;
+}
+
+/*
+ * The interactive mode, recomputing definitions on nthreads threads
+ *
+ * Returns: The exit status
+ */
+static int run_repl(int nthreads)
 {
   char *input = NULL;
-  CList tokens = NULL;
+  VarTable vars = VT_new();
+  ThreadPool pool = (nthreads > 1) ? TP_new(nthreads) : NULL;
+  Sheet sheet = SH_new(vars, pool);
+  Reparser rp = RP_new(vars);
   ExprTree tree = NULL;
+  Variable target = NULL;
   char errmsg[128];
   bool time_to_quit = false;
   char expr_buf[1024];
+  char value_buf[DT_BUFFER_SIZE];
 
   printf("Welcome to ExpressionWhizz!\n");
 
@@ -48,40 +418,330 @@ int main(int argc, char *argv[])
 
     add_history(input);
 
-    tokens = TOK_tokenize_input(input, errmsg, sizeof(errmsg));
+    // a line recalled from the history and edited is mostly the last
+    // one, so only what changed is tokenized and parsed again; the
+    // tree belongs to rp
+    uint64_t t = LH_start();
+    tree = RP_parse(rp, input, errmsg, sizeof(errmsg));
+    LH_lap(LH_PARSE, t);
 
-    if (tokens == NULL)
+    if (tree == NULL)
     {
-      fprintf(stderr, "%s\n", errmsg);
+      if (errmsg[0] != '\0')
+        fprintf(stderr, "%s\n", errmsg);
       goto loop_end;
     }
 
-    if (CL_length(tokens) == 0)
-      goto loop_end;
+    ET_tree2string(tree, expr_buf, sizeof(expr_buf));
 
-    // uncomment for more debug info
-    TOK_print(tokens);
+    if ((target = RP_target(rp)) != NULL)
+    {
+      // a definition: the sheet takes the tree over from rp
+      tree = RP_take(rp);
+      if (SH_define(sheet, target, tree, errmsg, sizeof(errmsg)) != 0)
+      {
+        ET_free(tree);
+        fprintf(stderr, "%s\n", errmsg);
+        goto loop_end;
+      }
 
-    tree = Parse(tokens, errmsg, sizeof(errmsg));
+      t = LH_start();
+      int count = SH_recompute(sheet);
+      t = LH_lap(LH_EVALUATE, t);
+      DT_format(target->value, output_precision, value_buf);
+      LH_lap(LH_FORMAT, t);
+      printf("%s = %s  ==> %s\n", target->name, expr_buf, value_buf);
+      if (count > 1)
+        printf("(%d definitions recomputed)\n", count);
+      goto loop_end;
+    }
 
-    if (tree == NULL)
+    // a definition may refer to a name ahead of its definition, but an
+    // expression to show must not read one that has no value yet
+    if ((target = SH_undefined(sheet, tree)) != NULL)
     {
-      fprintf(stderr, "%s\n", errmsg);
+      fprintf(stderr, "Undefined name '%s'\n", target->name);
       goto loop_end;
     }
 
-    ET_tree2string(tree, expr_buf, sizeof(expr_buf));
-
-    printf("%s  ==> %g\n", expr_buf, ET_evaluate(tree));
+    t = LH_start();
+    double value = ET_evaluate(tree);
+    t = LH_lap(LH_EVALUATE, t);
+    DT_format(value, output_precision, value_buf);
+    LH_lap(LH_FORMAT, t);
+    printf("%s  ==> %s\n", expr_buf, value_buf);
 
   loop_end:
     free(input);
     input = NULL;
-    CL_free(tokens);
-    tokens = NULL;
-    ET_free(tree);
-    tree = NULL;
   }
 
+  RP_free(rp);
+  SH_free(sheet);
+  if (pool != NULL)
+    TP_free(pool);
+  VT_free(vars);
   return 0;
 }
+
+// the server that SIGINT and SIGTERM stop: one or the other
+static ExprServer running_server = NULL;
+static ShmServer running_shm = NULL;
+
+/*
+ * Signal handler: stop the running server
+ */
+static void stop_server(int sig)
+{
+  if (running_server != NULL)
+    ES_stop(running_server);
+  if (running_shm != NULL)
+    SHM_stop(running_shm);
+}
+
+/*
+ * The server mode: serve the batch-mode protocol on addr
+ *
+ * Returns: The exit status
+ */
+static int run_server(const char *addr, int nthreads)
+{
+  char errmsg[128];
+  struct sigaction sa = {.sa_handler = stop_server};
+
+  running_server = ES_new(addr, output_precision, errmsg, sizeof(errmsg));
+
+  if (running_server == NULL)
+  {
+    fprintf(stderr, "%s\n", errmsg);
+    return 1;
+  }
+
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  int status = ES_run(running_server, nthreads);
+
+  ES_free(running_server);
+  running_server = NULL;
+  return (status == 0) ? 0 : 1;
+}
+
+/*
+ * The shared memory server mode: serve clients through the segment name
+ *
+ * Returns: The exit status
+ */
+static int run_shm(const char *name, int nthreads)
+{
+  char errmsg[128];
+  struct sigaction sa = {.sa_handler = stop_server};
+
+  running_shm = SHM_new(name, nthreads, errmsg, sizeof(errmsg));
+
+  if (running_shm == NULL)
+  {
+    fprintf(stderr, "%s\n", errmsg);
+    return 1;
+  }
+
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  int status = SHM_run(running_shm);
+
+  SHM_free(running_shm);
+  running_shm = NULL;
+  return (status == 0) ? 0 : 1;
+}
+
+/*
+ * The CSV mode: evaluate expr for every row of the CSV file path
+ *
+ * Returns: The exit status
+ */
+static int run_csv(const char *path, const char *expr)
+{
+  char errmsg[128];
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0)
+  {
+    fprintf(stderr, "Cannot open %s\n", path);
+    return 1;
+  }
+
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  setvbuf(stdout, NULL, _IOFBF, BATCH_BUFFER_SIZE);
+
+  long nrows = CSV_evaluate(fd, expr, output_precision, stdout, errmsg, sizeof(errmsg));
+
+  close(fd);
+
+  if (fflush(stdout) != 0)
+  {
+    perror("expr_whizz");
+    return 1;
+  }
+  if (nrows < 0)
+  {
+    fprintf(stderr, "%s: %s\n", path, errmsg);
+    return 1;
+  }
+
+  return 0;
+}
+
+/*
+ * Print the allocation counters, for --stats
+ */
+static void print_stats()
+{
+  EW_stats_print(stderr);
+}
+
+/*
+ * Print the latency percentiles, for --latency
+ */
+static void print_latency()
+{
+  LH_print(stderr);
+}
+
+/*
+ * Print the latency percentiles whenever SIGUSR1 comes. The signal is
+ * blocked in every other thread, so this one takes it with sigwait and
+ * can print as any thread would, which a handler could not.
+ */
+static void *latency_dumper(void *arg)
+{
+  sigset_t *usr1 = arg;
+  int sig;
+
+  for (;;)
+    if (sigwait(usr1, &sig) == 0)
+      print_latency();
+
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  static const struct option long_options[] = {
+      {"csv", required_argument, NULL, 'c'},
+      {"shm", required_argument, NULL, 's'},
+      {"stats", no_argument, NULL, 'S'},
+      {"latency", no_argument, NULL, 'L'},
+      {"trace", required_argument, NULL, 'T'},
+      {NULL, 0, NULL, 0}};
+  int nthreads = 1;
+  const char *listen_addr = NULL;
+  const char *csv_path = NULL;
+  const char *shm_name = NULL;
+  bool stats = false;
+  bool latency = false;
+  const char *trace_path = NULL;
+  char errmsg[128];
+  int opt;
+
+  while ((opt = getopt_long(argc, argv, "j:l:p:", long_options, NULL)) != -1)
+  {
+    if (opt == 'l')
+      listen_addr = optarg;
+    else if (opt == 'p')
+    {
+      output_precision = atoi(optarg);
+      if (output_precision < 1 || output_precision > 17)
+        goto usage;
+    }
+    else if (opt == 'c')
+      csv_path = optarg;
+    else if (opt == 's')
+      shm_name = optarg;
+    else if (opt == 'S')
+      stats = true;
+    else if (opt == 'L')
+      latency = true;
+    else if (opt == 'T')
+      trace_path = optarg;
+    else if (opt != 'j' || (nthreads = atoi(optarg)) < 1)
+      goto usage;
+  }
+
+  if (stats)
+  {
+    EW_stats_enable(1);
+    atexit(print_stats);
+  }
+
+  if (latency)
+  {
+    static sigset_t usr1;
+    pthread_t dumper;
+
+    // before any other thread starts, so that they all inherit the mask
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+    pthread_create(&dumper, NULL, latency_dumper, &usr1);
+    pthread_detach(dumper);
+
+    LH_enable();
+    atexit(print_latency);
+  }
+
+  if (trace_path != NULL && TR_open(trace_path, errmsg, sizeof(errmsg)) != 0)
+  {
+    fprintf(stderr, "%s\n", errmsg);
+    return 1;
+  }
+
+  if (csv_path != NULL)
+  {
+    if (argc - optind != 1 || listen_addr != NULL || shm_name != NULL)
+      goto usage;
+    return run_csv(csv_path, argv[optind]);
+  }
+
+  if (shm_name != NULL)
+  {
+    if (argc - optind != 0 || listen_addr != NULL)
+      goto usage;
+    return run_shm(shm_name, nthreads);
+  }
+
+  if (argc - optind > (listen_addr == NULL ? 1 : 0))
+    goto usage;
+
+  if (listen_addr != NULL)
+    return run_server(listen_addr, nthreads);
+
+  if (argc - optind == 1)
+  {
+    FILE *in = fopen(argv[optind], "r");
+
+    if (in == NULL)
+    {
+      fprintf(stderr, "Cannot open %s\n", argv[optind]);
+      return 1;
+    }
+
+    int status = run_batch(in, nthreads);
+    fclose(in);
+    return status;
+  }
+
+  if (!isatty(STDIN_FILENO))
+    return run_batch(stdin, nthreads);
+
+  return run_repl(nthreads);
+
+usage:
+  fprintf(stderr, "Usage: %s [OPTIONS] [-p DIGITS] [-j N] [FILE]\n"
+                  "       %s [OPTIONS] [-p DIGITS] [-j N] -l ADDR\n"
+                  "       %s [OPTIONS] [-j N] --shm NAME\n"
+                  "       %s [OPTIONS] [-p DIGITS] --csv FILE EXPR\n"
+                  "OPTIONS: --stats, --latency, --trace FILE\n",
+          argv[0], argv[0], argv[0], argv[0]);
+  return 1;
+}
@@ -0,0 +1,453 @@
+/*
+ * exprwhizz.c
+ *
+ * Contexts for libexprwhizz. A context owns a Heap, and every call
+ * that allocates enters it, so the lists, trees and variables built by
+ * the core modules are tracked by the context. A call that runs out of
+ * memory lands back in its setjmp, undoes what it had done by rolling
+ * the Heap back to the mark it took on entry, and reports the error.
+ *
+ * Definitions are kept in a Sheet, whose memory also comes from the
+ * context's Heap; it makes every allocation before changing anything,
+ * so a definition that runs out of memory is rolled back like the rest.
+ *
+ * The allocation counters are the Heap module's; this only translates
+ * them to the types of the interface.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include "exprwhizz.h"
+#include "heap.h"
+#include "clist.h"
+#include "tokenize.h"
+#include "parse.h"
+#include "expr_tree.h"
+#include "vars.h"
+#include "sheet.h"
+#include "thread_pool.h"
+
+#define ERRMSG_SIZE 128
+
+struct _ew_expr
+{
+  EW_Expr next;  // in its bucket of the cache
+  uint32_t hash;
+  int refs;      // compiles not yet released
+  char *src;
+  size_t len;
+  ExprTree tree;
+};
+
+struct _ew_context
+{
+  Heap heap;
+  VarTable vars;
+  Sheet sheet;       // the definitions among vars
+  ThreadPool pool;   // for EW_recompute, or NULL
+  EW_Expr *buckets;  // the compiled expressions, by hash of their text
+  int nbuckets;      // always a power of two, at least nexprs
+  int nexprs;
+  EW_Status status;
+  char errmsg[ERRMSG_SIZE];
+};
+
+/*
+ * The allocator used when EW_new is given none
+ */
+static void *default_alloc(void *user, size_t size)
+{
+  return malloc(size);
+}
+
+static void default_release(void *user, void *ptr, size_t size)
+{
+  free(ptr);
+}
+
+/*
+ * FNV-1a hash of the text of an expression
+ */
+static uint32_t hash_src(const char *src, size_t len)
+{
+  uint32_t h = 2166136261u;
+
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char)src[i]) * 16777619u;
+
+  return h;
+}
+
+/*
+ * Record the outcome of a call on ctx
+ */
+static void set_status(EW_Context ctx, EW_Status status, const char *errmsg)
+{
+  ctx->status = status;
+  snprintf(ctx->errmsg, sizeof(ctx->errmsg), "%s", errmsg);
+}
+
+/*
+ * Double the number of buckets of the cache. Must be called with the
+ * Heap of ctx entered.
+ */
+static void grow_cache(EW_Context ctx)
+{
+  int nbuckets = 2 * ctx->nbuckets;
+  EW_Expr *buckets = HP_calloc(HP_CONTEXT, nbuckets, sizeof(EW_Expr));
+
+  for (int b = 0; b < ctx->nbuckets; b++)
+  {
+    for (EW_Expr expr = ctx->buckets[b], next; expr != NULL; expr = next)
+    {
+      next = expr->next;
+      expr->next = buckets[expr->hash & (nbuckets - 1)];
+      buckets[expr->hash & (nbuckets - 1)] = expr;
+    }
+  }
+
+  HP_free(HP_CONTEXT, ctx->buckets);
+  ctx->buckets = buckets;
+  ctx->nbuckets = nbuckets;
+}
+
+// Documented in .h file
+EW_Context EW_new(const EW_Allocator *allocator)
+{
+  EW_Allocator def = {default_alloc, default_release, NULL};
+
+  if (allocator == NULL)
+    allocator = &def;
+
+  EW_Context ctx = allocator->alloc(allocator->user, sizeof(struct _ew_context));
+  if (ctx == NULL)
+    return NULL;
+
+  HP_init(&ctx->heap, allocator->alloc, allocator->release, allocator->user);
+  set_status(ctx, EW_OK, "");
+
+  jmp_buf on_failure;
+  Heap *prev = HP_enter(&ctx->heap, &on_failure);
+
+  if (setjmp(on_failure))
+  {
+    HP_release_all(&ctx->heap);
+    HP_enter(prev, NULL);
+    allocator->release(allocator->user, ctx, sizeof(struct _ew_context));
+    return NULL;
+  }
+
+  ctx->vars = VT_new();
+  ctx->pool = NULL;
+  ctx->sheet = SH_new(ctx->vars, NULL);
+  ctx->nbuckets = 16;
+  ctx->nexprs = 0;
+  ctx->buckets = HP_calloc(HP_CONTEXT, ctx->nbuckets, sizeof(EW_Expr));
+
+  HP_enter(prev, NULL);
+  return ctx;
+}
+
+// Documented in .h file
+void EW_free(EW_Context ctx)
+{
+  if (ctx == NULL)
+    return;
+
+  if (ctx->pool != NULL)
+    TP_free(ctx->pool);
+
+  // the Heap tracks every block of the context, so nothing need be walked
+  HP_release_all(&ctx->heap);
+  ctx->heap.release(ctx->heap.user, ctx, sizeof(struct _ew_context));
+}
+
+// Documented in .h file
+EW_Expr EW_compile(EW_Context ctx, const char *src, size_t len)
+{
+  uint32_t hash = hash_src(src, len);
+
+  set_status(ctx, EW_OK, "");
+
+  for (EW_Expr expr = ctx->buckets[hash & (ctx->nbuckets - 1)]; expr != NULL; expr = expr->next)
+  {
+    if (expr->hash == hash && expr->len == len && memcmp(expr->src, src, len) == 0)
+    {
+      expr->refs++;
+      return expr;
+    }
+  }
+
+  jmp_buf on_failure;
+  uint64_t mark = HP_mark(&ctx->heap);
+  int nvars = VT_count(ctx->vars);
+  HeapPhase phase = HP_set_phase(HP_OTHER);
+  Heap *prev = HP_enter(&ctx->heap, &on_failure);
+
+  if (setjmp(on_failure))
+  {
+    // the jump may have come out of tokenizing or parsing
+    HP_set_phase(phase);
+    VT_truncate(ctx->vars, nvars);
+    HP_rollback(&ctx->heap, mark);
+    HP_enter(prev, NULL);
+    set_status(ctx, EW_ERR_NOMEM, "Out of memory");
+    return NULL;
+  }
+
+  char errmsg[ERRMSG_SIZE] = "Empty expression";
+  ExprTree tree = NULL;
+  CList tokens = TOK_tokenize_n(src, len, ctx->vars, errmsg, sizeof(errmsg));
+
+  if (tokens != NULL)
+  {
+    tree = Parse(tokens, errmsg, sizeof(errmsg));
+    CL_free(tokens);
+  }
+
+  if (tree == NULL)
+  {
+    // forget the variables that only the failed expression named
+    VT_truncate(ctx->vars, nvars);
+    HP_enter(prev, NULL);
+    set_status(ctx, EW_ERR_SYNTAX, errmsg);
+    return NULL;
+  }
+
+  EW_Expr expr = HP_malloc(HP_CONTEXT, sizeof(struct _ew_expr));
+  expr->hash = hash;
+  expr->refs = 1;
+  expr->src = HP_strndup(HP_CONTEXT, src, len);
+  expr->len = len;
+  expr->tree = tree;
+
+  if (ctx->nexprs == ctx->nbuckets)
+    grow_cache(ctx);
+
+  expr->next = ctx->buckets[hash & (ctx->nbuckets - 1)];
+  ctx->buckets[hash & (ctx->nbuckets - 1)] = expr;
+  ctx->nexprs++;
+
+  HP_enter(prev, NULL);
+  return expr;
+}
+
+// Documented in .h file
+void EW_release(EW_Context ctx, EW_Expr expr)
+{
+  if (expr == NULL || --expr->refs > 0)
+    return;
+
+  EW_Expr *link = &ctx->buckets[expr->hash & (ctx->nbuckets - 1)];
+  while (*link != expr)
+    link = &(*link)->next;
+  *link = expr->next;
+  ctx->nexprs--;
+
+  // freeing never allocates, so there is nothing to jump back for
+  Heap *prev = HP_enter(&ctx->heap, NULL);
+  ET_free(expr->tree);
+  HP_free(HP_CONTEXT, expr->src);
+  HP_free(HP_CONTEXT, expr);
+  HP_enter(prev, NULL);
+}
+
+// Documented in .h file
+int EW_set(EW_Context ctx, const char *name, double value)
+{
+  jmp_buf on_failure;
+  uint64_t mark = HP_mark(&ctx->heap);
+  int nvars = VT_count(ctx->vars);
+  Heap *prev = HP_enter(&ctx->heap, &on_failure);
+
+  if (setjmp(on_failure))
+  {
+    VT_truncate(ctx->vars, nvars);
+    HP_rollback(&ctx->heap, mark);
+    HP_enter(prev, NULL);
+    set_status(ctx, EW_ERR_NOMEM, "Out of memory");
+    return -1;
+  }
+
+  SH_set(ctx->sheet, VT_define(ctx->vars, name, strlen(name)), value);
+
+  HP_enter(prev, NULL);
+  set_status(ctx, EW_OK, "");
+  return 0;
+}
+
+// Documented in .h file
+int EW_define(EW_Context ctx, const char *src, size_t len)
+{
+  jmp_buf on_failure;
+  uint64_t mark = HP_mark(&ctx->heap);
+  int nvars = VT_count(ctx->vars);
+  HeapPhase phase = HP_set_phase(HP_OTHER);
+  Heap *prev = HP_enter(&ctx->heap, &on_failure);
+
+  if (setjmp(on_failure))
+  {
+    // the jump may have come out of tokenizing or parsing
+    HP_set_phase(phase);
+    VT_truncate(ctx->vars, nvars);
+    HP_rollback(&ctx->heap, mark);
+    HP_enter(prev, NULL);
+    set_status(ctx, EW_ERR_NOMEM, "Out of memory");
+    return -1;
+  }
+
+  char errmsg[ERRMSG_SIZE] = "Empty definition";
+  EW_Status status = EW_ERR_SYNTAX;
+  Variable target = NULL;
+  ExprTree tree = NULL;
+  CList tokens = TOK_tokenize_n(src, len, ctx->vars, errmsg, sizeof(errmsg));
+
+  if (tokens != NULL)
+  {
+    tree = Parse_statement(tokens, &target, errmsg, sizeof(errmsg));
+    CL_free(tokens);
+  }
+
+  if (tree != NULL && target == NULL)
+    snprintf(errmsg, sizeof(errmsg), "Expected a definition, name = expression");
+  else if (tree != NULL && SH_define(ctx->sheet, target, tree, errmsg, sizeof(errmsg)) == 0)
+    status = EW_OK;
+  else if (tree != NULL)
+    status = EW_ERR_CYCLE;
+
+  if (status != EW_OK)
+  {
+    ET_free(tree);
+    // forget the variables that only the failed definition named
+    VT_truncate(ctx->vars, nvars);
+    HP_enter(prev, NULL);
+    set_status(ctx, status, errmsg);
+    return -1;
+  }
+
+  HP_enter(prev, NULL);
+  set_status(ctx, EW_OK, "");
+  return 0;
+}
+
+// Documented in .h file
+int EW_recompute(EW_Context ctx)
+{
+  // evaluating allocates nothing, so there is nothing to jump back for
+  Heap *prev = HP_enter(&ctx->heap, NULL);
+  int count = SH_recompute(ctx->sheet);
+
+  HP_enter(prev, NULL);
+  set_status(ctx, EW_OK, "");
+  return count;
+}
+
+// Documented in .h file
+int EW_set_threads(EW_Context ctx, int nthreads)
+{
+  ThreadPool pool = NULL;
+
+  if (nthreads > 1 && (pool = TP_new(nthreads)) == NULL)
+  {
+    set_status(ctx, EW_ERR_THREADS, "Could not start the threads");
+    return -1;
+  }
+
+  if (ctx->pool != NULL)
+    TP_free(ctx->pool);
+  ctx->pool = pool;
+  SH_set_pool(ctx->sheet, pool);
+
+  set_status(ctx, EW_OK, "");
+  return 0;
+}
+
+// Documented in .h file
+double EW_evaluate(EW_Expr expr)
+{
+  return ET_evaluate(expr->tree);
+}
+
+// Documented in .h file
+EW_Status EW_status(EW_Context ctx)
+{
+  return ctx->status;
+}
+
+// Documented in .h file
+const char *EW_error(EW_Context ctx)
+{
+  return ctx->errmsg;
+}
+
+// Documented in .h file
+size_t EW_memory(EW_Context ctx)
+{
+  return ctx->heap.bytes;
+}
+
+// Documented in .h file
+void EW_stats_enable(int on)
+{
+  HP_stats_enable(on != 0);
+}
+
+/*
+ * Copy one set of counters
+ */
+static EW_Counts counts(const HeapCounts *c)
+{
+  return (EW_Counts){c->allocs, c->frees, c->bytes, c->live, c->peak};
+}
+
+// Documented in .h file
+void EW_stats(EW_Stats *stats)
+{
+  HeapStats hs;
+
+  HP_stats(&hs);
+  stats->clist = counts(&hs.module[HP_CLIST]);
+  stats->expr_tree = counts(&hs.module[HP_EXPR_TREE]);
+  stats->vars = counts(&hs.module[HP_VARS]);
+  stats->context = counts(&hs.module[HP_CONTEXT]);
+  stats->sheet = counts(&hs.module[HP_SHEET]);
+  stats->tokenize = counts(&hs.phase[HP_TOKENIZE]);
+  stats->parse = counts(&hs.phase[HP_PARSE]);
+  stats->other = counts(&hs.phase[HP_OTHER]);
+}
+
+// Documented in .h file
+void EW_stats_reset()
+{
+  HP_stats_reset();
+}
+
+// Documented in .h file
+void EW_stats_print(FILE *out)
+{
+  EW_Stats stats;
+
+  EW_stats(&stats);
+
+  const struct
+  {
+    const char *name;
+    const EW_Counts *c;
+  } rows[] = {{"clist", &stats.clist}, {"expr_tree", &stats.expr_tree}, {"vars", &stats.vars},
+              {"context", &stats.context}, {"sheet", &stats.sheet}, {"tokenize", &stats.tokenize},
+              {"parse", &stats.parse}, {"other", &stats.other}};
+
+  fprintf(out, "%-10s %12s %12s %14s %14s %14s\n", "", "allocs", "frees", "bytes", "live", "peak live");
+  for (int i = 0; i < sizeof(rows) / sizeof(rows[0]); i++)
+  {
+    if (i == 0 || i == 5)
+      fprintf(out, i == 0 ? "by module:\n" : "by phase:\n");
+    fprintf(out, "%-10s %12llu %12llu %14llu %14lld %14lld\n", rows[i].name, rows[i].c->allocs,
+            rows[i].c->frees, rows[i].c->bytes, rows[i].c->live, rows[i].c->peak);
+  }
+}
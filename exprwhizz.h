@@ -0,0 +1,279 @@
+/*
+ * exprwhizz.h
+ *
+ * The interface of libexprwhizz, for programs that parse and evaluate
+ * expressions without going through expr_whizz.
+ *
+ * Everything hangs off an EW_Context: its variables, the expressions
+ * compiled in it, the definitions of variables as expressions of
+ * others (see sheet.h), the memory they use and the last error. Contexts
+ * share nothing, so any number of threads may each use their own
+ * context at the same time without locking; one context must not be
+ * used by two threads at once.
+ *
+ * Memory comes from the allocator the context was created with. If it
+ * runs out, the call that needed the memory fails with EW_ERR_NOMEM
+ * and leaves the context as it was before the call; nothing aborts.
+ *
+ * Apart from contexts, the library can count the allocations of all
+ * threads, by module and by phase of the pipeline (EW_stats); this is
+ * off until EW_stats_enable turns it on.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#ifndef _EXPRWHIZZ_H_
+#define _EXPRWHIZZ_H_
+
+#include <stdio.h>
+#include <stddef.h>
+
+typedef struct _ew_context *EW_Context;
+typedef struct _ew_expr *EW_Expr;
+
+typedef enum
+{
+  EW_OK,
+  EW_ERR_SYNTAX, // the expression does not tokenize or parse
+  EW_ERR_NOMEM,  // the allocator returned NULL
+  EW_ERR_CYCLE,  // a definition would make a variable depend on itself
+  EW_ERR_THREADS // the threads could not be started
+} EW_Status;
+
+/*
+ * Where a context gets its memory. alloc returns size bytes aligned
+ * for any type, or NULL; release gives back a block that alloc
+ * returned, along with the size that was asked for. Both get user as
+ * their first argument. They are only called from the thread using the
+ * context, but an allocator shared by several contexts must be
+ * thread-safe.
+ */
+typedef struct
+{
+  void *(*alloc)(void *user, size_t size);
+  void (*release)(void *user, void *ptr, size_t size);
+  void *user;
+} EW_Allocator;
+
+/*
+ * The allocations counted for a module or a phase: how many, how many
+ * frees, and the bytes they asked for in all. For a module, live is the
+ * bytes it has allocated and not freed, and peak the most that has
+ * been. For a phase, live is the bytes allocated less those freed in
+ * it, and peak the most bytes of all modules live at once while some
+ * thread was in it. A realloc counts as a free and an allocation.
+ */
+typedef struct
+{
+  unsigned long long allocs;
+  unsigned long long frees;
+  unsigned long long bytes;
+  long long live;
+  long long peak;
+} EW_Counts;
+
+typedef struct
+{
+  // by module: what the memory is for
+  EW_Counts clist;     // lists of tokens
+  EW_Counts expr_tree; // tree nodes
+  EW_Counts vars;      // variables
+  EW_Counts context;   // the caches of compiled expressions
+  EW_Counts sheet;     // the definitions and their dependencies
+  // by phase: what the thread was doing
+  EW_Counts tokenize;
+  EW_Counts parse;
+  EW_Counts other;     // such as evaluating, or freeing
+} EW_Stats;
+
+/*
+ * Create a context, with no variables or expressions
+ *
+ * Parameters:
+ *   allocator  Where the context gets its memory, or NULL for malloc;
+ *              the struct is copied
+ *
+ * Returns: The context, or NULL if its memory could not be allocated
+ */
+EW_Context EW_new(const EW_Allocator *allocator);
+
+/*
+ * Destroy a context, its variables and every expression compiled in it
+ *
+ * Parameters:
+ *   ctx        The context; may be NULL
+ *
+ * Returns: None
+ */
+void EW_free(EW_Context ctx);
+
+/*
+ * Compile an expression. Names in it are the variables of the context,
+ * which are created, with value 0, as needed. Compiling the same text
+ * again returns the same expression from the context's cache, without
+ * parsing it again.
+ *
+ * Parameters:
+ *   ctx        The context
+ *   src        The text of the expression; need not be NUL-terminated
+ *   len        Its length
+ *
+ * Returns: The expression, which the caller must EW_release, or NULL
+ *   in case of error (see EW_status and EW_error)
+ */
+EW_Expr EW_compile(EW_Context ctx, const char *src, size_t len);
+
+/*
+ * Give back an expression from EW_compile. It is destroyed once it
+ * has been released as many times as it was compiled.
+ *
+ * Parameters:
+ *   ctx        The context the expression was compiled in
+ *   expr       The expression; may be NULL
+ *
+ * Returns: None
+ */
+void EW_release(EW_Context ctx, EW_Expr expr);
+
+/*
+ * Set the value of a variable, creating it if need be. A variable that
+ * was defined by EW_define is an input from then on; the definitions
+ * that read it are recomputed by the next EW_recompute.
+ *
+ * Parameters:
+ *   ctx        The context
+ *   name       The name, NUL-terminated
+ *   value      The new value
+ *
+ * Returns: 0, or -1 in case of error (see EW_status and EW_error)
+ */
+int EW_set(EW_Context ctx, const char *name, double value);
+
+/*
+ * Define a variable as an expression of others, replacing any value or
+ * definition it had, as a cell of a spreadsheet is. Its value, and
+ * those of the definitions downstream of it, are brought up to date
+ * by the next EW_recompute. A definition that would make a variable
+ * depend on itself, directly or through others, is refused.
+ *
+ * Parameters:
+ *   ctx        The context
+ *   src        The definition, "name = expression"; need not be
+ *              NUL-terminated
+ *   len        Its length
+ *
+ * Returns: 0, or -1 in case of error (see EW_status and EW_error)
+ */
+int EW_define(EW_Context ctx, const char *src, size_t len);
+
+/*
+ * Bring the values of the defined variables up to date with the changes
+ * made by EW_set and EW_define since the last call. Only definitions
+ * downstream of a change are evaluated, a level of the dependency
+ * graph at a time; with EW_set_threads, the independent definitions
+ * of a level are evaluated in parallel.
+ *
+ * Parameters:
+ *   ctx        The context
+ *
+ * Returns: The number of definitions evaluated
+ */
+int EW_recompute(EW_Context ctx);
+
+/*
+ * Set how many threads EW_recompute uses. The threads, and the little
+ * memory they need, are not drawn from the context's allocator.
+ *
+ * Parameters:
+ *   ctx        The context
+ *   nthreads   The number of threads, or 1 for the calling thread only
+ *
+ * Returns: 0, or -1 in case of error (see EW_status and EW_error)
+ */
+int EW_set_threads(EW_Context ctx, int nthreads);
+
+/*
+ * Evaluate an expression with the current values of the variables of
+ * its context
+ *
+ * Parameters:
+ *   expr       The expression
+ *
+ * Returns: The value
+ */
+double EW_evaluate(EW_Expr expr);
+
+/*
+ * Return the status of the last call on a context that can fail
+ *
+ * Parameters:
+ *   ctx        The context
+ *
+ * Returns: EW_OK if the call succeeded, or what went wrong
+ */
+EW_Status EW_status(EW_Context ctx);
+
+/*
+ * Return a message describing the last error on a context
+ *
+ * Parameters:
+ *   ctx        The context
+ *
+ * Returns: The message, or "" if the last call succeeded; it is
+ *   overwritten by the next call on the context
+ */
+const char *EW_error(EW_Context ctx);
+
+/*
+ * Return how much memory a context is using for its variables and
+ * expressions
+ *
+ * Parameters:
+ *   ctx        The context
+ *
+ * Returns: The number of bytes asked of the allocator, not counting
+ *   the context itself and a small header per block
+ */
+size_t EW_memory(EW_Context ctx);
+
+/*
+ * Turn the counting of allocations on or off, for every thread and
+ * context, and for the programs' own use of the core modules. While it
+ * is on, every allocation updates counters shared by all threads.
+ *
+ * Parameters:
+ *   on         Nonzero to count
+ *
+ * Returns: None
+ */
+void EW_stats_enable(int on);
+
+/*
+ * Read the allocation counters
+ *
+ * Parameters:
+ *   stats      Return space for the counters
+ *
+ * Returns: None
+ */
+void EW_stats(EW_Stats *stats);
+
+/*
+ * Zero the allocation counters, keeping what is live
+ *
+ * Returns: None
+ */
+void EW_stats_reset();
+
+/*
+ * Print the allocation counters as a table, one line per module and
+ * per phase
+ *
+ * Parameters:
+ *   out        Where to print them
+ *
+ * Returns: None
+ */
+void EW_stats_print(FILE *out);
+
+#endif /* _EXPRWHIZZ_H_ */
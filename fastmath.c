@@ -0,0 +1,386 @@
+/*
+ * fastmath.c
+ *
+ * Approximations of exp2, log2, pow, sin and cos.
+ *
+ * The tables and polynomials are as short as the error budget of
+ * fastmath.h allows, and no shorter: pow is 2^(y * log2(x)), so an
+ * error in log2 is multiplied by up to ln 2 * 1022 in the result, and
+ * log2 is kept about a thousand times tighter than the budget for it.
+ *
+ * The scalar kernels are table driven, in the style of most libms:
+ *
+ * exp2(x) = 2^n * 2^(j/16) * 2^f, with x = n + j/16 + f and
+ *   |f| <= 1/32. 2^(j/16) comes from a table, and 2^f from a degree-3
+ *   Taylor polynomial of e^(f ln 2). 2^n is built directly in the
+ *   exponent bits, in two halves so that results that overflow or
+ *   become subnormal still come out right.
+ *
+ * log2(x) = e + log2(c) + log2(1 + r), with x = z * 2^e,
+ *   0.742 <= z < 1.484, c the centre of one of 32 subintervals of that
+ *   range and r = z / c - 1, so |r| <= 1/64. log2(1 + r) is a degree-5
+ *   polynomial. The subinterval holding 1 has c = 1 exactly, so close
+ *   to x = 1 the result is the polynomial alone, and nothing cancels.
+ *
+ * sin(x) and cos(x) share one kernel, which reduces x to
+ *   r = x - n pi/2, |r| <= pi/4, with pi/2 split in two parts (Cody
+ *   and Waite) so that the product with the first is exact for
+ *   |x| <= 2^20, and then evaluates the Taylor polynomials of sin r
+ *   (degree 9) and cos r (degree 8), picking one as n mod 4 says.
+ *   Larger and non-finite arguments are left to libm. This kernel has
+ *   no table, so the scalar and block forms are the same.
+ *
+ * The block kernels avoid table lookups, which do not vectorize well,
+ * and use longer polynomials over wider intervals instead:
+ *
+ * exp2(x): |f| <= 1/2 and the degree-6 Taylor polynomial.
+ *
+ * log2(x): sqrt(1/2) <= m < sqrt(2), and the series
+ *   2/ln 2 * (s + s^3/3 + s^5/5 + ... + s^11/11), with
+ *   s = (m - 1) / (m + 1), |s| <= 0.172.
+ *
+ * The block forms are written once, with GCC vector extensions, in
+ * fastmath_simd.h, and instantiated below twice: two doubles at a
+ * time for the baseline SSE2 instruction set, and four at a time for
+ * AVX2 + FMA. On x86-64 Linux the best one is bound when the program
+ * is loaded.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "fastmath.h"
+
+#define ROUND_MAGIC 0x1.8p52 // adding this rounds |x| < 2^51 to an integer
+#define EXP2_MIN -1076.0     // 2^x underflows to 0 below this
+#define EXP2_MAX 1025.0      // and overflows to infinity above this
+#define SQRT2 1.4142135623730951
+
+#define EXP2_TABLE_BITS 4
+#define EXP2_TABLE_SIZE (1 << EXP2_TABLE_BITS)
+#define LOG2_TABLE_BITS 5
+#define LOG2_TABLE_SIZE (1 << LOG2_TABLE_BITS)
+#define LOG2_OFF 0x3fe7c00000000000LL // 0.7421875: m is brought into [LOG2_OFF, 2 LOG2_OFF)
+
+#define SINCOS_MAX 0x1p20 // the argument reduction is exact up to here
+#define TWO_OVER_PI 0.6366197723675814
+#define PIO2_1 0x1.921fb54400000p+0 // pi/2 = PIO2_1 + PIO2_2, the first
+#define PIO2_2 0x1.0b4611a626331p-34 // with 33 significant bits
+
+// ln(2)^k / k!
+#define E0 1.0
+#define E1 0.6931471805599453
+#define E2 0.24022650695910072
+#define E3 0.05550410866482158
+#define E4 0.009618129107628477
+#define E5 0.0013333558146428443
+#define E6 0.0001540353039338161
+
+// (-1)^(k+1) / (k ln 2), the Taylor coefficients of log2(1 + r)
+#define R1 1.4426950408889634
+#define R2 -0.7213475204444817
+#define R3 0.4808983469629878
+#define R4 -0.36067376022224085
+#define R5 0.28853900817779266
+
+// 2 / ((2k + 1) ln 2)
+#define L0 2.8853900817779268
+#define L1 0.9617966939259756
+#define L2 0.5770780163555853
+#define L3 0.4121985831111324
+#define L4 0.3205988979753252
+#define L5 0.2623081892525388
+
+// (-1)^k / (2k + 1)!, the Taylor coefficients of sin r
+#define S1 -0.16666666666666666
+#define S2 0.008333333333333333
+#define S3 -0.0001984126984126984
+#define S4 2.7557319223985893e-06
+
+// (-1)^k / (2k)!, the Taylor coefficients of cos r
+#define C2 0.041666666666666664
+#define C3 -0.001388888888888889
+#define C4 2.48015873015873e-05
+
+// sin r = r * (1 + r^2 * SIN_POLY(r^2)), cos r = 1 - r^2 / 2 + r^4 * COS_POLY(r^2);
+// shared by the scalar and the vector kernel
+#define SIN_POLY(r2) \
+  (S1 + r2 * (S2 + r2 * (S3 + r2 * S4)))
+
+#define COS_POLY(r2) \
+  (C2 + r2 * (C3 + r2 * C4))
+
+// the scalar polynomials, in Estrin's form rather than Horner's: the
+// scalar kernels are bound by the latency of their longest chain of
+// dependent operations, which this shortens; f2 = f^2 and r2 = r^2
+#define EXP2_SHORT_POLY(f, f2) \
+  ((E0 + f * E1) + f2 * (E2 + f * E3))
+
+#define LOG2_SHORT_POLY(r, r2) \
+  ((R1 + r * R2) + r2 * ((R3 + r * R4) + r2 * R5))
+
+// the vector polynomials
+#define EXP2_POLY(f) \
+  (E0 + f * (E1 + f * (E2 + f * (E3 + f * (E4 + f * (E5 + f * E6))))))
+
+#define LOG2_POLY(s2) \
+  (L0 + s2 * (L1 + s2 * (L2 + s2 * (L3 + s2 * (L4 + s2 * L5)))))
+
+static const struct
+{
+  double invc;  // 1 / c, c the centre of the subinterval; 1 for the one holding 1
+  double log2c; // -log2(invc), for invc exactly as rounded
+} log2_table[LOG2_TABLE_SIZE] = {
+    {0x1.5555555555555p+0, -0x1.a8ff971810a5dp-2},
+    {0x1.4e5e0a72f0539p+0, -0x1.8a8980abfbd30p-2},
+    {0x1.47ae147ae147bp+0, -0x1.6cb0f6865c8ebp-2},
+    {0x1.4141414141414p+0, -0x1.4f6fbb2cec598p-2},
+    {0x1.3b13b13b13b14p+0, -0x1.32bfee370ee6ap-2},
+    {0x1.3521cfb2b78c1p+0, -0x1.169c05363f157p-2},
+    {0x1.2f684bda12f68p+0, -0x1.f5fd8a9063e32p-3},
+    {0x1.29e4129e4129ep+0, -0x1.bfc67a7fff4cap-3},
+    {0x1.2492492492492p+0, -0x1.8a8980abfbd30p-3},
+    {0x1.1f7047dc11f70p+0, -0x1.563dc29ffacafp-3},
+    {0x1.1a7b9611a7b96p+0, -0x1.22dadc2ab3496p-3},
+    {0x1.15b1e5f75270dp+0, -0x1.e0b1ae8f2fd56p-4},
+    {0x1.1111111111111p+0, -0x1.7d60496cfbb4bp-4},
+    {0x1.0c9714fbcda3bp+0, -0x1.1bb32a60054a2p-4},
+    {0x1.0842108421084p+0, -0x1.77394c9d958d0p-5},
+    {0x1.0410410410410p+0, -0x1.743ee861f353fp-6},
+    {0x1.0000000000000p+0, 0x0.0p+0},
+    {0x1.f07c1f07c1f08p-1, 0x1.6bad3758efd81p-5},
+    {0x1.e1e1e1e1e1e1ep-1, 0x1.663f6fac91318p-4},
+    {0x1.d41d41d41d41dp-1, 0x1.08c588cda79e5p-3},
+    {0x1.c71c71c71c71cp-1, 0x1.5c01a39fbd68bp-3},
+    {0x1.bacf914c1bad0p-1, 0x1.acf5e2db4ec91p-3},
+    {0x1.af286bca1af28p-1, 0x1.fbc16b902680dp-3},
+    {0x1.a41a41a41a41ap-1, 0x1.24407ab0e073ap-2},
+    {0x1.999999999999ap-1, 0x1.49a784bcd1b8ap-2},
+    {0x1.8f9c18f9c18fap-1, 0x1.6e221cd9d0cddp-2},
+    {0x1.8618618618618p-1, 0x1.91bba891f170ap-2},
+    {0x1.7d05f417d05f4p-1, 0x1.b47ebf73882a1p-2},
+    {0x1.745d1745d1746p-1, 0x1.d6753e032ea0ep-2},
+    {0x1.6c16c16c16c17p-1, 0x1.f7a8568cb06cep-2},
+    {0x1.642c8590b2164p-1, 0x1.0c10500d63aa7p-1},
+    {0x1.5c9882b931057p-1, 0x1.1bf311e95d00ep-1},
+};
+
+// 2^(j / EXP2_TABLE_SIZE)
+static const double exp2_table[EXP2_TABLE_SIZE] = {
+    0x1.0000000000000p+0, 0x1.0b5586cf9890fp+0,
+    0x1.172b83c7d517bp+0, 0x1.2387a6e756238p+0,
+    0x1.306fe0a31b715p+0, 0x1.3dea64c123422p+0,
+    0x1.4bfdad5362a27p+0, 0x1.5ab07dd485429p+0,
+    0x1.6a09e667f3bcdp+0, 0x1.7a11473eb0187p+0,
+    0x1.8ace5422aa0dbp+0, 0x1.9c49182a3f090p+0,
+    0x1.ae89f995ad3adp+0, 0x1.c199bdd85529cp+0,
+    0x1.d5818dcfba487p+0, 0x1.ea4afa2a490dap+0,
+};
+
+static double bits_to_double(int64_t bits)
+{
+  double d;
+  memcpy(&d, &bits, sizeof(d));
+  return d;
+}
+
+static int64_t double_to_bits(double d)
+{
+  int64_t bits;
+  memcpy(&bits, &d, sizeof(bits));
+  return bits;
+}
+
+// Documented in .h file
+double FM_exp2(double x)
+{
+  const double shift = ROUND_MAGIC / EXP2_TABLE_SIZE;
+
+  // clamp out-of-range exponents; NaN fails both tests and propagates
+  if (x < EXP2_MIN)
+    x = EXP2_MIN;
+  if (x > EXP2_MAX)
+    x = EXP2_MAX;
+
+  // t holds x rounded to a multiple of 1/16; its low bits are 16 times that
+  double t = x + shift;
+  double f = x - (t - shift);
+  int64_t k = (int32_t)double_to_bits(t);
+  int64_t n = k >> EXP2_TABLE_BITS;
+  int64_t n1 = n >> 1;
+  int64_t n2 = n - n1;
+  double p = exp2_table[k & (EXP2_TABLE_SIZE - 1)] * EXP2_SHORT_POLY(f, f * f);
+
+  return p * bits_to_double((n1 + 1023) << 52) * bits_to_double((n2 + 1023) << 52);
+}
+
+/*
+ * log2(x) for a positive, finite x
+ */
+static inline double log2_core(double x)
+{
+  int64_t e = 0;
+
+  // bring subnormals into the normal range first
+  if (x < 0x1p-1022)
+  {
+    x *= 0x1p54;
+    e = -54;
+  }
+
+  // x = z * 2^k with z in [LOG2_OFF, 2 LOG2_OFF), and i the subinterval of z
+  int64_t bits = double_to_bits(x);
+  int64_t tmp = bits - LOG2_OFF;
+  int i = (tmp >> (52 - LOG2_TABLE_BITS)) & (LOG2_TABLE_SIZE - 1);
+  double z = bits_to_double(bits - (tmp & (0xfffLL << 52)));
+  double r = z * log2_table[i].invc - 1;
+
+  e += tmp >> 52;
+
+  return e + log2_table[i].log2c + r * LOG2_SHORT_POLY(r, r * r);
+}
+
+// Documented in .h file
+double FM_log2(double x)
+{
+  if (!(x > 0) || x == INFINITY)
+    return log2(x);
+
+  return log2_core(x);
+}
+
+// Documented in .h file
+double FM_pow(double x, double y)
+{
+  if (x > 0 && x < INFINITY && fabs(y) < INFINITY)
+    return FM_exp2(y * log2_core(x));
+
+  return pow(x, y);
+}
+
+/*
+ * sin(x + quadrant * pi/2), for |x| <= SINCOS_MAX
+ */
+static double sin_quadrant(double x, int64_t quadrant)
+{
+  double t = x * TWO_OVER_PI + ROUND_MAGIC;
+  double n = t - ROUND_MAGIC;
+  int64_t q = double_to_bits(t) - double_to_bits(ROUND_MAGIC) + quadrant;
+  double r = (x - n * PIO2_1) - n * PIO2_2;
+  double r2 = r * r;
+  double s = r * (1 + r2 * SIN_POLY(r2));
+  double c = 1 - 0.5 * r2 + r2 * r2 * COS_POLY(r2);
+
+  // the quadrant of random arguments is unpredictable, so both are
+  // computed, and picked and negated with bit masks instead of branches
+  int64_t odd = -(q & 1);
+  int64_t bits = (double_to_bits(c) & odd) | (double_to_bits(s) & ~odd);
+
+  return bits_to_double(bits ^ (int64_t)((uint64_t)(q & 2) << 62));
+}
+
+// Documented in .h file
+double FM_sin(double x)
+{
+  if (!(fabs(x) <= SINCOS_MAX))
+    return sin(x);
+
+  return sin_quadrant(x, 0);
+}
+
+// Documented in .h file
+double FM_cos(double x)
+{
+  if (!(fabs(x) <= SINCOS_MAX))
+    return cos(x);
+
+  return sin_quadrant(x, 1);
+}
+
+#define FM_VLEN 2
+#define FM_TARGET
+#define FM_FN(name) name##_generic
+#include "fastmath_simd.h"
+#undef FM_VLEN
+#undef FM_TARGET
+#undef FM_FN
+
+#if defined(__x86_64__) && defined(__linux__) && defined(__GNUC__)
+
+#define FM_VLEN 4
+#define FM_TARGET __attribute__((target("avx2,fma")))
+#define FM_FN(name) name##_avx2
+#include "fastmath_simd.h"
+#undef FM_VLEN
+#undef FM_TARGET
+#undef FM_FN
+
+static void (*exp2_block)(double *, const double *, int) = FM_exp2_block_generic;
+static void (*log2_block)(double *, const double *, int) = FM_log2_block_generic;
+static void (*pow_block)(double *, const double *, const double *, int) = FM_pow_block_generic;
+static void (*sin_block)(double *, const double *, int) = FM_sin_block_generic;
+static void (*cos_block)(double *, const double *, int) = FM_cos_block_generic;
+
+/*
+ * Pick the AVX2 kernels when the CPU has them. This runs as a
+ * constructor, before main() and so before any thread could call a
+ * block kernel; an ifunc resolver would run even earlier, before the
+ * address sanitizer is initialized, and crash under it.
+ */
+__attribute__((constructor)) static void select_block_kernels()
+{
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+  {
+    exp2_block = FM_exp2_block_avx2;
+    log2_block = FM_log2_block_avx2;
+    pow_block = FM_pow_block_avx2;
+    sin_block = FM_sin_block_avx2;
+    cos_block = FM_cos_block_avx2;
+  }
+}
+
+#else
+
+#define exp2_block FM_exp2_block_generic
+#define log2_block FM_log2_block_generic
+#define pow_block FM_pow_block_generic
+#define sin_block FM_sin_block_generic
+#define cos_block FM_cos_block_generic
+
+#endif
+
+// Documented in .h file
+void FM_exp2_block(double *out, const double *x, int n)
+{
+  exp2_block(out, x, n);
+}
+
+// Documented in .h file
+void FM_log2_block(double *out, const double *x, int n)
+{
+  log2_block(out, x, n);
+}
+
+// Documented in .h file
+void FM_pow_block(double *out, const double *x, const double *y, int n)
+{
+  pow_block(out, x, y, n);
+}
+
+// Documented in .h file
+void FM_sin_block(double *out, const double *x, int n)
+{
+  sin_block(out, x, n);
+}
+
+// Documented in .h file
+void FM_cos_block(double *out, const double *x, int n)
+{
+  cos_block(out, x, n);
+}
@@ -0,0 +1,104 @@
+/*
+ * fastmath.h
+ *
+ * Fast approximations of exp2, log2, pow, sin and cos, for evaluating
+ * expressions that need only about six significant digits. Each
+ * kernel comes in a scalar form and a block form that processes whole
+ * arrays with SIMD instructions.
+ *
+ * The bounds below are maximum errors against libm, for the scalar
+ * and block forms alike: relative errors, except for sin and cos,
+ * whose results pass through zero. They are sized to a budget of about
+ * 1e-6, some hundreds of millions of times the 2.2e-16 of one ulp of a
+ * double, which is what makes the kernels cheaper than libm. They are
+ * checked by sweeps over the input domain in ew_test.c, and ew_bench
+ * times each kernel against libm.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#ifndef _FASTMATH_H_
+#define _FASTMATH_H_
+
+// FM_exp2, over the whole domain. Results that are subnormal are
+// measured relative to the smallest normal double instead.
+#define FM_EXP2_MAX_REL_ERR 3e-7
+
+// FM_log2, over the whole domain; tighter than the others, since
+// FM_pow multiplies its error by up to ln 2 * 1022
+#define FM_LOG2_MAX_REL_ERR 5e-10
+
+// FM_pow, whenever the exact result is a normal double, that is for
+// |y * log2(x)| < 1022
+#define FM_POW_MAX_REL_ERR 5e-7
+
+// FM_sin and FM_cos, over the whole domain: an absolute error
+#define FM_SINCOS_MAX_ABS_ERR 5e-8
+
+/*
+ * Approximate 2 raised to the power x
+ *
+ * Parameters:
+ *   x        The exponent
+ *
+ * Returns: 2^x, within FM_EXP2_MAX_REL_ERR. Infinities and NaN give
+ *   the same results as exp2().
+ */
+double FM_exp2(double x);
+
+/*
+ * Approximate the base-2 logarithm of x
+ *
+ * Parameters:
+ *   x        The argument
+ *
+ * Returns: log2(x), within FM_LOG2_MAX_REL_ERR. Zero, negative,
+ *   infinite and NaN arguments give the same results as log2().
+ */
+double FM_log2(double x);
+
+/*
+ * Approximate x raised to the power y, computed as 2^(y * log2(x))
+ *
+ * Parameters:
+ *   x        The base
+ *   y        The exponent
+ *
+ * Returns: x^y, within FM_POW_MAX_REL_ERR. Bases that are not
+ *   positive and finite, and exponents that are not finite, are
+ *   handed to pow(), so every special case matches libm exactly.
+ */
+double FM_pow(double x, double y);
+
+/*
+ * Approximate the sine or cosine of x
+ *
+ * Parameters:
+ *   x        The argument, in radians
+ *
+ * Returns: sin(x) or cos(x), within FM_SINCOS_MAX_ABS_ERR. Arguments
+ *   beyond +-2^20, infinities and NaN are handed to libm.
+ */
+double FM_sin(double x);
+double FM_cos(double x);
+
+/*
+ * Block forms of the kernels above: out[i] = f(x[i]) (or f(x[i], y[i]))
+ * for 0 <= i < n. The error bounds are the same as for the scalar
+ * forms, although the two may differ in the last bits. out may be the
+ * same array as x or y.
+ *
+ * Parameters:
+ *   out      The results
+ *   x, y     The arguments
+ *   n        Number of elements
+ *
+ * Returns: None
+ */
+void FM_exp2_block(double *out, const double *x, int n);
+void FM_log2_block(double *out, const double *x, int n);
+void FM_pow_block(double *out, const double *x, const double *y, int n);
+void FM_sin_block(double *out, const double *x, int n);
+void FM_cos_block(double *out, const double *x, int n);
+
+#endif /* _FASTMATH_H_ */
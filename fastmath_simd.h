@@ -0,0 +1,200 @@
+/*
+ * fastmath_simd.h
+ *
+ * Vector bodies of the fastmath block kernels. This file is a
+ * template, included by fastmath.c once per instruction set, with
+ * these macros defined:
+ *
+ *   FM_VLEN      Number of doubles per vector
+ *   FM_TARGET    Function attribute selecting the instruction set
+ *   FM_FN(name)  Name of the instantiated function
+ *
+ * It relies on the scalar kernels, constants and polynomial macros
+ * defined in fastmath.c before the inclusion.
+ *
+ * Only lane operations that SSE2 and AVX2 provide natively are used:
+ * no 64-bit arithmetic right shifts and no int64 <-> double
+ * conversions. Integers are moved in and out of doubles with the
+ * ROUND_MAGIC trick instead, and 2^n is split as 2^n1 * 2^(n - n1)
+ * with n1 = round(n / 2), which need not be exactly n >> 1.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#define FMV FM_FN(vdouble)
+#define FMVI FM_FN(vint)
+#define FMVU FM_FN(vuint)
+
+typedef double FMV __attribute__((vector_size(8 * FM_VLEN)));
+typedef int64_t FMVI __attribute__((vector_size(8 * FM_VLEN)));
+typedef uint64_t FMVU __attribute__((vector_size(8 * FM_VLEN)));
+
+// comparisons yield all-ones in the lanes where they hold
+FM_TARGET static inline FMV FM_FN(select)(FMVI mask, FMV a, FMV b)
+{
+  return (FMV)((mask & (FMVI)a) | (~mask & (FMVI)b));
+}
+
+FM_TARGET static inline FMV FM_FN(exp2_v)(FMV x)
+{
+  const FMV zero = {0};
+  const FMV magic = zero + ROUND_MAGIC;
+
+  x = FM_FN(select)(x < EXP2_MIN, zero + EXP2_MIN, x);
+  x = FM_FN(select)(x > EXP2_MAX, zero + EXP2_MAX, x);
+
+  FMV t = x + magic;
+  FMV n = t - magic;
+  FMV f = x - n;
+  FMVI ni = (FMVI)t - (FMVI)magic;
+  FMVI n1 = (FMVI)(n * 0.5 + magic) - (FMVI)magic;
+  FMVI n2 = ni - n1;
+
+  return EXP2_POLY(f) * (FMV)((n1 + 1023) << 52) * (FMV)((n2 + 1023) << 52);
+}
+
+FM_TARGET static inline FMV FM_FN(log2_v)(FMV x)
+{
+  const FMV zero = {0};
+  const FMV magic = zero + ROUND_MAGIC;
+
+  FMVI tiny = x < 0x1p-1022;
+  FMV xs = FM_FN(select)(tiny, x * 0x1p54, x);
+  FMVI bits = (FMVI)xs;
+  FMVI e = (FMVI)(((FMVU)bits >> 52) & 0x7ff) - 1023 - (tiny & 54);
+  FMV m = (FMV)((bits & 0xfffffffffffffLL) | (1023LL << 52));
+
+  FMVI big = m > SQRT2;
+  m = FM_FN(select)(big, m * 0.5, m);
+  e -= big;
+
+  FMV s = (m - 1) / (m + 1);
+  FMV s2 = s * s;
+  FMV r = ((FMV)(e + (FMVI)magic) - magic) + s * LOG2_POLY(s2);
+
+  // the special cases, last to first in order of precedence
+  r = FM_FN(select)(x == 0, zero - INFINITY, r);
+  r = FM_FN(select)((x < 0) | (x != x), zero + NAN, r);
+  return FM_FN(select)(x == INFINITY, zero + INFINITY, r);
+}
+
+// as sin_quadrant in fastmath.c, lane by lane
+FM_TARGET static inline FMV FM_FN(sin_v)(FMV x, int64_t quadrant)
+{
+  const FMV zero = {0};
+  const FMV magic = zero + ROUND_MAGIC;
+
+  FMV t = x * TWO_OVER_PI + magic;
+  FMV n = t - magic;
+  FMVI q = (FMVI)t - (FMVI)magic + quadrant;
+  FMV r = (x - n * PIO2_1) - n * PIO2_2;
+  FMV r2 = r * r;
+  FMV v = FM_FN(select)((q & 1) != 0, 1 - 0.5 * r2 + r2 * r2 * COS_POLY(r2), r * (1 + r2 * SIN_POLY(r2)));
+
+  return FM_FN(select)((q & 2) != 0, -v, v);
+}
+
+FM_TARGET static inline FMV FM_FN(load)(const double *p)
+{
+  FMV v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+FM_TARGET static inline void FM_FN(store)(double *p, FMV v)
+{
+  memcpy(p, &v, sizeof(v));
+}
+
+FM_TARGET static void FM_FN(FM_exp2_block)(double *out, const double *x, int n)
+{
+  int i = 0;
+
+  for (; i + FM_VLEN <= n; i += FM_VLEN)
+    FM_FN(store)(out + i, FM_FN(exp2_v)(FM_FN(load)(x + i)));
+
+  for (; i < n; i++)
+    out[i] = FM_exp2(x[i]);
+}
+
+FM_TARGET static void FM_FN(FM_log2_block)(double *out, const double *x, int n)
+{
+  int i = 0;
+
+  for (; i + FM_VLEN <= n; i += FM_VLEN)
+    FM_FN(store)(out + i, FM_FN(log2_v)(FM_FN(load)(x + i)));
+
+  for (; i < n; i++)
+    out[i] = FM_log2(x[i]);
+}
+
+FM_TARGET static void FM_FN(FM_pow_block)(double *out, const double *x, const double *y, int n)
+{
+  int i = 0;
+
+  for (; i + FM_VLEN <= n; i += FM_VLEN)
+  {
+    FMV xv = FM_FN(load)(x + i);
+    FMV yv = FM_FN(load)(y + i);
+    FMVI bad = ~((xv > 0) & (xv < INFINITY) & (yv > -INFINITY) & (yv < INFINITY));
+    int64_t any_bad = 0;
+
+    FM_FN(store)(out + i, FM_FN(exp2_v)(yv * FM_FN(log2_v)(xv)));
+
+    // rare: lanes with special arguments are redone by libm
+    for (int j = 0; j < FM_VLEN; j++)
+      any_bad |= bad[j];
+
+    if (any_bad)
+      for (int j = 0; j < FM_VLEN; j++)
+        if (bad[j])
+          out[i + j] = pow(xv[j], yv[j]);
+  }
+
+  for (; i < n; i++)
+    out[i] = FM_pow(x[i], y[i]);
+}
+
+/*
+ * out[i] = sin(x[i] + quadrant * pi/2); lanes the reduction cannot
+ * handle are redone by libm
+ */
+FM_TARGET static void FM_FN(sin_quadrant_block)(double *out, const double *x, int n, int64_t quadrant)
+{
+  double (*libm)(double) = (quadrant == 0) ? sin : cos;
+  int i = 0;
+
+  for (; i + FM_VLEN <= n; i += FM_VLEN)
+  {
+    FMV xv = FM_FN(load)(x + i);
+    FMVI bad = ~((xv >= -SINCOS_MAX) & (xv <= SINCOS_MAX));
+    int64_t any_bad = 0;
+
+    FM_FN(store)(out + i, FM_FN(sin_v)(xv, quadrant));
+
+    for (int j = 0; j < FM_VLEN; j++)
+      any_bad |= bad[j];
+
+    if (any_bad)
+      for (int j = 0; j < FM_VLEN; j++)
+        if (bad[j])
+          out[i + j] = libm(xv[j]);
+  }
+
+  for (; i < n; i++)
+    out[i] = (quadrant == 0) ? FM_sin(x[i]) : FM_cos(x[i]);
+}
+
+FM_TARGET static void FM_FN(FM_sin_block)(double *out, const double *x, int n)
+{
+  FM_FN(sin_quadrant_block)(out, x, n, 0);
+}
+
+FM_TARGET static void FM_FN(FM_cos_block)(double *out, const double *x, int n)
+{
+  FM_FN(sin_quadrant_block)(out, x, n, 1);
+}
+
+#undef FMV
+#undef FMVI
+#undef FMVU
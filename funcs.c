@@ -0,0 +1,208 @@
+/*
+ * funcs.c
+ *
+ * The registry of built-in math functions.
+ *
+ * Every block kernel is a single loop over plain arrays, which the
+ * compiler vectorizes for sqrt, abs, min and max (this file is built
+ * with -fno-math-errno, so that sqrt needs no errno check); the exact
+ * exp, log, sin and cos call libm element by element, so that they
+ * match the scalar forms bit for bit. The approximate kernels hand
+ * whole blocks to the SIMD kernels of fastmath.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "funcs.h"
+#include "fastmath.h"
+
+#define LOG2E 1.4426950408889634
+#define LN2 0.6931471805599453
+
+// The names are between FN_MIN_NAME and FN_MAX_NAME characters long,
+// and FN_HASH maps each one to a different slot of a table of
+// FN_SLOTS, from its first two characters and its length. A new name
+// must keep it that way; test_functions checks that it does.
+#define FN_MIN_NAME 3
+#define FN_MAX_NAME 4
+#define FN_SLOTS 16
+#define FN_HASH(c0, c1, len) (((unsigned char)(c0) + (unsigned char)(c1) + (len)) & (FN_SLOTS - 1))
+
+static double fn_sqrt(double x, double y)
+{
+  return sqrt(x);
+}
+
+static double fn_exp(double x, double y)
+{
+  return exp(x);
+}
+
+static double fn_log(double x, double y)
+{
+  return log(x);
+}
+
+static double fn_sin(double x, double y)
+{
+  return sin(x);
+}
+
+static double fn_cos(double x, double y)
+{
+  return cos(x);
+}
+
+static double fn_abs(double x, double y)
+{
+  return fabs(x);
+}
+
+// as the SSE2 minpd and maxpd instructions: y when either is NaN
+static double fn_min(double x, double y)
+{
+  return x < y ? x : y;
+}
+
+static double fn_max(double x, double y)
+{
+  return x > y ? x : y;
+}
+
+static double fn_exp_approx(double x, double y)
+{
+  return FM_exp2(x * LOG2E);
+}
+
+static double fn_log_approx(double x, double y)
+{
+  return FM_log2(x) * LN2;
+}
+
+static double fn_sin_approx(double x, double y)
+{
+  return FM_sin(x);
+}
+
+static double fn_cos_approx(double x, double y)
+{
+  return FM_cos(x);
+}
+
+static void fn_sqrt_block(double *out, const double *x, const double *y, int n)
+{
+  for (int i = 0; i < n; i++)
+    out[i] = sqrt(x[i]);
+}
+
+static void fn_exp_block(double *out, const double *x, const double *y, int n)
+{
+  for (int i = 0; i < n; i++)
+    out[i] = exp(x[i]);
+}
+
+static void fn_log_block(double *out, const double *x, const double *y, int n)
+{
+  for (int i = 0; i < n; i++)
+    out[i] = log(x[i]);
+}
+
+static void fn_sin_block(double *out, const double *x, const double *y, int n)
+{
+  for (int i = 0; i < n; i++)
+    out[i] = sin(x[i]);
+}
+
+static void fn_cos_block(double *out, const double *x, const double *y, int n)
+{
+  for (int i = 0; i < n; i++)
+    out[i] = cos(x[i]);
+}
+
+static void fn_abs_block(double *out, const double *x, const double *y, int n)
+{
+  for (int i = 0; i < n; i++)
+    out[i] = fabs(x[i]);
+}
+
+static void fn_min_block(double *out, const double *x, const double *y, int n)
+{
+  for (int i = 0; i < n; i++)
+    out[i] = x[i] < y[i] ? x[i] : y[i];
+}
+
+static void fn_max_block(double *out, const double *x, const double *y, int n)
+{
+  for (int i = 0; i < n; i++)
+    out[i] = x[i] > y[i] ? x[i] : y[i];
+}
+
+static void fn_exp_approx_block(double *out, const double *x, const double *y, int n)
+{
+  for (int i = 0; i < n; i++)
+    out[i] = x[i] * LOG2E;
+
+  FM_exp2_block(out, out, n);
+}
+
+static void fn_log_approx_block(double *out, const double *x, const double *y, int n)
+{
+  FM_log2_block(out, x, n);
+
+  for (int i = 0; i < n; i++)
+    out[i] *= LN2;
+}
+
+static void fn_sin_approx_block(double *out, const double *x, const double *y, int n)
+{
+  FM_sin_block(out, x, n);
+}
+
+static void fn_cos_approx_block(double *out, const double *x, const double *y, int n)
+{
+  FM_cos_block(out, x, n);
+}
+
+// Documented in .h file
+const struct _function FN_registry[FN_COUNT] = {
+    {"sqrt", OP_SQRT, 1, fn_sqrt, fn_sqrt, fn_sqrt_block, fn_sqrt_block},
+    {"exp", OP_EXP, 1, fn_exp, fn_exp_approx, fn_exp_block, fn_exp_approx_block},
+    {"log", OP_LOG, 1, fn_log, fn_log_approx, fn_log_block, fn_log_approx_block},
+    {"sin", OP_SIN, 1, fn_sin, fn_sin_approx, fn_sin_block, fn_sin_approx_block},
+    {"cos", OP_COS, 1, fn_cos, fn_cos_approx, fn_cos_block, fn_cos_approx_block},
+    {"abs", OP_ABS, 1, fn_abs, fn_abs, fn_abs_block, fn_abs_block},
+    {"min", OP_MIN, 2, fn_min, fn_min, fn_min_block, fn_min_block},
+    {"max", OP_MAX, 2, fn_max, fn_max, fn_max_block, fn_max_block},
+};
+
+#define SLOT(c0, c1, len, op) [FN_HASH(c0, c1, len)] = &FN_registry[op - OP_SQRT]
+
+// the perfect hash table, filled in at compile time
+static const struct _function *const fn_slots[FN_SLOTS] = {
+    SLOT('s', 'q', 4, OP_SQRT),
+    SLOT('e', 'x', 3, OP_EXP),
+    SLOT('l', 'o', 3, OP_LOG),
+    SLOT('s', 'i', 3, OP_SIN),
+    SLOT('c', 'o', 3, OP_COS),
+    SLOT('a', 'b', 3, OP_ABS),
+    SLOT('m', 'i', 3, OP_MIN),
+    SLOT('m', 'a', 3, OP_MAX),
+};
+
+// Documented in .h file
+MathFunc FN_lookup(const char *name, size_t len)
+{
+  if (len < FN_MIN_NAME || len > FN_MAX_NAME)
+    return NULL;
+
+  // one probe, and one comparison to reject names that are not there
+  MathFunc fn = fn_slots[FN_HASH(name[0], name[1], len)];
+
+  if (fn == NULL || strncmp(fn->name, name, len) != 0 || fn->name[len] != '\0')
+    return NULL;
+
+  return fn;
+}
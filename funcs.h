@@ -0,0 +1,88 @@
+/*
+ * funcs.h
+ *
+ * The registry of built-in math functions that expressions can call,
+ * such as sqrt(x) or min(a, b). Each function is an ExprNodeType of
+ * its own, from OP_SQRT to OP_MAX, and its registry entry gives its
+ * name, its number of arguments and its implementations:
+ *
+ *   scalar        one value at a time, for ET_evaluate and the other
+ *                 scalar evaluators
+ *   block         whole arrays at a time, for the batch evaluators;
+ *                 bit-identical to scalar
+ *   approx,       the same two for EI_APPROX mode, built on the
+ *   approx_block  fastmath kernels where there is one to use
+ *
+ * The tokenizer resolves names with FN_lookup, a perfect hash over
+ * the (fixed) set of names.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#ifndef _FUNCS_H_
+#define _FUNCS_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "expr_tree.h"
+
+#define FN_COUNT (OP_MAX - OP_SQRT + 1)
+
+struct _function
+{
+  const char *name;
+  ExprNodeType op;
+  int nargs; // 1 or 2
+
+  // f(x) or f(x, y); y is ignored by functions of one argument
+  double (*scalar)(double x, double y);
+  double (*approx)(double x, double y);
+
+  // out[i] = f(x[i], y[i]) for 0 <= i < n. out may be the same array
+  // as x; y is ignored, and may be NULL, for functions of one argument.
+  void (*block)(double *out, const double *x, const double *y, int n);
+  void (*approx_block)(double *out, const double *x, const double *y, int n);
+};
+
+typedef const struct _function *MathFunc;
+
+// the registry, in node type order; use FN_for_op
+extern const struct _function FN_registry[FN_COUNT];
+
+/*
+ * Returns true if type is the node type of a built-in function
+ */
+static inline bool FN_is_function(ExprNodeType type)
+{
+  return type >= OP_SQRT && type <= OP_MAX;
+}
+
+/*
+ * Return the registry entry for a function node type
+ *
+ * Parameters:
+ *   op       The node type; FN_is_function(op) must hold
+ *
+ * Returns: The function
+ */
+static inline MathFunc FN_for_op(ExprNodeType op)
+{
+  assert(FN_is_function(op));
+
+  return &FN_registry[op - OP_SQRT];
+}
+
+/*
+ * Look up a function by name
+ *
+ * Parameters:
+ *   name     The name, which need not be \0-terminated
+ *   len      Length of name
+ *
+ * Returns: The function, or NULL if there is none by that name
+ */
+MathFunc FN_lookup(const char *name, size_t len);
+
+#endif /* _FUNCS_H_ */
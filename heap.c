@@ -0,0 +1,376 @@
+/*
+ * heap.c
+ *
+ * Tracked allocation for the core modules: each block allocated from
+ * a Heap carries a small header that links it into the Heap's list of
+ * live blocks, newest first, with a sequence number that only grows.
+ * The header also says which module the block is for, so that blocks
+ * given back together by a rollback are still counted where they were.
+ * Blocks from malloc have no header; the accounting takes their sizes
+ * from malloc_usable_size.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <malloc.h>
+#include <stdatomic.h>
+
+#include "heap.h"
+
+struct _heap_block
+{
+  HeapBlock *newer;
+  HeapBlock *older;
+  size_t size;
+  uint64_t seq : 55;
+  uint64_t counted : 1; // allocated while the accounting was on
+  uint64_t module : 8;
+};
+
+// The counters of a module or a phase; see HeapCounts
+struct counters
+{
+  atomic_uint_least64_t allocs;
+  atomic_uint_least64_t frees;
+  atomic_uint_least64_t bytes;
+  atomic_int_least64_t live;
+  atomic_int_least64_t peak;
+};
+
+_Static_assert(sizeof(HeapBlock) % _Alignof(max_align_t) == 0,
+               "the header must keep blocks aligned for any type");
+
+// The Heap the calling thread allocates from, or NULL for malloc
+static _Thread_local Heap *current;
+
+// The phase of the pipeline the calling thread is in
+static _Thread_local HeapPhase phase;
+
+static atomic_bool stats_on;
+static struct counters module_counters[HP_NMODULES];
+static struct counters phase_counters[HP_NPHASES];
+static atomic_int_least64_t total_live; // of all modules
+
+/*
+ * Make *peak at least value
+ */
+static void raise_peak(atomic_int_least64_t *peak, int64_t value)
+{
+  int64_t old = atomic_load_explicit(peak, memory_order_relaxed);
+
+  while (value > old &&
+         !atomic_compare_exchange_weak_explicit(peak, &old, value, memory_order_relaxed, memory_order_relaxed))
+    ;
+}
+
+/*
+ * Count an allocation of size bytes for module, in the phase of the
+ * calling thread
+ */
+static void count_alloc(HeapModule module, size_t size)
+{
+  struct counters *m = &module_counters[module];
+  struct counters *p = &phase_counters[phase];
+
+  atomic_fetch_add_explicit(&m->allocs, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&m->bytes, size, memory_order_relaxed);
+  raise_peak(&m->peak, atomic_fetch_add_explicit(&m->live, size, memory_order_relaxed) + size);
+
+  atomic_fetch_add_explicit(&p->allocs, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&p->bytes, size, memory_order_relaxed);
+  atomic_fetch_add_explicit(&p->live, size, memory_order_relaxed);
+  raise_peak(&p->peak, atomic_fetch_add_explicit(&total_live, size, memory_order_relaxed) + size);
+}
+
+/*
+ * Count a free of size bytes of module, in the phase of the calling
+ * thread
+ */
+static void count_free(HeapModule module, size_t size)
+{
+  struct counters *m = &module_counters[module];
+  struct counters *p = &phase_counters[phase];
+
+  atomic_fetch_add_explicit(&m->frees, 1, memory_order_relaxed);
+  atomic_fetch_sub_explicit(&m->live, size, memory_order_relaxed);
+  atomic_fetch_add_explicit(&p->frees, 1, memory_order_relaxed);
+  atomic_fetch_sub_explicit(&p->live, size, memory_order_relaxed);
+  atomic_fetch_sub_explicit(&total_live, size, memory_order_relaxed);
+}
+
+/*
+ * Return whether allocations are being counted
+ */
+static bool counting()
+{
+  return atomic_load_explicit(&stats_on, memory_order_relaxed);
+}
+
+/*
+ * Return the header of a block allocated from a Heap
+ */
+static HeapBlock *header(void *ptr)
+{
+  return (HeapBlock *)ptr - 1;
+}
+
+/*
+ * Allocate an untracked block from heap, jumping to its failure handler
+ * if there is no memory
+ */
+static HeapBlock *block_alloc(Heap *heap, HeapModule module, size_t size)
+{
+  HeapBlock *block = NULL;
+
+  if (size <= SIZE_MAX - sizeof(HeapBlock))
+    block = heap->alloc(heap->user, sizeof(HeapBlock) + size);
+
+  if (block == NULL)
+  {
+    assert(heap->on_failure != NULL);
+    longjmp(*heap->on_failure, 1);
+  }
+
+  block->size = size;
+  block->module = module;
+  block->counted = counting();
+  if (block->counted)
+    count_alloc(module, size);
+  return block;
+}
+
+/*
+ * Take a block out of the list of live blocks and give it back
+ */
+static void block_free(Heap *heap, HeapBlock *block)
+{
+  if (block->newer != NULL)
+    block->newer->older = block->older;
+  else
+    heap->newest = block->older;
+  if (block->older != NULL)
+    block->older->newer = block->newer;
+
+  if (block->counted)
+    count_free(block->module, block->size);
+  heap->bytes -= block->size;
+  heap->release(heap->user, block, sizeof(HeapBlock) + block->size);
+}
+
+// Documented in .h file
+void HP_init(Heap *heap, void *(*alloc)(void *user, size_t size),
+             void (*release)(void *user, void *ptr, size_t size), void *user)
+{
+  heap->alloc = alloc;
+  heap->release = release;
+  heap->user = user;
+  heap->newest = NULL;
+  heap->seq = 0;
+  heap->bytes = 0;
+  heap->on_failure = NULL;
+}
+
+// Documented in .h file
+Heap *HP_enter(Heap *heap, jmp_buf *on_failure)
+{
+  Heap *prev = current;
+
+  current = heap;
+  if (heap != NULL)
+    heap->on_failure = on_failure;
+
+  return prev;
+}
+
+// Documented in .h file
+uint64_t HP_mark(const Heap *heap)
+{
+  return heap->seq;
+}
+
+// Documented in .h file
+void HP_rollback(Heap *heap, uint64_t mark)
+{
+  while (heap->newest != NULL && heap->newest->seq > mark)
+    block_free(heap, heap->newest);
+}
+
+// Documented in .h file
+void HP_release_all(Heap *heap)
+{
+  HP_rollback(heap, 0);
+}
+
+// Documented in .h file
+void *HP_malloc(HeapModule module, size_t size)
+{
+  if (current == NULL)
+  {
+    void *ptr = malloc(size ? size : 1);
+    assert(ptr != NULL);
+    if (counting())
+      count_alloc(module, malloc_usable_size(ptr));
+    return ptr;
+  }
+
+  HeapBlock *block = block_alloc(current, module, size);
+
+  block->seq = ++current->seq;
+  block->newer = NULL;
+  block->older = current->newest;
+  if (current->newest != NULL)
+    current->newest->newer = block;
+  current->newest = block;
+  current->bytes += size;
+
+  return block + 1;
+}
+
+// Documented in .h file
+void *HP_calloc(HeapModule module, size_t n, size_t size)
+{
+  size_t total = n * size;
+
+  if (size != 0 && total / size != n)
+    total = SIZE_MAX; // fails like any other allocation that is too large
+
+  void *ptr = HP_malloc(module, total);
+  memset(ptr, 0, total);
+  return ptr;
+}
+
+// Documented in .h file
+void *HP_realloc(HeapModule module, void *ptr, size_t size)
+{
+  if (current == NULL)
+  {
+    bool count = counting();
+
+    if (count && ptr != NULL)
+      count_free(module, malloc_usable_size(ptr));
+    ptr = realloc(ptr, size ? size : 1);
+    assert(ptr != NULL);
+    if (count)
+      count_alloc(module, malloc_usable_size(ptr));
+    return ptr;
+  }
+
+  if (ptr == NULL)
+    return HP_malloc(module, size);
+
+  HeapBlock *old = header(ptr);
+  HeapBlock *block = block_alloc(current, module, size);
+
+  memcpy(block + 1, old + 1, old->size < size ? old->size : size);
+
+  // take over the place of the old block in the list
+  block->seq = old->seq;
+  block->newer = old->newer;
+  block->older = old->older;
+  if (block->newer != NULL)
+    block->newer->older = block;
+  else
+    current->newest = block;
+  if (block->older != NULL)
+    block->older->newer = block;
+
+  if (old->counted)
+    count_free(old->module, old->size);
+  current->bytes += size - old->size;
+  current->release(current->user, old, sizeof(HeapBlock) + old->size);
+
+  return block + 1;
+}
+
+// Documented in .h file
+char *HP_strndup(HeapModule module, const char *str, size_t len)
+{
+  len = strnlen(str, len);
+
+  char *dup = HP_malloc(module, len + 1);
+  memcpy(dup, str, len);
+  dup[len] = '\0';
+  return dup;
+}
+
+// Documented in .h file
+void HP_free(HeapModule module, void *ptr)
+{
+  if (ptr == NULL)
+    return;
+
+  if (current != NULL)
+    block_free(current, header(ptr));
+  else
+  {
+    if (counting())
+      count_free(module, malloc_usable_size(ptr));
+    free(ptr);
+  }
+}
+
+// Documented in .h file
+void HP_stats_enable(bool on)
+{
+  atomic_store_explicit(&stats_on, on, memory_order_relaxed);
+}
+
+// Documented in .h file
+HeapPhase HP_set_phase(HeapPhase new_phase)
+{
+  HeapPhase prev = phase;
+
+  phase = new_phase;
+  return prev;
+}
+
+/*
+ * Read one set of counters
+ */
+static void read_counters(struct counters *c, HeapCounts *counts)
+{
+  counts->allocs = atomic_load_explicit(&c->allocs, memory_order_relaxed);
+  counts->frees = atomic_load_explicit(&c->frees, memory_order_relaxed);
+  counts->bytes = atomic_load_explicit(&c->bytes, memory_order_relaxed);
+  counts->live = atomic_load_explicit(&c->live, memory_order_relaxed);
+  counts->peak = atomic_load_explicit(&c->peak, memory_order_relaxed);
+}
+
+// Documented in .h file
+void HP_stats(HeapStats *stats)
+{
+  for (int i = 0; i < HP_NMODULES; i++)
+    read_counters(&module_counters[i], &stats->module[i]);
+  for (int i = 0; i < HP_NPHASES; i++)
+    read_counters(&phase_counters[i], &stats->phase[i]);
+}
+
+/*
+ * Zero one set of counters, but for what is live
+ */
+static void reset_counters(struct counters *c, int64_t peak)
+{
+  atomic_store_explicit(&c->allocs, 0, memory_order_relaxed);
+  atomic_store_explicit(&c->frees, 0, memory_order_relaxed);
+  atomic_store_explicit(&c->bytes, 0, memory_order_relaxed);
+  atomic_store_explicit(&c->peak, peak, memory_order_relaxed);
+}
+
+// Documented in .h file
+void HP_stats_reset()
+{
+  int64_t live = atomic_load_explicit(&total_live, memory_order_relaxed);
+
+  for (int i = 0; i < HP_NMODULES; i++)
+    reset_counters(&module_counters[i], atomic_load_explicit(&module_counters[i].live, memory_order_relaxed));
+  for (int i = 0; i < HP_NPHASES; i++)
+  {
+    reset_counters(&phase_counters[i], live);
+    atomic_store_explicit(&phase_counters[i].live, 0, memory_order_relaxed);
+  }
+}
@@ -0,0 +1,208 @@
+/*
+ * heap.h
+ *
+ * Where the core modules (lists, trees, variable tables) get their
+ * memory. By default HP_malloc and friends are malloc and friends,
+ * asserting on failure. While a Heap is entered on a thread, the
+ * allocations of that thread come from the Heap's allocator instead
+ * and are tracked by it, so that:
+ *
+ *   - every block can be given back at once (HP_release_all), or just
+ *     the ones allocated since a mark (HP_rollback), which is how a
+ *     failed operation is undone without knowing what it had built;
+ *   - running out of memory does not abort, but jumps back to the
+ *     caller that entered the Heap, which reports the failure.
+ *
+ * The entered Heap is per thread, so threads entering different Heaps
+ * never share anything. Memory must be freed under the Heap that
+ * allocated it (or under none, if it was allocated under none).
+ *
+ * Every call names the module the memory is for, and, when switched on
+ * with HP_stats_enable, the allocations and frees are counted by module
+ * and by the phase of the pipeline the calling thread is in. The
+ * counters are shared by all threads; while they are off, all that an
+ * allocation pays for them is the test of one flag.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#ifndef _HEAP_H_
+#define _HEAP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <setjmp.h>
+
+typedef struct _heap_block HeapBlock;
+
+// The modules that allocate, which the accounting charges blocks to
+typedef enum
+{
+  HP_CLIST,     // lists and their nodes
+  HP_EXPR_TREE, // tree nodes
+  HP_VARS,      // variable tables and variables
+  HP_CONTEXT,   // the caches of compiled expressions of contexts
+  HP_SHEET,     // definitions and their dependency graphs
+  HP_NMODULES
+} HeapModule;
+
+// The phases of the pipeline a thread may be in, as set by HP_set_phase
+typedef enum
+{
+  HP_OTHER,    // anywhere else, such as evaluating or freeing
+  HP_TOKENIZE, // in TOK_tokenize_n
+  HP_PARSE,    // in Parse
+  HP_NPHASES
+} HeapPhase;
+
+/*
+ * What the accounting counted. For a module, live is the bytes of its
+ * blocks allocated and not yet freed, and peak the most live has been.
+ * For a phase, live is the bytes allocated less the bytes freed in it,
+ * and peak the most bytes of all modules that were live at once while
+ * a thread was in it. A realloc counts as a free and an allocation.
+ */
+typedef struct
+{
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t bytes; // allocated, in all
+  int64_t live;
+  int64_t peak;
+} HeapCounts;
+
+typedef struct
+{
+  HeapCounts module[HP_NMODULES];
+  HeapCounts phase[HP_NPHASES];
+} HeapStats;
+
+typedef struct
+{
+  void *(*alloc)(void *user, size_t size);
+  void (*release)(void *user, void *ptr, size_t size);
+  void *user;
+
+  HeapBlock *newest;   // the live blocks, newest first
+  uint64_t seq;        // sequence number of the last block allocated
+  size_t bytes;        // live bytes, not counting the tracking overhead
+  jmp_buf *on_failure; // where an allocation that fails jumps to
+} Heap;
+
+/*
+ * Initialize a Heap with no live blocks
+ *
+ * Parameters:
+ *   heap       The Heap
+ *   alloc      Returns size bytes aligned for any type, or NULL
+ *   release    Gives back a block that alloc returned, with its size
+ *   user       Passed to alloc and release
+ *
+ * Returns: None
+ */
+void HP_init(Heap *heap, void *(*alloc)(void *user, size_t size),
+             void (*release)(void *user, void *ptr, size_t size), void *user);
+
+/*
+ * Make heap the one that the calling thread allocates from. An
+ * allocation that fails longjmps to *on_failure with the value 1.
+ *
+ * Parameters:
+ *   heap        The Heap, or NULL to go back to malloc
+ *   on_failure  Where to jump when out of memory; ignored if heap is NULL
+ *
+ * Returns: The Heap that was entered before, to be passed back to
+ *   HP_enter when done
+ */
+Heap *HP_enter(Heap *heap, jmp_buf *on_failure);
+
+/*
+ * Return a mark that HP_rollback can go back to
+ *
+ * Parameters:
+ *   heap       The Heap
+ *
+ * Returns: The mark
+ */
+uint64_t HP_mark(const Heap *heap);
+
+/*
+ * Free every block allocated from heap since mark was taken. Objects
+ * that live on must not point into them.
+ *
+ * Parameters:
+ *   heap       The Heap
+ *   mark       A mark from HP_mark
+ *
+ * Returns: None
+ */
+void HP_rollback(Heap *heap, uint64_t mark);
+
+/*
+ * Free every block of heap
+ *
+ * Parameters:
+ *   heap       The Heap
+ *
+ * Returns: None
+ */
+void HP_release_all(Heap *heap);
+
+/*
+ * The allocation functions, with the semantics of the C library ones,
+ * except that they never return NULL, and take the module the memory is
+ * for first; a block must be reallocated and freed for the module that
+ * allocated it. A block that HP_realloc moves keeps its place in the
+ * order of allocation, so a rollback never frees a block that was
+ * allocated before the mark just because it grew.
+ */
+void *HP_malloc(HeapModule module, size_t size);
+void *HP_calloc(HeapModule module, size_t n, size_t size);
+void *HP_realloc(HeapModule module, void *ptr, size_t size);
+char *HP_strndup(HeapModule module, const char *str, size_t len);
+void HP_free(HeapModule module, void *ptr);
+
+/*
+ * Switch the accounting on or off, for all threads. Blocks allocated
+ * while it was off are not counted when they are freed, if they came
+ * from a Heap; others are, so a module's live bytes may go below zero.
+ *
+ * Parameters:
+ *   on         Whether to count
+ *
+ * Returns: None
+ */
+void HP_stats_enable(bool on);
+
+/*
+ * Set the phase of the pipeline the calling thread is in
+ *
+ * Parameters:
+ *   phase      The phase
+ *
+ * Returns: The phase it was in before, to be set back when done
+ */
+HeapPhase HP_set_phase(HeapPhase phase);
+
+/*
+ * Read the counters. Threads allocating meanwhile may be counted in some
+ * of them and not yet in others.
+ *
+ * Parameters:
+ *   stats      Return space for the counters
+ *
+ * Returns: None
+ */
+void HP_stats(HeapStats *stats);
+
+/*
+ * Zero the counters, except that the modules keep their live bytes,
+ * which become their peaks, and the peaks of the phases become the
+ * bytes live in all
+ *
+ * Returns: None
+ */
+void HP_stats_reset();
+
+#endif /* _HEAP_H_ */
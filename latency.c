@@ -0,0 +1,203 @@
+/*
+ * latency.c
+ *
+ * Per-thread latency histograms. A thread's first recording allocates
+ * its histograms and pushes them onto a list with a compare-and-swap;
+ * they are never taken off it, so a reader can walk the list at any
+ * time. Only the owning thread writes to a histogram, so a count is
+ * bumped with a relaxed load and store rather than an atomic add.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <time.h>
+#include <math.h>
+#include <stdatomic.h>
+
+#include "latency.h"
+
+#define SUB_BITS 5 // log2 of LH_SUB_BUCKETS
+#define NBUCKETS ((64 - SUB_BITS) * LH_SUB_BUCKETS + LH_SUB_BUCKETS)
+
+_Static_assert(LH_SUB_BUCKETS == 1 << SUB_BITS, "SUB_BITS must match LH_SUB_BUCKETS");
+
+// the histograms of one thread
+struct histograms
+{
+  struct histograms *next;
+  atomic_uint_least64_t counts[LH_NPHASES][NBUCKETS];
+  atomic_uint_least64_t max[LH_NPHASES];
+};
+
+static const char *phase_names[LH_NPHASES] = {"tokenize", "parse", "evaluate", "format"};
+
+static atomic_bool enabled;
+static _Atomic(struct histograms *) all;  // of every thread that has recorded
+static _Thread_local struct histograms *mine;
+
+/*
+ * Return the bucket of a time. Times below 2 * LH_SUB_BUCKETS have a
+ * bucket each; above that, the bucket is given by the position of the
+ * highest bit set and the SUB_BITS bits below it.
+ */
+static int bucket(uint64_t ns)
+{
+  if (ns < 2 * LH_SUB_BUCKETS)
+    return ns;
+
+  int shift = 63 - __builtin_clzll(ns) - SUB_BITS;
+  return shift * LH_SUB_BUCKETS + (ns >> shift);
+}
+
+/*
+ * Return the highest time that falls in a bucket
+ */
+static uint64_t bucket_high(int b)
+{
+  if (b < 2 * LH_SUB_BUCKETS)
+    return b;
+
+  int shift = b / LH_SUB_BUCKETS - 1;
+  uint64_t top = b - shift * LH_SUB_BUCKETS;
+
+  return ((top + 1) << shift) - 1;
+}
+
+/*
+ * Return the time in nanoseconds
+ */
+static uint64_t now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Add one to a counter only the calling thread writes to
+ */
+static void bump(atomic_uint_least64_t *counter)
+{
+  atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1,
+                        memory_order_relaxed);
+}
+
+// Documented in .h file
+void LH_enable()
+{
+  atomic_store_explicit(&enabled, true, memory_order_relaxed);
+}
+
+// Documented in .h file
+uint64_t LH_start()
+{
+  return atomic_load_explicit(&enabled, memory_order_relaxed) ? now() : 0;
+}
+
+// Documented in .h file
+uint64_t LH_lap(LatencyPhase phase, uint64_t start)
+{
+  if (!atomic_load_explicit(&enabled, memory_order_relaxed))
+    return 0;
+
+  uint64_t t = now();
+
+  // start is 0 if recording was turned on since the phase started
+  if (start != 0)
+    LH_record(phase, t - start);
+  return t;
+}
+
+// Documented in .h file
+void LH_record(LatencyPhase phase, uint64_t ns)
+{
+  if (mine == NULL)
+  {
+    mine = calloc(1, sizeof(struct histograms));
+    assert(mine != NULL);
+
+    mine->next = atomic_load_explicit(&all, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&all, &mine->next, mine, memory_order_release,
+                                                  memory_order_relaxed))
+      ;
+  }
+
+  if (ns > atomic_load_explicit(&mine->max[phase], memory_order_relaxed))
+    atomic_store_explicit(&mine->max[phase], ns, memory_order_relaxed);
+  bump(&mine->counts[phase][bucket(ns)]);
+}
+
+/*
+ * Return the highest time of the bucket that the rank'th smallest time
+ * falls in, counting from 1
+ */
+static uint64_t value_at_rank(const uint64_t *counts, uint64_t rank)
+{
+  uint64_t seen = 0;
+
+  for (int b = 0; b < NBUCKETS; b++)
+  {
+    seen += counts[b];
+    if (seen >= rank)
+      return bucket_high(b);
+  }
+
+  return 0;
+}
+
+// Documented in .h file
+void LH_summary(LatencyPhase phase, LatencySummary *summary)
+{
+  uint64_t counts[NBUCKETS] = {0};
+  const double fractions[] = {0.5, 0.9, 0.99, 0.999};
+  uint64_t *percentiles[] = {&summary->p50, &summary->p90, &summary->p99, &summary->p999};
+
+  summary->count = 0;
+  summary->max = 0;
+
+  for (struct histograms *h = atomic_load_explicit(&all, memory_order_acquire); h != NULL; h = h->next)
+  {
+    for (int b = 0; b < NBUCKETS; b++)
+    {
+      uint64_t n = atomic_load_explicit(&h->counts[phase][b], memory_order_relaxed);
+
+      counts[b] += n;
+      summary->count += n;
+    }
+
+    uint64_t max = atomic_load_explicit(&h->max[phase], memory_order_relaxed);
+    if (max > summary->max)
+      summary->max = max;
+  }
+
+  for (int i = 0; i < sizeof(fractions) / sizeof(fractions[0]); i++)
+  {
+    uint64_t rank = ceil(fractions[i] * summary->count);
+    uint64_t value = value_at_rank(counts, rank > 0 ? rank : 1);
+
+    // a bucket may reach beyond the largest time in it
+    *percentiles[i] = (value < summary->max) ? value : summary->max;
+  }
+}
+
+// Documented in .h file
+void LH_print(FILE *out)
+{
+  fprintf(out, "%-10s %12s %10s %10s %10s %10s %12s\n", "(ns)", "count", "p50", "p90", "p99", "p99.9",
+          "max");
+
+  for (int phase = 0; phase < LH_NPHASES; phase++)
+  {
+    LatencySummary s;
+
+    LH_summary(phase, &s);
+    fprintf(out, "%-10s %12llu %10llu %10llu %10llu %10llu %12llu\n", phase_names[phase],
+            (unsigned long long)s.count, (unsigned long long)s.p50, (unsigned long long)s.p90,
+            (unsigned long long)s.p99, (unsigned long long)s.p999, (unsigned long long)s.max);
+  }
+}
@@ -0,0 +1,108 @@
+/*
+ * latency.h
+ *
+ * Latency histograms for the phases an expression goes through on its
+ * way from text to answer: tokenize, parse, evaluate and format. They
+ * are off until LH_enable is called; until then timing a phase costs
+ * the test of one flag and reads no clock.
+ *
+ * The histograms are log-bucketed in the manner of HdrHistogram: each
+ * power of two of nanoseconds is cut into LH_SUB_BUCKETS buckets, so a
+ * value is known to within 1 part in LH_SUB_BUCKETS however large it
+ * is, and a histogram is a fixed array of counters. Every thread
+ * records into histograms of its own, with plain stores and no lock;
+ * readers merge the histograms of all threads as they go.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+typedef enum
+{
+  LH_TOKENIZE,
+  LH_PARSE,
+  LH_EVALUATE,
+  LH_FORMAT,
+  LH_NPHASES
+} LatencyPhase;
+
+// The number of buckets each power of two is cut into
+#define LH_SUB_BUCKETS 32
+
+// What the histogram of a phase says, in nanoseconds. A percentile is
+// the highest value of the bucket it falls in.
+typedef struct
+{
+  uint64_t count;
+  uint64_t p50;
+  uint64_t p90;
+  uint64_t p99;
+  uint64_t p999;
+  uint64_t max;
+} LatencySummary;
+
+/*
+ * Start recording, for all threads
+ *
+ * Returns: None
+ */
+void LH_enable();
+
+/*
+ * Read the clock at the start of the first phase timed
+ *
+ * Returns: The time in nanoseconds, or 0 if recording is off
+ */
+uint64_t LH_start();
+
+/*
+ * Record that a phase has run from start until now
+ *
+ * Parameters:
+ *   phase      The phase
+ *   start      When it started, from LH_start or the last LH_lap
+ *
+ * Returns: The time now, for the start of the next phase, or 0 if
+ *   recording is off
+ */
+uint64_t LH_lap(LatencyPhase phase, uint64_t start);
+
+/*
+ * Record a time taken by a phase
+ *
+ * Parameters:
+ *   phase      The phase
+ *   ns         The time, in nanoseconds
+ *
+ * Returns: None
+ */
+void LH_record(LatencyPhase phase, uint64_t ns);
+
+/*
+ * Summarize what the threads have recorded so far for a phase. Times
+ * recorded meanwhile may or may not be counted.
+ *
+ * Parameters:
+ *   phase      The phase
+ *   summary    Return space for the summary
+ *
+ * Returns: None
+ */
+void LH_summary(LatencyPhase phase, LatencySummary *summary);
+
+/*
+ * Print the summaries of all phases as a table
+ *
+ * Parameters:
+ *   out        Where to print them
+ *
+ * Returns: None
+ */
+void LH_print(FILE *out);
+
+#endif /* _LATENCY_H_ */
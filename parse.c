@@ -8,9 +8,12 @@
  */
 
 #include <stdio.h>
+#include <stdbool.h>
 
 #include "parse.h"
 #include "tokenize.h"
+#include "heap.h"
+#include "trace.h"
 
 /*
  * Forward declarations for the functions (rules) to produce the
@@ -27,10 +30,130 @@
  *   encountered, copies an error message into errmsg and returns
  *   NULL.
  */
+static ExprTree conditional(CList tokens, char *errmsg, size_t errmsg_sz);    // comparison [ ? conditional : conditional ]
+static ExprTree comparison(CList tokens, char *errmsg, size_t errmsg_sz);     // additive { ( < | <= | > | >= | == | != ) additive }
 static ExprTree additive(CList tokens, char *errmsg, size_t errmsg_sz);       // multiplicative { ( + | – ) multiplicative }
 static ExprTree multiplicative(CList tokens, char *errmsg, size_t errmsg_sz); // exponential { ( * | / ) exponential }
 static ExprTree exponential(CList tokens, char *errmsg, size_t errmsg_sz);    // primary [ ^ exponential ]
-static ExprTree primary(CList tokens, char *errmsg, size_t errmsg_sz);        // constant | ( additive ) | – primary
+static ExprTree primary(CList tokens, char *errmsg, size_t errmsg_sz);        // constant | variable | ( conditional ) | – primary
+                                                                              //   | if ( conditional , conditional , conditional )
+                                                                              //   | function ( conditional { , conditional } )
+
+// what Parse_groups reports the groups of the parse running on this
+// thread to; fn is NULL for Parse
+static _Thread_local struct
+{
+  ParseGroupFn fn;
+  void *data;
+} on_group;
+
+/*
+ * Consume the next token, which must be of type expected
+ *
+ * Returns: true on success; false, with errmsg filled in, if the next
+ *   token is of some other type
+ */
+static bool expect(CList tokens, TokenType expected, const char *what, char *errmsg, size_t errmsg_sz)
+{
+  if (TOK_next_type(tokens) != expected)
+  {
+    snprintf(errmsg, errmsg_sz, "Expected '%s'", what);
+    return false;
+  }
+
+  TOK_consume(tokens);
+  return true;
+}
+
+/*
+ * The comparison operator for a token, or VALUE if it is not one
+ */
+static ExprNodeType comparison_op(TokenType type)
+{
+  switch (type)
+  {
+  case TOK_LESS:
+    return OP_LT;
+  case TOK_LESS_EQUAL:
+    return OP_LE;
+  case TOK_GREATER:
+    return OP_GT;
+  case TOK_GREATER_EQUAL:
+    return OP_GE;
+  case TOK_EQUAL:
+    return OP_EQ;
+  case TOK_NOT_EQUAL:
+    return OP_NE;
+  default:
+    return VALUE;
+  }
+}
+
+/*
+ * The two branches of a conditional, given its already-parsed test;
+ * separated by sep and followed by end (if end is not TOK_END). On
+ * error, cond is freed.
+ */
+static ExprTree branches(ExprTree cond, CList tokens, TokenType sep, const char *sep_str,
+                         TokenType end, const char *end_str, char *errmsg, size_t errmsg_sz)
+{
+  ExprTree if_true = conditional(tokens, errmsg, errmsg_sz);
+  ExprTree if_false = NULL;
+
+  if (if_true == NULL || !expect(tokens, sep, sep_str, errmsg, errmsg_sz))
+    goto error;
+
+  if_false = conditional(tokens, errmsg, errmsg_sz);
+
+  if (if_false == NULL || (end != TOK_END && !expect(tokens, end, end_str, errmsg, errmsg_sz)))
+    goto error;
+
+  return ET_cond(cond, if_true, if_false);
+
+error:
+  ET_free(cond);
+  ET_free(if_true);
+  ET_free(if_false);
+  return NULL;
+}
+
+static ExprTree conditional(CList tokens, char *errmsg, size_t errmsg_sz)
+{
+  ExprTree cond = comparison(tokens, errmsg, errmsg_sz);
+
+  if (cond == NULL || TOK_next_type(tokens) != TOK_QUESTION)
+    return cond;
+
+  TOK_consume(tokens);
+  return branches(cond, tokens, TOK_COLON, ":", TOK_END, NULL, errmsg, errmsg_sz);
+}
+
+static ExprTree comparison(CList tokens, char *errmsg, size_t errmsg_sz)
+{
+  ExprTree expr = additive(tokens, errmsg, errmsg_sz);
+
+  if (expr == NULL)
+    return NULL;
+
+  // WHILE THERE ARE STILL TOKENS TO BE PARSED
+  while (comparison_op(TOK_next_type(tokens)) != VALUE)
+  {
+    ExprNodeType op = comparison_op(TOK_next_type(tokens));
+    TOK_consume(tokens);
+
+    ExprTree right = additive(tokens, errmsg, errmsg_sz);
+
+    if (right == NULL)
+    {
+      ET_free(expr);
+      return NULL;
+    }
+
+    expr = ET_node(op, expr, right);
+  }
+
+  return expr;
+}
 
 static ExprTree additive(CList tokens, char *errmsg, size_t errmsg_sz)
 {
@@ -40,7 +163,7 @@ static ExprTree additive(CList tokens, char *errmsg, size_t errmsg_sz)
     return NULL;
 
   // WHILE THERE ARE STILL TOKENS TO BE PARSED
-  while (TOK_next_type(tokens) == TOK_PLUS || TOK_next_type(tokens) == TOK_MINUS)
+  for (bool first = true; TOK_next_type(tokens) == TOK_PLUS || TOK_next_type(tokens) == TOK_MINUS; first = false)
   {
     TokenType op = TOK_next_type(tokens);
     TOK_consume(tokens);
@@ -53,8 +176,11 @@ static ExprTree additive(CList tokens, char *errmsg, size_t errmsg_sz)
       return NULL;
     }
 
-    // CREATE A NEW NODE WITH THE OPERATOR AND THE LEFT AND RIGHT EXPRESSIONS
-    ExprTree temp_tree = ET_node((op == TOK_PLUS) ? OP_ADD : OP_SUB, expr, right);
+    // CREATE A NEW NODE WITH THE OPERATOR AND THE LEFT AND RIGHT EXPRESSIONS;
+    // a first operand that is a sum can only be one in parentheses, which
+    // is kept whole rather than extended
+    ExprNodeType node_op = (op == TOK_PLUS) ? OP_ADD : OP_SUB;
+    ExprTree temp_tree = first ? ET_node(node_op, expr, right) : ET_chain(node_op, expr, right);
 
     if (temp_tree == NULL)
     {
@@ -77,7 +203,7 @@ static ExprTree multiplicative(CList tokens, char *errmsg, size_t errmsg_sz)
     return NULL;
 
   // WHILE THERE ARE STILL TOKENS TO BE PARSED
-  while (TOK_next_type(tokens) == TOK_MULTIPLY || TOK_next_type(tokens) == TOK_DIVIDE)
+  for (bool first = true; TOK_next_type(tokens) == TOK_MULTIPLY || TOK_next_type(tokens) == TOK_DIVIDE; first = false)
   {
     TokenType op = TOK_next_type(tokens);
     TOK_consume(tokens);
@@ -89,8 +215,10 @@ static ExprTree multiplicative(CList tokens, char *errmsg, size_t errmsg_sz)
       return NULL;
     }
 
-    // CREATE A NEW NODE WITH THE OPERATOR AND THE LEFT AND RIGHT EXPRESSIONS
-    ExprTree temp_tree = ET_node((op == TOK_MULTIPLY) ? OP_MUL : OP_DIV, expr, right);
+    // CREATE A NEW NODE WITH THE OPERATOR AND THE LEFT AND RIGHT EXPRESSIONS;
+    // as in additive, a product in parentheses is kept whole
+    ExprNodeType node_op = (op == TOK_MULTIPLY) ? OP_MUL : OP_DIV;
+    ExprTree temp_tree = first ? ET_node(node_op, expr, right) : ET_chain(node_op, expr, right);
 
     if (temp_tree == NULL)
     {
@@ -150,10 +278,17 @@ static ExprTree primary(CList tokens, char *errmsg, size_t errmsg_sz)
     ret = ET_value(TOK_next(tokens).value);
     TOK_consume(tokens);
   }
+  else if (TOK_next_type(tokens) == TOK_VARIABLE)
+  {
+    ret = ET_variable(TOK_next(tokens).var);
+    TOK_consume(tokens);
+  }
   else if (TOK_next_type(tokens) == TOK_OPEN_PAREN)
   {
+    Token open = TOK_next(tokens);
+
     TOK_consume(tokens);
-    ret = additive(tokens, errmsg, errmsg_sz);
+    ret = conditional(tokens, errmsg, errmsg_sz);
 
     if (ret == NULL)
       return NULL;
@@ -166,8 +301,54 @@ static ExprTree primary(CList tokens, char *errmsg, size_t errmsg_sz)
     }
 
     TOK_consume(tokens);
+    if (on_group.fn != NULL)
+      on_group.fn(open, ret, on_group.data);
     return ret;
   }
+  else if (TOK_next_type(tokens) == TOK_IF)
+  {
+    TOK_consume(tokens);
+
+    if (!expect(tokens, TOK_OPEN_PAREN, "(", errmsg, errmsg_sz))
+      return NULL;
+
+    ExprTree cond = conditional(tokens, errmsg, errmsg_sz);
+
+    if (cond == NULL || !expect(tokens, TOK_COMMA, ",", errmsg, errmsg_sz))
+    {
+      ET_free(cond);
+      return NULL;
+    }
+
+    return branches(cond, tokens, TOK_COMMA, ",", TOK_CLOSE_PAREN, ")", errmsg, errmsg_sz);
+  }
+  else if (TOK_next_type(tokens) == TOK_FUNCTION)
+  {
+    MathFunc func = TOK_next(tokens).func;
+    ExprTree args[2] = {NULL, NULL};
+
+    TOK_consume(tokens);
+
+    if (!expect(tokens, TOK_OPEN_PAREN, "(", errmsg, errmsg_sz))
+      return NULL;
+
+    // the arguments, each followed by ',' except the last, which ends with ')'
+    for (int i = 0; i < func->nargs; i++)
+    {
+      bool last = (i == func->nargs - 1);
+
+      args[i] = conditional(tokens, errmsg, errmsg_sz);
+
+      if (args[i] == NULL || !expect(tokens, last ? TOK_CLOSE_PAREN : TOK_COMMA, last ? ")" : ",", errmsg, errmsg_sz))
+      {
+        ET_free(args[0]);
+        ET_free(args[1]);
+        return NULL;
+      }
+    }
+
+    return ET_node(func->op, args[0], args[1]);
+  }
   else if (TOK_next_type(tokens) == TOK_MINUS)
   {
     TOK_consume(tokens);
@@ -198,14 +379,17 @@ static ExprTree primary(CList tokens, char *errmsg, size_t errmsg_sz)
   return ret;
 }
 
-ExprTree Parse(CList tokens, char *errmsg, size_t errmsg_sz)
+/*
+ * Parse, less the accounting and tracing of the phase
+ */
+static ExprTree parse(CList tokens, char *errmsg, size_t errmsg_sz)
 {
   // HANDLE ERRORS IN THE TOKENS LIST TO BE PARSED AS A MATH EXPRESSION
   if (tokens == NULL || CL_length(tokens) == 0 || TOK_next_type(tokens) == TOK_END)
     return NULL;
 
   // START PARSING THE TOKENS LIST
-  ExprTree ret = additive(tokens, errmsg, errmsg_sz);
+  ExprTree ret = conditional(tokens, errmsg, errmsg_sz);
 
   if (ret == NULL)
     return NULL;
@@ -219,4 +403,64 @@ ExprTree Parse(CList tokens, char *errmsg, size_t errmsg_sz)
   }
   
   return ret;
-}
\ No newline at end of file
+}
+
+// Documented in .h file
+ExprTree Parse(CList tokens, char *errmsg, size_t errmsg_sz)
+{
+  TR_BEGIN("parse");
+  HeapPhase prev = HP_set_phase(HP_PARSE);
+  ExprTree tree = parse(tokens, errmsg, errmsg_sz);
+
+  HP_set_phase(prev);
+  TR_END("parse");
+
+  if (tree != NULL)
+  {
+    TR_COUNTER("nodes", ET_count(tree));
+    TR_COUNTER("depth", ET_depth(tree));
+  }
+  return tree;
+}
+
+// Documented in .h file
+ExprTree Parse_statement(CList tokens, Variable *target, char *errmsg, size_t errmsg_sz)
+{
+  *target = NULL;
+
+  if (TOK_next_type(tokens) != TOK_VARIABLE || CL_length(tokens) < 2 || CL_nth(tokens, 1).type != TOK_ASSIGN)
+    return Parse(tokens, errmsg, errmsg_sz);
+
+  Variable var = CL_nth(tokens, 0).var;
+
+  TOK_consume(tokens);
+  TOK_consume(tokens);
+
+  // Parse takes no tokens at all for a blank line, without a message
+  if (TOK_next_type(tokens) == TOK_END)
+  {
+    snprintf(errmsg, errmsg_sz, "Expected an expression after '='");
+    return NULL;
+  }
+
+  ExprTree tree = Parse(tokens, errmsg, errmsg_sz);
+
+  if (tree != NULL)
+    *target = var;
+  return tree;
+}
+
+// Documented in .h file
+ExprTree Parse_groups(CList tokens, Variable *target, ParseGroupFn fn, void *data, char *errmsg,
+                      size_t errmsg_sz)
+{
+  on_group.fn = fn;
+  on_group.data = data;
+
+  ExprTree tree = (target != NULL) ? Parse_statement(tokens, target, errmsg, errmsg_sz)
+                                   : Parse(tokens, errmsg, errmsg_sz);
+
+  on_group.fn = NULL;
+  on_group.data = NULL;
+  return tree;
+}
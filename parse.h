@@ -29,4 +29,61 @@
  */
 ExprTree Parse(CList tokens, char *errmsg, size_t errmsg_sz);
 
+/*
+ * Parses a statement: either an expression, or an assignment
+ *
+ *   variable = conditional
+ *
+ * which defines the variable as the expression (see sheet.h). Only the
+ * first '=' of a statement is an assignment; anywhere else it is an
+ * error, as it is for Parse.
+ *
+ * Parameters:
+ *   tokens     List of tokens remaining to be parsed
+ *   target     Return space for the variable assigned to, set to NULL
+ *              if the statement is an expression
+ *   errmsg     Return space for an error message, filled in in case of error
+ *   errmsg_sz  The size of errmsg
+ *
+ * Returns: The ExprTree of the expression, which for an assignment is
+ *   its right-hand side; on error, as for Parse.
+ */
+ExprTree Parse_statement(CList tokens, Variable *target, char *errmsg, size_t errmsg_sz);
+
+/*
+ * The callback of Parse_groups, called for each subexpression in
+ * parentheses once it has been parsed, inner ones first
+ *
+ * Parameters:
+ *   open       The '(' token that opens the group
+ *   group      The tree of what is between the parentheses
+ *   data       As passed to Parse_groups
+ *
+ * Returns: None
+ */
+typedef void (*ParseGroupFn)(Token open, ExprTree group, void *data);
+
+/*
+ * Parse, reporting each group: a subexpression in parentheses, but
+ * not the parentheses around the arguments of a function or of if.
+ * Each group stays a node of its own in the finished tree (a sum or
+ * product in parentheses is never merged into the chain around it),
+ * so a group can later be replaced in place.
+ *
+ * Parameters:
+ *   tokens     List of tokens remaining to be parsed
+ *   target     NULL to parse an expression, as Parse does; otherwise a
+ *              statement, as Parse_statement does, with the variable
+ *              assigned to returned here
+ *   fn         Called for each group
+ *   data       Passed to fn
+ *   errmsg     Return space for an error message, filled in in case of error
+ *   errmsg_sz  The size of errmsg
+ *
+ * Returns: As for Parse. If it returns NULL, the groups reported have
+ *   already been freed.
+ */
+ExprTree Parse_groups(CList tokens, Variable *target, ParseGroupFn fn, void *data, char *errmsg,
+                      size_t errmsg_sz);
+
 #endif /* _PARSE_H_ */
@@ -0,0 +1,533 @@
+/*
+ * reparse.c
+ *
+ * Incremental parsing. The tokens of the last text are kept in an
+ * array, each with its span, the index of the parenthesis it pairs
+ * with, and, for the '(' of a group, the subtree of the group, as
+ * reported by Parse_groups.
+ *
+ * The window of tokens that is tokenized again starts one token
+ * before the first one that the change touches, and further back
+ * while that one is a + or -, since "++" and "--" after a number fold
+ * into it, or is a word (a number or a name) right after another,
+ * since strtod may have looked into it for the end of the number
+ * before. Only then does the token at the start come out the same
+ * whatever came before it.
+ *
+ * The window ends with an old token after the change that comes out
+ * of the new text with the same type and span, is not a sign, and, if
+ * it is a word, is not followed by anything it could run on into; if
+ * the first one tried is not such a token, the window is widened, by
+ * twice as many tokens each time. Past that token, the new text
+ * tokenizes exactly as the old one did.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+
+#include "reparse.h"
+#include "clist.h"
+#include "tokenize.h"
+#include "parse.h"
+#include "expr_tree_priv.h"
+
+// a token of the text, and how it fits in the tree
+struct rp_token
+{
+  Token tok;      // with its span in the text
+  int match;      // for a parenthesis, the index of the one it pairs with, or -1
+  ExprTree group; // for the '(' of a group, its subtree in the tree, or NULL
+};
+
+struct _reparser
+{
+  VarTable vars;
+  char *text;            // the last text
+  size_t len;
+  size_t text_cap;
+  struct rp_token *toks; // its tokens
+  int ntoks;
+  int toks_cap;
+  bool lexed;            // whether toks are the tokens of text; false if it did not tokenize
+  ExprTree tree;         // its tree, or NULL if it did not parse
+  Variable target;       // what the text assigns its tree to, if anything
+  RPStats stats;
+};
+
+// Documented in .h file
+Reparser RP_new(VarTable vars)
+{
+  Reparser rp = calloc(1, sizeof(struct _reparser));
+  assert(rp != NULL);
+
+  rp->vars = vars;
+  return rp;
+}
+
+// Documented in .h file
+void RP_free(Reparser rp)
+{
+  if (rp == NULL)
+    return;
+
+  ET_free(rp->tree);
+  free(rp->text);
+  free(rp->toks);
+  free(rp);
+}
+
+// Documented in .h file
+RPStats RP_stats(Reparser rp)
+{
+  return rp->stats;
+}
+
+/*
+ * Returns true for the tokens that "++" and "--" can fold into the
+ * number before them
+ */
+static bool is_sign(TokenType type)
+{
+  return type == TOK_PLUS || type == TOK_MINUS;
+}
+
+/*
+ * Returns true for the tokens that a number can run on into
+ */
+static bool is_word(TokenType type)
+{
+  return type == TOK_VALUE || type == TOK_VARIABLE || type == TOK_FUNCTION || type == TOK_IF;
+}
+
+/*
+ * Returns true if a number that reached input[end - 1] would go no
+ * further, so that the text can be cut there without changing how
+ * what comes before it tokenizes
+ */
+static bool cut_at(const char *input, size_t len, size_t end)
+{
+  if (end >= len)
+    return true;
+
+  char c = input[end];
+
+  return !(isalnum(c) || c == '.' || ((c == '+' || c == '-') && strchr("eEpP", input[end - 1]) != NULL));
+}
+
+/*
+ * Returns true if two tokens are the same but for their spans
+ */
+static bool same_token(Token a, Token b)
+{
+  return a.type == b.type && memcmp(&a.value, &b.value, sizeof(double)) == 0 && a.var == b.var &&
+         a.func == b.func;
+}
+
+/*
+ * Make room for ntoks tokens
+ */
+static void reserve(Reparser rp, int ntoks)
+{
+  if (ntoks <= rp->toks_cap)
+    return;
+
+  rp->toks_cap = (2 * rp->toks_cap > ntoks) ? 2 * rp->toks_cap : ntoks;
+  rp->toks = realloc(rp->toks, rp->toks_cap * sizeof(struct rp_token));
+  assert(rp->toks != NULL);
+}
+
+/*
+ * Keep a copy of the text
+ */
+static void set_text(Reparser rp, const char *input, size_t len)
+{
+  if (len + 1 > rp->text_cap)
+  {
+    rp->text_cap = 2 * (len + 1);
+    free(rp->text);
+    rp->text = malloc(rp->text_cap);
+    assert(rp->text != NULL);
+  }
+
+  memcpy(rp->text, input, len + 1);
+  rp->len = len;
+}
+
+/*
+ * Return the index of the first token that ends at or after pos, or
+ * ntoks if there is none
+ */
+static int first_ending_at(Reparser rp, size_t pos)
+{
+  int lo = 0, hi = rp->ntoks;
+
+  while (lo < hi)
+  {
+    int mid = lo + (hi - lo) / 2;
+
+    if (rp->toks[mid].tok.end < pos)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/*
+ * Return the index of the first token that starts at or after pos, or
+ * ntoks if there is none
+ */
+static int first_starting_at(Reparser rp, size_t pos)
+{
+  int lo = 0, hi = rp->ntoks;
+
+  while (lo < hi)
+  {
+    int mid = lo + (hi - lo) / 2;
+
+    if (rp->toks[mid].tok.start < pos)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/*
+ * Pair up the parentheses among tokens [lo, hi), as far as they pair
+ *
+ * Returns: true if they all paired up within the range
+ */
+static bool match_parens(Reparser rp, int lo, int hi)
+{
+  int *open = malloc((hi - lo + 1) * sizeof(int));
+  int depth = 0;
+  bool balanced = true;
+
+  assert(open != NULL);
+
+  for (int i = lo; i < hi; i++)
+  {
+    struct rp_token *t = &rp->toks[i];
+
+    t->match = -1;
+    if (t->tok.type == TOK_OPEN_PAREN)
+      open[depth++] = i;
+    else if (t->tok.type == TOK_CLOSE_PAREN && depth == 0)
+      balanced = false;
+    else if (t->tok.type == TOK_CLOSE_PAREN)
+    {
+      t->match = open[--depth];
+      rp->toks[t->match].match = i;
+    }
+  }
+
+  free(open);
+  return balanced && depth == 0;
+}
+
+/*
+ * Returns true if the parentheses among tokens [lo, hi) all pair up
+ * within the range
+ */
+static bool balanced(const struct rp_token *toks, int lo, int hi)
+{
+  int depth = 0;
+
+  for (int i = lo; i < hi && depth >= 0; i++)
+  {
+    if (toks[i].tok.type == TOK_OPEN_PAREN)
+      depth++;
+    else if (toks[i].tok.type == TOK_CLOSE_PAREN)
+      depth--;
+  }
+  return depth == 0;
+}
+
+/*
+ * Forget the groups of tokens [lo, hi)
+ */
+static void clear_groups(Reparser rp, int lo, int hi)
+{
+  for (int i = lo; i < hi; i++)
+    rp->toks[i].group = NULL;
+}
+
+/*
+ * ParseGroupFn: note the subtree of a group by its '(' token
+ */
+static void record_group(Token open, ExprTree group, void *data)
+{
+  Reparser rp = data;
+  int i = first_starting_at(rp, open.start);
+
+  assert(i < rp->ntoks && rp->toks[i].tok.type == TOK_OPEN_PAREN);
+  rp->toks[i].group = group;
+}
+
+/*
+ * Parse tokens [lo, hi), reporting their groups; as a statement if
+ * target is not NULL
+ */
+static ExprTree parse_range(Reparser rp, int lo, int hi, Variable *target, char *errmsg, size_t errmsg_sz)
+{
+  CList tokens = CL_new();
+
+  for (int i = lo; i < hi; i++)
+    CL_append(tokens, rp->toks[i].tok);
+
+  ExprTree tree = Parse_groups(tokens, target, record_group, rp, errmsg, errmsg_sz);
+
+  CL_free(tokens);
+  rp->stats.reparsed += hi - lo;
+  return tree;
+}
+
+/*
+ * Parse all of the tokens, as a statement, into a new tree
+ */
+static ExprTree parse_all(Reparser rp, char *errmsg, size_t errmsg_sz)
+{
+  ET_free(rp->tree);
+  clear_groups(rp, 0, rp->ntoks);
+
+  rp->target = NULL;
+  rp->tree = (rp->ntoks > 0) ? parse_range(rp, 0, rp->ntoks, &rp->target, errmsg, errmsg_sz) : NULL;
+  if (rp->tree == NULL)
+    clear_groups(rp, 0, rp->ntoks);
+
+  return rp->tree;
+}
+
+/*
+ * Parse again the tokens of the group that opens at token open, and
+ * put its new subtree in place of the old one
+ */
+static ExprTree parse_group(Reparser rp, int open, char *errmsg, size_t errmsg_sz)
+{
+  int close = rp->toks[open].match;
+  ExprTree old = rp->toks[open].group;
+
+  clear_groups(rp, open + 1, close);
+
+  ExprTree group = parse_range(rp, open + 1, close, NULL, errmsg, errmsg_sz);
+
+  // the whole text fails too; parsed whole, it gives the same message
+  if (group == NULL)
+    return parse_all(rp, errmsg, errmsg_sz);
+
+  ET_replace(old, group);
+
+  // a group directly inside this one had the same root
+  for (int i = open + 1; i < close; i++)
+    if (rp->toks[i].group == group)
+      rp->toks[i].group = old;
+
+  return rp->tree;
+}
+
+/*
+ * Tokenize and parse the text from scratch
+ */
+static ExprTree lex_all(Reparser rp, const char *input, size_t len, char *errmsg, size_t errmsg_sz)
+{
+  CList tokens = TOK_tokenize_n(input, len, rp->vars, errmsg, errmsg_sz);
+
+  set_text(rp, input, len);
+  rp->ntoks = 0;
+  rp->lexed = (tokens != NULL);
+  ET_free(rp->tree);
+  rp->tree = NULL;
+  rp->target = NULL;
+
+  if (tokens == NULL)
+    return NULL;
+
+  reserve(rp, CL_length(tokens));
+  while (CL_length(tokens) > 0)
+    rp->toks[rp->ntoks++] = (struct rp_token){CL_pop(tokens), -1, NULL};
+  CL_free(tokens);
+
+  rp->stats.relexed = rp->ntoks;
+  match_parens(rp, 0, rp->ntoks);
+  return parse_all(rp, errmsg, errmsg_sz);
+}
+
+/*
+ * Tokenize and parse again only what changed since the last text
+ */
+static ExprTree reparse(Reparser rp, const char *input, size_t len, char *errmsg, size_t errmsg_sz)
+{
+  size_t old_len = rp->len;
+  size_t min_len = (len < old_len) ? len : old_len;
+  size_t prefix = 0, suffix = 0;
+
+  while (prefix < min_len && input[prefix] == rp->text[prefix])
+    prefix++;
+  while (suffix < min_len - prefix && input[len - 1 - suffix] == rp->text[old_len - 1 - suffix])
+    suffix++;
+
+  ptrdiff_t delta = (ptrdiff_t)len - (ptrdiff_t)old_len;
+  int ntoks = rp->ntoks;
+
+  // the window starts before the first token that the change touches
+  int first = first_ending_at(rp, prefix);
+
+  if (first > 0)
+    first--;
+  while (first > 0 && (is_sign(rp->toks[first].tok.type) ||
+                       (is_word(rp->toks[first - 1].tok.type) && rp->toks[first - 1].tok.end == rp->toks[first].tok.start)))
+    first--;
+
+  size_t start = (first == 0) ? 0 : rp->toks[first].tok.start;
+
+  // and ends with the first token after the change that tokenizes the same
+  int last = first_starting_at(rp, old_len - suffix);
+  int widen = 1;
+  CList window;
+
+  for (;;)
+  {
+    size_t end = (last < ntoks) ? rp->toks[last].tok.end + delta : len;
+
+    window = TOK_tokenize_n(input + start, end - start, rp->vars, errmsg, errmsg_sz);
+
+    // the whole text fails too; tokenized whole, it gives the position
+    if (window == NULL)
+      return lex_all(rp, input, len, errmsg, errmsg_sz);
+
+    rp->stats.relexed += CL_length(window);
+    if (last == ntoks)
+      break;
+
+    Token tail = CL_nth(window, -1);
+    const Token *old = &rp->toks[last].tok;
+
+    if (CL_length(window) > 0 && tail.type == old->type && !is_sign(tail.type) &&
+        start + tail.start == old->start + delta && start + tail.end == old->end + delta &&
+        (!is_word(tail.type) || cut_at(input, len, end)))
+      break;
+
+    CL_free(window);
+    last = (ntoks - last > widen) ? last + widen : ntoks;
+    widen *= 2;
+  }
+
+  int nold = ((last < ntoks) ? last + 1 : ntoks) - first;
+  int nnew = CL_length(window);
+  struct rp_token *fresh = malloc((nnew + 1) * sizeof(struct rp_token));
+
+  assert(fresh != NULL);
+  for (int i = 0; i < nnew; i++)
+  {
+    fresh[i] = (struct rp_token){CL_pop(window), -1, NULL};
+    fresh[i].tok.start += start;
+    fresh[i].tok.end += start;
+  }
+  CL_free(window);
+
+  // the tokens at either end of the window that came out the same
+  // stay, with their parentheses and groups; the ones between are
+  // spliced in for the old ones
+  int head = 0, tail = 0;
+
+  while (head < nnew && head < nold && same_token(fresh[head].tok, rp->toks[first + head].tok))
+    head++;
+  while (tail < nnew - head && tail < nold - head &&
+         same_token(fresh[nnew - 1 - tail].tok, rp->toks[first + nold - 1 - tail].tok))
+    tail++;
+
+  int lo = first + head;
+  int old_hi = first + nold - tail;
+  int new_hi = first + nnew - tail;
+  int shift = nnew - nold;
+  bool nested = balanced(rp->toks, lo, old_hi) && balanced(fresh, head, nnew - tail);
+
+  // parentheses on either side of a balanced change pair among themselves
+  for (int i = 0; i < ntoks && nested; i++)
+    if (rp->toks[i].match >= old_hi)
+      rp->toks[i].match += shift;
+
+  reserve(rp, ntoks + shift);
+  memmove(&rp->toks[new_hi], &rp->toks[old_hi], (ntoks - old_hi) * sizeof(struct rp_token));
+  memcpy(&rp->toks[lo], &fresh[head], (new_hi - lo) * sizeof(struct rp_token));
+  rp->ntoks = ntoks = ntoks + shift;
+
+  for (int i = first; i < first + nnew; i++)
+  {
+    rp->toks[i].tok.start = fresh[i - first].tok.start;
+    rp->toks[i].tok.end = fresh[i - first].tok.end;
+  }
+  for (int i = first + nnew; i < ntoks; i++)
+  {
+    rp->toks[i].tok.start += delta;
+    rp->toks[i].tok.end += delta;
+  }
+  free(fresh);
+
+  set_text(rp, input, len);
+
+  if (lo == old_hi && lo == new_hi && rp->tree != NULL)
+    return rp->tree;
+
+  if (!nested || rp->tree == NULL)
+  {
+    match_parens(rp, 0, ntoks);
+    return parse_all(rp, errmsg, errmsg_sz);
+  }
+
+  match_parens(rp, lo, new_hi);
+
+  // the innermost group around the change: skip the groups before it,
+  // and the parentheses of functions around it
+  for (int i = lo - 1; i >= 0; i--)
+  {
+    if (rp->toks[i].tok.type == TOK_CLOSE_PAREN)
+      i = rp->toks[i].match;
+    else if (rp->toks[i].tok.type == TOK_OPEN_PAREN && rp->toks[i].group != NULL)
+      return parse_group(rp, i, errmsg, errmsg_sz);
+  }
+
+  return parse_all(rp, errmsg, errmsg_sz);
+}
+
+// Documented in .h file
+ExprTree RP_parse(Reparser rp, const char *input, char *errmsg, size_t errmsg_sz)
+{
+  size_t len = strlen(input);
+
+  rp->stats = (RPStats){0, 0};
+  if (errmsg_sz > 0)
+    errmsg[0] = '\0';
+
+  if (rp->lexed && rp->tree != NULL && len == rp->len && memcmp(input, rp->text, len) == 0)
+    return rp->tree;
+
+  if (!rp->lexed)
+    return lex_all(rp, input, len, errmsg, errmsg_sz);
+
+  return reparse(rp, input, len, errmsg, errmsg_sz);
+}
+
+// Documented in .h file
+Variable RP_target(Reparser rp)
+{
+  return (rp->tree != NULL) ? rp->target : NULL;
+}
+
+// Documented in .h file
+ExprTree RP_take(Reparser rp)
+{
+  ExprTree tree = rp->tree;
+
+  // the groups were its subtrees; the next text is parsed whole
+  rp->tree = NULL;
+  clear_groups(rp, 0, rp->ntoks);
+  return tree;
+}
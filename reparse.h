@@ -0,0 +1,116 @@
+/*
+ * reparse.h
+ *
+ * Incremental parsing of a line that is edited and parsed again, as
+ * in the interactive mode. A Reparser keeps the last text it parsed,
+ * its tokens with their spans, and its tree. Given the next text, it
+ * finds the part that differs from the last one (the longest common
+ * prefix and suffix bound it), tokenizes again only a window of
+ * tokens around it, and parses again only the smallest subexpression
+ * in parentheses that encloses all of the changed tokens; the new
+ * subtree replaces the old one in place, and every other subtree is
+ * kept as it was. An edit that leaves the tokens as they were, such
+ * as one to white space, parses nothing.
+ *
+ * So the lexing and parsing take time in proportion to the size of
+ * the change and of the group around it. Finding the change, and
+ * keeping the text and the tokens up to date, are still linear in
+ * the length of the line, but they are plain comparisons and copies.
+ *
+ * A text is a statement: an assignment "name = expression" gives the
+ * tree of its right-hand side, and RP_target the variable assigned to.
+ * The tree is always the one Parse_statement would give for the whole
+ * text, and errors are the same as well.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#ifndef _REPARSE_H_
+#define _REPARSE_H_
+
+#include <stddef.h>
+
+#include "expr_tree.h"
+#include "vars.h"
+
+typedef struct _reparser *Reparser;
+
+// What the last RP_parse did
+typedef struct
+{
+  int relexed;  // tokens it tokenized
+  int reparsed; // tokens it parsed
+} RPStats;
+
+/*
+ * Create a reparser, with no text yet
+ *
+ * Parameters:
+ *   vars     The variables names are resolved in, as for
+ *            TOK_tokenize_vars, or NULL for none
+ *
+ * Returns: The reparser, which the caller must RP_free
+ */
+Reparser RP_new(VarTable vars);
+
+/*
+ * Free a reparser, and the tree it holds
+ *
+ * Parameters:
+ *   rp       The reparser
+ *
+ * Returns: None
+ */
+void RP_free(Reparser rp);
+
+/*
+ * Parse a text, reusing what the last one had in common with it
+ *
+ * Parameters:
+ *   rp         The reparser
+ *   input      The text
+ *   errmsg     Return space for an error message, filled in in case of error
+ *   errmsg_sz  The size of errmsg
+ *
+ * Returns: The tree of input, which belongs to rp, and is valid until
+ *   the next RP_parse or RP_free. If input cannot be tokenized or
+ *   parsed, copies an error message into errmsg and returns NULL; if
+ *   it has no tokens at all, returns NULL with errmsg empty.
+ */
+ExprTree RP_parse(Reparser rp, const char *input, char *errmsg, size_t errmsg_sz);
+
+/*
+ * Return the variable that the text of the last RP_parse assigns to
+ *
+ * Parameters:
+ *   rp       The reparser
+ *
+ * Returns: The variable, or NULL if the text is an expression, or
+ *   did not parse
+ */
+Variable RP_target(Reparser rp);
+
+/*
+ * Take the tree of the last RP_parse away from the reparser, as for
+ * handing a definition on to a Sheet. The next RP_parse parses its
+ * text whole.
+ *
+ * Parameters:
+ *   rp       The reparser
+ *
+ * Returns: The tree, or NULL if there was none; the caller must
+ *   ET_free it
+ */
+ExprTree RP_take(Reparser rp);
+
+/*
+ * Report how much the last RP_parse had to do
+ *
+ * Parameters:
+ *   rp       The reparser
+ *
+ * Returns: The counts
+ */
+RPStats RP_stats(Reparser rp);
+
+#endif /* _REPARSE_H_ */
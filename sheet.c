@@ -0,0 +1,532 @@
+/*
+ * sheet.c
+ *
+ * The dependency graph of a Sheet. There is a cell per variable of
+ * the VarTable, indexed like it; a defined cell holds its tree and an
+ * array of the variables the tree reads, each entry of which is also a
+ * link in the list of readers of that variable, so the graph can be
+ * walked both ways.
+ *
+ * Defining a variable walks its readers, and theirs, once: that finds
+ * a cycle, if the new expression reads any of them, and gives the only
+ * cells whose levels can change, which are then leveled again in
+ * topological order. Every allocation a call makes comes before the
+ * first change to the graph, so that in a context (exprwhizz.h) a call
+ * that runs out of memory leaves the sheet as it was.
+ *
+ * Dirty cells wait in a list until SH_recompute, which sorts them into
+ * a list per level and works up through the levels.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "sheet.h"
+#include "expr_tree_priv.h"
+#include "heap.h"
+#include "trace.h"
+
+// cells the arrays have room for to start with
+#define SHEET_INITIAL_CAPACITY 16
+
+// fewest dirty cells worth a task of their own
+#define SH_TASK_CELLS 8
+
+// most tasks a level is split into
+#define SH_MAX_TASKS 64
+
+// that one definition reads one variable
+struct sh_dep
+{
+  int var;             // the variable read
+  int reader;          // the definition reading it
+  struct sh_dep *next; // the next reader of var
+};
+
+struct sh_cell
+{
+  ExprTree tree;          // the definition, or NULL for an input
+  struct sh_dep *deps;    // the variables tree reads, each once
+  int ndeps;
+  struct sh_dep *readers; // the definitions that read this variable
+  int level;              // -1 for an input
+  int next_dirty;         // in the list of dirty cells of its level
+  bool dirty;
+  bool changed;           // whether its value changed when last evaluated
+  bool set;               // whether SH_set has given it a value
+};
+
+struct _sheet
+{
+  VarTable vars;
+  ThreadPool pool;
+  struct sh_cell *cells; // by index of variable
+  int ncells;
+  int cap;               // of cells and of each array below
+  int *dirty;            // the dirty cells, until SH_recompute
+  int ndirty;
+  int *dirty_head;       // by level, the first dirty cell, or -1
+  int nlevels;           // no level is this high
+  int *list;             // scratch: the variables a tree reads, cells in
+                         // topological order, or the dirty cells of a level
+  int *queue;            // scratch: the cells downstream of a change
+  int *indegree;         // scratch: for the topological order
+  unsigned *mark;        // the stamp of the walk that last reached each cell
+  unsigned stamp;
+};
+
+// a share of the dirty cells of a level, as a task
+struct sh_task
+{
+  TPTask task;
+  Sheet sh;
+  const int *cells;
+  int n;
+};
+
+/*
+ * Returns true if a and b have exactly the same bit pattern
+ */
+static bool same_double(double a, double b)
+{
+  return memcmp(&a, &b, sizeof(double)) == 0;
+}
+
+/*
+ * Make room for n cells, and set up the new ones as inputs
+ */
+static void reserve(Sheet sh, int n)
+{
+  if (n > sh->cap)
+  {
+    int cap = (2 * sh->cap > n) ? 2 * sh->cap : n;
+
+    // each array is grown in place in the order of allocation, so an
+    // allocation that fails part of the way leaves them all usable
+    sh->cells = HP_realloc(HP_SHEET, sh->cells, cap * sizeof(struct sh_cell));
+    sh->dirty = HP_realloc(HP_SHEET, sh->dirty, cap * sizeof(int));
+    sh->dirty_head = HP_realloc(HP_SHEET, sh->dirty_head, cap * sizeof(int));
+    sh->list = HP_realloc(HP_SHEET, sh->list, cap * sizeof(int));
+    sh->queue = HP_realloc(HP_SHEET, sh->queue, cap * sizeof(int));
+    sh->indegree = HP_realloc(HP_SHEET, sh->indegree, cap * sizeof(int));
+    sh->mark = HP_realloc(HP_SHEET, sh->mark, cap * sizeof(unsigned));
+    memset(sh->mark + sh->cap, 0, (cap - sh->cap) * sizeof(unsigned));
+    sh->cap = cap;
+  }
+
+  for (; sh->ncells < n; sh->ncells++)
+    sh->cells[sh->ncells] = (struct sh_cell){NULL, NULL, 0, NULL, -1, -1, false, false, false};
+}
+
+// Documented in .h file
+Sheet SH_new(VarTable vars, ThreadPool pool)
+{
+  Sheet sh = HP_calloc(HP_SHEET, 1, sizeof(struct _sheet));
+
+  sh->vars = vars;
+  sh->pool = pool;
+  reserve(sh, SHEET_INITIAL_CAPACITY);
+  return sh;
+}
+
+// Documented in .h file
+void SH_set_pool(Sheet sh, ThreadPool pool)
+{
+  sh->pool = pool;
+}
+
+// Documented in .h file
+void SH_free(Sheet sh)
+{
+  if (sh == NULL)
+    return;
+
+  for (int i = 0; i < sh->ncells; i++)
+  {
+    ET_free(sh->cells[i].tree);
+    HP_free(HP_SHEET, sh->cells[i].deps);
+  }
+
+  HP_free(HP_SHEET, sh->cells);
+  HP_free(HP_SHEET, sh->dirty);
+  HP_free(HP_SHEET, sh->dirty_head);
+  HP_free(HP_SHEET, sh->list);
+  HP_free(HP_SHEET, sh->queue);
+  HP_free(HP_SHEET, sh->indegree);
+  HP_free(HP_SHEET, sh->mark);
+  HP_free(HP_SHEET, sh);
+}
+
+/*
+ * Add the variables tree reads that are not marked yet to sh->list,
+ * and mark them
+ */
+static void collect_vars(Sheet sh, ExprTree tree, int *n)
+{
+  if (tree->type == VALUE)
+    return;
+
+  if (tree->type == VARIABLE)
+  {
+    int i = tree->n.var->index;
+
+    if (sh->mark[i] != sh->stamp)
+    {
+      sh->mark[i] = sh->stamp;
+      sh->list[(*n)++] = i;
+    }
+    return;
+  }
+
+  if (ET_is_chain(tree))
+  {
+    for (int i = 0; i < tree->n.list.count; i++)
+      collect_vars(sh, tree->n.list.ops[i], n);
+    return;
+  }
+
+  for (int i = 0; i < ET_arity(tree->type); i++)
+    collect_vars(sh, tree->n.child[i], n);
+}
+
+/*
+ * Put cell c and every definition downstream of it into sh->queue,
+ * marked with a new stamp, stopping at a cell marked with stop, unless
+ * stop is 0 (stamps start from 1)
+ *
+ * Returns: How many cells it found, or -1 - i if it reached cell i
+ *   marked with stop
+ */
+static int downstream(Sheet sh, int c, unsigned stop)
+{
+  int n = 0;
+
+  sh->stamp++;
+  if (stop != 0 && sh->mark[c] == stop)
+    return -1 - c;
+  sh->mark[c] = sh->stamp;
+  sh->queue[n++] = c;
+
+  for (int i = 0; i < n; i++)
+  {
+    for (struct sh_dep *d = sh->cells[sh->queue[i]].readers; d != NULL; d = d->next)
+    {
+      if (stop != 0 && sh->mark[d->reader] == stop)
+        return -1 - d->reader;
+      if (sh->mark[d->reader] != sh->stamp)
+      {
+        sh->mark[d->reader] = sh->stamp;
+        sh->queue[n++] = d->reader;
+      }
+    }
+  }
+  return n;
+}
+
+/*
+ * Work out the levels of the n cells in sh->queue, found by
+ * downstream, taking them in topological order; no others can have
+ * changed
+ */
+static void relevel(Sheet sh, int n)
+{
+  int *order = sh->list;
+  int norder = 0;
+
+  for (int i = 0; i < n; i++)
+  {
+    struct sh_cell *cell = &sh->cells[sh->queue[i]];
+
+    sh->indegree[sh->queue[i]] = 0;
+    for (int k = 0; k < cell->ndeps; k++)
+      if (sh->mark[cell->deps[k].var] == sh->stamp)
+        sh->indegree[sh->queue[i]]++;
+  }
+
+  for (int i = 0; i < n; i++)
+    if (sh->indegree[sh->queue[i]] == 0)
+      order[norder++] = sh->queue[i];
+
+  for (int i = 0; i < norder; i++)
+  {
+    struct sh_cell *cell = &sh->cells[order[i]];
+
+    cell->level = (cell->tree != NULL) ? 0 : -1;
+    for (int k = 0; k < cell->ndeps; k++)
+      if (sh->cells[cell->deps[k].var].level + 1 > cell->level)
+        cell->level = sh->cells[cell->deps[k].var].level + 1;
+
+    if (cell->level >= sh->nlevels)
+      sh->nlevels = cell->level + 1;
+
+    for (struct sh_dep *d = cell->readers; d != NULL; d = d->next)
+      if (sh->mark[d->reader] == sh->stamp && --sh->indegree[d->reader] == 0)
+        order[norder++] = d->reader;
+  }
+}
+
+/*
+ * Drop the definition of cell c, leaving it an input
+ */
+static void undefine(Sheet sh, int c)
+{
+  struct sh_cell *cell = &sh->cells[c];
+
+  for (int k = 0; k < cell->ndeps; k++)
+  {
+    struct sh_dep **link = &sh->cells[cell->deps[k].var].readers;
+
+    while (*link != &cell->deps[k])
+      link = &(*link)->next;
+    *link = cell->deps[k].next;
+  }
+
+  HP_free(HP_SHEET, cell->deps);
+  ET_free(cell->tree);
+  cell->deps = NULL;
+  cell->ndeps = 0;
+  cell->tree = NULL;
+}
+
+/*
+ * Add cell c to the dirty cells waiting for SH_recompute
+ */
+static void mark_dirty(Sheet sh, int c)
+{
+  if (sh->cells[c].dirty)
+    return;
+
+  sh->cells[c].dirty = true;
+  sh->dirty[sh->ndirty++] = c;
+}
+
+/*
+ * Add cell c to the dirty cells of its level, during SH_recompute
+ */
+static void mark_dirty_level(Sheet sh, int c)
+{
+  struct sh_cell *cell = &sh->cells[c];
+
+  if (cell->dirty)
+    return;
+
+  cell->dirty = true;
+  cell->next_dirty = sh->dirty_head[cell->level];
+  sh->dirty_head[cell->level] = c;
+}
+
+// Documented in .h file
+int SH_define(Sheet sh, Variable var, ExprTree tree, char *errmsg, size_t errmsg_sz)
+{
+  int c = var->index;
+  int ndeps = 0;
+
+  reserve(sh, VT_count(sh->vars));
+
+  sh->stamp++;
+  collect_vars(sh, tree, &ndeps);
+
+  // a cycle, if the tree reads c or anything downstream of it
+  unsigned read = sh->stamp;
+  int n = downstream(sh, c, read);
+
+  if (n < 0)
+  {
+    int via = -1 - n;
+
+    if (via == c)
+      snprintf(errmsg, errmsg_sz, "Circular definition: %s reads itself", var->name);
+    else
+      snprintf(errmsg, errmsg_sz, "Circular definition: %s reads %s, which depends on %s", var->name,
+               VT_nth(sh->vars, via)->name, var->name);
+    return -1;
+  }
+
+  // the one allocation, before anything changes
+  struct sh_dep *deps = HP_malloc(HP_SHEET, ndeps * sizeof(struct sh_dep));
+
+  // collect_vars has no more use for sh->list, so relevel can have it
+  for (int k = 0; k < ndeps; k++)
+    deps[k] = (struct sh_dep){sh->list[k], c, NULL};
+
+  undefine(sh, c);
+
+  struct sh_cell *cell = &sh->cells[c];
+
+  cell->tree = tree;
+  cell->deps = deps;
+  cell->ndeps = ndeps;
+  for (int k = 0; k < ndeps; k++)
+  {
+    deps[k].next = sh->cells[deps[k].var].readers;
+    sh->cells[deps[k].var].readers = &deps[k];
+  }
+
+  relevel(sh, n);
+  mark_dirty(sh, c);
+  return 0;
+}
+
+// Documented in .h file
+void SH_set(Sheet sh, Variable var, double value)
+{
+  int c = var->index;
+
+  reserve(sh, VT_count(sh->vars));
+
+  if (sh->cells[c].tree != NULL)
+  {
+    int n = downstream(sh, c, 0);
+
+    undefine(sh, c);
+    relevel(sh, n);
+  }
+
+  sh->cells[c].set = true;
+  if (same_double(var->value, value))
+    return;
+
+  var->value = value;
+  for (struct sh_dep *d = sh->cells[c].readers; d != NULL; d = d->next)
+    mark_dirty(sh, d->reader);
+}
+
+/*
+ * Evaluate n dirty cells, noting which changed
+ */
+static void evaluate_cells(Sheet sh, const int *cells, int n)
+{
+  for (int i = 0; i < n; i++)
+  {
+    struct sh_cell *cell = &sh->cells[cells[i]];
+    Variable var = VT_nth(sh->vars, cells[i]);
+    double value = ET_evaluate(cell->tree);
+
+    cell->changed = !same_double(value, var->value);
+    cell->dirty = false;
+    var->value = value;
+  }
+}
+
+/*
+ * TP_task_fn: evaluate_cells on a share of a level
+ */
+static void evaluate_task(void *arg)
+{
+  struct sh_task *task = arg;
+
+  evaluate_cells(task->sh, task->cells, task->n);
+}
+
+/*
+ * Evaluate the n dirty cells of one level, on the pool if there are
+ * enough of them; they read only lower levels, so they can be
+ * evaluated in any order
+ */
+static void evaluate_level(Sheet sh, const int *cells, int n)
+{
+  if (sh->pool == NULL || n < 2 * SH_TASK_CELLS)
+  {
+    evaluate_cells(sh, cells, n);
+    return;
+  }
+
+  struct sh_task tasks[SH_MAX_TASKS];
+  int ntasks = (n / SH_TASK_CELLS < SH_MAX_TASKS) ? n / SH_TASK_CELLS : SH_MAX_TASKS;
+  int share = (n + ntasks - 1) / ntasks;
+
+  // this thread takes the first share itself
+  for (int t = 1; t < ntasks; t++)
+  {
+    int first = t * share;
+
+    tasks[t] = (struct sh_task){.sh = sh, .cells = cells + first, .n = (n - first < share) ? n - first : share};
+    TP_spawn(sh->pool, &tasks[t].task, evaluate_task, &tasks[t]);
+  }
+
+  evaluate_cells(sh, cells, share);
+
+  for (int t = 1; t < ntasks; t++)
+    TP_sync(sh->pool, &tasks[t].task);
+}
+
+// Documented in .h file
+int SH_recompute(Sheet sh)
+{
+  int count = 0;
+
+  if (sh->ndirty == 0)
+    return 0;
+
+  TR_BEGIN("recompute");
+
+  for (int level = 0; level < sh->nlevels; level++)
+    sh->dirty_head[level] = -1;
+
+  for (int i = 0; i < sh->ndirty; i++)
+  {
+    struct sh_cell *cell = &sh->cells[sh->dirty[i]];
+
+    // a cell that has become an input since it was marked
+    cell->dirty = false;
+    if (cell->tree != NULL)
+      mark_dirty_level(sh, sh->dirty[i]);
+  }
+  sh->ndirty = 0;
+
+  for (int level = 0; level < sh->nlevels; level++)
+  {
+    int n = 0;
+
+    for (int c = sh->dirty_head[level]; c != -1; c = sh->cells[c].next_dirty)
+      sh->list[n++] = c;
+
+    if (n == 0)
+      continue;
+
+    evaluate_level(sh, sh->list, n);
+    count += n;
+
+    // their readers are all on higher levels
+    for (int i = 0; i < n; i++)
+      if (sh->cells[sh->list[i]].changed)
+        for (struct sh_dep *d = sh->cells[sh->list[i]].readers; d != NULL; d = d->next)
+          mark_dirty_level(sh, d->reader);
+  }
+
+  TR_END("recompute");
+  TR_COUNTER("recomputed", count);
+  return count;
+}
+
+// Documented in .h file
+ExprTree SH_definition(Sheet sh, Variable var)
+{
+  return (var->index < sh->ncells) ? sh->cells[var->index].tree : NULL;
+}
+
+// Documented in .h file
+int SH_level(Sheet sh, Variable var)
+{
+  return (var->index < sh->ncells) ? sh->cells[var->index].level : -1;
+}
+
+// Documented in .h file
+Variable SH_undefined(Sheet sh, ExprTree tree)
+{
+  int n = 0;
+
+  reserve(sh, VT_count(sh->vars));
+
+  sh->stamp++;
+  collect_vars(sh, tree, &n);
+
+  for (int k = 0; k < n; k++)
+    if (sh->cells[sh->list[k]].tree == NULL && !sh->cells[sh->list[k]].set)
+      return VT_nth(sh->vars, sh->list[k]);
+
+  return NULL;
+}
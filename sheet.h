@@ -0,0 +1,155 @@
+/*
+ * sheet.h
+ *
+ * Named definitions, as in a spreadsheet. A Sheet holds a definition
+ * "name = expression" for some of the variables of a VarTable, and
+ * keeps the value of each defined variable up to date with the
+ * variables its expression reads, whether those are inputs, set with
+ * SH_set, or other definitions.
+ *
+ * The definitions form a dependency graph, which must be acyclic: a
+ * definition that would make a variable depend on itself is refused.
+ * Each definition has a level, one more than the highest level of the
+ * definitions it reads (0 if it reads only inputs), so that the
+ * definitions of one level depend only on lower levels.
+ *
+ * Changes are recomputed incrementally. Defining a variable, or
+ * setting an input, marks dirty only what it affects directly;
+ * SH_recompute then evaluates the dirty definitions level by level, and
+ * a definition whose value changed marks its own readers dirty for the
+ * levels above. A definition that nothing upstream of it changed is
+ * never evaluated. The dirty definitions of a level are independent of
+ * each other, so with a thread pool they are evaluated in parallel.
+ *
+ * Setting a variable directly (VT_set, or ET_evaluate of a tree that
+ * reads it after doing so) bypasses the sheet; inputs must be set with
+ * SH_set for their readers to be recomputed.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#ifndef _SHEET_H_
+#define _SHEET_H_
+
+#include <stddef.h>
+
+#include "expr_tree.h"
+#include "vars.h"
+#include "thread_pool.h"
+
+typedef struct _sheet *Sheet;
+
+/*
+ * Create a sheet with no definitions
+ *
+ * Parameters:
+ *   vars     The variables that are defined and read; must outlive
+ *            the sheet
+ *   pool     The pool to recompute the levels on, or NULL to
+ *            recompute on the calling thread only
+ *
+ * Returns: The sheet, which the caller must SH_free
+ */
+Sheet SH_new(VarTable vars, ThreadPool pool);
+
+/*
+ * Free a sheet, and the trees of its definitions
+ *
+ * Parameters:
+ *   sh       The sheet; may be NULL
+ *
+ * Returns: None
+ */
+void SH_free(Sheet sh);
+
+/*
+ * Change the pool the levels are recomputed on
+ *
+ * Parameters:
+ *   sh       The sheet
+ *   pool     The pool, or NULL for the calling thread only; must
+ *            outlive the sheet or the next SH_set_pool
+ *
+ * Returns: None
+ */
+void SH_set_pool(Sheet sh, ThreadPool pool);
+
+/*
+ * Define a variable as an expression, replacing any definition or
+ * value it had. Its value is computed by the next SH_recompute.
+ *
+ * Parameters:
+ *   sh         The sheet
+ *   var        The variable, from the sheet's VarTable
+ *   tree       The expression, whose variables are from the same table
+ *   errmsg     Return space for an error message, filled in in case of error
+ *   errmsg_sz  The size of errmsg
+ *
+ * Returns: 0, with the sheet owning tree; or -1 if var would then
+ *   depend on itself, with an error message in errmsg, the sheet as it
+ *   was, and tree still the caller's
+ */
+int SH_define(Sheet sh, Variable var, ExprTree tree, char *errmsg, size_t errmsg_sz);
+
+/*
+ * Make a variable an input with the given value, dropping any
+ * definition it had, and mark the definitions that read it dirty
+ *
+ * Parameters:
+ *   sh       The sheet
+ *   var      The variable, from the sheet's VarTable
+ *   value    Its new value
+ *
+ * Returns: None
+ */
+void SH_set(Sheet sh, Variable var, double value);
+
+/*
+ * Bring the values of the definitions up to date, evaluating only the
+ * dirty ones and those whose inputs turn out to change
+ *
+ * Parameters:
+ *   sh       The sheet
+ *
+ * Returns: The number of definitions evaluated
+ */
+int SH_recompute(Sheet sh);
+
+/*
+ * Return the expression a variable is defined as
+ *
+ * Parameters:
+ *   sh       The sheet
+ *   var      The variable
+ *
+ * Returns: The tree, which belongs to the sheet, or NULL if var is an
+ *   input
+ */
+ExprTree SH_definition(Sheet sh, Variable var);
+
+/*
+ * Return the level of a variable in the dependency graph
+ *
+ * Parameters:
+ *   sh       The sheet
+ *   var      The variable
+ *
+ * Returns: The level, from 0, of a definition, or -1 for an input
+ */
+int SH_level(Sheet sh, Variable var);
+
+/*
+ * Find a variable that an expression reads but that has neither a
+ * definition nor a value from SH_set, such as one a definition only
+ * refers to ahead of its own definition, or a misspelt name
+ *
+ * Parameters:
+ *   sh       The sheet
+ *   tree     The expression, whose variables are from the sheet's
+ *            VarTable
+ *
+ * Returns: The first such variable tree reads, or NULL if there is none
+ */
+Variable SH_undefined(Sheet sh, ExprTree tree);
+
+#endif /* _SHEET_H_ */
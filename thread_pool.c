@@ -0,0 +1,435 @@
+/*
+ * thread_pool.c
+ *
+ * A work-stealing thread pool. Every worker owns a deque of tasks:
+ * the owner pushes and pops at the bottom (LIFO, which keeps the
+ * working set hot in its cache), while idle workers steal from the
+ * top (FIFO, which hands out the largest, oldest pieces of work).
+ * Threads that are not part of the pool submit work through an extra
+ * injection deque. A thread waiting in TP_sync with nothing of its own
+ * left to run sleeps until some task finishes, so it takes no CPU from
+ * the workers running what it waits for.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "thread_pool.h"
+
+#define INITIAL_DEQUE_CAPACITY 64
+
+// number of fruitless scans a worker makes before going to sleep
+#define IDLE_SPINS 64
+
+// number of times TP_sync finds a task unfinished before going to sleep
+#define SYNC_SPINS 64
+
+struct _tp_deque
+{
+  pthread_mutex_t lock;
+  TPTask **tasks;
+  long capacity;
+  long top;    // steal end: index of the oldest task
+  long bottom; // owner end: one past the newest task
+};
+
+struct _thread_pool
+{
+  int nthreads;
+  int nstarted; // workers actually running; less than nthreads only while starting up
+  pthread_t *threads;
+  struct _tp_deque *deques; // nthreads worker deques, then the injection deque
+  atomic_int pending;       // tasks sitting in some deque
+  atomic_int sleeping;      // workers blocked on wake
+  atomic_int waiting;       // threads blocked on finished in TP_sync
+  atomic_bool shutdown;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t finished;  // a task has finished
+};
+
+struct _tp_worker_arg
+{
+  ThreadPool pool;
+  int index;
+};
+
+// identifies the pool and deque owned by the current thread, if any
+static _Thread_local ThreadPool tp_self_pool = NULL;
+static _Thread_local int tp_self_index = -1;
+static _Thread_local unsigned tp_rand_state = 0;
+
+/*
+ * Return the index of the calling thread's deque within pool, or -1
+ * if the caller is not one of pool's workers
+ */
+static int self_index(ThreadPool pool)
+{
+  return (tp_self_pool == pool) ? tp_self_index : -1;
+}
+
+/*
+ * Cheap per-thread pseudo-random number, used to pick steal victims
+ */
+static unsigned next_rand()
+{
+  if (tp_rand_state == 0)
+    tp_rand_state = (unsigned)(size_t)&tp_rand_state | 1;
+
+  tp_rand_state ^= tp_rand_state << 13;
+  tp_rand_state ^= tp_rand_state >> 17;
+  tp_rand_state ^= tp_rand_state << 5;
+  return tp_rand_state;
+}
+
+static void deque_init(struct _tp_deque *dq)
+{
+  pthread_mutex_init(&dq->lock, NULL);
+  dq->tasks = malloc(INITIAL_DEQUE_CAPACITY * sizeof(TPTask *));
+  assert(dq->tasks != NULL);
+  dq->capacity = INITIAL_DEQUE_CAPACITY;
+  dq->top = 0;
+  dq->bottom = 0;
+}
+
+static void deque_destroy(struct _tp_deque *dq)
+{
+  pthread_mutex_destroy(&dq->lock);
+  free(dq->tasks);
+}
+
+static void deque_push(struct _tp_deque *dq, TPTask *task)
+{
+  pthread_mutex_lock(&dq->lock);
+
+  if (dq->bottom - dq->top == dq->capacity)
+  {
+    // full: double the ring, keeping the logical indices unchanged
+    TPTask **grown = malloc(2 * dq->capacity * sizeof(TPTask *));
+    assert(grown != NULL);
+
+    for (long i = dq->top; i < dq->bottom; i++)
+      grown[i % (2 * dq->capacity)] = dq->tasks[i % dq->capacity];
+
+    free(dq->tasks);
+    dq->tasks = grown;
+    dq->capacity *= 2;
+  }
+
+  dq->tasks[dq->bottom % dq->capacity] = task;
+  dq->bottom++;
+
+  pthread_mutex_unlock(&dq->lock);
+}
+
+static TPTask *deque_pop_bottom(struct _tp_deque *dq)
+{
+  TPTask *task = NULL;
+
+  pthread_mutex_lock(&dq->lock);
+  if (dq->bottom > dq->top)
+  {
+    dq->bottom--;
+    task = dq->tasks[dq->bottom % dq->capacity];
+  }
+  pthread_mutex_unlock(&dq->lock);
+
+  return task;
+}
+
+static TPTask *deque_steal_top(struct _tp_deque *dq)
+{
+  TPTask *task = NULL;
+
+  // don't queue up behind a busy owner; there are other victims
+  if (pthread_mutex_trylock(&dq->lock) != 0)
+    return NULL;
+
+  if (dq->bottom > dq->top)
+  {
+    task = dq->tasks[dq->top % dq->capacity];
+    dq->top++;
+  }
+  pthread_mutex_unlock(&dq->lock);
+
+  return task;
+}
+
+/*
+ * Find a task to run: first from our own deque, if we have one, then
+ * by stealing from the others starting at a random victim.
+ *
+ * Parameters:
+ *   pool     The pool
+ *   self     Index of the caller's own deque, or -1
+ *
+ * Returns: A task removed from some deque, or NULL if none was found
+ */
+static TPTask *find_task(ThreadPool pool, int self)
+{
+  TPTask *task = NULL;
+  int ndeques = pool->nthreads + 1;
+
+  if (atomic_load(&pool->pending) <= 0)
+    return NULL;
+
+  if (self >= 0)
+    task = deque_pop_bottom(&pool->deques[self]);
+
+  for (int i = 0, start = next_rand() % ndeques; task == NULL && i < ndeques; i++)
+  {
+    int victim = (start + i) % ndeques;
+    if (victim != self)
+      task = deque_steal_top(&pool->deques[victim]);
+  }
+
+  if (task != NULL)
+    atomic_fetch_sub(&pool->pending, 1);
+
+  return task;
+}
+
+static void run_task(ThreadPool pool, TPTask *task)
+{
+  task->fn(task->arg);
+
+  // the seq_cst store pairs with the waiting/done checks in TP_sync, so
+  // a waiter can never sleep through the end of its task; task may be
+  // gone as soon as done is set
+  atomic_store(&task->done, true);
+
+  if (atomic_load(&pool->waiting) > 0)
+  {
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_broadcast(&pool->finished);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+static void *worker_main(void *arg)
+{
+  struct _tp_worker_arg *wa = arg;
+  ThreadPool pool = wa->pool;
+  int index = wa->index;
+  free(wa);
+
+  tp_self_pool = pool;
+  tp_self_index = index;
+
+  int idle = 0;
+
+  while (true)
+  {
+    TPTask *task = find_task(pool, index);
+
+    if (task != NULL)
+    {
+      run_task(pool, task);
+      idle = 0;
+      continue;
+    }
+
+    if (++idle < IDLE_SPINS)
+    {
+      sched_yield();
+      continue;
+    }
+
+    // nothing to do for a while: sleep until a spawn or shutdown
+    pthread_mutex_lock(&pool->lock);
+    atomic_fetch_add(&pool->sleeping, 1);
+    while (atomic_load(&pool->pending) <= 0 && !atomic_load(&pool->shutdown))
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    atomic_fetch_sub(&pool->sleeping, 1);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (atomic_load(&pool->shutdown) && atomic_load(&pool->pending) <= 0)
+      break;
+
+    idle = 0;
+  }
+
+  return NULL;
+}
+
+// Documented in .h file
+ThreadPool TP_new(int nthreads)
+{
+  if (nthreads <= 0)
+    nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads <= 0)
+    nthreads = 1;
+
+  ThreadPool pool = malloc(sizeof(struct _thread_pool));
+  if (pool == NULL)
+    return NULL;
+
+  pool->nthreads = nthreads;
+  pool->nstarted = 0;
+  pool->threads = malloc(nthreads * sizeof(pthread_t));
+  pool->deques = malloc((nthreads + 1) * sizeof(struct _tp_deque));
+  assert(pool->threads != NULL && pool->deques != NULL);
+
+  for (int i = 0; i <= nthreads; i++)
+    deque_init(&pool->deques[i]);
+
+  atomic_init(&pool->pending, 0);
+  atomic_init(&pool->sleeping, 0);
+  atomic_init(&pool->waiting, 0);
+  atomic_init(&pool->shutdown, false);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->finished, NULL);
+
+  for (int i = 0; i < nthreads; i++)
+  {
+    struct _tp_worker_arg *wa = malloc(sizeof(struct _tp_worker_arg));
+    assert(wa != NULL);
+    wa->pool = pool;
+    wa->index = i;
+
+    if (pthread_create(&pool->threads[i], NULL, worker_main, wa) != 0)
+    {
+      // stop the workers that did start, then give up
+      free(wa);
+      TP_free(pool);
+      return NULL;
+    }
+
+    pool->nstarted++;
+  }
+
+  return pool;
+}
+
+// Documented in .h file
+void TP_free(ThreadPool pool)
+{
+  if (pool == NULL)
+    return;
+
+  assert(atomic_load(&pool->pending) == 0);
+
+  pthread_mutex_lock(&pool->lock);
+  atomic_store(&pool->shutdown, true);
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->nstarted; i++)
+    pthread_join(pool->threads[i], NULL);
+
+  for (int i = 0; i <= pool->nthreads; i++)
+    deque_destroy(&pool->deques[i]);
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->wake);
+  pthread_cond_destroy(&pool->finished);
+  free(pool->deques);
+  free(pool->threads);
+  free(pool);
+}
+
+// Documented in .h file
+int TP_size(ThreadPool pool)
+{
+  return (pool == NULL) ? 0 : pool->nthreads;
+}
+
+// Documented in .h file
+void TP_spawn(ThreadPool pool, TPTask *task, TP_task_fn fn, void *arg)
+{
+  task->fn = fn;
+  task->arg = arg;
+  atomic_init(&task->done, false);
+
+  int self = self_index(pool);
+  deque_push(&pool->deques[self >= 0 ? self : pool->nthreads], task);
+
+  // the seq_cst increment pairs with the sleeping/pending checks in
+  // worker_main, so a worker can never sleep through this spawn
+  atomic_fetch_add(&pool->pending, 1);
+
+  if (atomic_load(&pool->sleeping) > 0)
+  {
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+/*
+ * Pop a task from the bottom of the caller's own deque, for TP_sync
+ *
+ * Parameters:
+ *   pool     The pool
+ *   self     Index of the caller's own deque, or -1
+ *
+ * Returns: The task, or NULL if the caller has no deque or it is empty
+ */
+static TPTask *pop_own(ThreadPool pool, int self)
+{
+  TPTask *task = NULL;
+
+  if (self >= 0 && atomic_load(&pool->pending) > 0)
+    task = deque_pop_bottom(&pool->deques[self]);
+
+  if (task != NULL)
+    atomic_fetch_sub(&pool->pending, 1);
+
+  return task;
+}
+
+// Documented in .h file
+void TP_sync(ThreadPool pool, TPTask *task)
+{
+  int self = self_index(pool);
+  int spins = 0;
+
+  // Only the waiter's own deque is worth helping from. Thieves take the
+  // oldest tasks, so everything still in it was spawned after the task
+  // waited on, or is that task: each one run here is a child of the
+  // wait, and the stack grows only as deep as the fork-join nests. A
+  // stolen task, run here instead, would stack a whole unrelated
+  // descent on top of this one.
+  while (!atomic_load_explicit(&task->done, memory_order_acquire))
+  {
+    TPTask *other = pop_own(pool, self);
+
+    if (other != NULL)
+    {
+      run_task(pool, other);
+      spins = 0;
+      continue;
+    }
+
+    if (++spins < SYNC_SPINS)
+    {
+      sched_yield();
+      continue;
+    }
+
+    // Nothing left to run here, and nothing can turn up: only the owner
+    // pushes onto a deque, and a thread outside the pool has none. Sleep
+    // until some task finishes, and check again.
+    pthread_mutex_lock(&pool->lock);
+    atomic_fetch_add(&pool->waiting, 1);
+    while (!atomic_load(&task->done))
+      pthread_cond_wait(&pool->finished, &pool->lock);
+    atomic_fetch_sub(&pool->waiting, 1);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+// Documented in .h file
+void TP_run(ThreadPool pool, TP_task_fn fn, void *arg)
+{
+  TPTask task;
+
+  TP_spawn(pool, &task, fn, arg);
+  TP_sync(pool, &task);
+}
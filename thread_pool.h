@@ -0,0 +1,106 @@
+/*
+ * thread_pool.h
+ *
+ * A small work-stealing thread pool for fork-join parallelism
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+
+#include <stdbool.h>
+#include <stdatomic.h>
+
+typedef struct _thread_pool *ThreadPool;
+
+typedef void (*TP_task_fn)(void *arg);
+
+/*
+ * A unit of work. Tasks are owned by the caller, which typically
+ * places them on its own stack: a task must stay alive until
+ * TP_sync has returned for it.
+ */
+typedef struct
+{
+  TP_task_fn fn;
+  void *arg;
+  atomic_bool done;
+} TPTask;
+
+/*
+ * Create a new pool and start its worker threads
+ *
+ * Parameters:
+ *   nthreads   Number of worker threads, or 0 to use one per online CPU
+ *
+ * Returns: The new pool, or NULL if the threads could not be started
+ */
+ThreadPool TP_new(int nthreads);
+
+/*
+ * Stop the worker threads and release the pool. There must be no
+ * outstanding tasks.
+ *
+ * Parameters:
+ *   pool     The pool
+ *
+ * Returns: None
+ */
+void TP_free(ThreadPool pool);
+
+/*
+ * Return the number of worker threads in the pool
+ *
+ * Parameters:
+ *   pool     The pool
+ *
+ * Returns: The number of workers
+ */
+int TP_size(ThreadPool pool);
+
+/*
+ * Make a task available for execution. When called from one of the
+ * pool's workers the task is pushed onto that worker's own deque,
+ * from which idle workers may steal it; otherwise it is queued on the
+ * pool's shared injection deque.
+ *
+ * Parameters:
+ *   pool     The pool
+ *   task     Storage for the task; must outlive the matching TP_sync
+ *   fn       Function to run
+ *   arg      Argument passed to fn
+ *
+ * Returns: None
+ */
+void TP_spawn(ThreadPool pool, TPTask *task, TP_task_fn fn, void *arg);
+
+/*
+ * Wait until a spawned task has completed. While waiting, a worker
+ * runs the tasks left in its own deque, which were all spawned after
+ * this one (or are this one), so nested fork-join never deadlocks and
+ * never stacks unrelated work on the waiter's stack. Once there are
+ * none left, or for a thread outside the pool from the start, it spins
+ * briefly and then sleeps until the task finishes.
+ *
+ * Parameters:
+ *   pool     The pool
+ *   task     A task previously passed to TP_spawn
+ *
+ * Returns: None
+ */
+void TP_sync(ThreadPool pool, TPTask *task);
+
+/*
+ * Convenience wrapper: spawn fn(arg) and wait for it to finish
+ *
+ * Parameters:
+ *   pool     The pool
+ *   fn       Function to run
+ *   arg      Argument passed to fn
+ *
+ * Returns: None
+ */
+void TP_run(ThreadPool pool, TP_task_fn fn, void *arg);
+
+#endif /* _THREAD_POOL_H_ */
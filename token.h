@@ -10,8 +10,14 @@
 #ifndef _TOKEN_H_
 #define _TOKEN_H_
 
+#include <stddef.h>
+
+#include "vars.h"
+#include "funcs.h"
+
 typedef enum {
   TOK_VALUE,
+  TOK_VARIABLE,
   TOK_PLUS,
   TOK_MINUS,
   TOK_MULTIPLY,
@@ -19,12 +25,28 @@ typedef enum {
   TOK_POWER,
   TOK_OPEN_PAREN,
   TOK_CLOSE_PAREN,
+  TOK_LESS,
+  TOK_LESS_EQUAL,
+  TOK_GREATER,
+  TOK_GREATER_EQUAL,
+  TOK_EQUAL,
+  TOK_NOT_EQUAL,
+  TOK_QUESTION,
+  TOK_COLON,
+  TOK_COMMA,
+  TOK_IF,
+  TOK_FUNCTION,
+  TOK_ASSIGN,
   TOK_END
 } TokenType;
 
 typedef struct {
   TokenType type;
-  double value;
+  double value;  // TOK_VALUE only
+  Variable var;  // TOK_VARIABLE only
+  MathFunc func; // TOK_FUNCTION only
+  size_t start;  // where the token is in the input: input[start..end)
+  size_t end;
 } Token;
 
 
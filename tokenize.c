@@ -16,6 +16,14 @@
 #include "clist.h"
 #include "tokenize.h"
 #include "token.h"
+#include "heap.h"
+#include "trace.h"
+
+// the character at index k of the input, or '\0' past its end
+#define AT(k) ((k) < len ? input[k] : '\0')
+
+// longest number scan_number converts without going to the heap
+#define NUMBER_MAX 63
 
 // Documented in .h file
 const char *TT_to_str(TokenType tt)
@@ -24,6 +32,8 @@ const char *TT_to_str(TokenType tt)
   {
   case TOK_VALUE:
     return "VALUE";
+  case TOK_VARIABLE:
+    return "VARIABLE";
   case TOK_PLUS:
     return "PLUS";
   case TOK_MINUS:
@@ -38,6 +48,30 @@ const char *TT_to_str(TokenType tt)
     return "OPEN_PAREN";
   case TOK_CLOSE_PAREN:
     return "CLOSE_PAREN";
+  case TOK_LESS:
+    return "LESS";
+  case TOK_LESS_EQUAL:
+    return "LESS_EQUAL";
+  case TOK_GREATER:
+    return "GREATER";
+  case TOK_GREATER_EQUAL:
+    return "GREATER_EQUAL";
+  case TOK_EQUAL:
+    return "EQUAL";
+  case TOK_NOT_EQUAL:
+    return "NOT_EQUAL";
+  case TOK_QUESTION:
+    return "QUESTION";
+  case TOK_COLON:
+    return "COLON";
+  case TOK_COMMA:
+    return "COMMA";
+  case TOK_IF:
+    return "IF";
+  case TOK_FUNCTION:
+    return "FUNCTION";
+  case TOK_ASSIGN:
+    return "ASSIGN";
   case TOK_END:
     return "(end)";
   }
@@ -62,94 +96,227 @@ bool isValidMathSign(char sign)
 // Documented in .h file
 CList TOK_tokenize_input(const char *input, char *errmsg, size_t errmsg_sz)
 {
-  int i = 0;
+  return TOK_tokenize_vars(input, NULL, errmsg, errmsg_sz);
+}
+
+// Documented in .h file
+CList TOK_tokenize_vars(const char *input, VarTable vars, char *errmsg, size_t errmsg_sz)
+{
+  return TOK_tokenize_n(input, strlen(input), vars, errmsg, errmsg_sz);
+}
+
+/*
+ * Convert the number that starts at input[i], reading no further than
+ * input[len - 1]
+ *
+ * Parameters:
+ *   input    The input
+ *   len      Its length
+ *   i        Where the number starts
+ *   end      Return space for the index of the first character after it
+ *
+ * Returns: The value of the number
+ */
+static double scan_number(const char *input, size_t len, size_t i, size_t *end)
+{
+  char local[NUMBER_MAX + 1];
+  char *buf = local;
+  size_t n = 0;
+
+  // every character strtod could take, so that it stops where it would
+  // have stopped in the input itself
+  while (i + n < len &&
+         (isalnum(input[i + n]) || input[i + n] == '.' ||
+          ((input[i + n] == '+' || input[i + n] == '-') && strchr("eEpP", input[i + n - 1]) != NULL)))
+    n++;
+
+  // a long number is rare, but all of it is the number
+  if (n > NUMBER_MAX)
+    buf = HP_malloc(HP_CLIST, n + 1);
+
+  memcpy(buf, &input[i], n);
+  buf[n] = '\0';
+
+  char *buf_end;
+  double value = strtod(buf, &buf_end);
+
+  *end = i + (buf_end - buf);
+  if (buf != local)
+    HP_free(HP_CLIST, buf);
+  return value;
+}
+
+/*
+ * Append a token that spans input[start..end)
+ */
+static void append(CList tokens, Token token, size_t start, size_t end)
+{
+  token.start = start;
+  token.end = end;
+  CL_append(tokens, token);
+}
+
+/*
+ * TOK_tokenize_n, less the accounting and tracing of the phase
+ */
+static CList tokenize(const char *input, size_t len, VarTable vars, char *errmsg, size_t errmsg_sz)
+{
+  size_t i = 0;
   CList tokens = CL_new();
 
-  while (input[i] != '\0')
+  while (i < len)
   {
     if (isspace(input[i]))
       i++;
       
-    else if (isdigit(input[i]) || (input[i] == '.' && isdigit(input[i + 1])))
+    else if (isdigit(input[i]) || (input[i] == '.' && isdigit(AT(i + 1))))
     {
-      char *end;
-      // convert string to double, starting at address of input[i]
-      // and store the address of the first character after the number in end
-      // if the number is 1.2e3, end will point to the 'e' & double value will be 1.2
-      double value = strtod(&input[i], &end);
+      size_t end;
+      // convert the number starting at input[i] to double, and store the
+      // index of the first character after the number in end
+      double value = scan_number(input, len, i, &end);
 
       // append the token to the list of tokens
-      CL_append(tokens, (CListElementType){TOK_VALUE, value});
+      append(tokens, (Token){TOK_VALUE, value}, i, end);
 
       // advance i to the first character after the number
-      i = end - input;
+      i = end;
+    }
+    else if (isalpha(input[i]) || input[i] == '_')
+    {
+      int name_len = 1;
+
+      while (isalnum(AT(i + name_len)) || AT(i + name_len) == '_')
+        name_len++;
+
+      // a keyword, a function, or else a variable if there can be any
+      MathFunc func = FN_lookup(&input[i], name_len);
+
+      if (name_len == 2 && strncmp(&input[i], "if", 2) == 0)
+        append(tokens, (Token){TOK_IF, 0.0}, i, i + name_len);
+      else if (func != NULL)
+        append(tokens, (Token){TOK_FUNCTION, 0.0, NULL, func}, i, i + name_len);
+      else if (vars != NULL)
+        append(tokens, (Token){TOK_VARIABLE, 0.0, VT_define(vars, &input[i], name_len)}, i, i + name_len);
+      else
+        goto unexpected;
+
+      i += name_len;
     }
     else if (input[i] == '+')
     {
-      if (input[i + 1] == '+' && CL_nth(tokens, CL_length(tokens) - 1).type == TOK_VALUE && isValidMathSign(input[i + 2]))
+      if (AT(i + 1) == '+' && CL_nth(tokens, CL_length(tokens) - 1).type == TOK_VALUE && isValidMathSign(AT(i + 2)))
       {
         Token prev_token = CL_remove(tokens, CL_length(tokens) - 1);
         Token new_token = {TOK_VALUE, prev_token.value + 1};
-        CL_append(tokens, new_token);
+        append(tokens, new_token, prev_token.start, i + 2);
         i += 2;
       }
       else
       {
-        CL_append(tokens, (CListElementType){TOK_PLUS, 0.0});
+        append(tokens, (Token){TOK_PLUS, 0.0}, i, i + 1);
         i++;
       }
     }
     else if (input[i] == '-')
     {
-      if (input[i + 1] == '-' && CL_nth(tokens, CL_length(tokens) - 1).type == TOK_VALUE && isValidMathSign(input[i + 2]))
+      if (AT(i + 1) == '-' && CL_nth(tokens, CL_length(tokens) - 1).type == TOK_VALUE && isValidMathSign(AT(i + 2)))
       {
         Token prev_token = CL_remove(tokens, CL_length(tokens) - 1);
         Token new_token = {TOK_VALUE, prev_token.value - 1};
-        CL_append(tokens, new_token);
+        append(tokens, new_token, prev_token.start, i + 2);
         i += 2;
       }
       else
       {
-        CL_append(tokens, (CListElementType){TOK_MINUS, 0.0});
+        append(tokens, (Token){TOK_MINUS, 0.0}, i, i + 1);
         i++;
       }
     }
     else if (input[i] == '*')
     {
-      CL_append(tokens, (CListElementType){TOK_MULTIPLY, 0.0});
+      append(tokens, (Token){TOK_MULTIPLY, 0.0}, i, i + 1);
       i++;
     }
     else if (input[i] == '/')
     {
-      CL_append(tokens, (CListElementType){TOK_DIVIDE, 0.0});
+      append(tokens, (Token){TOK_DIVIDE, 0.0}, i, i + 1);
       i++;
     }
     else if (input[i] == '^')
     {
-      CL_append(tokens, (CListElementType){TOK_POWER, 0.0});
+      append(tokens, (Token){TOK_POWER, 0.0}, i, i + 1);
       i++;
     }
     else if (input[i] == '(')
     {
-      CL_append(tokens, (CListElementType){TOK_OPEN_PAREN, 0.0});
+      append(tokens, (Token){TOK_OPEN_PAREN, 0.0}, i, i + 1);
       i++;
     }
     else if (input[i] == ')')
     {
-      CL_append(tokens, (CListElementType){TOK_CLOSE_PAREN, 0.0});
+      append(tokens, (Token){TOK_CLOSE_PAREN, 0.0}, i, i + 1);
       i++;
     }
-    else
+    else if (input[i] == '<' || input[i] == '>')
+    {
+      bool or_equal = (AT(i + 1) == '=');
+
+      if (input[i] == '<')
+        append(tokens, (Token){or_equal ? TOK_LESS_EQUAL : TOK_LESS, 0.0}, i, i + (or_equal ? 2 : 1));
+      else
+        append(tokens, (Token){or_equal ? TOK_GREATER_EQUAL : TOK_GREATER, 0.0}, i, i + (or_equal ? 2 : 1));
+      i += or_equal ? 2 : 1;
+    }
+    else if ((input[i] == '=' || input[i] == '!') && AT(i + 1) == '=')
+    {
+      append(tokens, (Token){input[i] == '=' ? TOK_EQUAL : TOK_NOT_EQUAL, 0.0}, i, i + 2);
+      i += 2;
+    }
+    else if (input[i] == '=')
+    {
+      append(tokens, (Token){TOK_ASSIGN, 0.0}, i, i + 1);
+      i++;
+    }
+    else if (input[i] == '?')
     {
-      CL_append(tokens, (CListElementType){TOK_END, 0.0});
-      snprintf(errmsg, errmsg_sz, "Position %d: unexpected character %c", i + 1, input[i]);
-      CL_free(tokens);
-      return NULL;
+      append(tokens, (Token){TOK_QUESTION, 0.0}, i, i + 1);
+      i++;
+    }
+    else if (input[i] == ':')
+    {
+      append(tokens, (Token){TOK_COLON, 0.0}, i, i + 1);
+      i++;
     }
+    else if (input[i] == ',')
+    {
+      append(tokens, (Token){TOK_COMMA, 0.0}, i, i + 1);
+      i++;
+    }
+    else
+      goto unexpected;
   }
 
   // 6. Return the list of tokens
   return tokens;
+
+unexpected:
+  CL_append(tokens, (CListElementType){TOK_END, 0.0});
+  snprintf(errmsg, errmsg_sz, "Position %zu: unexpected character %c", i + 1, input[i]);
+  CL_free(tokens);
+  return NULL;
+}
+
+// Documented in .h file
+CList TOK_tokenize_n(const char *input, size_t len, VarTable vars, char *errmsg, size_t errmsg_sz)
+{
+  TR_BEGIN("tokenize");
+  HeapPhase prev = HP_set_phase(HP_TOKENIZE);
+  CList tokens = tokenize(input, len, vars, errmsg, errmsg_sz);
+
+  HP_set_phase(prev);
+  TR_END("tokenize");
+  return tokens;
 }
 
 // Documented in .h file
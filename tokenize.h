@@ -39,6 +39,44 @@ const char *TT_to_str(TokenType tt);
  */
 CList TOK_tokenize_input(const char *input, char *errmsg, size_t errmsg_sz);
 
+/*
+ * Tokenize a string that may refer to variables. A name is a letter
+ * or underscore followed by letters, digits and underscores. The name
+ * "if" is a keyword, and the names of built-in functions (see
+ * funcs.h) become TOK_FUNCTION tokens; any other name is a variable,
+ * looked up in vars and added to it if it is new.
+ * TOK_tokenize_input is the same as passing a NULL vars, which makes
+ * any other name an error.
+ *
+ * Parameters:
+ *   input      The input as entered by the user
+ *   vars       The variables names are resolved in, or NULL
+ *   errmsg     Return space for an error message, filled in in case of error
+ *   errmsg_sz  The size of errmsg
+ *
+ * Returns: As for TOK_tokenize_input. TOK_VARIABLE tokens point into
+ *   vars, which must outlive the tokens and any tree parsed from them.
+ */
+CList TOK_tokenize_vars(const char *input, VarTable vars, char *errmsg, size_t errmsg_sz);
+
+/*
+ * Tokenize the first len characters of input, which need not be
+ * NUL-terminated: nothing at or beyond input[len] is ever read, so
+ * input can be a line in the middle of a mapped file. A NUL within
+ * them is an unexpected character. Otherwise the same as
+ * TOK_tokenize_vars, which calls this with strlen(input).
+ *
+ * Parameters:
+ *   input      The input
+ *   len        Its length
+ *   vars       The variables names are resolved in, or NULL
+ *   errmsg     Return space for an error message, filled in in case of error
+ *   errmsg_sz  The size of errmsg
+ *
+ * Returns: As for TOK_tokenize_vars
+ */
+CList TOK_tokenize_n(const char *input, size_t len, VarTable vars, char *errmsg, size_t errmsg_sz);
+
 /*
  * Returns the TokenType for the next token. Does not modify the list
  * of tokens.
@@ -0,0 +1,230 @@
+/*
+ * trace.c
+ *
+ * The per-thread event buffers behind trace.h. A thread's first event
+ * gives it a buffer, pushed onto a list of all buffers with a
+ * compare-and-swap. A buffer is a list of chunks of events; the owner
+ * fills in an event and then publishes it by bumping its chunk's count
+ * with a release store, so TR_flush reads only events that are whole.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+#include "trace.h"
+
+#ifdef EW_TRACE
+
+#define CHUNK_EVENTS 4096
+
+struct event
+{
+  const char *name;
+  uint64_t ts;  // ns since TR_open
+  double value; // of a counter
+  char ph;
+};
+
+struct chunk
+{
+  _Atomic(struct chunk *) next;
+  atomic_int count; // events published
+  struct event events[CHUNK_EVENTS];
+};
+
+// the events of one thread
+struct buffer
+{
+  struct buffer *next; // in the list of all buffers
+  int tid;             // numbered from 1 in order of first event
+  struct chunk *first;
+  struct chunk *last;  // the one being filled
+};
+
+static atomic_bool tracing;
+static FILE *trace_file;
+static uint64_t epoch; // when TR_open was called
+static _Atomic(struct buffer *) buffers;
+static atomic_int next_tid = 1;
+static _Thread_local struct buffer *mine;
+
+/*
+ * Return the time in nanoseconds
+ */
+static uint64_t now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Allocate an empty chunk
+ */
+static struct chunk *new_chunk()
+{
+  struct chunk *chunk = malloc(sizeof(struct chunk));
+  assert(chunk != NULL);
+
+  atomic_init(&chunk->next, NULL);
+  atomic_init(&chunk->count, 0);
+  return chunk;
+}
+
+/*
+ * Give the calling thread a buffer, and make it visible to TR_flush
+ */
+static struct buffer *new_buffer()
+{
+  struct buffer *buf = malloc(sizeof(struct buffer));
+  assert(buf != NULL);
+
+  buf->tid = atomic_fetch_add(&next_tid, 1);
+  buf->first = buf->last = new_chunk();
+  buf->next = atomic_load_explicit(&buffers, memory_order_relaxed);
+  while (!atomic_compare_exchange_weak_explicit(&buffers, &buf->next, buf, memory_order_release,
+                                                memory_order_relaxed))
+    ;
+
+  return buf;
+}
+
+// Documented in .h file
+int TR_open(const char *path, char *errmsg, size_t errmsg_sz)
+{
+  static bool opened = false;
+
+  // the buffers are never emptied, so a second trace would repeat the first
+  if (opened)
+  {
+    snprintf(errmsg, errmsg_sz, "Tracing can only be started once");
+    return -1;
+  }
+
+  trace_file = fopen(path, "w");
+  if (trace_file == NULL)
+  {
+    snprintf(errmsg, errmsg_sz, "%s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  opened = true;
+  atexit(TR_flush);
+
+  epoch = now();
+  atomic_store_explicit(&tracing, true, memory_order_release);
+  return 0;
+}
+
+// Documented in .h file
+bool TR_enabled()
+{
+  return atomic_load_explicit(&tracing, memory_order_relaxed);
+}
+
+// Documented in .h file
+void TR_event(char ph, const char *name, double value)
+{
+  // acquire, to see the epoch that TR_open set
+  if (!atomic_load_explicit(&tracing, memory_order_acquire))
+    return;
+
+  if (mine == NULL)
+    mine = new_buffer();
+
+  struct chunk *chunk = mine->last;
+  int n = atomic_load_explicit(&chunk->count, memory_order_relaxed);
+
+  if (n == CHUNK_EVENTS)
+  {
+    chunk = new_chunk();
+    atomic_store_explicit(&mine->last->next, chunk, memory_order_release);
+    mine->last = chunk;
+    n = 0;
+  }
+
+  chunk->events[n] = (struct event){name, now() - epoch, value, ph};
+  atomic_store_explicit(&chunk->count, n + 1, memory_order_release);
+}
+
+/*
+ * Write one event as a JSON object
+ */
+static void write_event(FILE *out, const struct event *ev, int tid)
+{
+  fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d", ev->name, ev->ph,
+          ev->ts / 1000.0, (int)getpid(), tid);
+  if (ev->ph == 'C')
+    fprintf(out, ",\"args\":{\"%s\":%.17g}", ev->name, ev->value);
+  fprintf(out, "}");
+}
+
+// Documented in .h file
+void TR_flush()
+{
+  if (!atomic_exchange(&tracing, false))
+    return;
+
+  FILE *out = trace_file;
+  bool first = true;
+
+  fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  for (struct buffer *buf = atomic_load_explicit(&buffers, memory_order_acquire); buf != NULL; buf = buf->next)
+  {
+    fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+            first ? "" : ",", (int)getpid(), buf->tid, buf->tid);
+    first = false;
+
+    for (struct chunk *chunk = buf->first; chunk != NULL;)
+    {
+      int n = atomic_load_explicit(&chunk->count, memory_order_acquire);
+
+      for (int i = 0; i < n; i++)
+        write_event(out, &chunk->events[i], buf->tid);
+
+      // the owner links a new chunk only once this one is full
+      chunk = (n == CHUNK_EVENTS) ? atomic_load_explicit(&chunk->next, memory_order_acquire) : NULL;
+    }
+  }
+  fprintf(out, "\n]}\n");
+
+  fclose(out);
+  trace_file = NULL;
+}
+
+#else
+
+// Documented in .h file
+int TR_open(const char *path, char *errmsg, size_t errmsg_sz)
+{
+  snprintf(errmsg, errmsg_sz, "Tracing is not built in (make TRACE=1)");
+  return -1;
+}
+
+// Documented in .h file
+bool TR_enabled()
+{
+  return false;
+}
+
+// Documented in .h file
+void TR_event(char ph, const char *name, double value)
+{
+}
+
+// Documented in .h file
+void TR_flush()
+{
+}
+
+#endif
@@ -0,0 +1,91 @@
+/*
+ * trace.h
+ *
+ * Tracing of where the time goes inside one expression, written out as
+ * Chrome trace-event JSON, which chrome://tracing and Perfetto load.
+ * The core modules mark spans (tokenize, parse, each evaluation
+ * engine, tree2string, free) with TR_BEGIN and TR_END, and record the
+ * size of each tree parsed with TR_COUNTER.
+ *
+ * Tracing is built in only when EW_TRACE is defined (make TRACE=1);
+ * otherwise the macros expand to nothing, their arguments are never
+ * evaluated, and TR_open fails. When built in, nothing is recorded
+ * until TR_open is called.
+ *
+ * Each thread appends its events to a buffer of its own, in chunks
+ * that only it writes, so recording takes no lock; the events of every
+ * thread are written out by TR_flush, which TR_open arranges to run at
+ * exit.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef EW_TRACE
+
+// name must be a string literal, or otherwise outlive the trace
+#define TR_BEGIN(name) TR_event('B', (name), 0)
+#define TR_END(name) TR_event('E', (name), 0)
+
+// value is evaluated only while tracing
+#define TR_COUNTER(name, value)             \
+  do                                        \
+  {                                         \
+    if (TR_enabled())                       \
+      TR_event('C', (name), (value));       \
+  } while (0)
+
+#else
+
+#define TR_BEGIN(name) ((void)0)
+#define TR_END(name) ((void)0)
+#define TR_COUNTER(name, value) ((void)0)
+
+#endif
+
+/*
+ * Start tracing, to be written to a file at exit or by TR_flush
+ *
+ * Parameters:
+ *   path       The file to write the trace to; it is created now
+ *   errmsg     Return space for an error message, filled in in case of error
+ *   errmsg_sz  The size of errmsg
+ *
+ * Returns: 0, or -1 in case of error, such as tracing not being built in
+ */
+int TR_open(const char *path, char *errmsg, size_t errmsg_sz);
+
+/*
+ * Return whether events are being recorded
+ *
+ * Returns: True between TR_open and TR_flush
+ */
+bool TR_enabled();
+
+/*
+ * Record an event on the calling thread; use the macros instead
+ *
+ * Parameters:
+ *   ph         The kind of event: 'B' begin, 'E' end, or 'C' counter
+ *   name       The name of the span or counter
+ *   value      The value of a counter
+ *
+ * Returns: None
+ */
+void TR_event(char ph, const char *name, double value);
+
+/*
+ * Stop tracing and write out the events of every thread. Events that
+ * threads record meanwhile may or may not be written. Does nothing if
+ * tracing was not started, or has already been flushed.
+ *
+ * Returns: None
+ */
+void TR_flush();
+
+#endif /* _TRACE_H_ */
@@ -0,0 +1,182 @@
+/*
+ * vars.c
+ *
+ * A table of named variables: an array of individually allocated
+ * variables, indexed by an open-addressing hash of their names
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "vars.h"
+#include "heap.h"
+
+struct _var_table
+{
+  Variable *vars;  // in index order
+  int count;
+  int *slots;      // index + 1; 0 marks an empty slot
+  int nslots;      // always a power of two, at least twice count
+};
+
+/*
+ * FNV-1a hash of a name
+ */
+static uint32_t hash_name(const char *name, size_t len)
+{
+  uint32_t h = 2166136261u;
+
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char)name[i]) * 16777619u;
+
+  return h;
+}
+
+/*
+ * Return the slot holding the variable called name, or the empty slot
+ * where it would go
+ */
+static int find_slot(VarTable vt, const char *name, size_t len)
+{
+  int mask = vt->nslots - 1;
+
+  for (int s = hash_name(name, len) & mask;; s = (s + 1) & mask)
+  {
+    if (vt->slots[s] == 0)
+      return s;
+
+    Variable var = vt->vars[vt->slots[s] - 1];
+    if (strncmp(var->name, name, len) == 0 && var->name[len] == '\0')
+      return s;
+  }
+}
+
+/*
+ * Rebuild the hash from the variables in the table
+ */
+static void rehash(VarTable vt)
+{
+  memset(vt->slots, 0, vt->nslots * sizeof(int));
+
+  for (int i = 0; i < vt->count; i++)
+    vt->slots[find_slot(vt, vt->vars[i]->name, strlen(vt->vars[i]->name))] = i + 1;
+}
+
+// Documented in .h file
+VarTable VT_new()
+{
+  VarTable vt = HP_malloc(HP_VARS, sizeof(struct _var_table));
+  assert(vt != NULL);
+
+  vt->count = 0;
+  vt->nslots = 16;
+  vt->vars = HP_malloc(HP_VARS, vt->nslots / 2 * sizeof(Variable));
+  vt->slots = HP_calloc(HP_VARS, vt->nslots, sizeof(int));
+  assert(vt->vars != NULL && vt->slots != NULL);
+
+  return vt;
+}
+
+// Documented in .h file
+void VT_free(VarTable vt)
+{
+  if (vt == NULL)
+    return;
+
+  for (int i = 0; i < vt->count; i++)
+  {
+    HP_free(HP_VARS, vt->vars[i]->name);
+    HP_free(HP_VARS, vt->vars[i]);
+  }
+
+  HP_free(HP_VARS, vt->vars);
+  HP_free(HP_VARS, vt->slots);
+  HP_free(HP_VARS, vt);
+}
+
+// Documented in .h file
+int VT_count(VarTable vt)
+{
+  return vt->count;
+}
+
+// Documented in .h file
+Variable VT_lookup(VarTable vt, const char *name, size_t len)
+{
+  int s = find_slot(vt, name, len);
+
+  return (vt->slots[s] == 0) ? NULL : vt->vars[vt->slots[s] - 1];
+}
+
+// Documented in .h file
+Variable VT_define(VarTable vt, const char *name, size_t len)
+{
+  int s = find_slot(vt, name, len);
+
+  if (vt->slots[s] != 0)
+    return vt->vars[vt->slots[s] - 1];
+
+  // keep the hash at most half full; both arrays are grown before
+  // anything else changes, so the table stays whole if that fails
+  if (2 * (vt->count + 1) > vt->nslots)
+  {
+    vt->vars = HP_realloc(HP_VARS, vt->vars, vt->nslots * sizeof(Variable));
+    vt->slots = HP_realloc(HP_VARS, vt->slots, 2 * vt->nslots * sizeof(int));
+    assert(vt->slots != NULL && vt->vars != NULL);
+    vt->nslots *= 2;
+    rehash(vt);
+
+    s = find_slot(vt, name, len);
+  }
+
+  Variable var = HP_malloc(HP_VARS, sizeof(struct _variable));
+  assert(var != NULL);
+  var->name = HP_strndup(HP_VARS, name, len);
+  assert(var->name != NULL);
+  var->index = vt->count;
+  var->value = 0;
+
+  vt->vars[vt->count++] = var;
+  vt->slots[s] = vt->count;
+
+  return var;
+}
+
+// Documented in .h file
+void VT_truncate(VarTable vt, int count)
+{
+  assert(count >= 0 && count <= vt->count);
+
+  if (count == vt->count)
+    return;
+
+  for (int i = count; i < vt->count; i++)
+  {
+    HP_free(HP_VARS, vt->vars[i]->name);
+    HP_free(HP_VARS, vt->vars[i]);
+  }
+
+  vt->count = count;
+  rehash(vt);
+}
+
+// Documented in .h file
+Variable VT_nth(VarTable vt, int index)
+{
+  assert(index >= 0 && index < vt->count);
+
+  return vt->vars[index];
+}
+
+// Documented in .h file
+Variable VT_set(VarTable vt, const char *name, double value)
+{
+  Variable var = VT_define(vt, name, strlen(name));
+
+  var->value = value;
+  return var;
+}
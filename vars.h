@@ -0,0 +1,120 @@
+/*
+ * vars.h
+ *
+ * Named variables that expressions can refer to. A VarTable holds
+ * every variable known to one set of expressions; each variable has a
+ * name, a dense index (its position in the table) and a current value.
+ * Trees hold pointers to Variables, so a variable keeps its address
+ * for the life of the table, and setting its value rebinds every tree
+ * that uses it.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#ifndef _VARS_H_
+#define _VARS_H_
+
+#include <stddef.h>
+
+struct _variable
+{
+  char *name;
+  int index;    // position in the table, 0 .. VT_count() - 1
+  double value; // the value used by ET_evaluate
+};
+
+typedef struct _variable *Variable;
+typedef struct _var_table *VarTable;
+
+/*
+ * Create a new, empty VarTable
+ *
+ * Parameters: None
+ *
+ * Returns: The new table, which the caller must VT_free
+ */
+VarTable VT_new();
+
+/*
+ * Destroy a VarTable and all of its variables. Trees that refer to
+ * the variables must not be evaluated afterwards.
+ *
+ * Parameters:
+ *   vt       The table
+ *
+ * Returns: None
+ */
+void VT_free(VarTable vt);
+
+/*
+ * Return the number of variables in the table
+ *
+ * Parameters:
+ *   vt       The table
+ *
+ * Returns: The number of variables
+ */
+int VT_count(VarTable vt);
+
+/*
+ * Look up a variable by name
+ *
+ * Parameters:
+ *   vt       The table
+ *   name     The name, which need not be \0-terminated
+ *   len      Length of name
+ *
+ * Returns: The variable, or NULL if there is none by that name
+ */
+Variable VT_lookup(VarTable vt, const char *name, size_t len);
+
+/*
+ * Look up a variable by name, adding it to the table (with the value
+ * 0 and the next free index) if it is not there yet
+ *
+ * Parameters:
+ *   vt       The table
+ *   name     The name, which need not be \0-terminated
+ *   len      Length of name
+ *
+ * Returns: The variable
+ */
+Variable VT_define(VarTable vt, const char *name, size_t len);
+
+/*
+ * Remove the variables defined after the first count, for instance to
+ * undo the definitions made while parsing an expression that failed.
+ * Trees that refer to the removed variables must be freed first.
+ *
+ * Parameters:
+ *   vt       The table
+ *   count    How many variables to keep, in the range [0, VT_count(vt)]
+ *
+ * Returns: None
+ */
+void VT_truncate(VarTable vt, int count);
+
+/*
+ * Return the variable with the given index
+ *
+ * Parameters:
+ *   vt       The table
+ *   index    The index, in the range [0, VT_count(vt) - 1]
+ *
+ * Returns: The variable
+ */
+Variable VT_nth(VarTable vt, int index);
+
+/*
+ * Set the value of the named variable, adding it to the table if need be
+ *
+ * Parameters:
+ *   vt       The table
+ *   name     The name, \0-terminated
+ *   value    The new value
+ *
+ * Returns: The variable
+ */
+Variable VT_set(VarTable vt, const char *name, double value);
+
+#endif /* _VARS_H_ */